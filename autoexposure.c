@@ -0,0 +1,186 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "autoexposure.h"
+#include "camera_functions.h"
+#include "cmdlnopts.h"
+#include "image_functions.h"
+
+// percentile of histogram used as "bright level" of image
+#define AE_PERCENTILE   (0.995)
+// pixels with this value are saturated
+#define AE_SATURATION   (255)
+// max part of saturated pixels
+#define AE_MAXSATURATED (0.001f)
+// exposure multiplier when image is saturated
+#define AE_SATSTEP      (0.5f)
+// max change of exposure per step (times)
+#define AE_MAXSTEP      (4.f)
+// don't change exposure if relative error less than this
+#define AE_DEADBAND     (0.05f)
+
+static pthread_t aethread;
+static pthread_mutex_t aemutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aecond = PTHREAD_COND_INITIALIZER;
+static int aerunning = 0;       // ==1 when worker thread is alive
+static int aepending = 0;       // ==1 if there's new request for worker
+static int aegain = 0;          // ==1 if gain is controlled too
+static float reqexp, reqgain;   // last requested values
+static float minexp = 0.01f, maxexp = 1000.f; // limits of exposition time (ms)
+static float mingain = 0.f, maxgain = 0.f;    // limits of gain (dB)
+
+/**
+ * @brief aeworker - thread that writes new properties to camera
+ * @param data - camera context
+ */
+static void *aeworker(void *data){
+    FNAME();
+    fc2Context context = (fc2Context) data;
+    pthread_mutex_lock(&aemutex);
+    while(aerunning){
+        if(!aepending){
+            pthread_cond_wait(&aecond, &aemutex);
+            continue;
+        }
+        float e = reqexp, g = reqgain;
+        aepending = 0;
+        pthread_mutex_unlock(&aemutex);
+        propsetting s[2] = {PROPVAL(FC2_SHUTTER, e), PROPVAL(FC2_GAIN, g)};
+        setprops(context, s, aegain ? 2 : 1);
+        if(FC2_ERROR_OK != s[0].err)
+            WARNX("Auto exposure: can't set exposition time to %gms", e);
+        if(aegain && FC2_ERROR_OK != s[1].err)
+            WARNX("Auto exposure: can't set gain to %gdB", g);
+        VDBG("Auto exposure: applied exptime=%gms, gain=%gdB", getexp(), getgain());
+        pthread_mutex_lock(&aemutex);
+    }
+    pthread_mutex_unlock(&aemutex);
+    return NULL;
+}
+
+/**
+ * @brief autoexp_start - get camera limits & run auto exposure thread
+ * @param context - initialized context
+ * @return 0 if all OK
+ */
+int autoexp_start(fc2Context context){
+    FNAME();
+    if(aerunning) return 0;
+    fc2PropertyInfo i = {0};
+    i.type = FC2_SHUTTER;
+    if(FC2_ERROR_OK == getpropinfo(context, &i) && i.present){
+        minexp = i.absMin;
+        maxexp = i.absMax;
+    }
+    if(!isnan(G.aemaxexp) && G.aemaxexp > minexp && G.aemaxexp < maxexp) maxexp = G.aemaxexp;
+    if(G.aemaxgain > 0.f){
+        i = (fc2PropertyInfo){0};
+        i.type = FC2_GAIN;
+        if(FC2_ERROR_OK == getpropinfo(context, &i) && i.present && i.absValSupported){
+            mingain = i.absMin;
+            maxgain = (G.aemaxgain < i.absMax) ? G.aemaxgain : i.absMax;
+            if(maxgain > mingain) aegain = 1;
+        }
+        if(!aegain) WARNX("Auto exposure: gain can't be changed");
+    }
+    VMESG("Auto exposure: exptime in [%g, %g]ms, gain in [%g, %g]dB", minexp, maxexp,
+          mingain, aegain ? maxgain : mingain);
+    aerunning = 1;
+    if(pthread_create(&aethread, NULL, aeworker, (void*)context)){
+        WARN("pthread_create()");
+        aerunning = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief autoexp_process - calculate new exposure by statistics of frame just grabbed
+ *          and send it to worker thread
+ * @param img - MONO8 image
+ */
+void autoexp_process(fc2Image *img){
+    if(!aerunning || !img || !img->pData) return;
+    frameinfo *info = getframeinfo();
+    if(isnan(info->exptime)) return;
+    int w = img->cols, h = img->rows, s = img->stride;
+    size_t hist[256] = {0}, N = (size_t)w * h;
+    if(N == 0) return;
+    for(int y = 0; y < h; ++y){
+        uint8_t *ptr = &img->pData[y * s];
+        for(int x = 0; x < w; ++x) ++hist[ptr[x]];
+    }
+    size_t thres = (size_t)(AE_PERCENTILE * N), sum = 0;
+    int level;
+    for(level = 0; level < 255; ++level){
+        sum += hist[level];
+        if(sum >= thres) break;
+    }
+    float saturated = (float)hist[AE_SATURATION] / (float)N;
+    float factor;
+    if(saturated > AE_MAXSATURATED) factor = AE_SATSTEP; // level is unreliable
+    else{
+        factor = G.aelevel * 255.f / (level ? (float)level : 0.5f);
+        if(factor > AE_MAXSTEP) factor = AE_MAXSTEP;
+        else if(factor < 1.f/AE_MAXSTEP) factor = 1.f/AE_MAXSTEP;
+    }
+    if(fabsf(factor - 1.f) < AE_DEADBAND) return;
+    // new values are calculated from values of this frame, so frames grabbed before
+    // worker applied last request won't cause overshooting
+    float newexp, newgain = isnan(info->gain) ? mingain : info->gain;
+    if(aegain){
+        float B = info->exptime * powf(10.f, (newgain - mingain) / 20.f) * factor;
+        if(B <= maxexp){
+            newexp = B;
+            newgain = mingain;
+        }else{
+            newexp = maxexp;
+            newgain = mingain + 20.f * log10f(B / maxexp);
+            if(newgain > maxgain) newgain = maxgain;
+        }
+    }else newexp = info->exptime * factor;
+    if(newexp < minexp) newexp = minexp;
+    else if(newexp > maxexp) newexp = maxexp;
+    if(fabsf(newexp - info->exptime) < AE_DEADBAND * info->exptime &&
+        (!aegain || fabsf(newgain - info->gain) < 0.1f)) return; // limits reached
+    VDBG("Auto exposure: level=%d, saturated=%.2f%%, exptime %g -> %g, gain %g -> %g",
+         level, saturated * 100.f, info->exptime, newexp, info->gain, newgain);
+    pthread_mutex_lock(&aemutex);
+    reqexp = newexp;
+    reqgain = newgain;
+    aepending = 1;
+    pthread_cond_signal(&aecond);
+    pthread_mutex_unlock(&aemutex);
+}
+
+// stop worker thread
+void autoexp_stop(){
+    FNAME();
+    if(!aerunning) return;
+    pthread_mutex_lock(&aemutex);
+    aerunning = 0;
+    pthread_cond_signal(&aecond);
+    pthread_mutex_unlock(&aemutex);
+    pthread_join(aethread, NULL);
+}
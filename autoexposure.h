@@ -0,0 +1,32 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef AUTOEXPOSURE__
+#define AUTOEXPOSURE__
+
+#include <C/FlyCapture2_C.h>
+
+// starting exposition time (ms) if user didn't point it
+#define AE_STARTEXP     (10.f)
+
+int  autoexp_start(fc2Context context);
+void autoexp_process(fc2Image *img);
+void autoexp_stop();
+
+#endif // AUTOEXPOSURE__
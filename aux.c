@@ -16,43 +16,157 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <arpa/inet.h>
+#include <ctype.h>
 #include <linux/limits.h> // PATH_MAX
+#include <netinet/in.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <unistd.h>
+#include <usefull_macros.h>
 
 #include "aux.h"
 #include "cmdlnopts.h"
+#include "durable.h"
 
-// print messages for given verbose_level
+// put message for given verbose_level into log (formatted here: use VMESG/VDBG instead)
 int verbose(verblevel levl, const char *fmt, ...){
     if((unsigned)verbose_level < levl) return 0;
+    char buf[LOGGER_STRSZ];
     va_list ar; int i;
     va_start(ar, fmt);
-    i = vprintf(fmt, ar);
+    i = vsnprintf(buf, LOGGER_STRSZ, fmt, ar);
     va_end(ar);
-    printf("\n");
-    fflush(stdout);
+    logarg a = logarg_s(buf);
+    logger_put(levl, "%s", 1, &a);
     return i;
 }
 
+/**
+ * @brief timephase - show duration of phase just finished (for startup profiling)
+ * @param phase - name of phase or NULL to start counting
+ */
+void timephase(const char *phase){
+    static double t0 = -1., tlast = -1.;
+    double t = dtime();
+    if(!phase || t0 < 0.){
+        t0 = tlast = t;
+        if(!phase) return;
+    }
+    VMESG("Timing: %s took %.1fms (%.1fms from start)", phase, (t - tlast)*1e3, (t - t0)*1e3);
+    tlast = t;
+}
+
 /**
  * @brief check_filename - find file name "outfile_xxxx.suff" NOT THREAD-SAFE!
+ *          (search starts from number found by previous call with the same prefix & suffix)
  * @param outfile - file name prefix
  * @param suff    - file name suffix
  * @return NULL or next free file name like "outfile_0010.suff" (don't free() it!)
  */
 char *check_filename(char *outfile, char *suff){
     static char buff[PATH_MAX];
+    static struct{ // last found numbers (FITS & PNG of the same prefix are saved in turn)
+        char prefix[PATH_MAX];
+        char suff[16];
+        int num;
+    } cache[4];
+    static int cachenext = 0;
+    char tmp[PATH_MAX];
     struct stat filestat;
-    int num;
-    for(num = 1; num < 10000; num++){
-        if(snprintf(buff, PATH_MAX, "%s_%04d.%s", outfile, num, suff) < 1)
+    int num = 1, c = 0;
+    for(; c < 4; ++c) if(!strcmp(cache[c].prefix, outfile) && !strcmp(cache[c].suff, suff)) break;
+    if(c < 4) num = cache[c].num;
+    else{
+        c = cachenext;
+        cachenext = (cachenext + 1) % 4;
+        snprintf(cache[c].prefix, PATH_MAX, "%s", outfile);
+        snprintf(cache[c].suff, sizeof(cache[c].suff), "%s", suff);
+    }
+    for(; num < 10000; num++){
+        int l = snprintf(buff, PATH_MAX, "%s_%04d.%s", outfile, num, suff);
+        if(l < 1 || l >= PATH_MAX || snprintf(tmp, PATH_MAX, "%s" DURABLE_TMPSUFFIX, buff) >= PATH_MAX){
+            WARNX("Too long file name %s_*.%s", outfile, suff);
+            cache[c].prefix[0] = 0;
             return NULL;
-        if(stat(buff, &filestat)) // OK, file not exists
+        }
+        if(stat(buff, &filestat) && stat(tmp, &filestat)){ // OK, file not exists & isn't being written
+            cache[c].num = num;
             return buff;
+        }
     }
+    cache[c].prefix[0] = 0;
     return NULL;
 }
+
+/**
+ * @brief openlistener - open listening socket
+ * @param path     - TCP port (listen on localhost) or path to UNIX socket
+ * @param backlog  - length of queue of connections
+ * @param unixpath - (o) copy of `path` for UNIX socket (to remove it at exit), NULL for TCP
+ * @return socket or -1 if failed
+ */
+int openlistener(const char *path, int backlog, char **unixpath){
+    if(!path || !*path) return -1;
+    int fd = -1;
+    *unixpath = NULL;
+    const char *p = path;
+    while(isdigit(*p)) ++p;
+    if(*p == 0){ // TCP port
+        struct sockaddr_in addr = {0};
+        int port = atoi(path);
+        if(port < 1 || port > 65535){
+            WARNX("Wrong port number: %s", path);
+            return -1;
+        }
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0){
+            WARN("socket()");
+            return -1;
+        }
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if(bind(fd, (struct sockaddr*)&addr, sizeof(addr))){
+            WARN("bind()");
+            goto bad;
+        }
+    }else{ // UNIX socket
+        struct sockaddr_un addr = {0};
+        if(strlen(path) >= sizeof(addr.sun_path)){
+            WARNX("Too long socket path: %s", path);
+            return -1;
+        }
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0){
+            WARN("socket()");
+            return -1;
+        }
+        unlink(path);
+        if(bind(fd, (struct sockaddr*)&addr, sizeof(addr))){
+            WARN("bind()");
+            goto bad;
+        }
+        *unixpath = strdup(path);
+    }
+    if(listen(fd, backlog)){
+        WARN("listen()");
+        goto bad;
+    }
+    return fd;
+bad:
+    close(fd);
+    if(*unixpath){
+        unlink(*unixpath);
+        FREE(*unixpath);
+    }
+    return -1;
+}
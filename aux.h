@@ -20,6 +20,8 @@
 #ifndef AUX_H__
 #define AUX_H__
 
+#include "logger.h"
+
 typedef enum{
     VERB_NONE,
     VERB_MESG,
@@ -28,8 +30,11 @@ typedef enum{
 
 int verbose(verblevel levl, const char *fmt, ...);
 char *check_filename(char *outfile, char *suff);
+void timephase(const char *phase);
+int openlistener(const char *path, int backlog, char **unixpath);
 
-#define VMESG(...)  do{verbose(VERB_MESG, __VA_ARGS__);}while(0)
-#define VDBG(...)   do{verbose(VERB_DEBUG, __VA_ARGS__);}while(0)
+// messages are formatted & printed by logging thread (see logger.h)
+#define VMESG(...)  LOGGER(VERB_MESG, __VA_ARGS__)
+#define VDBG(...)   LOGGER(VERB_DEBUG, __VA_ARGS__)
 
 #endif // AUX_H__
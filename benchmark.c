@@ -0,0 +1,309 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <C/FlyCapture2_C.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "benchmark.h"
+#include "cmdlnopts.h"
+#include "demosaic.h"
+#include "durable.h"
+#include "image_functions.h"
+#include "logger.h"
+#include "parallel.h"
+#include "stretch.h"
+
+// size of synthetic frames
+#define BENCH_W     (2048)
+#define BENCH_H     (2048)
+// amount of iterations
+#define BENCH_ITER  (20)
+
+// synthetic RGB image: smooth gradients & slanted edges
+static uint8_t *mktruth(int w, int h){
+    uint8_t *rgb = MALLOC(uint8_t, 3 * w * h);
+    for(int y = 0; y < h; ++y) for(int x = 0; x < w; ++x){
+        uint8_t *p = &rgb[3 * (y * w + x)];
+        int edge = (((x + y / 3) / 37 + y / 41) & 1) ? 160 : 0;
+        p[0] = (uint8_t)(48 + 40. * sin(x / 40.) * cos(y / 30.) + edge);
+        p[1] = (uint8_t)(48 + 40. * sin((x + y) / 50.) + edge);
+        p[2] = (uint8_t)(48 + 40. * cos((x - y) / 70.) + edge / 2);
+    }
+    return rgb;
+}
+
+// PSNR of image `rgb` (with given stride) relative to `truth` (dB)
+static double psnr(const uint8_t *truth, const uint8_t *rgb, int w, int h, int stride){
+    double mse = 0.;
+    for(int y = 0; y < h; ++y){
+        const uint8_t *t = &truth[3 * y * w], *p = &rgb[y * stride];
+        for(int x = 0; x < 3 * w; ++x){
+            double d = (double)t[x] - p[x];
+            mse += d * d;
+        }
+    }
+    mse /= 3. * w * h;
+    return (mse > 0.) ? 10. * log10(255. * 255. / mse) : INFINITY;
+}
+
+static void showresult(const char *name, double t, const uint8_t *truth, const uint8_t *rgb, int stride){
+    t /= BENCH_ITER;
+    printf("%-28s %8.2fms %8.1fMpix/s   PSNR %.1fdB\n", name, t * 1e3, BENCH_W * BENCH_H / t / 1e6,
+           psnr(truth, rgb, BENCH_W, BENCH_H, stride));
+}
+
+// our demosaic kernels vs fc2ConvertImageTo() on synthetic RGGB frame
+static int bench_demosaic(){
+    int w = BENCH_W, h = BENCH_H, ncpu = parallel_threads();
+    uint8_t *truth = mktruth(w, h), *raw = MALLOC(uint8_t, w * h), *rgb = MALLOC(uint8_t, 3 * w * h);
+    for(int y = 0; y < h; ++y) for(int x = 0; x < w; ++x){ // RGGB
+        int c = (y & 1) ? ((x & 1) ? 2 : 1) : ((x & 1) ? 1 : 0);
+        raw[y * w + x] = truth[3 * (y * w + x) + c];
+    }
+    printf("Demosaic of %dx%d RGGB frame, %d iterations, %d thread[s]\n", w, h, BENCH_ITER, ncpu);
+    const char *qnames[] = {"nearest", "bilinear", "edge"};
+    char buf[64];
+    for(int q = DEMOSAIC_NEAREST; q <= DEMOSAIC_EDGE; ++q){
+        for(int nthr = 1; ; nthr *= 2){ // 1, 2, 4 ... ncpu threads
+            if(nthr > ncpu) nthr = ncpu;
+            parallel_setthreads(nthr);
+            demosaic(raw, w, h, w, BAYER_RGGB, q, rgb); // warm up
+            double t0 = dtime();
+            for(int i = 0; i < BENCH_ITER; ++i) demosaic(raw, w, h, w, BAYER_RGGB, q, rgb);
+            snprintf(buf, 64, "%s, %d thread[s]", qnames[q], nthr);
+            showresult(buf, dtime() - t0, truth, rgb, 3 * w);
+            if(nthr == ncpu) break;
+        }
+    }
+    parallel_setthreads(ncpu);
+    fc2Image in, out;
+    if(FC2_ERROR_OK != fc2CreateImage(&in) || FC2_ERROR_OK != fc2CreateImage(&out) ||
+       FC2_ERROR_OK != fc2SetImageDimensions(&in, h, w, w, FC2_PIXEL_FORMAT_RAW8, FC2_BT_RGGB) ||
+       FC2_ERROR_OK != fc2SetImageData(&in, raw, w * h)){
+        WARNX("Can't prepare fc2Image");
+    }else{
+        struct{
+            fc2ColorProcessingAlgorithm alg;
+            const char *name;
+        } algs[] = {
+            {FC2_NEAREST_NEIGHBOR_FAST, "fc2 nearest neighbor"},
+            {FC2_HQ_LINEAR, "fc2 HQ linear"},
+            {FC2_EDGE_SENSING, "fc2 edge sensing"},
+            {FC2_DIRECTIONAL, "fc2 directional"},
+        };
+        for(size_t a = 0; a < sizeof(algs) / sizeof(algs[0]); ++a){
+            if(FC2_ERROR_OK != fc2SetDefaultColorProcessing(algs[a].alg) ||
+               FC2_ERROR_OK != fc2ConvertImageTo(FC2_PIXEL_FORMAT_RGB8, &in, &out)){
+                printf("%-28s not supported\n", algs[a].name);
+                continue;
+            }
+            double t0 = dtime();
+            for(int i = 0; i < BENCH_ITER; ++i) fc2ConvertImageTo(FC2_PIXEL_FORMAT_RGB8, &in, &out);
+            showresult(algs[a].name, dtime() - t0, truth, out.pData, out.stride);
+        }
+        fc2SetDefaultColorProcessing(FC2_DEFAULT);
+    }
+    fc2DestroyImage(&in);
+    fc2DestroyImage(&out);
+    FREE(truth);
+    FREE(raw);
+    FREE(rgb);
+    return 0;
+}
+
+// kernels for scaling benchmark
+typedef struct{
+    uint8_t *raw, *out;
+} kernarg;
+
+static void k_colorize(kernarg *a){ colorize(a->raw, BENCH_W, BENCH_H, BENCH_W, 1, NULL, a->out); }
+static void k_colorize2(kernarg *a){ colorize(a->raw, BENCH_W, BENCH_H, BENCH_W, 2, NULL, a->out); }
+static void k_colorize4(kernarg *a){ colorize(a->raw, BENCH_W, BENCH_H, BENCH_W, 4, NULL, a->out); }
+static void k_clahe(kernarg *a){
+    stretchmode m = stretch_mode();
+    stretch_setmode(STRETCH_CLAHE);
+    colorize(a->raw, BENCH_W, BENCH_H, BENCH_W, 1, NULL, a->out);
+    stretch_setmode(m);
+}
+static void k_flip(kernarg *a){ flipframe(a->out, a->raw, BENCH_W, BENCH_H, BENCH_W); }
+static void k_bilinear(kernarg *a){ demosaic(a->raw, BENCH_W, BENCH_H, BENCH_W, BAYER_RGGB, DEMOSAIC_BILINEAR, a->out); }
+static void k_edge(kernarg *a){ demosaic(a->raw, BENCH_W, BENCH_H, BENCH_W, BAYER_RGGB, DEMOSAIC_EDGE, a->out); }
+
+// speed of per-frame kernels with 1..N threads of pool
+static int bench_threads(){
+    int ncpu = parallel_threads();
+    struct{
+        void (*fn)(kernarg*);
+        const char *name;
+    } kernels[] = {
+        {k_colorize, "equalize & colorize"},
+        {k_colorize2, "preview binned 2x2"},
+        {k_colorize4, "preview binned 4x4"},
+        {k_clahe, "CLAHE & colorize"},
+        {k_flip, "flip (FITS writing)"},
+        {k_bilinear, "demosaic bilinear"},
+        {k_edge, "demosaic edge"},
+    };
+    kernarg a = {.raw = MALLOC(uint8_t, BENCH_W * BENCH_H), .out = MALLOC(uint8_t, 3 * BENCH_W * BENCH_H)};
+    uint8_t *truth = mktruth(BENCH_W, BENCH_H);
+    for(int i = 0; i < BENCH_W * BENCH_H; ++i) a.raw[i] = truth[3*i + 1];
+    FREE(truth);
+    printf("Scaling of %dx%d frame kernels, %d iterations, pool of %d thread[s]\n", BENCH_W, BENCH_H, BENCH_ITER, ncpu);
+    printf("%-22s %8s %10s %10s %8s\n", "kernel", "threads", "ms", "Mpix/s", "speedup");
+    for(size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k){
+        double t1 = 0.;
+        for(int nthr = 1; nthr <= ncpu; ++nthr){
+            parallel_setthreads(nthr);
+            kernels[k].fn(&a); // warm up
+            double t0 = dtime();
+            for(int i = 0; i < BENCH_ITER; ++i) kernels[k].fn(&a);
+            double t = (dtime() - t0) / BENCH_ITER;
+            if(nthr == 1) t1 = t;
+            printf("%-22s %8d %10.2f %10.1f %8.2f\n", kernels[k].name, nthr, t * 1e3,
+                   BENCH_W * BENCH_H / t / 1e6, t1 / t);
+        }
+    }
+    parallel_setthreads(ncpu);
+    FREE(a.raw);
+    FREE(a.out);
+    return 0;
+}
+
+// amount & size of files for write benchmark
+#define BENCH_NFILES    (32)
+#define BENCH_FILESZ    (BENCH_W * BENCH_H)
+
+// latency of writing files by different strategies (files are written into current directory)
+static int bench_write(){
+    struct{
+        writemode mode;
+        int syncframes;
+        const char *name;
+    } strategies[] = {
+        {WRITE_PLAIN, 1, "plain (no sync)"},
+        {WRITE_SAFE, 1, "safe, sync each file"},
+        {WRITE_SAFE, 8, "safe, sync by 8"},
+        {WRITE_DIRECT, 1, "direct, sync each file"},
+        {WRITE_DIRECT, 8, "direct, sync by 8"},
+    };
+    uint8_t *data = MALLOC(uint8_t, BENCH_FILESZ);
+    for(int i = 0; i < BENCH_FILESZ; ++i) data[i] = (uint8_t)(i * 7 + i / BENCH_W);
+    char name[64];
+    int ret = 0;
+    printf("Writing of %d files by %.1fMB into current directory\n", BENCH_NFILES, BENCH_FILESZ / 1024. / 1024.);
+    printf("%-24s %10s %10s %10s\n", "strategy", "mean, ms", "max, ms", "MB/s");
+    for(size_t k = 0; k < sizeof(strategies) / sizeof(strategies[0]) && !ret; ++k){
+        durable_init(strategies[k].mode, strategies[k].syncframes, 0.);
+        double tmax = 0., t0 = dtime();
+        for(int i = 0; i < BENCH_NFILES && !ret; ++i){
+            snprintf(name, 64, "grasshopper_bench_%02d.raw", i);
+            double t = dtime();
+            ret = durable_write(name, data, BENCH_FILESZ);
+            t = dtime() - t;
+            if(t > tmax) tmax = t;
+        }
+        durable_sync(); // rest of last batch
+        double t = dtime() - t0;
+        if(!ret) printf("%-24s %10.2f %10.2f %10.1f\n", strategies[k].name, t * 1e3 / BENCH_NFILES, tmax * 1e3,
+                        (double)BENCH_NFILES * BENCH_FILESZ / 1024. / 1024. / t);
+        for(int i = 0; i < BENCH_NFILES; ++i){
+            snprintf(name, 64, "grasshopper_bench_%02d.raw", i);
+            unlink(name);
+        }
+    }
+    durable_init(WRITE_PLAIN, 1, 0.);
+    FREE(data);
+    return ret;
+}
+
+// amount of messages in burst (less than ring of logger) & amount of bursts for logging benchmark
+#define BENCH_LOGBURST  (256)
+#define BENCH_LOGITER   (200)
+
+// old synchronous verbose()
+static void syncprint(FILE *f, const char *fmt, ...){
+    va_list ar;
+    va_start(ar, fmt);
+    vfprintf(f, fmt, ar);
+    va_end(ar);
+    fprintf(f, "\n");
+    fflush(f);
+}
+
+// cost of per-frame message: synchronous printing vs asynchronous logger (messages are written into /dev/null)
+static int bench_log(){
+    FILE *null = fopen("/dev/null", "w");
+    if(!null) return 1;
+    int verb = verbose_level;
+    verbose_level = VERB_MESG;
+    logger_stop();
+    if(logger_init("/dev/null")){
+        fclose(null);
+        return 1;
+    }
+    double tsync = 0., tasync = 0., tmax = 0.;
+    for(int it = 0; it < BENCH_LOGITER; ++it){
+        double t0 = dtime();
+        for(int i = 0; i < BENCH_LOGBURST; ++i)
+            syncprint(null, "Grabbed image #%d, exptime=%gms, %s", i, 12.5, "bench");
+        tsync += dtime() - t0;
+        t0 = dtime();
+        for(int i = 0; i < BENCH_LOGBURST; ++i)
+            VMESG("Grabbed image #%d, exptime=%gms, %s", i, 12.5, "bench");
+        tasync += dtime() - t0;
+        logger_flush(); // don't let ring overflow
+        for(int i = 0; i < BENCH_LOGBURST / 2; ++i){ // latency of single calls
+            double t = dtime();
+            VMESG("Grabbed image #%d, exptime=%gms, %s", i, 12.5, "bench");
+            t = dtime() - t;
+            if(t > tmax) tmax = t;
+        }
+        logger_flush();
+    }
+    double n = (double)BENCH_LOGBURST * BENCH_LOGITER;
+    printf("Cost of message (%.0f messages):\n", n);
+    printf("%-28s %10.1f ns\n", "vfprintf + fflush", tsync / n * 1e9);
+    printf("%-28s %10.1f ns (max %.1f us)\n", "logger", tasync / n * 1e9, tmax * 1e6);
+    logger_stop();
+    fclose(null);
+    verbose_level = verb;
+    logger_init(G.logfile);
+    return 0;
+}
+
+/**
+ * @brief benchmark - run benchmark by name
+ * @param name - "demosaic", "threads", "write" or "log"
+ * @return 0 if all OK
+ */
+int benchmark(const char *name){
+    int ret = 1;
+    if(strcmp(name, "demosaic") == 0) ret = bench_demosaic();
+    else if(strcmp(name, "threads") == 0) ret = bench_threads();
+    else if(strcmp(name, "write") == 0) ret = bench_write();
+    else if(strcmp(name, "log") == 0) ret = bench_log();
+    else WARNX("Unknown benchmark %s, available: demosaic, threads, write, log", name);
+    parallel_stop();
+    return ret;
+}
@@ -0,0 +1,435 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fitsio.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "calibration.h"
+#include "demosaic.h"
+#include "image_functions.h"
+#include "parallel.h"
+
+// fixed point: dark is stored as value*2^DARKSHIFT, flat correction as gain*2^FLATSHIFT
+#define DARKSHIFT       (8)
+#define FLATSHIFT       (12)
+// max correction of flat (times): gain*2^FLATSHIFT should fit into uint16_t
+#define FLATMAXGAIN     (15.f)
+// pixels of normalized flat less than this are bad
+#define FLATMINLEVEL    (0.1f)
+// sigma clipping of master frames (in units of sigma estimated by MAD)
+#define MASTER_NSIGMA   (3.f)
+// max amount of frames for master
+#define MASTER_MAXFRAMES (255)
+// collected frames are stored by blocks of MASTER_BLOCK pixels: values of one pixel from all frames are close
+#define MASTER_BLOCK    (64)
+
+static int calw = 0, calh = 0;      // geometry of calibration frames
+static float *dark = NULL;          // master dark (NULL if absent)
+static float darkexp = NAN;         // its exposition time (ms)
+static uint16_t *darkq = NULL;      // dark scaled for current exposition (fixed point)
+static float darkqexp = -1.f;       // exposition time of darkq
+static uint16_t *flatq = NULL;      // flat correction (fixed point)
+static uint32_t *badpix = NULL;     // bad pixels: [index, left neighbour, right neighbour] triples
+static size_t nbad = 0;
+static uint8_t *badmap = NULL;      // map of bad pixels (list is rebuilt when Bayer frames come)
+static int badstep = 1;             // distance of neighbours in `badpix`
+static int calactive = 0;           // ==1 if calibration frames loaded
+static int sizewarned = 0;          // ==1 if geometry mismatch was reported
+static uint64_t ncalib = 0;         // statistics
+static double calibtime = 0.;
+
+// building of master frame
+static char *mastername = NULL;
+static mastertype mtype;
+static int mframes = 0, mcollected = 0, mw = 0, mh = 0;
+static uint8_t *mstack = NULL;      // collected frames: [block][frame][MASTER_BLOCK pixels]
+static double mexpsum = 0.;         // sum of expositions
+
+/**
+ * @brief readfits - read 2D image from FITS-file as float
+ * @param name    - filename
+ * @param w, h    (o) - image size
+ * @param exptime (o) - EXPTIME value in ms (NAN if absent)
+ * @return data allocated here (in frame order - upside down relative to FITS) or NULL
+ */
+static float *readfits(const char *name, int *w, int *h, float *exptime){
+    fitsfile *fp;
+    int status = 0, naxis = 0, bitpix, anynul = 0;
+    long naxes[2] = {0, 0}, fpix[2] = {1, 1};
+    float *img = NULL;
+    if(fits_open_image(&fp, name, READONLY, &status)){
+        fits_report_error(stderr, status);
+        return NULL;
+    }
+    fits_get_img_param(fp, 2, &bitpix, &naxis, naxes, &status);
+    if(!status && (naxis != 2 || naxes[0] < 1 || naxes[1] < 1)){
+        WARNX("%s: not a 2D image", name);
+        status = -1;
+    }
+    if(!status){
+        img = MALLOC(float, naxes[0] * naxes[1]);
+        fits_read_pix(fp, TFLOAT, fpix, naxes[0] * naxes[1], NULL, img, &anynul, &status);
+    }
+    if(exptime){
+        double e;
+        int st = 0;
+        fits_read_key(fp, TDOUBLE, "EXPTIME", &e, NULL, &st);
+        *exptime = st ? NAN : (float)(e * 1000.);
+    }
+    int st = 0;
+    fits_close_file(fp, &st);
+    if(status){
+        if(status > 0) fits_report_error(stderr, status);
+        FREE(img);
+        return NULL;
+    }
+    *w = (int)naxes[0];
+    *h = (int)naxes[1];
+    // writefb() mirrors frames upside down, so mirror them back
+    size_t rowsz = sizeof(float) * *w;
+    float *row = MALLOC(float, *w);
+    for(int y = 0; y < *h / 2; ++y){
+        float *a = &img[y * *w], *b = &img[(*h - 1 - y) * *w];
+        memcpy(row, a, rowsz);
+        memcpy(a, b, rowsz);
+        memcpy(b, row, rowsz);
+    }
+    FREE(row);
+    return img;
+}
+
+// check that image have the same size as other calibration frames
+static int chksize(const char *name, int w, int h){
+    if(!calw){
+        calw = w;
+        calh = h;
+        return 0;
+    }
+    if(w == calw && h == calh) return 0;
+    WARNX("%s: size %dx%d differs from %dx%d", name, w, h, calw, calh);
+    return 1;
+}
+
+/*
+ * fill `badpix` by pixels marked in `badmap` and find their neighbours in row (or column);
+ * `step` is distance of neighbours: 1 for gray frames, 2 for Bayer (neighbours of the same colour)
+ */
+static void mkbadlist(int step){
+    const uint8_t *bad = badmap;
+    size_t N = (size_t)calw * calh, n = 0;
+    FREE(badpix);
+    nbad = 0;
+    badstep = step;
+    if(!bad) return;
+    for(size_t i = 0; i < N; ++i) if(bad[i]) ++n;
+    if(!n) return;
+    badpix = MALLOC(uint32_t, 3 * n);
+    for(int y = 0; y < calh; ++y){
+        const uint8_t *brow = &bad[y * calw];
+        for(int x = 0; x < calw; ++x){
+            if(!brow[x]) continue;
+            int l = x - step, r = x + step;
+            while(l >= 0 && brow[l]) l -= step;
+            while(r < calw && brow[r]) r += step;
+            uint32_t idx = (uint32_t)(y * calw + x), a, b;
+            if(l >= 0 && r < calw){ a = idx - (x - l); b = idx + (r - x); }
+            else if(l >= 0) a = b = idx - (x - l);
+            else if(r < calw) a = b = idx + (r - x);
+            else{ // whole row is bad: try column
+                int u = y - step, d = y + step;
+                while(u >= 0 && bad[u * calw + x]) u -= step;
+                while(d < calh && bad[d * calw + x]) d += step;
+                if(u < 0 && d >= calh) continue; // nothing to do
+                a = (u >= 0) ? (uint32_t)(u * calw + x) : (uint32_t)(d * calw + x);
+                b = (d < calh) ? (uint32_t)(d * calw + x) : a;
+            }
+            badpix[3*nbad] = idx;
+            badpix[3*nbad + 1] = a;
+            badpix[3*nbad + 2] = b;
+            ++nbad;
+        }
+    }
+}
+
+/**
+ * @brief calib_load - load master dark, flat & bad pixels map (any of them could be NULL)
+ * @param darkname   - master dark (scaled by EXPTIME)
+ * @param flatname   - master flat (dark-subtracted, it will be normalized by its mean)
+ * @param badpixname - bad pixels map (nonzero values are bad pixels)
+ * @return 0 if all OK
+ */
+int calib_load(const char *darkname, const char *flatname, const char *badpixname){
+    FNAME();
+    int w, h;
+    float *flat = NULL, *bp = NULL;
+    if(darkname){
+        if(!(dark = readfits(darkname, &w, &h, &darkexp)) || chksize(darkname, w, h)) goto bad;
+        if(isnan(darkexp)) WARNX("%s: no EXPTIME, dark won't be scaled", darkname);
+        VMESG("Master dark %s (%dx%d, exptime=%gms) loaded", darkname, w, h, darkexp);
+    }
+    if(flatname){
+        if(!(flat = readfits(flatname, &w, &h, NULL)) || chksize(flatname, w, h)) goto bad;
+        VMESG("Master flat %s (%dx%d) loaded", flatname, w, h);
+    }
+    if(badpixname){
+        if(!(bp = readfits(badpixname, &w, &h, NULL)) || chksize(badpixname, w, h)) goto bad;
+    }
+    if(!calw) return 0; // nothing to do
+    size_t N = (size_t)calw * calh;
+    uint8_t *bad = badmap = MALLOC(uint8_t, N);
+    if(bp) for(size_t i = 0; i < N; ++i) if(bp[i] != 0.f) bad[i] = 1;
+    darkq = MALLOC(uint16_t, N); // zeros if there's no dark
+    flatq = MALLOC(uint16_t, N);
+    if(flat){
+        double sum = 0.;
+        for(size_t i = 0; i < N; ++i) sum += flat[i];
+        float mean = (float)(sum / N);
+        if(mean <= 0.f){
+            WARNX("%s: bad flat (mean=%g)", flatname, mean);
+            FREE(badmap);
+            goto bad;
+        }
+        for(size_t i = 0; i < N; ++i){
+            float f = flat[i] / mean;
+            if(f < FLATMINLEVEL){ // dead pixel
+                bad[i] = 1;
+                f = 1.f;
+            }
+            f = 1.f / f;
+            if(f > FLATMAXGAIN) f = FLATMAXGAIN;
+            flatq[i] = (uint16_t)(f * (1 << FLATSHIFT) + 0.5f);
+        }
+    }else for(size_t i = 0; i < N; ++i) flatq[i] = 1 << FLATSHIFT;
+    mkbadlist(1);
+    if(!nbad) FREE(badmap);
+    FREE(flat);
+    FREE(bp);
+    if(nbad) VMESG("%zu bad pixels will be interpolated", nbad);
+    calactive = 1;
+    return 0;
+bad:
+    FREE(dark);
+    FREE(flat);
+    FREE(bp);
+    FREE(darkq);
+    FREE(flatq);
+    calw = calh = 0;
+    return 1;
+}
+
+// recalculate scaled dark for exposition `exptime` (ms)
+static void scaledark(float exptime){
+    size_t N = (size_t)calw * calh;
+    float scale = 1.f;
+    if(!isnan(exptime) && !isnan(darkexp) && darkexp > 0.f) scale = exptime / darkexp;
+    scale *= (float)(1 << DARKSHIFT);
+    for(size_t i = 0; i < N; ++i){
+        float d = dark[i] * scale + 0.5f;
+        darkq[i] = (d < 0.f) ? 0 : (d > 65535.f) ? 65535 : (uint16_t)d;
+    }
+    darkqexp = exptime;
+}
+
+/**
+ * @brief calibrow - calibrate one row: p = (p - dark) * flat
+ *          (simple loop without branches, so compiler can vectorize it)
+ * @param p - data
+ * @param d - dark (fixed point)
+ * @param f - flat correction (fixed point)
+ * @param w - row length
+ */
+__attribute__((optimize("tree-vectorize")))
+static void calibrow(uint8_t *restrict p, const uint16_t *restrict d, const uint16_t *restrict f, int w){
+    for(int x = 0; x < w; ++x){
+        int32_t v = ((int32_t)p[x] << DARKSHIFT) - (int32_t)d[x];
+        v = (v < 0) ? 0 : v;
+        uint32_t r = ((uint32_t)v * f[x] + (1u << (DARKSHIFT + FLATSHIFT - 1))) >> (DARKSHIFT + FLATSHIFT);
+        p[x] = (r > 255) ? 255 : (uint8_t)r;
+    }
+}
+
+// calibrate rows [y0, y1) of frame `arg`
+static void calibrows(void *arg, int y0, int y1){
+    framebuf *fb = (framebuf*) arg;
+    for(int y = y0; y < y1; ++y)
+        calibrow(&fb->data[y * fb->stride], &darkq[y * calw], &flatq[y * calw], calw);
+}
+
+/**
+ * @brief calib_apply - calibrate frame in place (do nothing if there's no calibration frames)
+ * @param fb - frame (its `info.exptime` used to scale dark)
+ */
+void calib_apply(framebuf *fb){
+    if(!calactive || !fb) return;
+    if(fb->w != calw || fb->h != calh){
+        if(!sizewarned) WARNX("Frame size %dx%d differs from calibration frames, won't calibrate", fb->w, fb->h);
+        sizewarned = 1;
+        return;
+    }
+    double t0 = dtime();
+    if(dark && fb->info.exptime != darkqexp) scaledark(fb->info.exptime);
+    int step = (fb->info.bayer != BAYER_NONE) ? 2 : 1; // Bayer: replace by pixels of the same colour
+    if(badmap && step != badstep) mkbadlist(step);
+    parallel_for(0, calh, 5 * calw, calibrows, fb);
+    uint8_t *p = fb->data;
+    int s = fb->stride;
+    for(size_t i = 0; i < nbad; ++i){
+        uint32_t *b = &badpix[3*i];
+        // indexes are for packed frames
+        uint32_t idx = b[0] / calw * s + b[0] % calw, a = b[1] / calw * s + b[1] % calw,
+                 c = b[2] / calw * s + b[2] % calw;
+        p[idx] = (uint8_t)((p[a] + p[c] + 1) >> 1);
+    }
+    calibtime += dtime() - t0;
+    ++ncalib;
+}
+
+/**
+ * @brief calib_mkmaster - start building of master frame from next grabbed frames
+ * @param filename - output file
+ * @param type     - dark or flat
+ * @param nframes  - amount of frames
+ * @return 0 if all OK
+ */
+int calib_mkmaster(const char *filename, mastertype type, int nframes){
+    if(!filename) return 1;
+    if(nframes < 1 || nframes > MASTER_MAXFRAMES){
+        WARNX("Amount of frames for master should be from 1 to %d", MASTER_MAXFRAMES);
+        return 1;
+    }
+    mastername = strdup(filename);
+    mtype = type;
+    mframes = nframes;
+    mcollected = 0;
+    mexpsum = 0.;
+    VMESG("Building master %s from %d frames", type == MASTER_DARK ? "dark" : "flat", nframes);
+    return 0;
+}
+
+// insertion sort for small arrays
+static void sortbytes(uint8_t *a, int n){
+    for(int i = 1; i < n; ++i){
+        uint8_t v = a[i];
+        int j = i - 1;
+        for(; j >= 0 && a[j] > v; --j) a[j+1] = a[j];
+        a[j+1] = v;
+    }
+}
+
+// sigma-clipped mean of pixels in blocks [b0, b1) of `mstack` into `arg`
+static void combineblocks(void *arg, int b0, int b1){
+    float *out = (float*) arg;
+    size_t N = (size_t)mw * mh;
+    uint8_t vals[MASTER_MAXFRAMES], dev[MASTER_MAXFRAMES];
+    for(int b = b0; b < b1; ++b){
+        const uint8_t *blk = &mstack[(size_t)b * mframes * MASTER_BLOCK];
+        for(int o = 0; o < MASTER_BLOCK; ++o){
+            size_t i = (size_t)b * MASTER_BLOCK + o;
+            if(i >= N) break;
+            for(int n = 0; n < mcollected; ++n) vals[n] = blk[n * MASTER_BLOCK + o];
+            sortbytes(vals, mcollected);
+            int med = vals[mcollected / 2];
+            for(int n = 0; n < mcollected; ++n) dev[n] = (uint8_t)abs(vals[n] - med);
+            sortbytes(dev, mcollected);
+            float lim = MASTER_NSIGMA * 1.4826f * dev[mcollected / 2] + 0.5f; // MAD -> sigma
+            int sum = 0, cnt = 0;
+            for(int n = 0; n < mcollected; ++n){
+                if(fabsf((float)(vals[n] - med)) > lim) continue;
+                sum += vals[n];
+                ++cnt;
+            }
+            out[i] = cnt ? (float)sum / cnt : (float)med;
+        }
+    }
+}
+
+/**
+ * @brief combine - sigma-clipped mean of collected frames around median
+ * @return master frame (in frame order)
+ */
+static float *combine(){
+    size_t N = (size_t)mw * mh;
+    float *out = MALLOC(float, N);
+    parallel_for(0, (int)((N + MASTER_BLOCK - 1) / MASTER_BLOCK), (size_t)mframes * MASTER_BLOCK, combineblocks, out);
+    return out;
+}
+
+/**
+ * @brief calib_collect - add frame to master (all frames should have the same size)
+ * @param fb - frame
+ * @return 1 when master is done (or failed), 0 if more frames needed or master isn't building
+ */
+int calib_collect(framebuf *fb){
+    if(!mastername || !fb) return 0;
+    if(!mstack){
+        mw = fb->w;
+        mh = fb->h;
+        size_t nblocks = ((size_t)mw * mh + MASTER_BLOCK - 1) / MASTER_BLOCK;
+        mstack = MALLOC(uint8_t, nblocks * mframes * MASTER_BLOCK);
+    }
+    if(fb->w != mw || fb->h != mh){
+        WARNX("Frame size changed, skip it");
+        return 0;
+    }
+    size_t i = 0; // index of pixel in packed frame
+    for(int y = 0; y < mh; ++y){
+        const uint8_t *src = &fb->data[y * fb->stride];
+        for(int x = 0; x < mw;){ // copy parts of row inside blocks
+            size_t o = i % MASTER_BLOCK, l = MASTER_BLOCK - o;
+            if(l > (size_t)(mw - x)) l = mw - x;
+            memcpy(&mstack[((i / MASTER_BLOCK) * mframes + mcollected) * MASTER_BLOCK + o], &src[x], l);
+            x += l;
+            i += l;
+        }
+    }
+    if(!isnan(fb->info.exptime)) mexpsum += fb->info.exptime;
+    VDBG("Master: got frame %d of %d", mcollected + 1, mframes);
+    if(++mcollected < mframes) return 0;
+    double t0 = dtime();
+    float *img = combine();
+    VMESG("Master combined by %.1fs", dtime() - t0);
+    if(writefloat(mastername, img, mw, mh, mtype == MASTER_DARK ? "dark" : "flat", mcollected,
+                  mexpsum / mcollected)) WARNX("Can't save master into %s", mastername);
+    else VMESG("Master saved into %s", mastername);
+    FREE(img);
+    FREE(mstack);
+    FREE(mastername);
+    return 1;
+}
+
+// free buffers & show statistics
+void calib_stop(){
+    if(ncalib) VMESG("Calibration: %llu frames, %.2fms per frame", (unsigned long long)ncalib,
+                     calibtime * 1000. / ncalib);
+    ncalib = 0;
+    calibtime = 0.;
+    if(mastername) WARNX("Master %s isn't done: got only %d of %d frames", mastername, mcollected, mframes);
+    calactive = 0;
+    FREE(dark);
+    FREE(darkq);
+    FREE(flatq);
+    FREE(badpix);
+    FREE(badmap);
+    FREE(mstack);
+    FREE(mastername);
+}
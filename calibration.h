@@ -0,0 +1,40 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef CALIBRATION__
+#define CALIBRATION__
+
+#include "framepool.h"
+
+// default amount of frames for master dark/flat
+#define CALIB_NFRAMES   (16)
+
+// type of master frame to build
+typedef enum{
+    MASTER_DARK,
+    MASTER_FLAT
+} mastertype;
+
+int  calib_load(const char *darkname, const char *flatname, const char *badpixname);
+void calib_apply(framebuf *fb);
+int  calib_mkmaster(const char *filename, mastertype type, int nframes);
+int  calib_collect(framebuf *fb);
+void calib_stop();
+
+#endif // CALIBRATION__
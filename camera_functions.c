@@ -16,7 +16,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 #include <usefull_macros.h>
 
 #include "aux.h"
@@ -45,6 +47,92 @@ static const char *propnames[] = {
     [FC2_UNSPECIFIED_PROPERTY_TYPE] = "unspecified"
 };
 
+// values of absolute properties read from camera or applied to it (NAN if unknown)
+static float propvals[FC2_UNSPECIFIED_PROPERTY_TYPE] = {
+    [0 ... FC2_UNSPECIFIED_PROPERTY_TYPE-1] = NAN
+};
+static pthread_mutex_t propmutex = PTHREAD_MUTEX_INITIALIZER;
+
+// cached properties table: readprops() fills it, setprops() keeps it in actual state
+static fc2PropertyInfo propinfo[FC2_UNSPECIFIED_PROPERTY_TYPE];
+static fc2Property propstate[FC2_UNSPECIFIED_PROPERTY_TYPE];
+static int cachevalid = 0;
+static pthread_mutex_t cachemutex = PTHREAD_MUTEX_INITIALIZER;
+
+// information about connected camera
+static fc2CameraInfo caminfo;
+static int caminfovalid = 0;
+
+// max difference between value set and value read back
+#define ABSVAL_TOLERANCE    (0.02f)
+
+/**
+ * @brief getpropval - get last value of absolute property
+ * @param t - type of property
+ * @return value or NAN if property wasn't read or set
+ */
+float getpropval(fc2PropertyType t){
+    if(t < FC2_BRIGHTNESS || t >= FC2_UNSPECIFIED_PROPERTY_TYPE) return NAN;
+    pthread_mutex_lock(&propmutex);
+    float f = propvals[t];
+    pthread_mutex_unlock(&propmutex);
+    return f;
+}
+
+// refresh cached state of property `t` (cachemutex should be locked)
+static fc2Error updprop(fc2Context context, fc2PropertyType t){
+    fc2Property prop = {0};
+    prop.type = t;
+    FC2FNW(fc2GetProperty, context, &prop);
+    propstate[t] = prop;
+    pthread_mutex_lock(&propmutex);
+    propvals[t] = (prop.present && prop.absControl) ? prop.absValue : NAN;
+    pthread_mutex_unlock(&propmutex);
+    return FC2_ERROR_OK;
+}
+
+// fill cache (cachemutex should be locked)
+static fc2Error readprops_(fc2Context context){
+    cachevalid = 0;
+    for(fc2PropertyType t = FC2_BRIGHTNESS; t < FC2_UNSPECIFIED_PROPERTY_TYPE; ++t){
+        fc2PropertyInfo i = {0};
+        i.type = t;
+        FC2FNW(fc2GetPropertyInfo, context, &i);
+        propinfo[t] = i;
+        fc2Error e = updprop(context, t);
+        if(e != FC2_ERROR_OK) return e;
+    }
+    cachevalid = 1;
+    return FC2_ERROR_OK;
+}
+
+/**
+ * @brief readprops - read information & values of all properties into cache
+ *          (should be called after connection to other camera)
+ * @param context - initialized context
+ * @return FC2_ERROR_OK if all OK
+ */
+fc2Error readprops(fc2Context context){
+    pthread_mutex_lock(&cachemutex);
+    fc2Error e = readprops_(context);
+    pthread_mutex_unlock(&cachemutex);
+    return e;
+}
+
+/**
+ * @brief refreshprop - read current value of property (e.g. temperature) from camera
+ * @param context - initialized context
+ * @param t       - type of property
+ * @return FC2_ERROR_OK if all OK
+ */
+fc2Error refreshprop(fc2Context context, fc2PropertyType t){
+    if(t < FC2_BRIGHTNESS || t >= FC2_UNSPECIFIED_PROPERTY_TYPE) return FC2_ERROR_INVALID_PARAMETER;
+    pthread_mutex_lock(&cachemutex);
+    fc2Error e = updprop(context, t);
+    pthread_mutex_unlock(&cachemutex);
+    return e;
+}
+
 // return property name
 const char *getPropName(fc2PropertyType t){
     if(t < FC2_BRIGHTNESS || t > FC2_UNSPECIFIED_PROPERTY_TYPE) return NULL;
@@ -58,12 +146,16 @@ static void prbl(char *s, BOOL prop){
     printf("\n");
 }
 
+// print cached property value
 fc2Error getproperty(fc2Context context, fc2PropertyType t){
-    fc2Property prop = {0};
-    prop.type = t;
-    FC2FNW(fc2GetProperty, context, &prop);
+    if(t < FC2_BRIGHTNESS || t >= FC2_UNSPECIFIED_PROPERTY_TYPE) return FC2_ERROR_NOT_FOUND;
+    pthread_mutex_lock(&cachemutex);
+    fc2Error e = cachevalid ? FC2_ERROR_OK : readprops_(context);
+    fc2Property prop = propstate[t];
+    pthread_mutex_unlock(&cachemutex);
+    if(e != FC2_ERROR_OK) return e;
     if(!prop.present) return FC2_ERROR_NOT_FOUND;
-    if(t <= FC2_UNSPECIFIED_PROPERTY_TYPE) green("\nProperty \"%s\":\n", propnames[t]);
+    green("\nProperty \"%s\":\n", propnames[t]);
     prbl("absControl", prop.absControl); // 1 - world units, 0 - camera units
     prbl("onePush", prop.onePush); // "one push"
     prbl("onOff", prop.onOff);
@@ -74,10 +166,14 @@ fc2Error getproperty(fc2Context context, fc2PropertyType t){
     return FC2_ERROR_OK;
 }
 
+// print cached property info
 fc2Error getpropertyInfo(fc2Context context, fc2PropertyType t){
-    fc2PropertyInfo i = {0};
-    i.type = t;
-    FC2FNW(fc2GetPropertyInfo, context, &i);
+    if(t < FC2_BRIGHTNESS || t >= FC2_UNSPECIFIED_PROPERTY_TYPE) return FC2_ERROR_NOT_FOUND;
+    pthread_mutex_lock(&cachemutex);
+    fc2Error e = cachevalid ? FC2_ERROR_OK : readprops_(context);
+    fc2PropertyInfo i = propinfo[t];
+    pthread_mutex_unlock(&cachemutex);
+    if(e != FC2_ERROR_OK) return e;
     if(!i.present) return FC2_ERROR_NOT_FOUND;
     green("Property Info:\n");
     prbl("autoSupported", i.autoSupported); // can be auto
@@ -95,85 +191,260 @@ fc2Error getpropertyInfo(fc2Context context, fc2PropertyType t){
     return FC2_ERROR_OK;
 }
 
-
 /**
- * @brief setfloat - set absolute property value (float)
- * @param t        - type of property
- * @param context  - initialized context
- * @param f        - new value
+ * @brief getpropinfo - get cached property info
+ * @param context - initialized context
+ * @param i (o)   - info (its field `type` should be set)
  * @return FC2_ERROR_OK if all OK
  */
-fc2Error setfloat(fc2PropertyType t, fc2Context context, float f){
-    fc2Property prop = {0};
-    prop.type = t;
-    fc2PropertyInfo i = {0};
-    i.type = t;
-    FC2FNW(fc2GetProperty, context, &prop);
-    FC2FNW(fc2GetPropertyInfo, context, &i);
-    if(!prop.present || !i.present) return FC2_ERROR_NOT_FOUND;
-    if(prop.autoManualMode){
-        if(!i.manualSupported){
+fc2Error getpropinfo(fc2Context context, fc2PropertyInfo *i){
+    if(!i || i->type < FC2_BRIGHTNESS || i->type >= FC2_UNSPECIFIED_PROPERTY_TYPE) return FC2_ERROR_INVALID_PARAMETER;
+    pthread_mutex_lock(&cachemutex);
+    fc2Error e = cachevalid ? FC2_ERROR_OK : readprops_(context);
+    if(e == FC2_ERROR_OK) *i = propinfo[i->type];
+    pthread_mutex_unlock(&cachemutex);
+    return e;
+}
+
+/**
+ * @brief mkprop - make new property state by cached one
+ * @param s (io)  - setting (s->err is filled here)
+ * @param prop (o)- new property state
+ * @return 1 if property should be changed
+ */
+static int mkprop(propsetting *s, fc2Property *prop){
+    fc2PropertyType t = s->type;
+    fc2PropertyInfo *i = &propinfo[t];
+    *prop = propstate[t];
+    s->err = FC2_ERROR_OK;
+    if(!prop->present || !i->present){
+        s->err = FC2_ERROR_NOT_FOUND;
+        return 0;
+    }
+    if(!s->isfloat){ // on/off
+        if(prop->onOff == s->onOff) return 0;
+        if(!i->onOffSupported){
+            WARNX("Property %s not supported state OFF", propnames[t]);
+            s->err = FC2_ERROR_PROPERTY_FAILED;
+            return 0;
+        }
+        prop->onOff = s->onOff;
+        return 1;
+    }
+    if(prop->autoManualMode){
+        if(!i->manualSupported){
             WARNX("Can't set auto-only property");
-            return FC2_ERROR_PROPERTY_FAILED;
+            s->err = FC2_ERROR_PROPERTY_FAILED;
+            return 0;
         }
-        prop.autoManualMode = false;
+        prop->autoManualMode = false;
     }
-    if(!prop.absControl){
-        if(!i.absValSupported){
+    if(!prop->absControl){
+        if(!i->absValSupported){
             WARNX("Can't set non-absolute property to absolute value");
-            return FC2_ERROR_PROPERTY_FAILED;
+            s->err = FC2_ERROR_PROPERTY_FAILED;
+            return 0;
         }
-        prop.absControl = true;
+        prop->absControl = true;
     }
-    if(!prop.onOff){
-        if(!i.onOffSupported){
+    if(!prop->onOff){
+        if(!i->onOffSupported){
             WARNX("Can't set property ON");
-            return FC2_ERROR_PROPERTY_FAILED;
+            s->err = FC2_ERROR_PROPERTY_FAILED;
+            return 0;
         }
-        prop.onOff = true;
+        prop->onOff = true;
+    }
+    if(prop->onePush && i->onePushSupported) prop->onePush = false;
+    if(fabsf(prop->absValue - s->value) <= ABSVAL_TOLERANCE &&
+        !memcmp(prop, &propstate[t], sizeof(fc2Property))) return 0; // nothing to change
+    prop->valueA = prop->valueB = 0;
+    prop->absValue = s->value;
+    return 1;
+}
+
+/**
+ * @brief setprops - apply a batch of settings; properties that are already in needed state
+ *          are skipped, changed properties are verified by one read-back after all writes
+ * @param context  - initialized context
+ * @param settings - array of settings (their fields `err` are filled by result)
+ * @param N        - length of `settings`
+ * @return FC2_ERROR_OK if all settings applied
+ */
+fc2Error setprops(fc2Context context, propsetting *settings, int N){
+    fc2Error ret = FC2_ERROR_OK;
+    int changed[N];
+    pthread_mutex_lock(&cachemutex);
+    if(!cachevalid && FC2_ERROR_OK != (ret = readprops_(context))){
+        pthread_mutex_unlock(&cachemutex);
+        return ret;
+    }
+    for(int n = 0; n < N; ++n){
+        propsetting *s = &settings[n];
+        changed[n] = 0;
+        if(s->type < FC2_BRIGHTNESS || s->type >= FC2_UNSPECIFIED_PROPERTY_TYPE){
+            s->err = FC2_ERROR_INVALID_PARAMETER;
+            ret = s->err;
+            continue;
+        }
+        fc2Property prop;
+        if(!mkprop(s, &prop)){
+            if(s->err != FC2_ERROR_OK) ret = s->err;
+            continue;
+        }
+        if(FC2_ERROR_OK != (s->err = fc2SetProperty(context, &prop))){
+            WARNX("fc2SetProperty(%s): %s", propnames[s->type], fc2ErrorToDescription(s->err));
+            ret = s->err;
+        }
+        changed[n] = 1; // verify even if failed: camera state is unknown
     }
-    if(prop.onePush && i.onePushSupported) prop.onePush = false;
-    prop.valueA = prop.valueB = 0;
-    prop.absValue = f;
-    FC2FNW(fc2SetProperty, context, &prop);
     // now check
-    FC2FNW(fc2GetProperty, context, &prop);
-    if(fabsf(prop.absValue - f) > 0.02f){
-        WARNX("Can't set %s! Got %g instead of %g.", propnames[t], prop.absValue, f);
-        return FC2_ERROR_FAILED;
+    for(int n = 0; n < N; ++n){
+        if(!changed[n]) continue;
+        propsetting *s = &settings[n];
+        fc2Error e = updprop(context, s->type);
+        if(e != FC2_ERROR_OK){
+            s->err = ret = e;
+            continue;
+        }
+        if(s->err != FC2_ERROR_OK) continue;
+        fc2Property *prop = &propstate[s->type];
+        if(s->isfloat){
+            if(fabsf(prop->absValue - s->value) > ABSVAL_TOLERANCE){
+                WARNX("Can't set %s! Got %g instead of %g.", propnames[s->type], prop->absValue, s->value);
+                s->err = ret = FC2_ERROR_FAILED;
+            }
+        }else if(prop->onOff != s->onOff){
+            WARNX("Can't change property %s OnOff state", propnames[s->type]);
+            s->err = ret = FC2_ERROR_FAILED;
+        }
     }
-    return FC2_ERROR_OK;
+    pthread_mutex_unlock(&cachemutex);
+    return ret;
+}
+
+/**
+ * @brief setfloat - set absolute property value (float)
+ * @param t        - type of property
+ * @param context  - initialized context
+ * @param f        - new value
+ * @return FC2_ERROR_OK if all OK
+ */
+fc2Error setfloat(fc2PropertyType t, fc2Context context, float f){
+    propsetting s = PROPVAL(t, f);
+    return setprops(context, &s, 1);
 }
 
 fc2Error propOnOff(fc2PropertyType t, fc2Context context, BOOL onOff){
-    fc2Property prop = {0};
-    prop.type = t;
-    fc2PropertyInfo i = {0};
-    i.type = t;
-    FC2FNW(fc2GetPropertyInfo, context, &i);
-    FC2FNW(fc2GetProperty, context, &prop);
-    if(!prop.present || !i.present) return FC2_ERROR_NOT_FOUND;
-    if(prop.onOff == onOff) return FC2_ERROR_OK;
-    if(!i.onOffSupported){
-        WARNX("Property %s not supported state OFF", propnames[t]);
-        return  FC2_ERROR_PROPERTY_FAILED;
+    propsetting s = PROPONOFF(t, onOff);
+    return setprops(context, &s, 1);
+}
+
+/**
+ * @brief startcapture - start capture of frame with exposition & gain known: setprops() from other
+ *          threads (e.g. auto exposure) can't change them between reading and start
+ * @param context - initialized context
+ * @param exptime - (o) exposition time of frame (ms)
+ * @param gain    - (o) gain of frame (dB)
+ * @return FC2_ERROR_OK if all OK
+ */
+fc2Error startcapture(fc2Context context, float *exptime, float *gain){
+    pthread_mutex_lock(&cachemutex); // setprops() writes camera & cache under it
+    *exptime = getexp();
+    *gain = getgain();
+    fc2Error e = fc2StartCapture(context);
+    pthread_mutex_unlock(&cachemutex);
+    return e;
+}
+
+/**
+ * @brief setroi - set region of sensor read out (Format7 image settings), capture should be stopped
+ *          (offsets & sizes are rounded down to steps of camera; nothing is sent if region isn't changed)
+ * @param context - initialized context
+ * @param roi     - x0, y0, w, h of region (w or h <= 0 - full frame), (o) region really set
+ * @return FC2_ERROR_OK if all OK
+ */
+fc2Error setroi(fc2Context context, int roi[4]){
+    fc2Format7ImageSettings cur, s;
+    unsigned int packet;
+    float percent;
+    BOOL ok;
+    FC2FNW(fc2GetFormat7Configuration, context, &cur, &packet, &percent);
+    fc2Format7Info info = {0};
+    info.mode = cur.mode;
+    FC2FNW(fc2GetFormat7Info, context, &info, &ok);
+    if(!ok) return FC2_ERROR_NOT_IMPLEMENTED;
+    s = cur;
+    if(roi[2] <= 0 || roi[3] <= 0){
+        s.offsetX = s.offsetY = 0;
+        s.width = info.maxWidth;
+        s.height = info.maxHeight;
+    }else{
+        #define ROUNDDOWN(v, step)  ((step) ? (unsigned int)(v) / (step) * (step) : (unsigned int)(v))
+        s.offsetX = ROUNDDOWN(roi[0], info.offsetHStepSize);
+        s.offsetY = ROUNDDOWN(roi[1], info.offsetVStepSize);
+        if(s.offsetX >= info.maxWidth || s.offsetY >= info.maxHeight) return FC2_ERROR_INVALID_PARAMETER;
+        unsigned int w = (unsigned int)roi[2], h = (unsigned int)roi[3];
+        if(w > info.maxWidth - s.offsetX) w = info.maxWidth - s.offsetX;
+        if(h > info.maxHeight - s.offsetY) h = info.maxHeight - s.offsetY;
+        s.width = ROUNDDOWN(w, info.imageHStepSize);
+        s.height = ROUNDDOWN(h, info.imageVStepSize);
+        #undef ROUNDDOWN
+        if(!s.width || !s.height) return FC2_ERROR_INVALID_PARAMETER;
     }
-    prop.onOff = onOff;
-    FC2FNW(fc2SetProperty, context, &prop);
-    FC2FNW(fc2GetProperty, context, &prop);
-    if(prop.onOff != onOff){
-        WARNX("Can't change property %s OnOff state", propnames[t]);
-        return FC2_ERROR_FAILED;
+    roi[0] = s.offsetX; roi[1] = s.offsetY;
+    roi[2] = s.width; roi[3] = s.height;
+    if(s.offsetX == cur.offsetX && s.offsetY == cur.offsetY && s.width == cur.width && s.height == cur.height)
+        return FC2_ERROR_OK;
+    fc2Format7PacketInfo pinfo;
+    FC2FNW(fc2ValidateFormat7Settings, context, &s, &ok, &pinfo);
+    if(!ok) return FC2_ERROR_INVALID_SETTINGS;
+    FC2FNW(fc2SetFormat7ConfigurationPacket, context, &s, pinfo.recommendedBytesPerPacket);
+    // range of shutter depends on frame size
+    pthread_mutex_lock(&cachemutex);
+    fc2Error e = FC2_ERROR_OK;
+    if(cachevalid){
+        fc2PropertyType t[] = {FC2_SHUTTER, FC2_FRAME_RATE};
+        for(int i = 0; i < 2 && e == FC2_ERROR_OK; ++i){
+            propinfo[t[i]].type = t[i];
+            e = fc2GetPropertyInfo(context, &propinfo[t[i]]);
+            if(e == FC2_ERROR_OK) e = updprop(context, t[i]);
+        }
+        if(e != FC2_ERROR_OK) cachevalid = 0;
     }
+    pthread_mutex_unlock(&cachemutex);
+    VDBG("ROI: %ux%u at (%u, %u)", s.width, s.height, s.offsetX, s.offsetY);
     return FC2_ERROR_OK;
 }
 
+/**
+ * @brief connectcam - connect to camera & read its information and properties into cache
+ * @param context - initialized context
+ * @param guid    - camera guid
+ * @return FC2_ERROR_OK if all OK
+ */
+fc2Error connectcam(fc2Context context, fc2PGRGuid *guid){
+    caminfovalid = 0;
+    FC2FNW(fc2Connect, context, guid);
+    FC2FNW(fc2GetCameraInfo, context, &caminfo);
+    caminfovalid = 1;
+    return readprops(context);
+}
+
+// return cached information about connected camera or NULL
+fc2CameraInfo *getcaminfo(){
+    return caminfovalid ? &caminfo : NULL;
+}
+
 void PrintCameraInfo(fc2Context context, unsigned int n){
     fc2CameraInfo camInfo;
-    fc2Error error = fc2GetCameraInfo(context, &camInfo);
-    if(error != FC2_ERROR_OK){
-        WARNX("fc2GetCameraInfo(): %s", fc2ErrorToDescription(error));
-        return;
+    if(caminfovalid) camInfo = caminfo;
+    else{
+        fc2Error error = fc2GetCameraInfo(context, &camInfo);
+        if(error != FC2_ERROR_OK){
+            WARNX("fc2GetCameraInfo(): %s", fc2ErrorToDescription(error));
+            return;
+        }
     }
     printf("\n\n");
     green("*** CAMERA %d INFORMATION ***\n", n);
@@ -191,9 +462,10 @@ void PrintCameraInfo(fc2Context context, unsigned int n){
            camInfo.sensorResolution,
            camInfo.firmwareVersion,
            camInfo.firmwareBuildTime);
-    if(verbose_level >= VERB_MESG){
+    if(verbose_level >= VERB_MESG){ // properties are printed from cache filled by connectcam()
         for(fc2PropertyType t = FC2_BRIGHTNESS; t < FC2_UNSPECIFIED_PROPERTY_TYPE; ++t){
-            getproperty(context, t);
+            fc2Error e = getproperty(context, t);
+            if(e != FC2_ERROR_OK && e != FC2_ERROR_NOT_FOUND) return; // cache can't be read
             if(verbose_level >= VERB_DEBUG) getpropertyInfo(context, t);
         }
     }
@@ -29,12 +29,34 @@
 #define FC2FNW(fn, c, ...) do{fc2Error err = FC2_ERROR_OK; if(FC2_ERROR_OK != (err=fn(c __VA_OPT__(,) __VA_ARGS__))){ \
     WARNX(#fn "(): %s", fc2ErrorToDescription(err)); return err;}}while(0)
 
+// one item of settings batch for setprops()
+typedef struct{
+    fc2PropertyType type;   // property
+    int isfloat;            // ==1 to set absolute value, ==0 to set on/off state
+    float value;            // absolute value
+    BOOL onOff;             // on/off state
+    fc2Error err;           // result of setting
+} propsetting;
+
+#define PROPVAL(t, v)       ((propsetting){.type = t, .isfloat = 1, .value = v})
+#define PROPONOFF(t, o)     ((propsetting){.type = t, .onOff = o})
+#define PROPOFF(t)          PROPONOFF(t, false)
+
+fc2Error connectcam(fc2Context context, fc2PGRGuid *guid);
+fc2CameraInfo *getcaminfo();
 void PrintCameraInfo(fc2Context context, unsigned int n);
 const char *getPropName(fc2PropertyType t);
 fc2Error getproperty(fc2Context context, fc2PropertyType t);
 fc2Error getpropertyInfo(fc2Context context, fc2PropertyType t);
+fc2Error readprops(fc2Context context);
+fc2Error refreshprop(fc2Context context, fc2PropertyType t);
+fc2Error getpropinfo(fc2Context context, fc2PropertyInfo *i);
+fc2Error setprops(fc2Context context, propsetting *settings, int N);
 fc2Error setfloat(fc2PropertyType t, fc2Context context, float f);
 fc2Error propOnOff(fc2PropertyType t, fc2Context context, BOOL onOff);
+fc2Error startcapture(fc2Context context, float *exptime, float *gain);
+fc2Error setroi(fc2Context context, int roi[4]);
+float getpropval(fc2PropertyType t);
 #define autoExpOff(c)           propOnOff(FC2_AUTO_EXPOSURE, c, false)
 #define whiteBalOff(c)          propOnOff(FC2_WHITE_BALANCE, c, false)
 #define gammaOff(c)             propOnOff(FC2_GAMMA, c, false)
@@ -45,5 +67,7 @@ fc2Error propOnOff(fc2PropertyType t, fc2Context context, BOOL onOff);
 #define setbrightness(c, b)     setfloat(FC2_BRIGHTNESS, c, b)
 #define setexp(c, e)            setfloat(FC2_SHUTTER, c, e)
 #define setgain(c, g)           setfloat(FC2_GAIN, c, g)
+#define getexp()                getpropval(FC2_SHUTTER)
+#define getgain()               getpropval(FC2_GAIN)
 
 #endif // CAMERA_FUNCTIONS__
@@ -0,0 +1,197 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Simple test client of grasshopper server: sends commands, receives streamed frames
+ * and shows their statistics; with `-d` it imitates slow subscriber (server should drop frames for it).
+ */
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+
+// max length of answer line
+#define LINEBUFSZ   (512)
+
+static int sock = -1;
+static char inbuf[LINEBUFSZ];   // data read from socket but still not processed
+static size_t inlen = 0;
+
+static void usage(const char *self){
+    printf("Usage: %s [-n frames] [-d ms] [-o file.pgm] <port | /path/to/socket> [command] ...\n", self);
+    printf("\tcommands are sent one by one before subscribing (e.g. \"bin 4\" \"roi 0 0 640 480\")\n");
+    printf("\t-n N      - subscribe and receive N frames\n");
+    printf("\t-d ms     - pause after each received frame (slow subscriber)\n");
+    printf("\t-o file   - save last received frame as PGM\n");
+    exit(1);
+}
+
+// connect to TCP port on localhost or to UNIX socket
+static int connectto(const char *path){
+    int fd;
+    const char *p = path;
+    while(isdigit(*p)) ++p;
+    if(*p == 0){
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(path));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) ERR("socket()");
+        if(connect(fd, (struct sockaddr*)&addr, sizeof(addr))) ERR("connect()");
+    }else{
+        struct sockaddr_un addr = {0};
+        if(strlen(path) >= sizeof(addr.sun_path)) ERRX("Too long socket path: %s", path);
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ERR("socket()");
+        if(connect(fd, (struct sockaddr*)&addr, sizeof(addr))) ERR("connect()");
+    }
+    return fd;
+}
+
+// read exactly `len` bytes (buffered data first)
+static void readexact(uint8_t *buf, size_t len){
+    size_t n = (inlen < len) ? inlen : len;
+    if(n){
+        memcpy(buf, inbuf, n);
+        memmove(inbuf, inbuf + n, inlen - n);
+        inlen -= n;
+    }
+    while(n < len){
+        ssize_t r = recv(sock, buf + n, len - n, 0);
+        if(r <= 0) ERRX("Server closed connection");
+        n += r;
+    }
+}
+
+// read next line without '\n'
+static void readline(char *line){
+    char *eol;
+    while(!(eol = memchr(inbuf, '\n', inlen))){
+        if(inlen == LINEBUFSZ) ERRX("Too long line from server");
+        ssize_t r = recv(sock, inbuf + inlen, LINEBUFSZ - inlen, 0);
+        if(r <= 0) ERRX("Server closed connection");
+        inlen += r;
+    }
+    size_t l = eol - inbuf;
+    memcpy(line, inbuf, l);
+    line[l] = 0;
+    memmove(inbuf, eol + 1, inlen - l - 1);
+    inlen -= l + 1;
+}
+
+static void sendline(const char *cmd){
+    size_t l = strlen(cmd);
+    if(send(sock, cmd, l, MSG_NOSIGNAL) != (ssize_t)l || send(sock, "\n", 1, MSG_NOSIGNAL) != 1)
+        ERR("send()");
+}
+
+/**
+ * @brief readframe - read next frame or answer
+ * @param line  - (o) line read
+ * @param data  - (o) frame data (reallocated), NULL to skip data
+ * @param dsz   - (io) size of `data`
+ * @return amount of frame bytes or 0 if `line` is answer
+ */
+static size_t readframe(char *line, uint8_t **data, size_t *dsz){
+    readline(line);
+    unsigned long long idx;
+    int w, h;
+    double exp;
+    size_t sz;
+    if(sscanf(line, "FRAME %llu %d %d %lg %zu", &idx, &w, &h, &exp, &sz) != 5) return 0;
+    static uint8_t *skip = NULL;
+    static size_t skipsz = 0;
+    if(!data){ data = &skip; dsz = &skipsz; }
+    if(*dsz < sz){
+        *data = realloc(*data, sz);
+        if(!*data) ERR("realloc()");
+        *dsz = sz;
+    }
+    readexact(*data, sz);
+    return sz;
+}
+
+// send command & print answer (frames received meanwhile are skipped)
+static void command(const char *cmd){
+    char line[LINEBUFSZ];
+    sendline(cmd);
+    while(readframe(line, NULL, NULL));
+    printf("%s -> %s\n", cmd, line);
+}
+
+int main(int argc, char **argv){
+    int nframes = 0, delay = 0, opt;
+    char *outfile = NULL;
+    while((opt = getopt(argc, argv, "n:d:o:h")) != -1){
+        switch(opt){
+            case 'n': nframes = atoi(optarg); break;
+            case 'd': delay = atoi(optarg); break;
+            case 'o': outfile = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if(optind >= argc) usage(argv[0]);
+    sock = connectto(argv[optind++]);
+    for(; optind < argc; ++optind) command(argv[optind]);
+    if(nframes > 0){
+        char line[LINEBUFSZ];
+        uint8_t *data = NULL;
+        size_t dsz = 0;
+        unsigned long long idx = 0, first = 0;
+        int w = 0, h = 0;
+        double t0 = dtime();
+        command("subscribe");
+        for(int i = 0; i < nframes;){
+            size_t sz = readframe(line, &data, &dsz);
+            if(!sz){
+                printf("%s\n", line);
+                continue;
+            }
+            double exp, sum = 0.;
+            sscanf(line, "FRAME %llu %d %d %lg", &idx, &w, &h, &exp);
+            if(i == 0) first = idx;
+            for(size_t j = 0; j < sz; ++j) sum += data[j];
+            printf("Frame #%llu: %dx%d, exptime=%gms, mean=%.1f\n", idx, w, h, exp, sum / sz);
+            if(++i < nframes && delay > 0) usleep(delay * 1000);
+        }
+        double t = dtime() - t0;
+        command("unsubscribe");
+        printf("Received %d frames of %llu in %.1fs (%.1f fps)\n", nframes, idx - first + 1, t, nframes / t);
+        if(outfile){
+            FILE *f = fopen(outfile, "w");
+            if(!f) ERR("Can't open %s", outfile);
+            fprintf(f, "P5\n%d %d\n255\n", w, h);
+            if(fwrite(data, 1, (size_t)w * h, f) != (size_t)w * h) WARN("Can't write %s", outfile);
+            fclose(f);
+        }
+        free(data);
+        command("status");
+    }
+    close(sock);
+    return 0;
+}
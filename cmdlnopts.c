@@ -24,7 +24,10 @@
 #include <strings.h>
 #include <usefull_macros.h>
 
+#include "calibration.h"
 #include "cmdlnopts.h"
+#include "pretrigger.h"
+#include "stretch.h"
 
 static int help;
 
@@ -43,7 +46,22 @@ static glob_pars const Gdefault = {
     .device = NULL,
     .pidfile = DEFAULT_PIDFILE,
     .exptime = NAN,
-    .gain = NAN
+    .gain = NAN,
+    .aelevel = 0.7,
+    .aemaxexp = NAN,
+    .aemaxgain = 0.,
+    .shmslots = 8,
+    .pnglevel = 1,
+    .calframes = CALIB_NFRAMES,
+    .stacksigma = 3.,
+    .dispfps = 25.,
+    .stretchsmooth = STRETCH_SMOOTH,
+    .stretchstep = 1,
+    .videofps = 25.,
+    .syncframes = 1,
+    .posttrigger = PRETRIGGER_POST,
+    .trigmem = PRETRIGGER_MEM,
+    .grabcpu = -1
 };
 
 /*
@@ -56,12 +74,73 @@ static myoption cmdlnopts[] = {
     {"device",  NEED_ARG,   NULL,   'd',    arg_string, APTR(&G.device),    _("camera device name")},
     {"pidfile", NEED_ARG,   NULL,   'P',    arg_string, APTR(&G.pidfile),   _("pidfile (default: " DEFAULT_PIDFILE ")")},
     {"verbose", NO_ARGS,    NULL,   'v',    arg_none,   APTR(&verbose_level), _("verbose level (each 'v' increases it)")},
+    {"log",     NEED_ARG,   NULL,   0,      arg_string, APTR(&G.logfile),   _("write messages into given file or \"syslog\" instead of console")},
     {"camno",   NEED_ARG,   NULL,   'n',    arg_int,    APTR(&G.camno),     _("camera number (if many connected)")},
+    {"serial",  NEED_ARG,   NULL,   's',    arg_int,    APTR(&G.serial),    _("serial number of camera (connect without enumeration)")},
     {"exptime", NEED_ARG,   NULL,   'x',    arg_float,  APTR(&G.exptime),   _("exposure time (ms)")},
     {"gain",    NEED_ARG,   NULL,   'g',    arg_float,  APTR(&G.gain),      _("gain value (dB)")},
+    {"readout", NEED_ARG,   NULL,   0,      arg_float,  APTR(&G.readout),   _("time of sensor readout & transfer of frame (ms) to get exposure start time (default: 0)")},
     {"display", NO_ARGS,    NULL,   'D',    arg_int,    APTR(&G.showimage), _("display captured image")},
+    {"stretch", NEED_ARG,   NULL,   0,      arg_string, APTR(&G.stretch),   _("stretch of displayed image: minmax, percent, asinh, zscale, equalize (default) or clahe")},
+    {"stretchsmooth",NEED_ARG,NULL, 0,      arg_double, APTR(&G.stretchsmooth), _("weight of new histogram in its moving average (0..1, 1 - don't smooth; default: 0.3)")},
+    {"stretchstep",NEED_ARG,NULL,   0,      arg_int,    APTR(&G.stretchstep), _("build stretch histogram by every N-th row & pixel (default: 1)")},
+    {"fps",     NEED_ARG,   NULL,   0,      arg_float,  APTR(&G.dispfps),   _("max refresh rate of displayed image (default: 25)")},
     {"nimages", NEED_ARG,   NULL,   'N',    arg_int,    APTR(&G.nimages),   _("number of images to capture")},
+    {"roots",   NEED_ARG,   NULL,   0,      arg_string, APTR(&G.roots),     _("comma-separated output directories (disks), files prefix is relative to them")},
+    {"rootpolicy",NEED_ARG, NULL,   0,      arg_string, APTR(&G.rootpolicy), _("choice of output root: \"rr\" (round-robin, default) or \"least\" (the shortest writers queue)")},
+    {"shard",   NEED_ARG,   NULL,   0,      arg_string, APTR(&G.shard),     _("put files into subdirectories: \"hour\" or by given amount of frames")},
+    {"video",   NEED_ARG,   NULL,   0,      arg_string, APTR(&G.video),     _("write frames into video: file.y4m, file.avi (uncompressed) or \"|command\" reading YUV4MPEG2")},
+    {"videofps",NEED_ARG,   NULL,   0,      arg_double, APTR(&G.videofps),  _("frame rate of video (default: 25)")},
+    {"videocolor",NO_ARGS,  NULL,   0,      arg_int,    APTR(&G.videocolor), _("colorize gray video by palette of display")},
+    {"replay",  NEED_ARG,   NULL,   0,      arg_string, APTR(&G.replay),    _("process recorded FITS files matching given pattern instead of grabbing")},
+    {"sequence",NEED_ARG,   NULL,   0,      arg_string, APTR(&G.sequence),  _("run steps of sequence file (exptime=, gain=, frames=, roi=, prefix= per line)")},
     {"png",     NO_ARGS,    NULL,   'p',    arg_int,    APTR(&G.save_png),  _("save png too")},
+    {"pnglevel",NEED_ARG,   NULL,   0,      arg_int,    APTR(&G.pnglevel),  _("PNG compression level (0 - store, 9 - best; default: 1)")},
+    {"pngfilter",NEED_ARG,  NULL,   0,      arg_string, APTR(&G.pngfilter), _("PNG row filter: none, sub, up, avg or paeth (default: up)")},
+    {"autoexp", NO_ARGS,    NULL,   'A',    arg_int,    APTR(&G.autoexp),   _("software auto exposure (--exptime is starting value)")},
+    {"aelevel", NEED_ARG,   NULL,   0,      arg_float,  APTR(&G.aelevel),   _("auto exposure target level of bright pixels (0..1, default: 0.7)")},
+    {"aemaxexp",NEED_ARG,   NULL,   0,      arg_float,  APTR(&G.aemaxexp),  _("auto exposure max exposition time (ms)")},
+    {"aemaxgain",NEED_ARG,  NULL,   0,      arg_float,  APTR(&G.aemaxgain), _("auto exposure max gain (dB, default: 0 - don't change gain)")},
+    {"compress",NEED_ARG,   NULL,   'c',    arg_string, APTR(&G.compress),  _("tile compression of FITS files: rice, gzip, gzip2, hcompress or none")},
+    {"writers", NEED_ARG,   NULL,   'w',    arg_int,    APTR(&G.nwriters),  _("amount of file writer threads per output root (default: 0 - write FITS in grabbing thread, 1 if --png or --roots)")},
+    {"writemode",NEED_ARG,  NULL,   0,      arg_string, APTR(&G.writemode), _("file writing: plain (default), safe (tmp file + fdatasync + rename) or direct (safe with O_DIRECT)")},
+    {"syncframes",NEED_ARG, NULL,   0,      arg_int,    APTR(&G.syncframes), _("safe writing: sync files by batches of N (1..64, default: 1)")},
+    {"synctime",NEED_ARG,   NULL,   0,      arg_double, APTR(&G.synctime),  _("safe writing: sync batch after T seconds since its first file (default: 0 - don't check)")},
+    {"fitscheck",NO_ARGS,   NULL,   0,      arg_int,    APTR(&G.fitscheck), _("read FITS files back after writing and compare with original")},
+    {"server",  NEED_ARG,   NULL,   'S',    arg_string, APTR(&G.server),    _("run server on given TCP port (localhost) or UNIX socket path")},
+    {"metrics", NEED_ARG,   NULL,   0,      arg_string, APTR(&G.metrics),   _("serve metrics in Prometheus format over HTTP on given TCP port (localhost) or UNIX socket path")},
+    {"shm",     NEED_ARG,   NULL,   0,      arg_string, APTR(&G.shmname),   _("publish frames into shared memory ring with given name (e.g. /grasshopper)")},
+    {"shmslots",NEED_ARG,   NULL,   0,      arg_int,    APTR(&G.shmslots),  _("amount of slots in shared memory ring (default: 8)")},
+    {"shmread", NO_ARGS,    NULL,   0,      arg_int,    APTR(&G.shmread),   _("don't grab, read frames from shared memory ring and show statistics")},
+    {"dark",    NEED_ARG,   NULL,   0,      arg_string, APTR(&G.dark),      _("master dark FITS (scaled by its EXPTIME) to subtract from frames")},
+    {"flat",    NEED_ARG,   NULL,   0,      arg_string, APTR(&G.flat),      _("master flat FITS to divide frames by")},
+    {"badpix",  NEED_ARG,   NULL,   0,      arg_string, APTR(&G.badpix),    _("bad pixels map FITS (nonzero pixels will be interpolated)")},
+    {"mkdark",  NEED_ARG,   NULL,   0,      arg_string, APTR(&G.mkdark),    _("build master dark from grabbed frames and save it into given file")},
+    {"mkflat",  NEED_ARG,   NULL,   0,      arg_string, APTR(&G.mkflat),    _("build master flat (frames are dark-subtracted) and save it into given file")},
+    {"calframes",NEED_ARG,  NULL,   0,      arg_int,    APTR(&G.calframes), _("amount of frames for master dark/flat (default: 16)")},
+    {"stack",   NO_ARGS,    NULL,   0,      arg_int,    APTR(&G.stack),     _("stack frames and save only stack (mean) instead of each frame")},
+    {"stackevery",NEED_ARG, NULL,   0,      arg_int,    APTR(&G.stackevery), _("save stack every N frames (default: 0 - only at the end)")},
+    {"stackreject",NEED_ARG,NULL,   0,      arg_string, APTR(&G.stackreject), _("rejection of outliers in stack: none, minmax or sigma")},
+    {"stacksigma",NEED_ARG, NULL,   0,      arg_float,  APTR(&G.stacksigma), _("sigma clipping level of stack (default: 3)")},
+    {"stackalign",NEED_ARG, NULL,   0,      arg_int,    APTR(&G.stackalign), _("align frames of stack by cross-correlation with max shift N pixels")},
+    {"lucky",   NEED_ARG,   NULL,   0,      arg_float,  APTR(&G.lucky),     _("lucky imaging: keep only given percent of sharpest frames (stack them if --stack)")},
+    {"luckybatch",NEED_ARG, NULL,   0,      arg_int,    APTR(&G.luckybatch), _("amount of frames to select from (default: --nimages or 100)")},
+    {"luckyroi",NEED_ARG,   NULL,   0,      arg_string, APTR(&G.luckyroi),  _("region for sharpness calculation: \"x,y,w,h\" (default: full frame)")},
+    {"raw",     NO_ARGS,    NULL,   0,      arg_int,    APTR(&G.rawbayer),  _("keep raw Bayer frames of color camera (demosaic them only for displaying)")},
+    {"demosaic",NEED_ARG,   NULL,   0,      arg_string, APTR(&G.demosaic),  _("demosaic algorithm: nearest, bilinear (default) or edge")},
+    {"pretrigger",NEED_ARG, NULL,   0,      arg_double, APTR(&G.pretrigger), _("keep last T seconds of frames in memory and save them only by event (key 't', command `trigger` or --trigdiff)")},
+    {"posttrigger",NEED_ARG,NULL,   0,      arg_double, APTR(&G.posttrigger), _("save frames during T seconds after event (default: 5)")},
+    {"trigmem", NEED_ARG,   NULL,   0,      arg_double, APTR(&G.trigmem),   _("max memory for pre-trigger frames (MB, default: 512)")},
+    {"trigdiff",NEED_ARG,   NULL,   0,      arg_double, APTR(&G.trigdiff),  _("fire event when mean difference of neighbouring frames exceeds given value (ADU)")},
+    {"retain",  NEED_ARG,   NULL,   0,      arg_double, APTR(&G.retain),    _("remove the oldest files of sequence when their total size exceeds given value (MB)")},
+    {"minfree", NEED_ARG,   NULL,   0,      arg_double, APTR(&G.minfree),   _("remove the oldest files of sequence when free disk space is less than given value (MB)")},
+    {"bench",   NEED_ARG,   NULL,   0,      arg_string, APTR(&G.bench),     _("run benchmark (demosaic, threads, write, log) and exit")},
+    {"grabcpu", NEED_ARG,   NULL,   0,      arg_int,    APTR(&G.grabcpu),   _("pin grabbing thread to given CPU (other threads run on the rest CPUs)")},
+    {"cpus",    NEED_ARG,   NULL,   0,      arg_string, APTR(&G.cpus),      _("CPUs of all threads but grabbing one (list like 0-3,6)")},
+    {"rtprio",  NEED_ARG,   NULL,   0,      arg_int,    APTR(&G.rtprio),    _("run grabbing thread with SCHED_FIFO policy and given priority (1..99)")},
+    {"mlock",   NO_ARGS,    NULL,   0,      arg_int,    APTR(&G.mlock),     _("lock process memory (no page faults on frame buffers)")},
+    {"numa",    NO_ARGS,    NULL,   0,      arg_int,    APTR(&G.numa),      _("allocate frame buffers on NUMA node of grabbing CPU")},
+    {"threads", NEED_ARG,   NULL,   0,      arg_int,    APTR(&G.nthreads),  _("amount of threads for image processing (default: amount of CPUs)")},
    end_option
 };
 
@@ -28,11 +28,72 @@ typedef struct{
     char *device;           // camera device name
     char *pidfile;          // name of PID file
     int camno;              // number of camera to work with
+    int serial;             // serial number of camera to work with (fast connection)
     float exptime;          // exposition time
     float gain;             // gain value
+    float readout;          // time of sensor readout & transfer of frame (ms)
     int showimage;          // display last captured image in OpenGL screen
     int nimages;            // number of images to capture
     int save_png;           // save png file
+    int pnglevel;           // PNG compression level (0..9)
+    char *pngfilter;        // PNG row filter
+    int autoexp;            // software auto exposure
+    float aelevel;          // target level of bright pixels for auto exposure (0..1)
+    float aemaxexp;         // max exposition time for auto exposure (ms)
+    float aemaxgain;        // max gain for auto exposure (dB)
+    char *compress;         // FITS compression type
+    int nwriters;           // amount of FITS writer threads (0 - write in grabbing thread)
+    int fitscheck;          // check FITS files after writing
+    char *writemode;        // file writing mode (plain, safe, direct)
+    int syncframes;         // sync files by batches of this size
+    double synctime;        // or after this time since first file of batch
+    char *server;           // TCP port or UNIX socket path for remote control
+    char *shmname;          // name of shared memory ring for frames
+    int shmslots;           // amount of slots in ring
+    int shmread;            // read frames from ring (test of readers)
+    char *dark;             // master dark
+    char *flat;             // master flat
+    char *badpix;           // bad pixels map
+    char *mkdark;           // build master dark into this file
+    char *mkflat;           // build master flat into this file
+    int calframes;          // amount of frames for master
+    int stack;              // stack frames instead of saving each
+    int stackevery;         // save stack every N frames (0 - only at the end)
+    char *stackreject;      // rejection of outliers in stack
+    float stacksigma;       // level of sigma clipping
+    int stackalign;         // max shift for alignment (0 - don't align)
+    float lucky;            // part of best frames to keep (%), 0 - keep all
+    int luckybatch;         // amount of frames to select from
+    char *luckyroi;         // region for sharpness calculation
+    int rawbayer;           // keep raw Bayer frames of color camera
+    char *demosaic;         // demosaic algorithm for displaying
+    char *stretch;          // stretch of displayed image
+    double stretchsmooth;   // weight of new histogram in its moving average
+    int stretchstep;        // build histogram by every N-th row & pixel
+    char *metrics;          // TCP port or UNIX socket path for metrics
+    char *logfile;          // log destination: file name or "syslog" (default: console)
+    char *bench;            // name of benchmark to run
+    double pretrigger;      // time of pre-trigger ring (s), 0 - save all frames
+    double posttrigger;     // time of recording after event (s)
+    double trigmem;         // max size of pre-trigger ring (MB)
+    double trigdiff;        // fire event when mean difference of frames is greater (ADU)
+    double retain;          // max total size of sequence files (MB)
+    double minfree;         // min free space on disk (MB)
+    int nthreads;           // amount of threads for image processing (0 - by CPUs amount)
+    float dispfps;          // max refresh rate of displayed image
+    char *sequence;         // file with observation sequence
+    char *replay;           // pattern of files to replay
+    char *roots;            // output roots
+    char *rootpolicy;       // choice of root for frame
+    char *shard;            // sharding of output directories
+    char *video;            // video file or encoder command
+    double videofps;        // frame rate of video
+    int videocolor;         // false color video by display palette
+    int grabcpu;            // CPU of grabbing thread (-1 - any)
+    char *cpus;             // CPUs of other threads
+    int rtprio;             // SCHED_FIFO priority of grabbing thread (0 - don't use)
+    int mlock;              // lock process memory
+    int numa;               // allocate frame buffers on NUMA node of grabbing CPU
     int rest_pars_num;      // number of rest parameters
     char** rest_pars;       // the rest parameters: array of char*
 } glob_pars;
@@ -0,0 +1,304 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <usefull_macros.h>
+
+#include "demosaic.h"
+#include "parallel.h"
+
+// width of border around padded frame
+#define PAD         (3)
+
+enum{R = 0, G = 1, B = 2};
+
+// colors of pixels: cfatab[pattern][y & 1][x & 1]
+static const uint8_t cfatab[5][2][2] = {
+    [BAYER_RGGB] = {{R, G}, {G, B}},
+    [BAYER_GRBG] = {{G, R}, {B, G}},
+    [BAYER_GBRG] = {{G, B}, {R, G}},
+    [BAYER_BGGR] = {{B, G}, {G, R}},
+};
+
+static const char *bayernames[] = {
+    [BAYER_NONE] = "none",
+    [BAYER_RGGB] = "RGGB",
+    [BAYER_GRBG] = "GRBG",
+    [BAYER_GBRG] = "GBRG",
+    [BAYER_BGGR] = "BGGR",
+};
+
+static const char *qualitynames[] = {
+    [DEMOSAIC_NEAREST] = "nearest",
+    [DEMOSAIC_BILINEAR] = "bilinear",
+    [DEMOSAIC_EDGE] = "edge",
+};
+
+// return algorithm by its name (NULL - bilinear) or -1
+int demosaic_byname(const char *name){
+    if(!name) return DEMOSAIC_BILINEAR;
+    for(int i = 0; i <= DEMOSAIC_EDGE; ++i)
+        if(strcasecmp(name, qualitynames[i]) == 0) return i;
+    return -1;
+}
+
+const char *bayer_name(bayerpattern pat){
+    if(pat > BAYER_BGGR) pat = BAYER_NONE;
+    return bayernames[pat];
+}
+
+// pattern of frame mirrored upside down (h - its height)
+bayerpattern bayer_flipud(bayerpattern pat, int h){
+    static const bayerpattern flipped[] = {
+        [BAYER_NONE] = BAYER_NONE,
+        [BAYER_RGGB] = BAYER_GBRG,
+        [BAYER_GRBG] = BAYER_BGGR,
+        [BAYER_GBRG] = BAYER_RGGB,
+        [BAYER_BGGR] = BAYER_GRBG,
+    };
+    if(pat > BAYER_BGGR || (h & 1)) return pat; // odd height: the last row has the same colors as first
+    return flipped[pat];
+}
+
+// data for row processing functions
+typedef struct{
+    const uint8_t *raw;     // input
+    int w, h, stride;
+    const uint8_t (*cfa)[2];// colors of pixels
+    uint8_t *pad;           // raw frame with reflected borders
+    uint8_t *green;         // green plane (with the same geometry as pad)
+    int pw;                 // stride of pad & green
+    uint8_t *rgb;           // output
+    int bin;                // binning of superpixel demosaic
+} dmctx;
+
+// pointer to pixel (x, y) of padded buffer
+#define PADDED(c, buf, x, y) (&(c)->buf[((y) + PAD) * (c)->pw + (x) + PAD])
+
+// reflect coordinate keeping its parity (so colors of Bayer pattern are the same)
+static inline int reflect(int x, int n){
+    if(x < 0) return -x;
+    if(x >= n) return 2 * (n - 1) - x;
+    return x;
+}
+
+static inline uint8_t clamp8(int v){
+    return (v < 0) ? 0 : (v > 255) ? 255 : (uint8_t)v;
+}
+
+// copy rows [y0, y1) of padded buffer (0 is the first border row)
+static void padrows(void *arg, int y0, int y1){
+    dmctx *c = (dmctx*) arg;
+    int w = c->w;
+    for(int y = y0; y < y1; ++y){
+        const uint8_t *src = c->raw + (size_t)reflect(y - PAD, c->h) * c->stride;
+        uint8_t *dst = &c->pad[(size_t)y * c->pw];
+        memcpy(dst + PAD, src, w);
+        for(int i = 1; i <= PAD; ++i){
+            dst[PAD - i] = src[i];
+            dst[PAD + w - 1 + i] = src[w - 1 - i];
+        }
+    }
+}
+
+// rows of 2x2 cells: each cell gives one color
+static void nearest_rows(void *arg, int y0, int y1){
+    dmctx *c = (dmctx*) arg;
+    int w = c->w, h = c->h, pw = c->pw, off[3] = {0}, offg = 0, ng = 0;
+    for(int dy = 0; dy < 2; ++dy) for(int dx = 0; dx < 2; ++dx){ // offsets of colors in cell
+        int col = c->cfa[dy][dx];
+        if(col == G && ng++) offg = dy * pw + dx; // the second green
+        else off[col] = dy * pw + dx;
+    }
+    for(int cy = y0; cy < y1; ++cy){
+        int y = 2 * cy;
+        const uint8_t *p = PADDED(c, pad, 0, y);
+        uint8_t *o0 = &c->rgb[3 * (size_t)y * w], *o1 = (y + 1 < h) ? o0 + 3 * w : o0;
+        for(int x = 0; x < w; x += 2){
+            uint8_t r = p[x + off[R]], g = (uint8_t)((p[x + off[G]] + p[x + offg] + 1) >> 1), b = p[x + off[B]];
+            int n = (x + 1 < w) ? 2 : 1;
+            for(int i = 0; i < n; ++i){
+                uint8_t *a = o0 + 3 * (x + i), *d = o1 + 3 * (x + i);
+                a[R] = d[R] = r;
+                a[G] = d[G] = g;
+                a[B] = d[B] = b;
+            }
+        }
+    }
+}
+
+/**
+ * @brief bilinear_px - bilinear interpolation of one pixel
+ * @param p  - pixel in padded buffer
+ * @param pw - stride of buffer
+ * @param c  - color of pixel
+ * @param ch - color of its horizontal neighbours
+ * @param o  - output RGB
+ */
+static inline void bilinear_px(const uint8_t *p, int pw, int c, int ch, uint8_t *o){
+    if(c == G){
+        o[G] = p[0];
+        o[ch] = (uint8_t)((p[-1] + p[1] + 1) >> 1);
+        o[2 - ch] = (uint8_t)((p[-pw] + p[pw] + 1) >> 1);
+    }else{
+        o[c] = p[0];
+        o[G] = (uint8_t)((p[-1] + p[1] + p[-pw] + p[pw] + 2) >> 2);
+        o[2 - c] = (uint8_t)((p[-pw-1] + p[-pw+1] + p[pw-1] + p[pw+1] + 2) >> 2);
+    }
+}
+
+static void bilinear_rows(void *arg, int y0, int y1){
+    dmctx *c = (dmctx*) arg;
+    int w = c->w, pw = c->pw;
+    for(int y = y0; y < y1; ++y){
+        const uint8_t *p = PADDED(c, pad, 0, y);
+        uint8_t *o = &c->rgb[3 * (size_t)y * w];
+        int c0 = c->cfa[y & 1][0], c1 = c->cfa[y & 1][1];
+        for(int x = 0; x < w; x += 2){
+            bilinear_px(p + x, pw, c0, c1, o + 3*x);
+            if(x + 1 < w) bilinear_px(p + x + 1, pw, c1, c0, o + 3*x + 3);
+        }
+    }
+}
+
+// green in red/blue pixel: interpolation along direction with smaller gradient (with laplacian correction)
+static inline uint8_t green_px(const uint8_t *p, int pw){
+    int lh = 2*p[0] - p[-2] - p[2], lv = 2*p[0] - p[-2*pw] - p[2*pw];
+    int dh = abs(p[-1] - p[1]) + abs(lh), dv = abs(p[-pw] - p[pw]) + abs(lv);
+    int gh = 2*(p[-1] + p[1]) + lh, gv = 2*(p[-pw] + p[pw]) + lv; // 4*green
+    int g = (dh < dv) ? 2*gh : (dv < dh) ? 2*gv : gh + gv;
+    return clamp8((g + 4) >> 3);
+}
+
+// green plane for rows [y0, y1) of image (from -1 to h, columns from -1 to w)
+static void green_rows(void *arg, int y0, int y1){
+    dmctx *c = (dmctx*) arg;
+    int w = c->w, pw = c->pw;
+    for(int y = y0; y < y1; ++y){
+        const uint8_t *p = PADDED(c, pad, 0, y);
+        uint8_t *g = PADDED(c, green, 0, y);
+        for(int x = -1; x <= w; ++x)
+            g[x] = (c->cfa[y & 1][x & 1] == G) ? p[x] : green_px(p + x, pw);
+    }
+}
+
+// red & blue by bilinear interpolation of color differences
+static void color_rows(void *arg, int y0, int y1){
+    dmctx *c = (dmctx*) arg;
+    int w = c->w, pw = c->pw;
+    for(int y = y0; y < y1; ++y){
+        const uint8_t *p = PADDED(c, pad, 0, y), *g = PADDED(c, green, 0, y);
+        uint8_t *o = &c->rgb[3 * (size_t)y * w];
+        for(int x = 0; x < w; ++x, o += 3){
+            int col = c->cfa[y & 1][x & 1], gx = g[x];
+            o[G] = (uint8_t)gx;
+            if(col == G){
+                int ch = c->cfa[y & 1][(x + 1) & 1];
+                o[ch] = clamp8(gx + (p[x-1] - g[x-1] + p[x+1] - g[x+1]) / 2);
+                o[2 - ch] = clamp8(gx + (p[x-pw] - g[x-pw] + p[x+pw] - g[x+pw]) / 2);
+            }else{
+                o[col] = p[x];
+                o[2 - col] = clamp8(gx + (p[x-pw-1] - g[x-pw-1] + p[x-pw+1] - g[x-pw+1] +
+                                          p[x+pw-1] - g[x+pw-1] + p[x+pw+1] - g[x+pw+1]) / 4);
+            }
+        }
+    }
+}
+
+// rounded division by 2^s
+#define RSHIFT(v, s)    (((v) + ((1 << (s)) >> 1)) >> (s))
+
+// superpixel demosaic: each bin x bin cell gives one RGB pixel (mean values of its colors)
+static void binned_rows(void *arg, int y0, int y1){
+    dmctx *c = (dmctx*) arg;
+    int b = c->bin, bw = c->w / b, sh = (b == 4) ? 2 : 0; // cell has b*b/4 red & blue and b*b/2 green pixels
+    for(int y = y0; y < y1; ++y){
+        uint8_t *o = &c->rgb[3 * (size_t)y * bw];
+        for(int x = 0; x < bw; ++x, o += 3){
+            int sum[3] = {0};
+            for(int dy = 0; dy < b; ++dy){
+                const uint8_t *p = &c->raw[(size_t)(y*b + dy) * c->stride + x*b];
+                const uint8_t *cfa = c->cfa[dy & 1];
+                for(int dx = 0; dx < b; ++dx) sum[cfa[dx & 1]] += p[dx];
+            }
+            o[R] = (uint8_t)RSHIFT(sum[R], sh);
+            o[G] = (uint8_t)RSHIFT(sum[G], sh + 1);
+            o[B] = (uint8_t)RSHIFT(sum[B], sh);
+        }
+    }
+}
+
+/**
+ * @brief demosaic_binned - fast superpixel demosaic with binning (for previews)
+ * @param raw      - input frame
+ * @param w, h     - its size (should be divisible by `bin`)
+ * @param stride   - size of input row
+ * @param pat      - Bayer pattern
+ * @param bin      - 2 or 4: each bin x bin cell gives one RGB pixel
+ * @param rgb      - output ((w/bin)*(h/bin)*3 bytes)
+ * @return 0 if all OK
+ */
+int demosaic_binned(const uint8_t *raw, int w, int h, int stride, bayerpattern pat, int bin, uint8_t *rgb){
+    if(!raw || !rgb || (bin != 2 && bin != 4) || w % bin || h % bin || pat < BAYER_RGGB || pat > BAYER_BGGR) return 1;
+    dmctx c = {.raw = raw, .w = w, .h = h, .stride = stride, .cfa = cfatab[pat], .rgb = rgb, .bin = bin};
+    parallel_for(0, h / bin, (size_t)bin * w, binned_rows, &c);
+    return 0;
+}
+
+/**
+ * @brief demosaic - convert raw Bayer frame into RGB (not reentrant: uses static buffers)
+ * @param raw      - input frame
+ * @param w, h     - its size (not less than 4x4)
+ * @param stride   - size of input row
+ * @param pat      - Bayer pattern
+ * @param q        - algorithm
+ * @param rgb      - output (w*h*3 bytes)
+ * @return 0 if all OK
+ */
+int demosaic(const uint8_t *raw, int w, int h, int stride, bayerpattern pat, demosaic_quality q,
+             uint8_t *rgb){
+    static uint8_t *pad = NULL, *green = NULL;
+    static size_t padsz = 0;
+    if(!raw || !rgb || w < 4 || h < 4 || pat < BAYER_RGGB || pat > BAYER_BGGR) return 1;
+    dmctx c = {.raw = raw, .w = w, .h = h, .stride = stride, .cfa = cfatab[pat], .pw = w + 2*PAD, .rgb = rgb};
+    size_t sz = (size_t)c.pw * (h + 2*PAD);
+    if(sz > padsz){
+        FREE(pad);
+        FREE(green);
+        pad = MALLOC(uint8_t, sz);
+        green = MALLOC(uint8_t, sz);
+        padsz = sz;
+    }
+    c.pad = pad;
+    c.green = green;
+    parallel_for(0, h + 2*PAD, c.pw, padrows, &c);
+    switch(q){
+        case DEMOSAIC_NEAREST:
+            parallel_for(0, (h + 1) / 2, 6 * w, nearest_rows, &c);
+        break;
+        case DEMOSAIC_EDGE:
+            parallel_for(-1, h + 1, c.pw, green_rows, &c);
+            parallel_for(0, h, 3 * w, color_rows, &c);
+        break;
+        default:
+            parallel_for(0, h, 3 * w, bilinear_rows, &c);
+    }
+    return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef DEMOSAIC__
+#define DEMOSAIC__
+
+#include <stdint.h>
+
+// Bayer patterns (colors of pixels (0,0), (1,0), (0,1), (1,1)); values are the same as in fc2BayerTileFormat
+typedef enum{
+    BAYER_NONE,
+    BAYER_RGGB,
+    BAYER_GRBG,
+    BAYER_GBRG,
+    BAYER_BGGR
+} bayerpattern;
+
+// demosaic algorithms
+typedef enum{
+    DEMOSAIC_NEAREST,   // each 2x2 cell gives one color (fastest)
+    DEMOSAIC_BILINEAR,  // bilinear interpolation
+    DEMOSAIC_EDGE       // edge-directed green & color differences for red/blue (best)
+} demosaic_quality;
+
+int demosaic_byname(const char *name);
+const char *bayer_name(bayerpattern pat);
+bayerpattern bayer_flipud(bayerpattern pat, int h);
+int demosaic(const uint8_t *raw, int w, int h, int stride, bayerpattern pat, demosaic_quality q,
+             uint8_t *rgb);
+int demosaic_binned(const uint8_t *raw, int w, int h, int stride, bayerpattern pat, int bin, uint8_t *rgb);
+
+#endif // DEMOSAIC__
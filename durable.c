@@ -0,0 +1,344 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h> // PATH_MAX
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "durable.h"
+
+// alignment of O_DIRECT buffers, offsets & sizes
+#define DIRECT_ALIGN    (4096)
+// size of aligned buffer for O_DIRECT
+#define DIRECT_BUFSZ    (1<<20)
+// max amount of files in one sync batch (they keep opened descriptors)
+#define MAX_PENDING     (64)
+
+static const char *modenames[] = {
+    [WRITE_PLAIN] = "plain",
+    [WRITE_SAFE] = "safe",
+    [WRITE_DIRECT] = "direct",
+};
+
+// written file waiting for sync & rename
+typedef struct{
+    int fd;
+    char *tmp;
+    char *name;
+} pendingfile;
+
+static writemode mode = WRITE_PLAIN;
+static int syncframes = 1;          // sync after this amount of files
+static double synctime = 0.;        // or after this time (s) since first unsynced file
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pendingfile pending[MAX_PENDING];
+static int npending = 0;
+static double tfirst = 0.;          // time of first unsynced file
+static int directwarned = 0;
+static pthread_t syncer;            // thread syncing batch by `synctime` when no more files are written
+static pthread_cond_t synccond = PTHREAD_COND_INITIALIZER;
+static int syncerrun = 0;
+
+// statistics (protected by mutex)
+static uint64_t nfiles = 0, nfailed = 0, nbatches = 0, nsynced = 0;
+static double nbytes = 0., writetime = 0., maxwrite = 0., synctotal = 0., maxsync = 0.;
+
+/**
+ * @brief writemode_byname - get write mode by its name
+ * @param name - "plain", "safe" or "direct" (NULL or empty - plain)
+ * @return mode or -1 if wrong name
+ */
+int writemode_byname(const char *name){
+    if(!name || !*name) return WRITE_PLAIN;
+    for(int i = 0; i < (int)(sizeof(modenames)/sizeof(modenames[0])); ++i)
+        if(strcasecmp(name, modenames[i]) == 0) return i;
+    return -1;
+}
+
+const char *writemode_name(writemode m){
+    if(m < WRITE_PLAIN || m > WRITE_DIRECT) return "unknown";
+    return modenames[m];
+}
+
+static void syncbatch(pendingfile *batch, int n);
+
+// wait for deadline of current batch & sync it
+static void *syncerthread(_U_ void *data){
+    pendingfile batch[MAX_PENDING];
+    pthread_mutex_lock(&mutex);
+    while(syncerrun){
+        if(!npending || synctime <= 0.){
+            pthread_cond_wait(&synccond, &mutex);
+            continue;
+        }
+        double deadline = tfirst + synctime;
+        if(dtime() < deadline){
+            struct timespec ts;
+            ts.tv_sec = (time_t)deadline;
+            ts.tv_nsec = (long)((deadline - (double)ts.tv_sec) * 1e9);
+            pthread_cond_timedwait(&synccond, &mutex, &ts);
+            continue;
+        }
+        int nbatch = npending;
+        memcpy(batch, pending, npending * sizeof(pendingfile));
+        npending = 0;
+        pthread_mutex_unlock(&mutex);
+        VDBG("Sync batch by timeout");
+        syncbatch(batch, nbatch);
+        pthread_mutex_lock(&mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+    return NULL;
+}
+
+/**
+ * @brief durable_init - set write mode
+ * @param m        - mode
+ * @param nframes  - sync after this amount of files (1..64, <1 - sync each file)
+ * @param interval - or after this time since first unsynced file (s, 0 - don't check)
+ * @return 0 if all OK
+ */
+int durable_init(writemode m, int nframes, double interval){
+    if(m < WRITE_PLAIN || m > WRITE_DIRECT || nframes > MAX_PENDING || interval < 0.) return 1;
+    pthread_mutex_lock(&mutex);
+    mode = m;
+    syncframes = (nframes < 1) ? 1 : nframes;
+    synctime = interval;
+    int needsyncer = (mode != WRITE_PLAIN && synctime > 0. && !syncerrun);
+    if(needsyncer) syncerrun = 1;
+    pthread_mutex_unlock(&mutex);
+    if(needsyncer && pthread_create(&syncer, NULL, syncerthread, NULL)){
+        WARN("pthread_create()");
+        syncerrun = 0; // batches will be synced by next written files only
+    }
+    if(mode != WRITE_PLAIN)
+        VMESG("Write mode %s: sync every %d file[s] or %gs", modenames[mode], syncframes, synctime);
+    return 0;
+}
+
+writemode durable_mode(){
+    return mode;
+}
+
+/**
+ * @brief durable_reserve - create empty file to reserve its name (check_filename() skips it)
+ * @param filename - name of file
+ * @return 0 if all OK
+ */
+int durable_reserve(const char *filename){
+    char tmp[PATH_MAX];
+    const char *path = filename;
+    if(mode != WRITE_PLAIN){ // final name appears only after syncing
+        if(snprintf(tmp, PATH_MAX, "%s" DURABLE_TMPSUFFIX, filename) >= PATH_MAX) return 1;
+        path = tmp;
+    }
+    int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if(fd < 0){
+        WARN("Can't create %s", path);
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
+
+static int writeall(int fd, const uint8_t *data, size_t size){
+    while(size){
+        ssize_t n = write(fd, data, size);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            return 1;
+        }
+        data += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+// write through aligned buffer (last block is padded and then truncated)
+static int writedirect(int fd, const uint8_t *data, size_t size){
+    static __thread uint8_t *buf = NULL;
+    if(!buf && posix_memalign((void**)&buf, DIRECT_ALIGN, DIRECT_BUFSZ)){
+        buf = NULL;
+        return 1;
+    }
+    for(size_t off = 0; off < size;){
+        size_t n = size - off;
+        if(n > DIRECT_BUFSZ) n = DIRECT_BUFSZ;
+        size_t nw = (n + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+        memcpy(buf, data + off, n);
+        if(nw > n) memset(buf + n, 0, nw - n);
+        if(writeall(fd, buf, nw)) return 1;
+        off += n;
+    }
+    return ftruncate(fd, (off_t)size) ? 1 : 0;
+}
+
+// sync directory containing `filename` (to make renaming durable)
+static void syncdir(const char *filename){
+    char dir[PATH_MAX];
+    const char *slash = strrchr(filename, '/');
+    if(!slash) strcpy(dir, ".");
+    else if(slash == filename) strcpy(dir, "/");
+    else snprintf(dir, PATH_MAX, "%.*s", (int)(slash - filename), filename);
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if(fd < 0) return;
+    if(fsync(fd)) WARN("fsync(%s)", dir);
+    close(fd);
+}
+
+// check if files are in the same directory
+static int samedir(const char *f1, const char *f2){
+    const char *s1 = strrchr(f1, '/'), *s2 = strrchr(f2, '/');
+    if(!s1 || !s2) return (s1 == s2);
+    return (s1 - f1 == s2 - f2 && strncmp(f1, f2, s1 - f1) == 0);
+}
+
+// sync files of batch & give them right names
+static void syncbatch(pendingfile *batch, int n){
+    double t0 = dtime();
+    int bad = 0;
+    for(int i = 0; i < n; ++i){
+        if(fdatasync(batch[i].fd)) WARN("fdatasync(%s)", batch[i].tmp);
+        close(batch[i].fd);
+        if(rename(batch[i].tmp, batch[i].name)){
+            WARN("Can't rename %s", batch[i].tmp);
+            ++bad;
+        }
+    }
+    for(int i = 0; i < n; ++i){ // usually all files are in one directory
+        if(i && samedir(batch[i].name, batch[i-1].name)) continue;
+        syncdir(batch[i].name);
+    }
+    for(int i = 0; i < n; ++i){
+        FREE(batch[i].tmp);
+        FREE(batch[i].name);
+    }
+    double t = dtime() - t0;
+    pthread_mutex_lock(&mutex);
+    ++nbatches;
+    nsynced += n;
+    nfailed += bad;
+    synctotal += t;
+    if(t > maxsync) maxsync = t;
+    pthread_mutex_unlock(&mutex);
+    VDBG("Synced %d file[s] in %.1fms", n, t * 1e3);
+}
+
+/**
+ * @brief durable_write - write file by current mode (thread-safe)
+ * @param filename - name of file (overwritten if exists)
+ * @param data     - its content
+ * @param size     - its size
+ * @return 0 if all OK (in safe modes file gets its name after syncing of batch)
+ */
+int durable_write(const char *filename, const uint8_t *data, size_t size){
+    if(!filename || (!data && size)) return 1;
+    double t0 = dtime();
+    char tmp[PATH_MAX];
+    const char *path = filename;
+    if(mode != WRITE_PLAIN){
+        if(snprintf(tmp, PATH_MAX, "%s" DURABLE_TMPSUFFIX, filename) >= PATH_MAX) return 1;
+        path = tmp;
+    }
+    int flags = O_CREAT | O_WRONLY | O_TRUNC, direct = (mode == WRITE_DIRECT && size >= DIRECT_ALIGN);
+    int fd = open(path, flags | (direct ? O_DIRECT : 0), 0644);
+    if(fd < 0 && direct && errno == EINVAL){ // filesystem doesn't support O_DIRECT
+        if(!directwarned) WARNX("O_DIRECT isn't supported for %s, write without it", path);
+        directwarned = 1;
+        direct = 0;
+        fd = open(path, flags, 0644);
+    }
+    if(fd < 0){
+        WARN("Can't open %s", path);
+        return 1;
+    }
+    // allocate file at once against fragmentation (errors aren't fatal)
+    if(mode != WRITE_PLAIN && size) fallocate(fd, 0, 0, (off_t)size);
+    int ret = direct ? writedirect(fd, data, size) : writeall(fd, data, size);
+    double t = dtime() - t0;
+    if(ret){
+        WARN("Can't write %s", path);
+        close(fd);
+        unlink(path);
+    }else if(mode == WRITE_PLAIN) close(fd);
+    pendingfile batch[MAX_PENDING];
+    int nbatch = 0;
+    pthread_mutex_lock(&mutex);
+    if(ret) ++nfailed;
+    else{
+        ++nfiles;
+        nbytes += (double)size;
+        writetime += t;
+        if(t > maxwrite) maxwrite = t;
+        if(mode != WRITE_PLAIN){
+            if(!npending){
+                tfirst = t0;
+                pthread_cond_signal(&synccond); // new deadline for syncer
+            }
+            pending[npending++] = (pendingfile){.fd = fd, .tmp = strdup(path), .name = strdup(filename)};
+            if(npending >= syncframes || npending == MAX_PENDING || (synctime > 0. && t0 + t - tfirst >= synctime)){
+                memcpy(batch, pending, npending * sizeof(pendingfile));
+                nbatch = npending;
+                npending = 0;
+            }
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    if(nbatch) syncbatch(batch, nbatch);
+    return ret;
+}
+
+// sync all written files
+void durable_sync(){
+    pendingfile batch[MAX_PENDING];
+    pthread_mutex_lock(&mutex);
+    int nbatch = npending;
+    memcpy(batch, pending, npending * sizeof(pendingfile));
+    npending = 0;
+    pthread_mutex_unlock(&mutex);
+    if(nbatch) syncbatch(batch, nbatch);
+}
+
+// sync all & show statistics
+void durable_stop(){
+    pthread_mutex_lock(&mutex);
+    int wasrun = syncerrun;
+    syncerrun = 0;
+    pthread_cond_signal(&synccond);
+    pthread_mutex_unlock(&mutex);
+    if(wasrun) pthread_join(syncer, NULL);
+    durable_sync();
+    if(!nfiles) return;
+    VMESG("Write mode %s: %llu files (%llu failed), %.1fMB; write %.2fms per file (max %.2fms)",
+          modenames[mode], (unsigned long long)nfiles, (unsigned long long)nfailed, nbytes / 1024. / 1024.,
+          writetime * 1e3 / nfiles, maxwrite * 1e3);
+    if(nbatches)
+        VMESG("Write mode %s: %llu syncs of %.1f files, %.2fms per sync (max %.2fms)", modenames[mode],
+              (unsigned long long)nbatches, (double)nsynced / nbatches, synctotal * 1e3 / nbatches, maxsync * 1e3);
+    nfiles = nfailed = nbatches = nsynced = 0;
+    nbytes = writetime = maxwrite = synctotal = maxsync = 0.;
+}
@@ -0,0 +1,50 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Crash-safe writing of encoded files: file is written into "name.tmp" (preallocated by fallocate),
+ * synced by fdatasync() in batches and then atomically renamed, so after power loss there's no
+ * truncated files with right names.
+ */
+
+#pragma once
+#ifndef DURABLE__
+#define DURABLE__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// suffix of files being written
+#define DURABLE_TMPSUFFIX   ".tmp"
+
+typedef enum{
+    WRITE_PLAIN,    // write file in place without syncing (as before)
+    WRITE_SAFE,     // temporary file + fallocate + batched fdatasync + rename
+    WRITE_DIRECT    // the same with O_DIRECT through aligned buffer
+} writemode;
+
+int  writemode_byname(const char *name);
+const char *writemode_name(writemode mode);
+int  durable_init(writemode mode, int syncframes, double synctime);
+writemode durable_mode();
+int  durable_reserve(const char *filename);
+int  durable_write(const char *filename, const uint8_t *data, size_t size);
+void durable_sync();
+void durable_stop();
+
+#endif // DURABLE__
@@ -56,6 +56,9 @@ static void processKeybrd(unsigned char key, int mod, _U_ int x, _U_ int y){
         case 27: // esc - kill
             killwindow();
         break;
+        case 'e': // roll stretch mode
+            win->winevt |= WINEVT_ROLLSTRETCH;
+        break;
         case 'c': // capture in pause mode
             DBG("winevt = %d", win->winevt);
             if(win->winevt & WINEVT_PAUSE)
@@ -67,6 +70,9 @@ static void processKeybrd(unsigned char key, int mod, _U_ int x, _U_ int y){
         case 'p': // pause capturing
             win->winevt ^= WINEVT_PAUSE;
         break;
+        case 't': // save pre-trigger frames
+            win->winevt |= WINEVT_TRIGGER;
+        break;
         case 'u': // flip up-down
             win->flip ^= WIN_FLIP_UD;
         break;
@@ -167,10 +173,12 @@ typedef struct{
 #define ALT_K(key)      (key | (GLUT_ACTIVE_ALT<<8))
 static const menuentry entries[] = {
     {"Capture in pause mode (c)", 'c'},
+    {"Roll stretch mode (e)", 'e'},
     {"Flip image LR (l)", 'l'},
     {"Flip image UD (u)", 'u'},
     {"Make a pause/continue (p)", 'p'},
     {"Restore zoom (0)", '0'},
+    {"Trigger recording (t)", 't'},
     {"Roll colorfun (ctrl+r)", CTRL_K('r')},
     {"Save image (ctrl+s)", CTRL_K('s')},
     {"Close this window (ESC)", 27},
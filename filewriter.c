@@ -0,0 +1,258 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/limits.h> // PATH_MAX
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "durable.h"
+#include "filewriter.h"
+#include "metrics.h"
+#include "retention.h"
+
+// max length of queue per writer thread
+#define QUEUE_PER_THREAD    (4)
+
+typedef struct filejob{
+    char *filename;
+    framebuf *fb;
+    savefn save;
+    struct filejob *next;
+} filejob;
+
+// queue of jobs with own writer threads (one per output root)
+typedef struct{
+    filejob *head, *tail;
+    int len, max;
+    pthread_cond_t cond;    // new job in queue
+    pthread_cond_t space;   // queue isn't full
+    pthread_t *workers;
+    int nworkers;
+    uint64_t nwritten;      // statistics
+    double filebytes;
+} jobqueue;
+
+static jobqueue *queues = NULL;
+static int nqueues = 0;
+static pthread_mutex_t qmutex = PTHREAD_MUTEX_INITIALIZER;
+static int stopping = 0;
+
+// statistics (protected by qmutex)
+static uint64_t nwritten = 0, nfailed = 0, nwaits = 0;
+static double rawbytes = 0., filebytes = 0., enctime = 0., tstart = 0., tend = 0.;
+
+// total length of queues (qmutex should be locked)
+static int totallen(){
+    int l = 0;
+    for(int i = 0; i < nqueues; ++i) l += queues[i].len;
+    return l;
+}
+
+// save file & account it in statistics (of queue `q` if not NULL)
+static int savefile(const char *filename, framebuf *fb, savefn save, jobqueue *q){
+    double t0 = dtime();
+    int r = save((char*)filename, fb);
+    double t = dtime();
+    struct stat st;
+    char tmp[PATH_MAX];
+    snprintf(tmp, PATH_MAX, "%s" DURABLE_TMPSUFFIX, filename); // file could wait for syncing
+    double fsz = (stat(filename, &st) && stat(tmp, &st)) ? 0. : (double)st.st_size;
+    double raw = (double)fb->w * fb->h;
+    pthread_mutex_lock(&qmutex);
+    if(r) ++nfailed;
+    else{
+        ++nwritten;
+        rawbytes += raw;
+        filebytes += fsz;
+        enctime += t - t0;
+        if(tstart < 1.) tstart = t0;
+        tend = t;
+        if(q){
+            ++q->nwritten;
+            q->filebytes += fsz;
+        }
+    }
+    pthread_mutex_unlock(&qmutex);
+    if(r){
+        WARNX("Can't write %s", filename);
+        metrics_inc(MC_FILEERRORS, 1);
+        return r;
+    }
+    metrics_inc(MC_FILES, 1);
+    metrics_inc(MC_FILEBYTES, (uint64_t)fsz);
+    metrics_observe(MH_WRITE, t - t0);
+    retention_add(filename);
+    VDBG("File %s saved (%.1fms, compression ratio %.2f)", filename, (t - t0)*1e3, fsz > 0. ? raw / fsz : 0.);
+    return 0;
+}
+
+static void *writer(void *data){
+    jobqueue *q = (jobqueue*) data;
+    while(1){
+        pthread_mutex_lock(&qmutex);
+        while(!q->head && !stopping) pthread_cond_wait(&q->cond, &qmutex);
+        filejob *job = q->head;
+        if(!job){
+            pthread_mutex_unlock(&qmutex);
+            break;
+        }
+        q->head = job->next;
+        if(!q->head) q->tail = NULL;
+        --q->len;
+        metrics_set(MG_QUEUE, totallen());
+        pthread_cond_signal(&q->space);
+        pthread_mutex_unlock(&qmutex);
+        savefile(job->filename, job->fb, job->save, q);
+        framebuf_unref(job->fb);
+        FREE(job->filename);
+        FREE(job);
+    }
+    return NULL;
+}
+
+/**
+ * @brief filewriter_start - run writer threads
+ * @param nroots   - amount of queues (output roots), each has own threads
+ * @param nthreads - amount of threads per queue
+ * @return 0 if all OK
+ */
+int filewriter_start(int nroots, int nthreads){
+    FNAME();
+    if(nqueues || nroots < 1 || nthreads < 1) return 1;
+    queues = MALLOC(jobqueue, nroots);
+    stopping = 0;
+    int total = 0;
+    for(int r = 0; r < nroots; ++r){
+        jobqueue *q = &queues[r];
+        pthread_cond_init(&q->cond, NULL);
+        pthread_cond_init(&q->space, NULL);
+        q->workers = MALLOC(pthread_t, nthreads);
+        for(int i = 0; i < nthreads; ++i){
+            if(pthread_create(&q->workers[i], NULL, writer, q)){
+                WARN("pthread_create()");
+                break;
+            }
+            ++q->nworkers;
+        }
+        q->max = QUEUE_PER_THREAD * q->nworkers;
+        total += q->nworkers;
+        ++nqueues;
+        if(!q->nworkers) break;
+    }
+    if(!queues[nqueues-1].nworkers){ // can't run threads for all roots
+        filewriter_stop();
+        return 1;
+    }
+    VMESG("Run %d file writer thread[s] for %d root[s]", total, nqueues);
+    return 0;
+}
+
+/**
+ * @brief filewriter_put - put frame into writing queue (waits if queue is full)
+ * @param filename - name of file (it is created here to reserve name)
+ * @param fb       - frame
+ * @param fn       - function to save frame
+ * @param root     - number of queue (output root)
+ * @return 0 if all OK
+ */
+int filewriter_put(const char *filename, framebuf *fb, savefn fn, int root){
+    if(!nqueues || !filename || !fb || !fn) return 1;
+    if(root < 0 || root >= nqueues) root = 0;
+    if(durable_reserve(filename)) return 1;
+    filejob *job = MALLOC(filejob, 1);
+    job->filename = strdup(filename);
+    framebuf_ref(fb);
+    job->fb = fb;
+    job->save = fn;
+    jobqueue *q = &queues[root];
+    pthread_mutex_lock(&qmutex);
+    if(q->len >= q->max){
+        ++nwaits;
+        metrics_inc(MC_QUEUEWAITS, 1);
+        while(q->len >= q->max) pthread_cond_wait(&q->space, &qmutex);
+    }
+    if(q->tail) q->tail->next = job;
+    else q->head = job;
+    q->tail = job;
+    ++q->len;
+    metrics_set(MG_QUEUE, totallen());
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&qmutex);
+    return 0;
+}
+
+/**
+ * @brief filewriter_queuelen - amount of files waiting in queue
+ * @param root - number of queue
+ * @return length of queue (0 if there's no writers)
+ */
+int filewriter_queuelen(int root){
+    if(root < 0 || root >= nqueues) return 0;
+    pthread_mutex_lock(&qmutex);
+    int l = queues[root].len;
+    pthread_mutex_unlock(&qmutex);
+    return l;
+}
+
+/**
+ * @brief filewriter_save - save frame in calling thread (without writer threads)
+ * @param filename - name of file
+ * @param fb       - frame
+ * @param fn       - function to save frame
+ * @return 0 if all OK
+ */
+int filewriter_save(const char *filename, framebuf *fb, savefn fn){
+    if(!filename || !fb || !fn) return 1;
+    return savefile(filename, fb, fn, NULL);
+}
+
+// write all queued frames, stop threads & show statistics
+void filewriter_stop(){
+    FNAME();
+    if(nqueues){
+        pthread_mutex_lock(&qmutex);
+        stopping = 1;
+        for(int r = 0; r < nqueues; ++r) pthread_cond_broadcast(&queues[r].cond);
+        pthread_mutex_unlock(&qmutex);
+        for(int r = 0; r < nqueues; ++r){
+            jobqueue *q = &queues[r];
+            for(int i = 0; i < q->nworkers; ++i) pthread_join(q->workers[i], NULL);
+            if(nqueues > 1 && q->nwritten)
+                VMESG("File writer: root %d: %llu files, %.1fMB", r, (unsigned long long)q->nwritten,
+                      q->filebytes / 1024. / 1024.);
+            FREE(q->workers);
+            pthread_cond_destroy(&q->cond);
+            pthread_cond_destroy(&q->space);
+        }
+        FREE(queues);
+        nqueues = 0;
+    }
+    if(nwritten == 0) return;
+    double MB = rawbytes / 1024. / 1024.;
+    VMESG("File writer: %llu files (%llu failed), %.1fMB -> %.1fMB (compression ratio %.2f)",
+          (unsigned long long)nwritten, (unsigned long long)nfailed, MB, filebytes / 1024. / 1024.,
+          filebytes > 0. ? rawbytes / filebytes : 0.);
+    VMESG("File writer: encoding %.1fMB/s per thread, %.1fMB/s total; queue was full %llu times",
+          enctime > 0. ? MB / enctime : 0., tend > tstart ? MB / (tend - tstart) : 0.,
+          (unsigned long long)nwaits);
+}
@@ -0,0 +1,34 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef FILEWRITER__
+#define FILEWRITER__
+
+#include "framepool.h"
+
+// function saving frame into file, returns 0 if all OK
+typedef int (*savefn)(char *filename, framebuf *fb);
+
+int  filewriter_start(int nroots, int nthreads);
+int  filewriter_put(const char *filename, framebuf *fb, savefn fn, int root);
+int  filewriter_queuelen(int root);
+int  filewriter_save(const char *filename, framebuf *fb, savefn fn);
+void filewriter_stop();
+
+#endif // FILEWRITER__
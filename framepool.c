@@ -0,0 +1,101 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <usefull_macros.h>
+
+#include "framepool.h"
+
+// max amount of free buffers kept in pool
+#define FRAMEPOOL_MAXFREE   (16)
+
+static framebuf *freelist = NULL;
+static int nfree = 0, maxfree = FRAMEPOOL_MAXFREE;
+static pthread_mutex_t poolmutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief framebuf_get - get buffer from pool or allocate new
+ * @param size - minimal size of data
+ * @return buffer with refcnt == 1
+ */
+framebuf *framebuf_get(size_t size){
+    pthread_mutex_lock(&poolmutex);
+    framebuf *fb = freelist;
+    if(fb){
+        freelist = fb->next;
+        --nfree;
+    }
+    pthread_mutex_unlock(&poolmutex);
+    if(!fb) fb = MALLOC(framebuf, 1);
+    if(fb->size < size){
+        FREE(fb->data);
+        fb->data = MALLOC(uint8_t, size);
+        fb->size = size;
+    }
+    fb->next = NULL;
+    fb->refcnt = 1;
+    return fb;
+}
+
+void framebuf_ref(framebuf *fb){
+    if(fb) __atomic_add_fetch(&fb->refcnt, 1, __ATOMIC_ACQ_REL);
+}
+
+// release buffer: the last user returns it into pool
+void framebuf_unref(framebuf *fb){
+    if(!fb || __atomic_sub_fetch(&fb->refcnt, 1, __ATOMIC_ACQ_REL)) return;
+    pthread_mutex_lock(&poolmutex);
+    if(nfree < maxfree){
+        fb->next = freelist;
+        freelist = fb;
+        ++nfree;
+        fb = NULL;
+    }
+    pthread_mutex_unlock(&poolmutex);
+    if(fb){
+        FREE(fb->data);
+        FREE(fb);
+    }
+}
+
+/**
+ * @brief framebuf_reserve - allocate buffers in advance & keep them in pool
+ *          (for consumers holding many frames, e.g. pre-trigger ring)
+ * @param size - size of data
+ * @param n    - amount of buffers
+ */
+void framebuf_reserve(size_t size, int n){
+    if(n < 1) return;
+    pthread_mutex_lock(&poolmutex);
+    maxfree += n;
+    int nnew = maxfree - nfree;
+    pthread_mutex_unlock(&poolmutex);
+    if(nnew > n) nnew = n;
+    for(int i = 0; i < nnew; ++i){
+        framebuf *fb = MALLOC(framebuf, 1);
+        fb->data = MALLOC(uint8_t, size);
+        memset(fb->data, 0, size); // touch pages now: no page faults while grabbing
+        fb->size = size;
+        pthread_mutex_lock(&poolmutex);
+        fb->next = freelist;
+        freelist = fb;
+        ++nfree;
+        pthread_mutex_unlock(&poolmutex);
+    }
+}
@@ -0,0 +1,55 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef FRAMEPOOL__
+#define FRAMEPOOL__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// parameters of grabbed frame
+typedef struct{
+    uint64_t index;     // number of frame since start
+    double timestamp;   // host time of frame grabbing (UNIX time, s)
+    float exptime;      // exposition time applied to camera when frame was grabbed (ms)
+    float gain;         // gain value (dB), NAN if not set
+    int bayer;          // Bayer pattern of raw color frame (bayerpattern), 0 for MONO8
+    uint32_t counter;   // embedded frame counter of camera (0 if not available)
+    uint32_t dropped;   // amount of frames lost before this one (by frame counter)
+    double obstime;     // embedded timestamp mapped to host clock (UNIX time, s), NAN if not available
+    int ncombine;       // amount of frames combined into float image (stacks), 0 for frames
+} frameinfo;
+
+// reference-counted buffer for image data: grabbed frames are converted directly into them,
+// so consumers in other threads can use frame data without copying
+typedef struct framebuf{
+    uint8_t *data;          // image data
+    size_t size;            // size of allocated memory
+    int w, h, stride;       // image geometry
+    frameinfo info;         // frame parameters
+    int refcnt;             // reference counter, buffer returns to pool when it becomes zero
+    struct framebuf *next;  // next free buffer in pool
+} framebuf;
+
+framebuf *framebuf_get(size_t size);
+void framebuf_ref(framebuf *fb);
+void framebuf_unref(framebuf *fb);
+void framebuf_reserve(size_t size, int n);
+
+#endif // FRAMEPOOL__
@@ -0,0 +1,206 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "frametime.h"
+#include "metrics.h"
+
+// period of camera cycle timer (s)
+#define CYCLE_PERIOD    (128.)
+// min time span of fitting window to fit slope (s)
+#define FRAMETIME_MINSPAN   (10.)
+
+static int hasstamp = 0, hascounter = 0;
+static int started = 0;             // first frame processed
+static uint32_t lastcounter = 0;
+static double lastcycle = 0.;       // last raw value of cycle timer (0..128s)
+static double lasthost = 0.;        // host time of last frame
+static float lastexp = 0.;          // exposition of last frame (ms)
+static double readtime = 0.;        // readout & transfer time of frame (s)
+static double camtime = 0.;         // unwrapped camera time (s since first frame)
+
+// fitting window: camera time & host time relative to `host0`
+static struct{
+    double cam, host;
+} pts[FRAMETIME_WINDOW];
+static int npts = 0, ptshead = 0;
+static double host0 = 0.;
+static double slope = 1., offset = 0.;
+
+// statistics
+static uint64_t nframes = 0, ndropped = 0, nresets = 0;
+static double resid2 = 0.;
+static uint64_t nresid = 0;
+
+/**
+ * @brief frametime_init - turn on embedded timestamp & frame counter
+ * @param context - initialized context
+ * @param readout - time of sensor readout & transfer of frame (ms)
+ * @return 0 if at least one of them is available
+ */
+int frametime_init(fc2Context context, float readout){
+    readtime = (readout > 0.f) ? readout / 1000. : 0.;
+    fc2EmbeddedImageInfo ei;
+    fc2Error e = fc2GetEmbeddedImageInfo(context, &ei);
+    if(e != FC2_ERROR_OK){
+        WARNX("fc2GetEmbeddedImageInfo(): %s", fc2ErrorToDescription(e));
+        return 1;
+    }
+    hasstamp = ei.timestamp.available;
+    hascounter = ei.frameCounter.available;
+    if(hasstamp) ei.timestamp.onOff = true;
+    if(hascounter) ei.frameCounter.onOff = true;
+    if(!hasstamp && !hascounter){
+        WARNX("Camera has no embedded timestamp & frame counter, use host time");
+        return 1;
+    }
+    e = fc2SetEmbeddedImageInfo(context, &ei);
+    if(e != FC2_ERROR_OK){
+        WARNX("fc2SetEmbeddedImageInfo(): %s", fc2ErrorToDescription(e));
+        hasstamp = hascounter = 0;
+        return 1;
+    }
+    started = 0;
+    npts = ptshead = 0;
+    VMESG("Embedded metadata: timestamp %s, frame counter %s", hasstamp ? "on" : "N/A", hascounter ? "on" : "N/A");
+    return 0;
+}
+
+// convert IEEE-1394 cycle timer (7 bits of seconds, 13 bits of 125us cycles, 12 bits of offset) into seconds
+static double cycle2sec(uint32_t stamp){
+    return (double)(stamp >> 25) + (double)((stamp >> 12) & 0x1fff) / 8000. + (double)(stamp & 0xfff) / 24576000.;
+}
+
+/*
+ * Recalculate fit. Host time of exposure start (time of retrieving minus exposition and readout) is camera time plus
+ * positive latency of transfer, so line is fitted to
+ * lower envelope of points: it is the edge of their lower convex hull under mean camera time (line below all
+ * points with min sum of residuals). Its error is much less than of least squares by such one-sided noise.
+ */
+static void fit(){
+    static struct{ double cam, host; } hull[FRAMETIME_WINDOW];
+    int nhull = 0, first = (npts < FRAMETIME_WINDOW) ? 0 : ptshead;
+    double mc = 0.;
+    for(int n = 0; n < npts; ++n){ // points are sorted by camera time
+        int i = (first + n) % FRAMETIME_WINDOW;
+        mc += pts[i].cam;
+        while(nhull > 1){
+            double dx = hull[nhull-1].cam - hull[nhull-2].cam, dy = hull[nhull-1].host - hull[nhull-2].host;
+            if(dx * (pts[i].host - hull[nhull-2].host) - dy * (pts[i].cam - hull[nhull-2].cam) > 0.) break;
+            --nhull;
+        }
+        hull[nhull].cam = pts[i].cam;
+        hull[nhull].host = pts[i].host;
+        ++nhull;
+    }
+    mc /= npts;
+    slope = 1.;
+    // slope by short span is worse than camera clock itself
+    if(nhull > 1 && hull[nhull-1].cam - hull[0].cam > FRAMETIME_MINSPAN){
+        int i = 0;
+        while(i < nhull - 2 && hull[i+1].cam < mc) ++i;
+        double s = (hull[i+1].host - hull[i].host) / (hull[i+1].cam - hull[i].cam);
+        if(fabs(s - 1.) < FRAMETIME_MAXDRIFT) slope = s;
+    }
+    offset = INFINITY;
+    for(int i = 0; i < nhull; ++i){
+        double o = hull[i].host - slope * hull[i].cam;
+        if(o < offset) offset = o;
+    }
+}
+
+static void resetfit(double host){
+    npts = ptshead = 0;
+    host0 = host;
+    camtime = 0.;
+    ++nresets;
+}
+
+/**
+ * @brief frametime_process - read metadata of frame & fill its timing fields
+ * @param raw      - raw image retrieved from camera (before conversion: metadata is in its first pixels)
+ * @param hosttime - host time of retrieving
+ * @param exptime  - exposition of frame (ms)
+ * @param info     - parameters of frame (fields `counter`, `dropped` & `obstime` - time of exposure start)
+ */
+void frametime_process(fc2Image *raw, double hosttime, float exptime, frameinfo *info){
+    info->counter = 0;
+    info->dropped = 0;
+    info->obstime = NAN;
+    if(!hasstamp && !hascounter) return;
+    fc2ImageMetadata md;
+    if(fc2GetImageMetadata(raw, &md) != FC2_ERROR_OK) return;
+    ++nframes;
+    if(hascounter){
+        info->counter = md.embeddedFrameCounter;
+        if(started){
+            uint32_t d = md.embeddedFrameCounter - lastcounter; // counter could overflow
+            if(d > 1 && d < 0x80000000U){
+                info->dropped = d - 1;
+                ndropped += d - 1;
+                metrics_inc(MC_DROPPED, d - 1);
+                VDBG("Lost %u frame[s] before frame %u", d - 1, md.embeddedFrameCounter);
+            }
+        }
+        lastcounter = md.embeddedFrameCounter;
+    }
+    if(isnan(exptime)) exptime = lastexp;
+    hosttime -= exptime / 1000. + readtime; // camera timestamp is latched at exposure start
+    if(hasstamp){
+        double cycle = cycle2sec(md.embeddedTimeStamp);
+        if(!started) resetfit(hosttime);
+        else{ // unwrap: amount of full periods is taken from host clock
+            double d = fmod(cycle - lastcycle + CYCLE_PERIOD, CYCLE_PERIOD);
+            d += CYCLE_PERIOD * round((hosttime - lasthost - d) / CYCLE_PERIOD);
+            camtime += d;
+            double maxjump = FRAMETIME_MAXJUMP + fabs(exptime - lastexp) / 1000.;
+            if(npts && fabs(offset + slope * camtime - (hosttime - host0)) > maxjump){
+                WARNX("Camera clock jumped, restart time fitting");
+                resetfit(hosttime);
+            }
+        }
+        lastcycle = cycle;
+        pts[ptshead].cam = camtime;
+        pts[ptshead].host = hosttime - host0;
+        ptshead = (ptshead + 1) % FRAMETIME_WINDOW;
+        if(npts < FRAMETIME_WINDOW) ++npts;
+        fit();
+        double r = hosttime - host0 - offset - slope * camtime;
+        resid2 += r * r;
+        ++nresid;
+        info->obstime = host0 + offset + slope * camtime;
+    }
+    lasthost = hosttime;
+    lastexp = exptime;
+    started = 1;
+}
+
+// show statistics
+void frametime_stop(){
+    if(!nframes) return;
+    VMESG("Embedded metadata: %llu frames, %llu dropped", (unsigned long long)nframes, (unsigned long long)ndropped);
+    if(nresid) VMESG("Camera clock: drift %.1fppm, latency jitter %.3fms, %llu fit restart[s]", (slope - 1.) * 1e6,
+                     sqrt(resid2 / nresid) * 1e3, (unsigned long long)(nresets - 1));
+    nframes = ndropped = nresets = nresid = 0;
+    resid2 = 0.;
+    started = 0;
+}
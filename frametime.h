@@ -0,0 +1,43 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Timing of frames by camera-embedded metadata: frame counter gives exact amount of dropped frames,
+ * cycle timer of camera (latched at exposure start) is mapped to host clock by drift-corrected linear fit.
+ */
+
+#pragma once
+#ifndef FRAMETIME__
+#define FRAMETIME__
+
+#include <C/FlyCapture2_C.h>
+#include "framepool.h"
+
+// amount of last frames used for fitting camera clock to host clock
+#define FRAMETIME_WINDOW    (256)
+// max drift of camera clock (relative), fit is restarted if slope is out of 1 +- FRAMETIME_MAXDRIFT
+#define FRAMETIME_MAXDRIFT  (1e-3)
+// restart fit if host time of frame differs from predicted by more than this (s): camera was reset
+// (plus change of exposition: new value could be applied by camera one frame later)
+#define FRAMETIME_MAXJUMP   (1.)
+
+int  frametime_init(fc2Context context, float readout);
+void frametime_process(fc2Image *raw, double hosttime, float exptime, frameinfo *info);
+void frametime_stop();
+
+#endif // FRAMETIME__
@@ -23,10 +23,42 @@
 #include <usefull_macros.h>
 
 #include "aux.h"
+#include "autoexposure.h"
+#include "benchmark.h"
+#include "calibration.h"
 #include "camera_functions.h"
 #include "cmdlnopts.h"
+#include "demosaic.h"
+#include "durable.h"
+#include "filewriter.h"
+#include "frametime.h"
 #include "image_functions.h"
 #include "imageview.h"
+#include "logger.h"
+#include "lucky.h"
+#include "metrics.h"
+#include "outdirs.h"
+#include "parallel.h"
+#include "pngwriter.h"
+#include "pretrigger.h"
+#include "replay.h"
+#include "retention.h"
+#include "rtsched.h"
+#include "sequence.h"
+#include "server.h"
+#include "shmring.h"
+#include "stacking.h"
+#include "stretch.h"
+#include "video.h"
+
+static shmring *ring = NULL; // shared memory ring for frames
+static volatile sig_atomic_t stopsig = 0; // signal to quit: main loop stops & shuts everything down
+
+// handler of quit signals: locks & threads are touched only by normal shutdown in main()
+static void onsignal(int sig){
+    signal(sig, SIG_IGN);
+    stopsig = sig;
+}
 
 void signals(int sig){
     if(sig){
@@ -34,49 +66,162 @@ void signals(int sig){
         DBG("Get signal %d, quit.\n", sig);
     }
     putlog("Exit with status %d", sig);
+    video_stop(); // finish video file
+    durable_stop(); // give names to written files
+    metrics_stop();
+    shmring_close(ring);
+    ring = NULL;
     if(G.pidfile) // remove unnesessary PID file
         unlink(G.pidfile);
     restore_console();
     exit(sig);
 }
 
-static void savePng(fc2Image *convertedImage, char *name){
-    VDBG("Save the image data into %s", name);
-    fc2Error error = fc2SaveImage(convertedImage, name, FC2_PNG);
-    if(error != FC2_ERROR_OK){
-        fprintf(stderr, "Error in fc2SaveImage: %s\n", fc2ErrorToDescription(error));
+// save frame (or stack got by stack_result()) by writers into next file of `prefix`
+static void saveImages(framebuf *fb, char *prefix){
+    static pthread_mutex_t savemutex = PTHREAD_MUTEX_INITIALIZER; // frames are saved by pre-trigger thread too
+    if(!fb) return;
+    outslot slot;
+    pthread_mutex_lock(&savemutex);
+    if(outdirs_next(prefix, fb, &slot)){
+        pthread_mutex_unlock(&savemutex);
+        return;
+    }
+    if(fb->info.ncombine){ // stack: only float FITS
+        char *newname = outdirs_name(&slot, "fits");
+        if(!newname) WARNX("Can't save stack");
+        else if(G.nwriters > 0) filewriter_put(newname, fb, stack_writefb, slot.root);
+        else filewriter_save(newname, fb, stack_writefb);
+        pthread_mutex_unlock(&savemutex);
+        return;
     }
-}
-
-static void saveImages(fc2Image *convertedImage, char *prefix){
     if(G.save_png){
-        char *newname = check_filename(prefix, "png");
-        if(newname) savePng(convertedImage, newname);
+        char *newname = outdirs_name(&slot, "png");
+        if(newname && filewriter_put(newname, fb, writepngfb, slot.root))
+            WARNX("Can't save %s", newname);
     }
     // and save FITS here
-    char *newname = check_filename(prefix, "fits");
-    if(newname && writefits(newname, convertedImage))
-        VDBG("FITS file saved into %s", newname);
+    char *newname = outdirs_name(&slot, fitscompression(G.compress) > 0 ? "fits.fz" : "fits");
+    if(newname){
+        if(G.nwriters > 0) filewriter_put(newname, fb, writefb, slot.root);
+        else filewriter_save(newname, fb, writefb);
+    }
+    pthread_mutex_unlock(&savemutex);
 }
 
-// manage some menu/shortcut events
-static void winevt_manage(windowData *win, fc2Image *convertedImage){
+// save current stack (it's written by writers, so grabbing isn't stopped)
+static void saveStack(char *prefix){
+    framebuf *fb = stack_result();
+    saveImages(fb, prefix);
+    framebuf_unref(fb);
+}
+
+// image to display: current stack or last frame
+static fc2Image *displayed(fc2Image *convertedImage){
+    fc2Image *img = G.stack ? stack_preview() : NULL;
+    return img ? img : convertedImage;
+}
+
+// publish frame into shared memory ring (it is created by first frame)
+static void shmpublish(framebuf *fb){
+    if(!fb) return;
+    if(!ring){
+        if(G.shmslots < 2) G.shmslots = 2;
+        ring = shmring_create(G.shmname, G.shmslots, fb->w * fb->h);
+        if(!ring){
+            WARN("Can't create shared memory ring %s", G.shmname);
+            G.shmname = NULL;
+            return;
+        }
+        VMESG("Created shared memory ring %s with %d slots", G.shmname, G.shmslots);
+    }
+    shmslot meta = {.index = fb->info.index, .timestamp = fb->info.timestamp, .exptime = fb->info.exptime,
+                    .gain = fb->info.gain, .w = fb->w, .h = fb->h, .stride = fb->stride};
+    if(shmring_write(ring, fb->data, &meta))
+        WARNX("Frame %dx%d is too large for shared memory ring", fb->w, fb->h);
+}
+
+// read frames from shared memory ring & show statistics (test of ring readers)
+static void shmreader(){
+    shmring *r = shmring_open(G.shmname);
+    if(!r) ERR("Can't open shared memory ring %s", G.shmname);
+    uint64_t n = shmring_head(r), got = 0, lost = 0, got0 = 0;
+    uint32_t nslots = r->hdr->nslots;
+    double t0 = dtime(), mean = 0.;
+    shmslot meta = {0};
+    while(G.nimages <= 0 || got < (uint64_t)G.nimages){
+        uint64_t head = shmring_wait(r, n, 1000);
+        if(head <= n) continue;
+        if(head - n > nslots){ // too slow: skip overwritten frames
+            lost += head - n - nslots;
+            n = head - nslots;
+        }
+        const uint8_t *data = shmring_frame(r, n, &meta);
+        if(data){
+            uint64_t sum = 0;
+            for(uint32_t i = 0; i < meta.size; ++i) sum += data[i];
+            if(shmring_check(r, n)){
+                ++got;
+                mean = (double)sum / meta.size;
+            }else ++lost;
+        }else ++lost;
+        ++n;
+        double t = dtime();
+        if(t - t0 >= 1.){
+            printf("Frame #%llu (%ux%u, exptime=%gms): mean=%.1f; %.1f fps, %llu lost\n",
+                   (unsigned long long)meta.index, meta.w, meta.h, meta.exptime, mean,
+                   (got - got0) / (t - t0), (unsigned long long)lost);
+            t0 = t; got0 = got;
+        }
+    }
+    shmring_close(r);
+}
+
+// counter of grabbed frames for image thread
+static uint64_t newframes = 0;
+
+// inform image thread about new frame
+static void newframe(){
+    __atomic_add_fetch(&newframes, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief winevt_manage - manage some menu/shortcut events
+ * @return 1 if preview should be rebuilt
+ */
+static int winevt_manage(windowData *win){
+    int ret = 0;
     if(win->winevt & WINEVT_SAVEIMAGE){ // save image
         VDBG("Try to make screenshot");
-        saveImages(convertedImage, "ScreenShot");
+        framebuf *fb = getframe_ref(); // grabbing thread could replace current frame meanwhile
+        saveImages(fb, "ScreenShot");
+        framebuf_unref(fb);
         win->winevt &= ~WINEVT_SAVEIMAGE;
     }
+    if(win->winevt & WINEVT_TRIGGER){
+        if(pretrigger_fire("key")) WARNX("Pre-trigger recording is off");
+        win->winevt &= ~WINEVT_TRIGGER;
+    }
     if(win->winevt & WINEVT_ROLLCOLORFUN){
         roll_colorfun();
         win->winevt &= ~WINEVT_ROLLCOLORFUN;
-        change_displayed_image(win, convertedImage);
+        ret = 1;
+    }
+    if(win->winevt & WINEVT_ROLLSTRETCH){
+        stretch_roll();
+        win->winevt &= ~WINEVT_ROLLSTRETCH;
+        ret = 1;
     }
+    return ret;
 }
 
-// main thread to deal with image
+// main thread to deal with image: it shows only the last frame and not faster than G.dispfps
 void* image_thread(_U_ void *data){
 	FNAME();
+    rtsched_unpin(); // created by grabbing thread
     fc2Image *img = (fc2Image*) data;
+    uint64_t shown = 0;
+    double period = 1. / G.dispfps, tnext = dtime();
 	while(1){
         windowData *win = getWin();
         if(!win) pthread_exit(NULL);
@@ -84,16 +229,101 @@ void* image_thread(_U_ void *data){
 			DBG("got killthread");
 			pthread_exit(NULL);
 		}
-        if(win->winevt) winevt_manage(win, img);
-		usleep(10000);
+        int rebuild = win->winevt ? winevt_manage(win) : 0;
+        uint64_t n = __atomic_load_n(&newframes, __ATOMIC_ACQUIRE);
+        // new frame or zooming/moving of image which needs another part or binning of preview
+        if(n && (n != shown || rebuild || preview_stale(win))){
+            shown = n;
+            change_displayed_image(win, displayed(img));
+        }
+        tnext += period;
+        double t = dtime();
+        if(tnext > t) usleep((useconds_t)((tnext - t) * 1e6));
+        else tnext = t; // too slow: don't try to catch up
 	}
 }
 
+/**
+ * @brief processframe - pass grabbed (or replayed) frame to consumers
+ * @param fb     - frame
+ * @param prefix - prefix of output files (NULL - don't save)
+ * @return 1 when master calibration frame is done
+ */
+static int processframe(framebuf *fb, char *prefix){
+    int masterdone = calib_collect(fb);
+    if(G.lucky > 0.f){ // save only selected frames (or their stack)
+        lucky_add(fb);
+    }else if(G.stack){ // save only stack
+        int n = stack_add(fb);
+        if(prefix && n && G.stackevery > 0 && n % G.stackevery == 0) saveStack(prefix);
+    }else if(G.pretrigger > 0.){ // save only frames around events
+        pretrigger_add(fb);
+    }else if(prefix){
+        saveImages(fb, prefix);
+    }
+    if(G.shmname) shmpublish(fb);
+    if(G.video) video_put(fb);
+    if(G.server){
+        server_publish(fb);
+        char *saveprefix = server_saverequest();
+        if(saveprefix) saveImages(fb, saveprefix);
+    }
+    return masterdone;
+}
+
+// replayed frame: calibrate it as grabbed one & process
+static int replayframe(framebuf *fb, void *prefix){
+    calib_apply(fb);
+    if(processframe(fb, (char*)prefix)) return 1;
+    return (G.nimages > 0 && fb->info.index >= (uint64_t)G.nimages);
+}
+
+/**
+ * @brief replay - process recorded files instead of grabbing & show throughput
+ * @param outfprefix - prefix of output files
+ * @return 0 if all OK
+ */
+static int replay(char *outfprefix){
+    if(G.server || G.sequence || G.autoexp || G.showimage)
+        ERRX("Replay can't be combined with server, sequence, auto exposure or image display");
+    if(!outfprefix && !G.shmname && !G.video && !G.mkdark && !G.mkflat)
+        WARNX("No output: frames will be only decoded & calibrated");
+    if(G.nwriters > 0 && filewriter_start(outdirs_amount(), G.nwriters)){
+        WARNX("Can't run file writers, will write FITS in main thread");
+        G.nwriters = 0;
+        G.save_png = 0;
+    }
+    if(G.video && video_start(G.video, G.videofps, G.videocolor, 1)) ERRX("Can't write video %s", G.video);
+    replaystat st;
+    double t0 = dtime();
+    int ret = replay_run(G.replay, G.nthreads, replayframe, outfprefix, &st);
+    lucky_stop();
+    pretrigger_stop();
+    if(G.stack){
+        if(outfprefix) saveStack(outfprefix);
+        stack_stop();
+    }
+    video_stop();
+    filewriter_stop(); // include writing of queued files into time
+    calib_stop();
+    durable_stop();
+    retention_stop();
+    double t = dtime() - t0;
+    if(!ret) printf("Replay: %llu frames (%llu failed) in %.2fs: %.1f frames/s, %.1f MB/s of files, %.1f Mpix/s; "
+                    "waited for decoding %.2fs\n", (unsigned long long)st.nframes, (unsigned long long)st.nfailed,
+                    t, st.nframes / t, st.filebytes / t / 1024. / 1024., st.pixbytes / t / 1e6, st.readwait);
+    metrics_stop();
+    parallel_stop();
+    return ret;
+}
+
 int main(int argc, char **argv){
     int ret = 0;
     initial_setup();
     char *self = strdup(argv[0]);
     parse_args(argc, argv);
+    if(rtsched_init(G.cpus, G.grabcpu)) ERRX("Wrong CPUs of threads"); // before all threads creation
+    if(logger_init(G.logfile)) ERRX("Can't run logger");
     char *outfprefix = NULL;
     if(G.rest_pars_num){
         if(G.rest_pars_num != 1){
@@ -101,12 +331,74 @@ int main(int argc, char **argv){
             signals(1);
         }else outfprefix = G.rest_pars[0];
     }
+    if(G.nthreads < 0) ERRX("Amount of threads should be positive");
+    if(G.dispfps <= 0.f) ERRX("Display refresh rate should be positive");
+    parallel_init(G.nthreads);
+    if(G.bench) return benchmark(G.bench);
+    if(demosaic_byname(G.demosaic) < 0) ERRX("Wrong demosaic algorithm: %s", G.demosaic);
+    int stretch = stretch_byname(G.stretch);
+    if(stretch < 0) ERRX("Wrong stretch mode: %s", G.stretch);
+    if(stretch_init(stretch, G.stretchsmooth, G.stretchstep)) ERRX("Wrong stretch parameters");
+    if(fitscompression(G.compress) < 0) ERRX("Wrong compression type: %s", G.compress);
+    if(pngfilter_byname(G.pngfilter) < 0) ERRX("Wrong PNG filter: %s", G.pngfilter);
+    int wmode = writemode_byname(G.writemode);
+    if(wmode < 0) ERRX("Wrong write mode: %s", G.writemode);
+    if(durable_init(wmode, G.syncframes, G.synctime)) ERRX("Wrong sync parameters");
+    if(outdirs_init(G.roots, G.rootpolicy, G.shard)) ERRX("Wrong output roots or sharding");
+    char rootprefix[PATH_MAX]; // prefix in the first root: its filesystem is shown by metrics
+    char *fsprefix = outfprefix;
+    if(outfprefix && outdirs_root(0)){
+        snprintf(rootprefix, PATH_MAX, "%s/%s", outdirs_root(0), outfprefix);
+        fsprefix = rootprefix;
+    }
+    if(G.metrics && metrics_start(G.metrics, fsprefix)) ERRX("Can't run metrics server on %s", G.metrics);
+    if(G.save_png && G.nwriters < 1) G.nwriters = 1; // PNG is always encoded out of grabbing thread
+    if(G.stack && G.nwriters < 1) G.nwriters = 1; // and float FITS of stacks
+    if(outdirs_amount() > 1 && G.nwriters < 1) G.nwriters = 1; // each root has own writers
+    if(G.mkdark && G.mkflat) ERRX("Can't build master dark and flat at the same time");
+    if(G.mkdark && (G.dark || G.flat)) ERRX("Master dark should be built from raw frames");
+    if(G.mkflat && G.flat) ERRX("Master flat should be built from frames without flat correction");
+    int reject = stack_reject_byname(G.stackreject);
+    if(reject < 0) ERRX("Wrong stack rejection type: %s", G.stackreject);
+    if(G.stack && stack_init(reject, G.stacksigma, G.stackalign)) ERRX("Wrong stacking parameters");
+    if(G.lucky > 0.f && lucky_init(G.lucky, G.luckybatch > 0 ? G.luckybatch : (G.nimages > 0 ? G.nimages : LUCKY_BATCH),
+                                   G.luckyroi, saveImages, outfprefix, G.stack))
+        ERRX("Wrong lucky imaging parameters");
+    if(G.pretrigger > 0.){
+        if(!outfprefix) ERRX("Pre-trigger recording needs file name prefix");
+        if(G.stack || G.lucky > 0.f) ERRX("Pre-trigger recording can't be combined with stacking or lucky imaging");
+        if(G.nwriters < 1) ERRX("Pre-trigger recording needs file writer threads (--writers)");
+        if(pretrigger_init(G.pretrigger, G.posttrigger, G.trigmem, G.trigdiff, saveImages, outfprefix))
+            ERRX("Wrong pre-trigger parameters");
+    }
+    if(G.sequence){
+        if(G.stack || G.lucky > 0.f || G.pretrigger > 0. || G.autoexp || G.mkdark || G.mkflat)
+            ERRX("Sequence can't be combined with stacking, lucky imaging, pre-trigger, auto exposure or masters");
+        if(sequence_load(G.sequence, &G.exptime, &G.gain, G.nimages, outfprefix)) ERRX("Wrong sequence %s", G.sequence);
+    }
+    if(G.retain > 0. || G.minfree > 0.){
+        if(G.stack) ERRX("Retention can't be combined with stacking");
+        const char *rootdirs[OUTDIRS_MAX];
+        int nrootdirs = outdirs_amount();
+        for(int i = 0; i < nrootdirs; ++i) rootdirs[i] = outdirs_root(i);
+        if(!outfprefix || retention_init(outfprefix, rootdirs, nrootdirs, G.retain, G.minfree))
+            ERRX("Wrong retention parameters");
+    }
+    if(G.shmread){ // work as reader, don't touch camera & PID file
+        if(!G.shmname) ERRX("Point shared memory ring name with --shm");
+        shmreader();
+        return 0;
+    }
+    if(calib_load(G.dark, G.flat, G.badpix)) ERRX("Can't load calibration frames");
+    if(G.mkdark && calib_mkmaster(G.mkdark, MASTER_DARK, G.calframes)) signals(1);
+    if(G.mkflat && calib_mkmaster(G.mkflat, MASTER_FLAT, G.calframes)) signals(1);
+    if(G.replay) return replay(outfprefix);
     check4running(self, G.pidfile);
     FREE(self);
-    signal(SIGTERM, signals); // kill (-15) - quit
+    signal(SIGTERM, onsignal); // kill (-15) - quit
     signal(SIGHUP, SIG_IGN);  // hup - ignore
-    signal(SIGINT, signals);  // ctrl+C - quit
-    signal(SIGQUIT, signals); // ctrl+\ - quit
+    signal(SIGINT, onsignal);  // ctrl+C - quit
+    signal(SIGQUIT, onsignal); // ctrl+\ - quit
     signal(SIGTSTP, SIG_IGN); // ignore ctrl+Z
 
     setup_con();
@@ -118,56 +410,95 @@ int main(int argc, char **argv){
     fc2Error err = FC2_ERROR_OK;
     unsigned int numCameras = 0;
 
+    timephase(NULL);
     if(FC2_ERROR_OK != (err = fc2CreateContext(&context))){
         ERRX("fc2CreateContext(): %s", fc2ErrorToDescription(err));
     }
+    timephase("context creation");
 
-    FC2FNE(fc2GetNumOfCameras, context, &numCameras);
-
-    if(numCameras == 0){
-        fc2DestroyContext(context);
-        ERRX("No cameras detected!");
-    }
-
-    VMESG("Found %d camera[s]", numCameras);
-    if(verbose_level >= VERB_MESG){
-        for(unsigned int i = 0; i < numCameras; ++i){
-            FC2FNE(fc2GetCameraFromIndex, context, i, &guid);
-            FC2FNE(fc2Connect, context, &guid);
-            PrintCameraInfo(context, i);
+    if(G.serial > 0){ // fast path: connect only to given camera
+        FC2FNE(fc2GetCameraFromSerialNumber, context, (unsigned int)G.serial, &guid);
+        timephase("camera search");
+    }else{
+        FC2FNE(fc2GetNumOfCameras, context, &numCameras);
+        if(numCameras == 0){
+            fc2DestroyContext(context);
+            ERRX("No cameras detected!");
+        }
+        VMESG("Found %d camera[s]", numCameras);
+        if(verbose_level >= VERB_MESG){ // show all cameras but target (it will be shown later)
+            for(unsigned int i = 0; i < numCameras; ++i){
+                if(i == (unsigned int)G.camno) continue;
+                FC2FNE(fc2GetCameraFromIndex, context, i, &guid);
+                FC2FNE(connectcam, context, &guid);
+                PrintCameraInfo(context, i);
+            }
         }
+        FC2FNE(fc2GetCameraFromIndex, context, G.camno, &guid);
+        timephase("enumeration");
     }
-    FC2FNE(fc2GetCameraFromIndex, context, G.camno, &guid);
-    FC2FNE(fc2Connect, context, &guid);
-    if(verbose_level >= VERB_MESG && numCameras > 1) PrintCameraInfo(context, G.camno);
+    FC2FNE(connectcam, context, &guid);
+    timephase("connection");
+    if(verbose_level >= VERB_MESG) PrintCameraInfo(context, G.camno);
+    if(G.autoexp && isnan(G.exptime)) G.exptime = AE_STARTEXP;
     if(isnan(G.exptime)){ // no expose time -> return
         printf("No exposure parameters given -> exit\n");
         fc2StopCapture(context);
         fc2DestroyContext(context);
         signals(ret);
     }
-    if(!G.showimage && !outfprefix){ // not display image & not save it?
-        ERRX("You should point file name or option `display image`");
-    }
-    // turn off all shit
-    autoExpOff(context);
-    whiteBalOff(context);
-    gammaOff(context);
-    trigModeOff(context);
-    trigDelayOff(context);
-    frameRateOff(context);
-    if(FC2_ERROR_OK != setexp(context, G.exptime)){
+    if(!G.showimage && !outfprefix && !G.sequence && !G.server && !G.shmname && !G.video && !G.mkdark && !G.mkflat){ // not display image & not save it?
+        ERRX("You should point file name, option `display image`, `sequence`, `server`, `shm`, `video` or `mkdark`/`mkflat`");
+    }
+    // turn off all shit & set exposition/gain by one batch
+    propsetting settings[] = {
+        PROPOFF(FC2_AUTO_EXPOSURE),
+        PROPOFF(FC2_WHITE_BALANCE),
+        PROPOFF(FC2_GAMMA),
+        PROPOFF(FC2_TRIGGER_MODE),
+        PROPOFF(FC2_TRIGGER_DELAY),
+        PROPOFF(FC2_FRAME_RATE),
+        PROPVAL(FC2_SHUTTER, G.exptime),
+        PROPVAL(FC2_GAIN, G.gain)
+    };
+    int nsettings = sizeof(settings) / sizeof(propsetting);
+    if(isnan(G.gain)) --nsettings; // don't change gain
+    setprops(context, settings, nsettings);
+    if(FC2_ERROR_OK != settings[6].err){
         ret = 1;
         goto destr;
     }
     VMESG("Set exposition to %gms", G.exptime);
     if(!isnan(G.gain)){
-        if(FC2_ERROR_OK != setgain(context, G.gain)){
+        if(FC2_ERROR_OK != settings[7].err){
             ret = 1;
             goto destr;
         }
         VMESG("Set gain value to %gdB", G.gain);
     }
+    frametime_init(context, G.readout);
+    if(G.sequence && sequence_start(context, &outfprefix)){
+        ret = 1;
+        goto destr;
+    }
+    timephase("properties setup");
+    if(G.autoexp && autoexp_start(context)){
+        WARNX("Can't run auto exposure");
+        G.autoexp = 0;
+    }
+    if(G.nwriters > 0 && filewriter_start(outdirs_amount(), G.nwriters)){
+        WARNX("Can't run file writers, will write FITS in main thread");
+        G.nwriters = 0;
+        G.save_png = 0;
+    }
+    if(G.server && server_start(context, G.server)){
+        ret = 1;
+        goto destr;
+    }
+    if(G.video && video_start(G.video, G.videofps, G.videocolor, 0)){
+        ret = 1;
+        goto destr;
+    }
 
     if(G.showimage){
         imageview_init();
@@ -177,16 +508,26 @@ int main(int argc, char **argv){
     FC2FNE(fc2CreateImage, &convertedImage);
     int N = 0;
     bool start = TRUE;
-    while(1){
+    double ttemp = 0.; // time of last temperature reading
+    rtsched_grab(G.rtprio, G.mlock, G.numa);
+    while(!stopsig){
+        while(server_paused() && !stopsig) usleep(10000);
+        if(stopsig) break;
+        if(metrics_running() && dtime() - ttemp >= METRICS_TEMPPERIOD){
+            ttemp = dtime();
+            if(refreshprop(context, FC2_TEMPERATURE) == FC2_ERROR_OK)
+                metrics_set(MG_TEMPERATURE, getpropval(FC2_TEMPERATURE));
+        }
         if(GrabImage(context, &convertedImage)){
-            fc2DestroyContext(context);
             WARNX("GrabImages()");
-            signals(12);
+            ret = 12;
+            break;
         }
+        rtsched_frame(getframe());
         VMESG("\nGrabbed image #%d", ++N);
-        if(outfprefix){
-            saveImages(&convertedImage, outfprefix);
-        }
+        if(N == 1) timephase("first frame");
+        if(G.autoexp) autoexp_process(&convertedImage);
+        int masterdone = processframe(getframe(), outfprefix);
         if(G.showimage){
             if(!mainwin && start){
                 DBG("Create window @ start");
@@ -198,39 +539,63 @@ int main(int argc, char **argv){
                     pthread_create(&mainwin->thread, NULL, &image_thread, (void*)&convertedImage); //(void*)mainwin);
             }
             if((mainwin = getWin())){
-                DBG("change image");
                 if(mainwin->killthread) goto destr;
-                change_displayed_image(mainwin, &convertedImage);
-                while((mainwin = getWin())){ // test paused state & grabbing custom frames
+                newframe();
+                while((mainwin = getWin()) && !stopsig){ // test paused state & grabbing custom frames
                     if((mainwin->winevt & WINEVT_PAUSE) == 0) break;
                     if(mainwin->winevt & WINEVT_GETIMAGE){
                         mainwin->winevt &= ~WINEVT_GETIMAGE;
-                        if(!GrabImage(context, &convertedImage))
-                            change_displayed_image(mainwin, &convertedImage);
+                        if(!GrabImage(context, &convertedImage)) newframe();
                     }
                     usleep(10000);
                 }
             }else break;
         }
+        if(masterdone) break;
+        if(G.sequence){ // steps define amount of frames
+            if(sequence_frame(context, getframe(), &outfprefix)) break;
+            continue;
+        }
+        if((G.mkdark || G.mkflat) && G.nimages <= 0) continue; // work until master is done
+        if((G.server || G.shmname || G.pretrigger > 0.) && G.nimages <= 0) continue; // daemon mode: work until killed
         if(--G.nimages <= 0) break;
     }
     if((mainwin = getWin())) mainwin->winevt |= WINEVT_PAUSE;
 destr:   
     if(G.showimage){
-        while((mainwin = getWin())){
+        while((mainwin = getWin()) && !stopsig){
             if(mainwin->killthread) break;
             if(mainwin->winevt & WINEVT_GETIMAGE){
                 mainwin->winevt &= ~WINEVT_GETIMAGE;
-                if(!GrabImage(context, &convertedImage))
-                    change_displayed_image(mainwin, &convertedImage);
+                if(!GrabImage(context, &convertedImage)) newframe();
             }
+            usleep(10000);
         }
         DBG("Close window");
         clear_GL_context();
+        stretch_stop();
+    }
+    lucky_stop();
+    pretrigger_stop();
+    frametime_stop();
+    rtsched_stop();
+    sequence_stop();
+    if(G.stack){
+        if(outfprefix) saveStack(outfprefix);
+        stack_stop();
     }
+    server_stop();
+    video_stop();
+    filewriter_stop();
+    autoexp_stop();
+    calib_stop();
+    durable_stop();
+    retention_stop();
+    metrics_stop();
+    parallel_stop();
     FC2FNE(fc2DestroyImage, &convertedImage);
     fc2StopCapture(context);
     fc2DestroyContext(context);
-    signals(ret);
+    signals(stopsig ? stopsig : ret);
     return ret;
 }
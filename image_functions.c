@@ -17,19 +17,57 @@
  */
 
 #include <fitsio.h>
+#include <linux/limits.h> // PATH_MAX
 #include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <usefull_macros.h>
 
+#include "aux.h"
+
+#include "calibration.h"
 #include "camera_functions.h"
 #include "cmdlnopts.h"
+#include "demosaic.h"
+#include "durable.h"
+#include "frametime.h"
 #include "image_functions.h"
+#include "metrics.h"
+#include "parallel.h"
+#include "stretch.h"
+
+static frameinfo lastframe = {.exptime = NAN, .gain = NAN, .obstime = NAN};
+static framebuf *curframe = NULL; // buffer with data of last grabbed image
+static pthread_mutex_t curmutex = PTHREAD_MUTEX_INITIALIZER; // protects changing of curframe
+
+// parameters of last grabbed frame
+frameinfo *getframeinfo(){
+    return &lastframe;
+}
+
+// buffer of last grabbed frame (call framebuf_ref() to keep it after next grabbing)
+framebuf *getframe(){
+    return curframe;
+}
+
+// buffer of last grabbed frame for other threads (it's referenced: call framebuf_unref() after using)
+framebuf *getframe_ref(){
+    pthread_mutex_lock(&curmutex);
+    framebuf *fb = curframe;
+    if(fb) framebuf_ref(fb);
+    pthread_mutex_unlock(&curmutex);
+    return fb;
+}
 
 int GrabImage(fc2Context context, fc2Image *convertedImage){
     fc2Error error;
     fc2Image rawImage;
+    // values changed after this moment will be applied to next frames
+    float exptime, gain;
     // start capture
-    FC2FNE(fc2StartCapture, context);
+    FC2FNE(startcapture, context, &exptime, &gain);
     error = fc2CreateImage(&rawImage);
     if(error != FC2_ERROR_OK){
         printf("Error in fc2CreateImage: %s\n", fc2ErrorToDescription(error));
@@ -39,19 +77,86 @@ int GrabImage(fc2Context context, fc2Image *convertedImage){
     error = fc2RetrieveBuffer(context, &rawImage);
     if (error != FC2_ERROR_OK){
         printf("Error in retrieveBuffer: %s\n", fc2ErrorToDescription(error));
+        metrics_inc(MC_GRABERRORS, 1);
         return -1;
     }
-    // Convert image to gray
-    windowData *win = getWin();
-    if(win) pthread_mutex_lock(&win->mutex);
-    error = fc2ConvertImageTo(FC2_PIXEL_FORMAT_MONO8, &rawImage, convertedImage);
-    if(win) pthread_mutex_unlock(&win->mutex);
+    double t = dtime();
+    // Convert image to gray directly into buffer from pool: consumers of previous frame
+    // could still use its buffer; `convertedImage` is attached to new buffer only after success,
+    // so it never points to buffer released on error
+    static fc2Image scratch;
+    static int hasscratch = 0;
+    if(!hasscratch){
+        error = fc2CreateImage(&scratch);
+        if(error != FC2_ERROR_OK){
+            printf("Error in fc2CreateImage: %s\n", fc2ErrorToDescription(error));
+            return -1;
+        }
+        hasscratch = 1;
+    }
+    framebuf *fb = framebuf_get((size_t)rawImage.rows * rawImage.cols);
+    bayerpattern bayer = BAYER_NONE;
+    if(G.rawbayer){
+        if(rawImage.format == FC2_PIXEL_FORMAT_RAW8 && rawImage.bayerFormat != FC2_BT_NONE)
+            bayer = (bayerpattern) rawImage.bayerFormat;
+        else{
+            WARNX("Camera doesn't give RAW8 Bayer frames, convert them to MONO8");
+            G.rawbayer = 0;
+        }
+    }
+    fc2PixelFormat format = FC2_PIXEL_FORMAT_MONO8;
+    fc2BayerTileFormat bayerformat = FC2_BT_NONE;
+    unsigned int stride = rawImage.cols;
+    if(bayer != BAYER_NONE){ // keep raw frame, it will be demosaiced only for displaying
+        format = FC2_PIXEL_FORMAT_RAW8;
+        bayerformat = rawImage.bayerFormat;
+        for(unsigned int y = 0; y < rawImage.rows; ++y)
+            memcpy(&fb->data[y * rawImage.cols], &rawImage.pData[y * rawImage.stride], rawImage.cols);
+    }else{
+        error = fc2SetImageData(&scratch, fb->data, (unsigned int)fb->size);
+        if(error == FC2_ERROR_OK)
+            error = fc2ConvertImageTo(FC2_PIXEL_FORMAT_MONO8, &rawImage, &scratch);
+        stride = scratch.stride;
+    }
+    if(error == FC2_ERROR_OK){ // calibrate before any consumer sees the frame
+        fb->w = rawImage.cols;
+        fb->h = rawImage.rows;
+        fb->stride = stride;
+        fb->info.exptime = exptime;
+        fb->info.bayer = bayer; // bad pixels of Bayer frames are replaced by the same colour
+        calib_apply(fb);
+        windowData *win = getWin();
+        if(win) pthread_mutex_lock(&win->mutex);
+        error = fc2SetImageData(convertedImage, fb->data, (unsigned int)fb->size);
+        if(error == FC2_ERROR_OK)
+            error = fc2SetImageDimensions(convertedImage, rawImage.rows, rawImage.cols, stride, format, bayerformat);
+        if(win) pthread_mutex_unlock(&win->mutex);
+    }
     if(error != FC2_ERROR_OK){
         printf("Error in fc2ConvertImageTo: %s\n", fc2ErrorToDescription(error));
+        framebuf_unref(fb);
+        metrics_inc(MC_GRABERRORS, 1);
         return -1;
     }
+    frametime_process(&rawImage, t, exptime, &lastframe);
     fc2StopCapture(context);
     fc2DestroyImage(&rawImage);
+    metrics_inc(MC_FRAMES, 1);
+    metrics_observe(MH_PROCESS, dtime() - t);
+    if(lastframe.index) metrics_observe(MH_INTERVAL, t - lastframe.timestamp);
+    metrics_set(MG_EXPTIME, exptime / 1000.);
+    metrics_set(MG_GAIN, gain);
+    ++lastframe.index;
+    lastframe.timestamp = t;
+    lastframe.exptime = exptime;
+    lastframe.gain = gain;
+    lastframe.bayer = bayer;
+    fb->info = lastframe;
+    pthread_mutex_lock(&curmutex);
+    framebuf *old = curframe;
+    curframe = fb;
+    pthread_mutex_unlock(&curmutex);
+    framebuf_unref(old);
     return 0;
 }
 
@@ -124,37 +229,104 @@ void roll_colorfun(){
     change_colorfun(t);
 }
 
-/**
- * @brief equalize - hystogram equalization
- * @param ori (io) - input/output data
- * @param w,h,s    - image width, height and stride
- * @return data allocated here
- */
-static uint8_t *equalize(uint8_t *ori, int w, int h, int s){
-    uint8_t *retn = MALLOC(uint8_t, s*h);
-
-    double orig_hysto[256] = {0.}; // original hystogram
-    uint8_t eq_levls[256] = {0};   // levels to convert: newpix = eq_levls[oldpix]
-    for(int y = 0; y < h; ++y){
-        uint8_t *ptr = &ori[y * s];
-        for(int x = 0; x < w; ++x)
-            ++orig_hysto[*ptr++];
+// colors of pixel values by current colorfun (without stretching)
+void colorlut(GLubyte lut[256][3]){
+    for(int i = 0; i < 256; ++i) gray2rgb(colorfun(i / 256.), lut[i]);
+}
+
+typedef struct{
+    const uint8_t *data;
+    int w, s;                   // width & stride of data
+    int x0, x1;                 // columns to process
+    const GLubyte (*lut)[3];    // colors by pixel value
+    GLubyte *rgb;               // output (with width w)
+    const uint8_t *src;         // data to bin, its stride & binning
+    int srcs, bin;
+} colorctx;
+
+__attribute__((optimize("tree-vectorize")))
+static void bin2row(const uint8_t *restrict p0, const uint8_t *restrict p1, uint8_t *restrict o, int w){
+    for(int x = 0; x < w; ++x)
+        o[x] = (uint8_t)((p0[2*x] + p0[2*x+1] + p1[2*x] + p1[2*x+1] + 2) >> 2);
+}
+
+// `col` - scratch for sums of columns (4*w)
+__attribute__((optimize("tree-vectorize")))
+static void bin4row(const uint8_t *restrict p, int s, uint16_t *restrict col, uint8_t *restrict o, int w){
+    for(int x = 0; x < 4*w; ++x)
+        col[x] = (uint16_t)(p[x] + p[s + x] + p[2*s + x] + p[3*s + x]);
+    for(int x = 0; x < w; ++x)
+        o[x] = (uint8_t)((col[4*x] + col[4*x+1] + col[4*x+2] + col[4*x+3] + 8) >> 4);
+}
+
+// bin rows [y0, y1) of binned image
+static void binrows(void *arg, int y0, int y1){
+    colorctx *c = (colorctx*) arg;
+    uint8_t *o = (uint8_t*) c->data;
+    uint16_t *col = (c->bin == 4) ? parallel_scratch(4 * c->w * sizeof(uint16_t)) : NULL;
+    for(int y = y0; y < y1; ++y){
+        const uint8_t *p = &c->src[(size_t)y * c->bin * c->srcs];
+        if(c->bin == 2) bin2row(p, p + c->srcs, &o[y * c->w], c->w);
+        else bin4row(p, c->srcs, col, &o[y * c->w], c->w);
     }
-    double part = (double)(w*h - 1) / 256., N = 0.;
-    for(size_t i = 0; i < 256; ++i){
-        N += orig_hysto[i];
-        eq_levls[i] = (uint8_t)(N/part);
+}
+
+// convert rows [y0, y1) into RGB by lookup table
+static void colorrows(void *arg, int y0, int y1){
+    colorctx *c = (colorctx*) arg;
+    for(int y = y0; y < y1; ++y){
+        const uint8_t *ptr = &c->data[y * c->s];
+        GLubyte *dst = &c->rgb[3 * (y * c->w + c->x0)];
+        for(int x = c->x0; x < c->x1; ++x, dst += 3){
+            const GLubyte *p = c->lut[ptr[x]];
+            dst[0] = p[0]; dst[1] = p[1]; dst[2] = p[2];
+        }
     }
+}
 
-    for(int y = 0; y < h; ++y){
-        uint8_t *iptr = &ori[y * s];
-        uint8_t *optr = &retn[y * s];
-        for(int x = 0; x < w; ++x){
-            //*optr++ = *iptr++;
-            *optr++ = eq_levls[*iptr++];
+/**
+ * @brief colorize - stretch image & convert it into RGB by current colorfun (not reentrant)
+ * @param data     - image
+ * @param w, h, s  - its width, height & stride
+ * @param bin      - binning (1, 2 or 4; w & h should be divisible by it)
+ * @param roi      - region to process (x, y, w, h) for bin == 1, NULL for whole image
+ * @param rgb      - output ((w/bin)*(h/bin)*3 bytes, only region filled)
+ */
+void colorize(const uint8_t *data, int w, int h, int s, int bin, const int roi[4], GLubyte *rgb){
+    static uint8_t *binned = NULL;
+    static size_t binnedsz = 0;
+    uint8_t levels[256];
+    GLubyte lut[256][3];
+    colorctx c = {.data = data, .w = w, .s = s, .x0 = 0, .x1 = w, .lut = (const GLubyte (*)[3])lut, .rgb = rgb};
+    int y0 = 0, y1 = h;
+    if(bin > 1){ // make binned image
+        size_t sz = (size_t)(w / bin) * (h / bin);
+        if(sz > binnedsz){
+            FREE(binned);
+            binned = MALLOC(uint8_t, sz);
+            binnedsz = sz;
         }
+        c.src = data;
+        c.srcs = s;
+        c.bin = bin;
+        c.data = binned;
+        c.w = c.s = c.x1 = w / bin;
+        y1 = h / bin;
+        parallel_for(0, y1, (size_t)bin * w, binrows, &c);
+    }else if(roi){
+        c.x0 = roi[0]; c.x1 = roi[0] + roi[2];
+        y0 = roi[1]; y1 = roi[1] + roi[3];
+    }
+    int rect[4] = {c.x0, y0, c.x1 - c.x0, y1 - y0};
+    stretch_update(c.data, c.s, rect);
+    if(stretch_local()){ // curve of each pixel is interpolated
+        for(int i = 0; i < 256; ++i) gray2rgb(colorfun(i / 256.), lut[i]);
+        stretch_map(c.data, c.s, rect, (const uint8_t (*)[3])lut, rgb, c.w);
+        return;
     }
-    return retn;
+    stretch_levels(levels);
+    for(int i = 0; i < 256; ++i) gray2rgb(colorfun(levels[i] / 256.), lut[i]);
+    parallel_for(y0, y1, 4 * (c.x1 - c.x0), colorrows, &c);
 }
 
 void change_displayed_image(windowData *win, fc2Image *convertedImage){
@@ -175,41 +347,48 @@ void change_displayed_image(windowData *win, fc2Image *convertedImage){
        convertedImage->cols, convertedImage->stride, convertedImage->dataSize, convertedImage->receivedDataSize);
     */
     pthread_mutex_lock(&win->mutex);
-    int  x, y, w = convertedImage->cols, h = convertedImage->rows, s = convertedImage->stride;
-    uint8_t *newima = equalize(convertedImage->pData, w, h, s);
-    /*
-    double avr, wd, max, min;
-    avr = max = min = (double)*convertedImage->pData;
-    for(y = 0; y < h; ++y){
-        unsigned char *ptr = &convertedImage->pData[y*convertedImage->stride];
-        for(x = 0; x < w; ++x, ++ptr){
-            double pix = (double) *ptr;
-            if(pix > max) max = pix;
-            if(pix < min) min = pix;
-            avr += pix;
-        }
-    }
-    avr /= (double)(w*h);
-    wd = max - min;
-    if(wd > DBL_EPSILON) avr = (avr - min) / wd;	// normal average by preview
-    if(avr < 0.6) wd *= avr + 0.2;
-    if(wd < DBL_EPSILON) wd = 1.;
-    DBG("stat: sz=(%dx%d) avr=%g wd=%g max=%g min=%g", w,h,avr, wd, max, min);
-    */
-    GLubyte *dst = im->rawdata;
-    for(y = 0; y < h; y++){
-        //unsigned char *ptr = &convertedImage->pData[y * s];
-        unsigned char *ptr = &newima[y * s];
-        for(x = 0; x < w; x++, dst += 3, ++ptr){
-            //gray2rgb(colorfun((*ptr - min) / wd), dst);
-            gray2rgb(colorfun(*ptr / 256.), dst);
+    int w = convertedImage->cols, h = convertedImage->rows, s = convertedImage->stride;
+    // preview resolution is chosen by window: binned image or only visible part of full-resolution one
+    int bin, roi[4];
+    preview_region(win, &bin, roi);
+    if(convertedImage->format == FC2_PIXEL_FORMAT_RAW8 && convertedImage->bayerFormat != FC2_BT_NONE){
+        bayerpattern pat = (bayerpattern)convertedImage->bayerFormat;
+        if(bin > 1) demosaic_binned(convertedImage->pData, w, h, s, pat, bin, im->rawdata);
+        else{ // demosaic needs whole frame
+            demosaic(convertedImage->pData, w, h, s, pat, demosaic_byname(G.demosaic), im->rawdata);
+            roi[0] = roi[1] = 0;
+            roi[2] = w; roi[3] = h;
         }
-    }
-    FREE(newima);
-    win->image->changed = 1;
+    }else colorize(convertedImage->pData, w, h, s, bin, roi, im->rawdata);
+    im->bin = bin;
+    memcpy(im->roi, roi, sizeof(roi));
+    im->changed = 1;
     pthread_mutex_unlock(&win->mutex);
 }
 
+typedef struct{
+    uint8_t *dst;
+    const uint8_t *src;
+    int w, h, s;
+} flipctx;
+
+static void fliprows(void *arg, int y0, int y1){
+    flipctx *c = (flipctx*) arg;
+    for(int y = y0; y < y1; ++y)
+        memcpy(&c->dst[y * c->w], &c->src[(c->h-y-1) * c->s], c->w);
+}
+
+/**
+ * @brief flipframe - mirror image upside down
+ * @param dst     - output (packed, w*h bytes)
+ * @param src     - input
+ * @param w, h, s - its width, height & stride
+ */
+void flipframe(uint8_t *dst, const uint8_t *src, int w, int h, int s){
+    flipctx c = {.dst = dst, .src = src, .w = w, .h = h, .s = s};
+    parallel_for(0, h, 2 * w, fliprows, &c);
+}
+
 #define TRYFITS(f, ...)                     \
 do{ int status = 0;                         \
     f(__VA_ARGS__, &status);                \
@@ -223,6 +402,98 @@ do{ int status = 0;                             \
     if(status) fits_report_error(stderr, status);\
 }while(0)
 
+/**
+ * @brief fitscompression - get cfitsio compression type by its name
+ * @param name - "rice", "gzip", "gzip2", "hcompress" or "none"
+ * @return compression type, 0 for no compression or -1 if wrong name
+ */
+int fitscompression(const char *name){
+    if(!name || !*name || strcasecmp(name, "none") == 0) return 0;
+    if(strcasecmp(name, "rice") == 0) return RICE_1;
+    if(strcasecmp(name, "gzip") == 0) return GZIP_1;
+    if(strcasecmp(name, "gzip2") == 0) return GZIP_2;
+    if(strcasecmp(name, "hcompress") == 0) return HCOMPRESS_1;
+    return -1;
+}
+
+// size of increment of FITS memory buffer
+#define FITSMEM_DELTA   (1<<20)
+// per-thread buffer of FITS-file encoded in memory (written to disk by durable_write())
+static __thread void *fitsmem = NULL;
+static __thread size_t fitsmemsz = 0;
+
+// create new FITS-file: on disk in plain write mode or in memory buffer for other modes
+static int fitscreate(fitsfile **fp, const char *filename, int *status){
+    if(durable_mode() == WRITE_PLAIN){
+        char fname[PATH_MAX+1];
+        snprintf(fname, PATH_MAX+1, "!%s", filename); // rewrite file reserved by caller
+        return fits_create_file(fp, fname, status);
+    }
+    return fits_create_memfile(fp, &fitsmem, &fitsmemsz, FITSMEM_DELTA, realloc, status);
+}
+
+/**
+ * @brief fitsclose - close file opened by fitscreate()
+ * @param fp   - file
+ * @param size - (o) size of file in memory buffer
+ * @return 0 if all OK
+ */
+static int fitsclose(fitsfile *fp, size_t *size){
+    int status = 0, nhdu = 0, ret = 0;
+    long long hdustart, datastart, dataend = 0;
+    if(durable_mode() != WRITE_PLAIN){ // file ends with data of last HDU
+        fits_flush_file(fp, &status);
+        fits_get_num_hdus(fp, &nhdu, &status);
+        fits_movabs_hdu(fp, nhdu, NULL, &status);
+        fits_get_hduaddrll(fp, &hdustart, &datastart, &dataend, &status);
+        if(status){
+            fits_report_error(stderr, status);
+            ret = 1;
+        }
+        status = 0;
+    }
+    fits_close_file(fp, &status);
+    if(status){
+        fits_report_error(stderr, status);
+        ret = 1;
+    }
+    if(dataend <= 0 || (size_t)dataend > fitsmemsz) dataend = (long long)fitsmemsz;
+    *size = (size_t)dataend;
+    return ret;
+}
+
+// write FITS-file from memory buffer
+static int fitsstore(const char *filename, size_t size){
+    if(durable_mode() == WRITE_PLAIN) return 0;
+    return durable_write(filename, fitsmem, size);
+}
+
+// check that image in file (or in memory buffer of `size` bytes) is the same as `data`
+static int checkfits(char *filename, uint8_t *data, long npix, size_t size){
+    fitsfile *fp;
+    int status = 0, anynul = 0, ret = 1;
+    uint8_t *rdata = MALLOC(uint8_t, npix);
+    if(durable_mode() == WRITE_PLAIN) fits_open_image(&fp, filename, READONLY, &status);
+    else{
+        int naxis = 0;
+        fits_open_memfile(&fp, "mem", READONLY, &fitsmem, &size, 0, NULL, &status);
+        fits_get_img_dim(fp, &naxis, &status);
+        if(!status && naxis == 0) fits_movabs_hdu(fp, 2, NULL, &status); // compressed image
+    }
+    if(!status){
+        long fpix[2] = {1, 1};
+        fits_read_pix(fp, TBYTE, fpix, npix, NULL, rdata, &anynul, &status);
+        if(!status && !anynul && !memcmp(rdata, data, npix)) ret = 0;
+        int st = 0;
+        fits_close_file(fp, &st);
+    }
+    if(status) fits_report_error(stderr, status);
+    FREE(rdata);
+    if(ret) WARNX("Round-trip check of %s failed!", filename);
+    else VDBG("Round-trip check of %s: OK", filename);
+    return ret;
+}
+
 /**
  * @brief writefits - save FITS-file
  * @param filename  - full filename of output file
@@ -230,14 +501,35 @@ do{ int status = 0;                             \
  * @return 0 if all OK
  */
 int writefits(char *filename, fc2Image *convertedImage){
-    int w = convertedImage->cols, s = convertedImage->stride, h = convertedImage->rows;
+    framebuf fb = {.data = convertedImage->pData, .w = convertedImage->cols,
+                   .h = convertedImage->rows, .stride = convertedImage->stride,
+                   .info = *getframeinfo()};
+    return writefb(filename, &fb);
+}
+
+/**
+ * @brief writefb - save frame buffer into FITS-file (thread-safe if cfitsio built reentrant)
+ *          file is overwritten if exists; image is tile-compressed if G.compress set
+ * @param filename  - full filename of output file
+ * @param fb        - frame to save
+ * @return 0 if all OK
+ */
+int writefb(char *filename, framebuf *fb){
+    int w = fb->w, s = fb->stride, h = fb->h;
     long naxes[2] = {w, h}; //, startTime;
     double tmp = 0.0;
     //struct tm *tm_starttime;
     char buf[80];
     time_t savetime = time(NULL);
     fitsfile *fp;
-    TRYFITS(fits_create_file, &fp, filename);
+    int comp = fitscompression(G.compress);
+    TRYFITS(fitscreate, &fp, filename);
+    if(comp > 0){
+        long tile[2] = {w, 1}; // row by row
+        if(comp == HCOMPRESS_1) tile[1] = (h < 16) ? h : 16; // hcompress needs 2D tiles
+        TRYFITS(fits_set_compression_type, fp, comp);
+        TRYFITS(fits_set_tile_dim, fp, 2, tile);
+    }
     TRYFITS(fits_create_img, fp, BYTE_IMG, 2, naxes);
     // FILE / Input file original name
     WRITEKEY(fp, TSTRING, "FILE", filename, "Input file original name");
@@ -245,17 +537,12 @@ int writefits(char *filename, fc2Image *convertedImage){
     WRITEKEY(fp, TSTRING, "ORIGIN", "SAO RAS", "organization responsible for the data");
     // OBSERVAT / Observatory name
     WRITEKEY(fp, TSTRING, "OBSERVAT", "Special Astrophysical Observatory, Russia", "Observatory name");
-    fc2Context context;
-    if(FC2_ERROR_OK == fc2CreateContext(&context)){
-        fc2CameraInfo camInfo;
-        fc2Error error = fc2GetCameraInfo(context, &camInfo);
-        if(error == FC2_ERROR_OK){
-            // INSTRUME / Instrument
-            WRITEKEY(fp, TSTRING, "INSTRUME", camInfo.modelName, "Instrument");
-            // DETECTOR / detector
-            WRITEKEY(fp, TSTRING, "DETECTOR", camInfo.sensorInfo, "Detector model");
-        }
-        fc2DestroyContext(context);
+    fc2CameraInfo *camInfo = getcaminfo();
+    if(camInfo){
+        // INSTRUME / Instrument
+        WRITEKEY(fp, TSTRING, "INSTRUME", camInfo->modelName, "Instrument");
+        // DETECTOR / detector
+        WRITEKEY(fp, TSTRING, "DETECTOR", camInfo->sensorInfo, "Detector model");
     }
     double pixX, pixY = pixX = 6.45;
     snprintf(buf, 80, "%g x %g", pixX, pixY);
@@ -284,36 +571,102 @@ int writefits(char *filename, fc2Image *convertedImage){
     WRITEKEY(fp, TDOUBLE, "STATSTD", &std, "Std. of data value");
     WRITEKEY(fp, TDOUBLE, "TEMP0", &G->temperature, "Camera temperature at exp. start (degr C)");
     */
-    tmp = (double)G.exptime / 1000.;
+    frameinfo *info = &fb->info;
+    tmp = isnan(info->exptime) ? (double)G.exptime : (double)info->exptime;
+    tmp /= 1000.;
     // EXPTIME / actual exposition time (sec)
     WRITEKEY(fp, TDOUBLE, "EXPTIME", &tmp, "Actual exposition time (sec)");
+    if(!isnan(info->gain)){
+        tmp = (double)info->gain;
+        WRITEKEY(fp, TDOUBLE, "GAIN", &tmp, "Gain value (dB)");
+    }
+    if(info->bayer != BAYER_NONE) // raw color frame
+        WRITEKEY(fp, TSTRING, "BAYERPAT", (void*)bayer_name(bayer_flipud(info->bayer, h)), "Bayer pattern");
     // DATE / Creation date (YYYY-MM-DDThh:mm:ss, UTC)
-    strftime(buf, 80, "%Y-%m-%dT%H:%M:%S", gmtime(&savetime));
+    struct tm tm;
+    strftime(buf, 80, "%Y-%m-%dT%H:%M:%S", gmtime_r(&savetime, &tm));
     WRITEKEY(fp, TSTRING, "DATE", buf, "Creation date (YYYY-MM-DDThh:mm:ss, UTC)");
-/*
-    startTime = (long)expStartsAt.tv_sec;
-    tm_starttime = localtime(&expStartsAt.tv_sec);
-    strftime(buf, 80, "exposition starts at %d/%m/%Y, %H:%M:%S (local)", tm_starttime);
-    tmp = startTime + (double)expStartsAt.tv_usec/1e6;
-    WRITEKEY(fp, TDOUBLE, "UNIXTIME", &tmp, buf);
-    strftime(buf, 80, "%Y/%m/%d", tm_starttime);
-    // DATE-OBS / DATE (YYYY/MM/DD) OF OBS.
-    WRITEKEY(fp, TSTRING, "DATE-OBS", buf, "DATE OF OBS. (YYYY/MM/DD, local)");
-    strftime(buf, 80, "%H:%M:%S", tm_starttime);
-    // START / Measurement start time (local) (hh:mm:ss)
-    WRITEKEY(fp, TSTRING, "START", buf, "Measurement start time (hh:mm:ss, local)");
-    */
+    // time of exposure start: by camera clock if embedded timestamp is available
+    int camclock = !isnan(info->obstime);
+    double obstime = camclock ? info->obstime : info->timestamp - G.readout / 1000.;
+    if(!camclock && !isnan(info->exptime)) obstime -= info->exptime / 1000.;
+    if(obstime > 0.){
+        time_t sec = (time_t)obstime;
+        long usec = lround((obstime - (double)sec) * 1e6);
+        if(usec > 999999){ ++sec; usec -= 1000000; }
+        size_t l = strftime(buf, 80, "%Y-%m-%dT%H:%M:%S", gmtime_r(&sec, &tm));
+        snprintf(buf + l, 80 - l, ".%06ld", usec);
+        // DATE-OBS / exposure start
+        WRITEKEY(fp, TSTRING, "DATE-OBS", buf, "Exposure start (YYYY-MM-DDThh:mm:ss.ssssss, UTC)");
+        int status = 0;
+        fits_write_key_fixdbl(fp, "UNIXTIME", obstime, 6, "Exposure start (UNIX time, s)", &status);
+        if(status) fits_report_error(stderr, status);
+        WRITEKEY(fp, TSTRING, "TIMESRC", (void*)(camclock ? "camera" : "host"),
+                 camclock ? "Time by camera clock fitted to host clock" : "Time of retrieving minus exposition");
+    }
+    if(info->counter){
+        unsigned int u = info->counter;
+        WRITEKEY(fp, TUINT, "FRAMECNT", &u, "Embedded frame counter of camera");
+        u = info->dropped;
+        WRITEKEY(fp, TUINT, "DROPPED", &u, "Frames lost before this one");
+    }
     uint8_t *data = MALLOC(uint8_t, w*h);
     // mirror upside down to make right image
-    for(int y = 0; y < h; y++){
-        memcpy(&data[y * w], &convertedImage->pData[(h-y-1) * s], w);
-    }
+    flipframe(data, fb->data, w, h, s);
     int status = 0;
     fits_write_img(fp, TBYTE, 1, w * h, data, &status);
     if(status) fits_report_error(stderr, status);
+    int ret = status;
+    size_t size = 0;
+    if(fitsclose(fp, &size)) ret = 1;
+    if(!ret && G.fitscheck) ret = checkfits(filename, data, w * h, size);
+    if(!ret) ret = fitsstore(filename, size);
     FREE(data);
-    TRYFITS(fits_close_file, fp);
-    return 0;
+    return ret;
+}
+
+/**
+ * @brief writefloat - save float image (master frame, stack etc) into FITS-file
+ * @param filename - full filename of output file (rewritten if exists)
+ * @param img      - image data (in frame order: it will be mirrored as in writefb())
+ * @param w, h     - image size
+ * @param imagetyp - value of IMAGETYP
+ * @param ncombine - amount of combined frames
+ * @param exptime  - exposition time of one frame (ms), NAN if unknown
+ * @return 0 if all OK
+ */
+int writefloat(char *filename, const float *img, int w, int h, const char *imagetyp, int ncombine, double exptime){
+    long naxes[2] = {w, h};
+    char buf[80];
+    time_t savetime = time(NULL);
+    fitsfile *fp;
+    TRYFITS(fitscreate, &fp, filename);
+    TRYFITS(fits_create_img, fp, FLOAT_IMG, 2, naxes);
+    WRITEKEY(fp, TSTRING, "IMAGETYP", (void*)imagetyp, "Image type");
+    WRITEKEY(fp, TINT, "NCOMBINE", &ncombine, "Number of combined frames");
+    if(!isnan(exptime)){
+        exptime /= 1000.;
+        WRITEKEY(fp, TDOUBLE, "EXPTIME", &exptime, "Exposition time of one frame (sec)");
+    }
+    fc2CameraInfo *camInfo = getcaminfo();
+    if(camInfo){
+        WRITEKEY(fp, TSTRING, "INSTRUME", camInfo->modelName, "Instrument");
+        WRITEKEY(fp, TSTRING, "DETECTOR", camInfo->sensorInfo, "Detector model");
+    }
+    struct tm tm;
+    strftime(buf, 80, "%Y-%m-%dT%H:%M:%S", gmtime_r(&savetime, &tm));
+    WRITEKEY(fp, TSTRING, "DATE", buf, "Creation date (YYYY-MM-DDThh:mm:ss, UTC)");
+    int status = 0;
+    for(int y = 0; y < h && !status; ++y){ // mirror upside down
+        long fpix[2] = {1, h - y};
+        fits_write_pix(fp, TFLOAT, fpix, w, (void*)&img[y * w], &status);
+    }
+    if(status) fits_report_error(stderr, status);
+    int ret = status;
+    size_t size = 0;
+    if(fitsclose(fp, &size)) ret = 1;
+    if(!ret) ret = fitsstore(filename, size);
+    return ret;
 }
 
 #undef TRYFITS
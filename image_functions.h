@@ -22,6 +22,7 @@
 
 #include <C/FlyCapture2_C.h>
 #include <GL/glut.h>
+#include "framepool.h"
 #include "imageview.h"
 
 // functions for converting grayscale value into colour
@@ -32,14 +33,23 @@ typedef enum{
     COLORFN_MAX     // end of list
 } colorfn_type;
 
+frameinfo *getframeinfo();
+framebuf *getframe();
+framebuf *getframe_ref();
 int GrabImage(fc2Context context, fc2Image *convertedImage);
 void change_displayed_image(windowData *win, fc2Image *convertedImage);
+void colorize(const uint8_t *data, int w, int h, int s, int bin, const int roi[4], GLubyte *rgb);
+void flipframe(uint8_t *dst, const uint8_t *src, int w, int h, int s);
 
 void gray2rgb(double gray, GLubyte *rgb);
 colorfn_type get_colorfun();
 void change_colorfun(colorfn_type f);
 void roll_colorfun();
+void colorlut(GLubyte lut[256][3]);
 
+int fitscompression(const char *name);
 int writefits(char *filename, fc2Image *convertedImage);
+int writefb(char *filename, framebuf *fb);
+int writefloat(char *filename, const float *img, int w, int h, const char *imagetyp, int ncombine, double exptime);
 
 #endif // IMAGE_FUNCTIONS__
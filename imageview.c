@@ -24,12 +24,21 @@
 #include <usefull_macros.h>
 
 #include "imageview.h"
+#include "rtsched.h"
 
 static windowData *win = NULL; // main window
 static pthread_t GLUTthread; // main GLUT thread
 
 static int initialized = 0; // ==1 if GLUT is initialized; ==0 after clear_GL_context
 
+// parameters of view: window is redrawn only if they or image changed
+typedef struct{
+    float zoom, x, y;
+    int w, h;
+    uint8_t flip;
+} viewstate;
+static viewstate drawn; // view of last drawing
+
 static void createWindow();
 static void RedrawWindow();
 static void *Redraw(_U_ void *arg);
@@ -62,6 +71,54 @@ void calc_win_props(GLfloat *Wortho, GLfloat *Hortho){
     win->y0 = H/Zoom + h - win->y / Zoom;
 }
 
+/**
+ * @brief preview_region - calculate binning & visible region of preview for current zoom & window size:
+ *          image is binned while its pixels are less than screen ones, otherwise only visible part is shown
+ * @param window   - window
+ * @param bin (o)  - binning (1, 2 or 4)
+ * @param roi (o)  - visible region in binned pixels (x, y, w, h)
+ */
+void preview_region(windowData *window, int *bin, int roi[4]){
+    int w = window->image->w, h = window->image->h, b = 1;
+    GLfloat W, H;
+    calc_win_props(&W, &H);
+    float scale = window->zoom * (float)window->w / (2.f * W); // screen pixels per image pixel
+    if(scale <= 0.25f && w % 4 == 0 && h % 4 == 0) b = 4;
+    else if(scale <= 0.5f && w % 2 == 0 && h % 2 == 0) b = 2;
+    *bin = b;
+    roi[0] = roi[1] = 0;
+    roi[2] = w / b; roi[3] = h / b;
+    if(b > 1) return;
+    // image pixel (X, Y) is at (zoom*lr*(X-w/2) + x, -zoom*ud*(Y-h/2) + y) of [-W, W]x[-H, H]
+    float lr = (window->flip & WIN_FLIP_LR) ? -1.f : 1.f, ud = (window->flip & WIN_FLIP_UD) ? -1.f : 1.f;
+    float X0 = w/2.f + (-W - window->x) / (window->zoom * lr), X1 = w/2.f + (W - window->x) / (window->zoom * lr);
+    float Y0 = h/2.f - (-H - window->y) / (window->zoom * ud), Y1 = h/2.f - (H - window->y) / (window->zoom * ud);
+    if(X0 > X1){ float t = X0; X0 = X1; X1 = t; }
+    if(Y0 > Y1){ float t = Y0; Y0 = Y1; Y1 = t; }
+    int x0 = (int)floorf(X0) - 2, x1 = (int)ceilf(X1) + 2, y0 = (int)floorf(Y0) - 2, y1 = (int)ceilf(Y1) + 2;
+    if(x0 < 0) x0 = 0;
+    if(y0 < 0) y0 = 0;
+    if(x1 > w) x1 = w;
+    if(y1 > h) y1 = h;
+    if(x1 <= x0 || y1 <= y0){ // image is out of window
+        x0 = y0 = 0; x1 = y1 = 1;
+    }
+    roi[0] = x0; roi[1] = y0;
+    roi[2] = x1 - x0; roi[3] = y1 - y0;
+}
+
+/**
+ * @brief preview_stale - check if preview should be rebuilt after zooming or moving of image
+ * @param window - window
+ * @return 1 if current preview has another binning or doesn't cover visible region
+ */
+int preview_stale(windowData *window){
+    int bin, roi[4], *cur = window->image->roi;
+    preview_region(window, &bin, roi);
+    if(bin != window->image->bin) return 1;
+    return (roi[0] < cur[0] || roi[1] < cur[1] || roi[0] + roi[2] > cur[0] + cur[2] || roi[1] + roi[3] > cur[1] + cur[3]);
+}
+
 /**
  * create window & run main loop
  */
@@ -91,6 +148,7 @@ static void createWindow(){
     win->zoom = 1. / win->Daspect;
     glEnable(GL_TEXTURE_2D);
     glBindTexture(GL_TEXTURE_2D, win->Tex);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // rows of binned previews could have any length
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, win->image->w, win->image->h, 0,
             GL_RGB, GL_UNSIGNED_BYTE, win->image->rawdata);
     glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
@@ -163,6 +221,17 @@ void redisplay(int GL_ID){
     glutPostRedisplay();
 }
 
+static viewstate curview(){
+    viewstate v = {.zoom = win->zoom, .x = win->x, .y = win->y, .w = win->w, .h = win->h, .flip = win->flip};
+    return v;
+}
+
+static int viewchanged(){
+    viewstate v = curview();
+    return (v.zoom != drawn.zoom || v.x != drawn.x || v.y != drawn.y || v.w != drawn.w || v.h != drawn.h
+            || v.flip != drawn.flip);
+}
+
 static void RedrawWindow(){
     if(!initialized || !win) return;
     if(pthread_mutex_trylock(&win->mutex) != 0) return;
@@ -174,26 +243,35 @@ static void RedrawWindow(){
     glScalef(-win->zoom, -win->zoom, 1.);
     glEnable(GL_TEXTURE_2D);
     glBindTexture(GL_TEXTURE_2D, win->Tex);
-    if(win->image->changed){
+    if(win->image->changed){ // upload only filled region of preview
+        int *roi = win->image->roi;
         glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
-        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, win->image->w, win->image->h,
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, win->image->w / win->image->bin);
+        glPixelStorei(GL_UNPACK_SKIP_PIXELS, roi[0]);
+        glPixelStorei(GL_UNPACK_SKIP_ROWS, roi[1]);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, roi[0], roi[1], roi[2], roi[3],
                         GL_RGB, GL_UNSIGNED_BYTE, win->image->rawdata);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+        glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
         win->image->changed = 0;
     }
 
     w /= 2.f; h /= 2.f;
+    float tc = 1.f / win->image->bin; // binned preview fills only part of texture
     float lr = 1., ud = 1.; // flipping coefficients
     if(win->flip & WIN_FLIP_LR) lr = -1.;
     if(win->flip & WIN_FLIP_UD) ud = -1.;
     glBegin(GL_QUADS);
-        glTexCoord2f(1.0f, 1.0f); glVertex2f( -1.f*lr*w, ud*h ); // top right
-        glTexCoord2f(1.0f, 0.0f); glVertex2f( -1.f*lr*w, -1.f*ud*h ); // bottom right
+        glTexCoord2f(tc, tc); glVertex2f( -1.f*lr*w, ud*h ); // top right
+        glTexCoord2f(tc, 0.0f); glVertex2f( -1.f*lr*w, -1.f*ud*h ); // bottom right
         glTexCoord2f(0.0f, 0.0f); glVertex2f(lr*w, -1.f*ud*h ); // bottom left
-        glTexCoord2f(0.0f, 1.0f); glVertex2f(lr*w,  ud*h ); // top left
+        glTexCoord2f(0.0f, tc); glVertex2f(lr*w,  ud*h ); // top left
     glEnd();
     glDisable(GL_TEXTURE_2D);
     glFinish();
     glutSwapBuffers();
+    drawn = curview();
     pthread_mutex_unlock(&win->mutex);
 }
 
@@ -203,14 +281,15 @@ static void RedrawWindow(){
  */
 static void *Redraw(_U_ void *arg){
     FNAME();
+    rtsched_unpin(); // window is created by grabbing thread
     while(1){
         if(!initialized){
             DBG("!initialized -> exit thread");
             return NULL;
         }
         if(win && win->ID > 0){
-            redisplay(win->ID);
-            glutMainLoopEvent(); // process actions if there are windows
+            if(win->image->changed || viewchanged()) redisplay(win->ID);
+            glutMainLoopEvent(); // process actions if there are windows (expose events redraw window by themselves)
         }
         usleep(10000);
     }
@@ -258,6 +337,9 @@ windowData *createGLwin(char *title, int w, int h, rawimage *rawdata){
             raw->w = w;
             raw->h = h;
             raw->changed = 1;
+            raw->bin = 1;
+            raw->roi[2] = w;
+            raw->roi[3] = h;
             // raw->protected is zero automatically
         }
     }
@@ -33,6 +33,8 @@ typedef struct{
     int w;             // size of image
     int h;
     int changed;       // == 1 if data was changed outside (to redraw)
+    int bin;           // binning of preview (1, 2 or 4): rawdata is (w/bin)x(h/bin) RGB image
+    int roi[4];        // region of rawdata filled by last frame (x, y, w, h in binned pixels)
 } rawimage;
 
 // events from menu:
@@ -44,6 +46,10 @@ typedef struct{
 #define WINEVT_SAVEIMAGE    (1<<2)
 // change color palette function
 #define WINEVT_ROLLCOLORFUN (1<<3)
+// event for pre-trigger recording
+#define WINEVT_TRIGGER      (1<<4)
+// change stretch mode
+#define WINEVT_ROLLSTRETCH  (1<<5)
 
 // flip image
 #define WIN_FLIP_LR         (1<<0)
@@ -80,6 +86,8 @@ void renderBitmapString(float x, float y, void *font, char *string, GLubyte *col
 void clear_GL_context();
 
 void calc_win_props(GLfloat *Wortho, GLfloat *Hortho);
+void preview_region(windowData *window, int *bin, int roi[4]);
+int  preview_stale(windowData *window);
 
 void conv_mouse_to_image_coords(int x, int y, float *X, float *Y, windowData *window);
 void conv_image_to_mouse_coords(float X, float Y, int *x, int *y, windowData *window);
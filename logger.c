@@ -0,0 +1,385 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+
+#include "logger.h"
+
+// amount of records in ring of each thread (power of 2)
+#define RING_SIZE       (512)
+// period of flushing (us)
+#define FLUSH_PERIOD    (10000)
+// max length of formatted message
+#define LINE_MAX_LEN    (1024)
+// offset of NULL string
+#define STR_NULL        (~0ULL)
+
+typedef struct{
+    double t;               // monotonic time
+    const char *fmt;        // format (string literal)
+    int level;
+    int nargs;
+    logarg args[LOGGER_MAXARGS]; // string arguments contain offset in `str`
+    char str[LOGGER_STRSZ];
+} logrecord;
+
+// single-producer single-consumer ring of one thread
+typedef struct logring{
+    logrecord rec[RING_SIZE];
+    uint32_t head __attribute__((aligned(64)));     // next record to write (changed by producer)
+    uint64_t lost;                                  // records lost due to full ring
+    uint32_t tail __attribute__((aligned(64)));     // next record to read (changed by flusher)
+    uint64_t reported;                              // lost records reported by flusher
+    uint32_t taken;                                 // records in current batch of flusher
+    int orphan;                                     // thread exited
+    struct logring *next;
+} logring;
+
+typedef enum{
+    DEST_CONSOLE,
+    DEST_FILE,
+    DEST_SYSLOG
+} logdest;
+
+static logring *rings = NULL;       // list of rings
+static pthread_mutex_t ringsmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ringkey;
+static __thread logring *myring = NULL;
+static pthread_t flusher;
+static int running = 0, stopping = 0;
+static logdest dest = DEST_CONSOLE;
+static FILE *logfile = NULL;
+static double t0 = 0.;              // time of start
+
+static double monotime(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief format - make message of record
+ * @param r    - record
+ * @param buf  - output buffer
+ * @param size - its size
+ * @return length of message
+ */
+static size_t format(const logrecord *r, char *buf, size_t size){
+    const char *f = r->fmt;
+    size_t l = 0;
+    int argn = 0;
+    #define ROOM    (l < size ? size - l : 0)
+    #define ADDED(n) do{ if((n) > 0) l += (size_t)(n); if(l >= size) l = size - 1; }while(0)
+    while(*f && l < size - 1){
+        if(*f != '%'){
+            buf[l++] = *f++;
+            continue;
+        }
+        if(f[1] == '%'){
+            buf[l++] = '%';
+            f += 2;
+            continue;
+        }
+        // conversion specification: flags, width & precision are kept, length modifiers are replaced
+        char spec[32] = "%";
+        size_t sl = 1;
+        const char *s = f + 1;
+        while(*s && strchr("-+ #0", *s) && sl < 20) spec[sl++] = *s++;
+        while(*s && ((*s >= '0' && *s <= '9') || *s == '.') && sl < 28) spec[sl++] = *s++;
+        while(*s && strchr("hlLqjzt", *s)) ++s;
+        char conv = *s;
+        if(!conv) break;
+        f = s + 1;
+        if(argn >= r->nargs){ // wrong amount of arguments
+            int n = snprintf(buf + l, ROOM, "%%%c", conv);
+            ADDED(n);
+            continue;
+        }
+        const logarg *a = &r->args[argn++];
+        int n = 0;
+        switch(conv){
+            case 'd':
+            case 'i':
+            case 'c':
+            {
+                long long v = (a->type == 'd') ? (long long)a->d : a->i;
+                if(conv == 'c'){
+                    spec[sl++] = 'c';
+                    spec[sl] = 0;
+                    n = snprintf(buf + l, ROOM, spec, (int)v);
+                }else{
+                    memcpy(spec + sl, "lld", 4);
+                    n = snprintf(buf + l, ROOM, spec, v);
+                }
+            }
+            break;
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+            {
+                unsigned long long v = (a->type == 'd') ? (unsigned long long)a->d : a->u;
+                spec[sl++] = 'l';
+                spec[sl++] = 'l';
+                spec[sl++] = conv;
+                spec[sl] = 0;
+                n = snprintf(buf + l, ROOM, spec, v);
+            }
+            break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+            {
+                double v = (a->type == 'd') ? a->d : (a->type == 'u') ? (double)a->u : (double)a->i;
+                spec[sl++] = conv;
+                spec[sl] = 0;
+                n = snprintf(buf + l, ROOM, spec, v);
+            }
+            break;
+            case 's':
+            {
+                const char *v = "?";
+                if(a->type == 's') v = (a->u == STR_NULL) ? "(null)" : r->str + a->u;
+                spec[sl++] = 's';
+                spec[sl] = 0;
+                n = snprintf(buf + l, ROOM, spec, v);
+            }
+            break;
+            case 'p':
+                n = snprintf(buf + l, ROOM, "%p", a->p);
+            break;
+            default:
+                n = snprintf(buf + l, ROOM, "%%%c", conv);
+        }
+        ADDED(n);
+    }
+    #undef ROOM
+    #undef ADDED
+    buf[l] = 0;
+    return l;
+}
+
+// fill record by message
+static void fillrecord(logrecord *r, int level, const char *fmt, int nargs, const logarg *args){
+    r->t = monotime();
+    r->fmt = fmt;
+    r->level = level;
+    if(nargs > LOGGER_MAXARGS) nargs = LOGGER_MAXARGS;
+    r->nargs = nargs;
+    size_t used = 0;
+    for(int i = 0; i < nargs; ++i){
+        r->args[i] = args[i];
+        if(args[i].type != 's') continue;
+        const char *s = (const char*)args[i].p;
+        if(!s){
+            r->args[i].u = STR_NULL;
+            continue;
+        }
+        r->args[i].u = used;
+        size_t room = LOGGER_STRSZ - used - 1; // (last byte is always zero)
+        size_t n = strnlen(s, room);
+        memcpy(r->str + used, s, n);
+        r->str[used + n] = 0;
+        used += n;
+        if(used < LOGGER_STRSZ - 1) ++used;
+    }
+}
+
+// write formatted message
+static void output(const logrecord *r){
+    char line[LINE_MAX_LEN];
+    format(r, line, LINE_MAX_LEN);
+    switch(dest){
+        case DEST_SYSLOG:
+            syslog(r->level > 1 ? LOG_DEBUG : LOG_INFO, "%s", line);
+        break;
+        case DEST_FILE:
+            fprintf(logfile, "[%12.6f] %s\n", r->t - t0, line);
+        break;
+        default:
+            printf("[%12.6f] %s\n", r->t - t0, line);
+    }
+}
+
+static void ringdestructor(void *data){
+    logring *r = (logring*) data;
+    if(r) __atomic_store_n(&r->orphan, 1, __ATOMIC_RELEASE);
+}
+
+// create ring for calling thread
+static logring *newring(){
+    logring *r = MALLOC(logring, 1);
+    pthread_mutex_lock(&ringsmutex);
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&ringsmutex);
+    pthread_setspecific(ringkey, r);
+    myring = r;
+    return r;
+}
+
+static int cmprec(const void *a, const void *b){
+    double t1 = (*(const logrecord**)a)->t, t2 = (*(const logrecord**)b)->t;
+    return (t1 < t2) ? -1 : (t1 > t2);
+}
+
+// write all records in time order
+static void drain(){
+    static const logrecord *batch[4 * RING_SIZE];
+    pthread_mutex_lock(&ringsmutex);
+    int more = 1;
+    while(more){
+        int n = 0;
+        more = 0;
+        for(logring *r = rings; r; r = r->next){
+            uint32_t h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE), t = r->tail;
+            for(; t != h; ++t){
+                if(n == 4 * RING_SIZE){
+                    more = 1;
+                    break;
+                }
+                batch[n++] = &r->rec[t & (RING_SIZE - 1)];
+            }
+            r->taken = t - r->tail;
+        }
+        if(n > 1) qsort(batch, n, sizeof(logrecord*), cmprec);
+        for(int i = 0; i < n; ++i) output(batch[i]);
+        for(logring *r = rings; r; r = r->next) // release written records
+            __atomic_store_n(&r->tail, r->tail + r->taken, __ATOMIC_RELEASE);
+    }
+    // report lost records & free rings of finished threads
+    for(logring **pr = &rings; *pr;){
+        logring *r = *pr;
+        uint64_t lost = __atomic_load_n(&r->lost, __ATOMIC_RELAXED);
+        if(lost != r->reported){
+            logrecord rec = {0};
+            logarg a = logarg_u(lost - r->reported);
+            fillrecord(&rec, 0, "Logger: %llu message[s] lost", 1, &a);
+            output(&rec);
+            r->reported = lost;
+        }
+        if(__atomic_load_n(&r->orphan, __ATOMIC_ACQUIRE) && r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)){
+            *pr = r->next;
+            FREE(r);
+        }else pr = &r->next;
+    }
+    pthread_mutex_unlock(&ringsmutex);
+    if(dest == DEST_FILE) fflush(logfile);
+    else if(dest == DEST_CONSOLE) fflush(stdout);
+}
+
+static void *flushthread(_U_ void *data){
+    while(!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)){
+        usleep(FLUSH_PERIOD);
+        drain();
+    }
+    drain();
+    return NULL;
+}
+
+/**
+ * @brief logger_put - put message into ring of calling thread (or print it if logger isn't running)
+ * @param level - verbose level of message
+ * @param fmt   - printf-like format (string literal: it is used after return)
+ * @param nargs - amount of arguments
+ * @param args  - arguments
+ */
+void logger_put(int level, const char *fmt, int nargs, const logarg *args){
+    if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE)){ // synchronous output
+        logrecord rec;
+        char line[LINE_MAX_LEN];
+        fillrecord(&rec, level, fmt, nargs, args);
+        format(&rec, line, LINE_MAX_LEN);
+        printf("%s\n", line);
+        fflush(stdout);
+        return;
+    }
+    logring *r = myring;
+    if(!r) r = newring();
+    uint32_t h = r->head;
+    if(h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= RING_SIZE){ // full: never wait
+        __atomic_add_fetch(&r->lost, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    fillrecord(&r->rec[h & (RING_SIZE - 1)], level, fmt, nargs, args);
+    __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief logger_init - run logging thread
+ * @param logto - NULL or "-" for console, "syslog" or name of file
+ * @return 0 if all OK
+ */
+int logger_init(const char *logto){
+    if(running) return 0;
+    dest = DEST_CONSOLE;
+    if(logto && strcmp(logto, "syslog") == 0){
+        openlog("grasshopper", LOG_PID, LOG_USER);
+        dest = DEST_SYSLOG;
+    }else if(logto && strcmp(logto, "-")){
+        logfile = fopen(logto, "a");
+        if(!logfile){
+            WARN("Can't open log file %s", logto);
+            return 1;
+        }
+        dest = DEST_FILE;
+    }
+    static int keyready = 0;
+    if(!keyready){
+        if(pthread_key_create(&ringkey, ringdestructor)) return 1;
+        atexit(logger_stop);
+        keyready = 1;
+    }
+    t0 = monotime();
+    stopping = 0;
+    if(pthread_create(&flusher, NULL, flushthread, NULL)){
+        WARN("pthread_create()");
+        return 1;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// write all messages got till now
+void logger_flush(){
+    if(running) drain();
+}
+
+// write all messages & stop logging thread (next messages are printed synchronously)
+void logger_stop(){
+    if(!__atomic_exchange_n(&running, 0, __ATOMIC_ACQ_REL)) return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(flusher, NULL);
+    if(dest == DEST_FILE){
+        fclose(logfile);
+        logfile = NULL;
+    }else if(dest == DEST_SYSLOG) closelog();
+    dest = DEST_CONSOLE;
+}
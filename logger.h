@@ -0,0 +1,93 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Asynchronous logging: VMESG()/VDBG() don't format anything, they only put fixed-size binary record (monotonic
+ * timestamp, pointer to format string, arguments packed by their types, copies of strings) into lock-free ring
+ * of calling thread. Background thread formats records and writes them into console, file or syslog.
+ */
+
+#pragma once
+#ifndef LOGGER__
+#define LOGGER__
+
+#include <stdint.h>
+
+// max amount of arguments of one message
+#define LOGGER_MAXARGS  (8)
+// size of buffer for copies of string arguments in record
+#define LOGGER_STRSZ    (192)
+
+// packed argument of message
+typedef struct{
+    char type;              // 'i' - signed, 'u' - unsigned, 'd' - floating point, 's' - string, 'p' - pointer
+    union{
+        long long i;
+        unsigned long long u;
+        double d;
+        const void *p;
+    };
+} logarg;
+
+static inline logarg logarg_i(long long x){ return (logarg){.type = 'i', .i = x}; }
+static inline logarg logarg_u(unsigned long long x){ return (logarg){.type = 'u', .u = x}; }
+static inline logarg logarg_d(double x){ return (logarg){.type = 'd', .d = x}; }
+static inline logarg logarg_s(const char *x){ return (logarg){.type = 's', .p = x}; }
+static inline logarg logarg_p(const void *x){ return (logarg){.type = 'p', .p = x}; }
+
+// pack argument by its type
+#define LOGARG(x) _Generic((x),                                                     \
+    char*: logarg_s, const char*: logarg_s,                                         \
+    void*: logarg_p, const void*: logarg_p,                                         \
+    float: logarg_d, double: logarg_d, long double: logarg_d,                       \
+    unsigned char: logarg_u, unsigned short: logarg_u, unsigned int: logarg_u,      \
+    unsigned long: logarg_u, unsigned long long: logarg_u,                          \
+    default: logarg_i)(x)
+
+// amount of arguments (0..LOGGER_MAXARGS)
+#define LOGGER_NARGS(...)   LOGGER_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOGGER_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, N, ...) N
+// apply LOGARG() to each argument
+#define LOGGER_MAP0()
+#define LOGGER_MAP1(a)      LOGARG(a)
+#define LOGGER_MAP2(a, ...) LOGARG(a), LOGGER_MAP1(__VA_ARGS__)
+#define LOGGER_MAP3(a, ...) LOGARG(a), LOGGER_MAP2(__VA_ARGS__)
+#define LOGGER_MAP4(a, ...) LOGARG(a), LOGGER_MAP3(__VA_ARGS__)
+#define LOGGER_MAP5(a, ...) LOGARG(a), LOGGER_MAP4(__VA_ARGS__)
+#define LOGGER_MAP6(a, ...) LOGARG(a), LOGGER_MAP5(__VA_ARGS__)
+#define LOGGER_MAP7(a, ...) LOGARG(a), LOGGER_MAP6(__VA_ARGS__)
+#define LOGGER_MAP8(a, ...) LOGARG(a), LOGGER_MAP7(__VA_ARGS__)
+#define LOGGER_CAT(a, b)    LOGGER_CAT_(a, b)
+#define LOGGER_CAT_(a, b)   a##b
+
+extern int verbose_level;
+
+/**
+ * put message into log if verbose level is not less than `lvl`
+ * `fmt` should be string literal (it is formatted later), arguments are printf-like
+ */
+#define LOGGER(lvl, fmt, ...) do{ if(verbose_level >= (int)(lvl)){                                 \
+    const logarg logargs_[] = {{0}, LOGGER_CAT(LOGGER_MAP, LOGGER_NARGS(__VA_ARGS__))(__VA_ARGS__)};  \
+    logger_put((lvl), fmt, LOGGER_NARGS(__VA_ARGS__), logargs_ + 1);}}while(0)
+
+int  logger_init(const char *dest);
+void logger_put(int level, const char *fmt, int nargs, const logarg *args);
+void logger_flush();
+void logger_stop();
+
+#endif // LOGGER__
@@ -0,0 +1,259 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "lucky.h"
+#include "stacking.h"
+
+// frame in top-K buffer
+typedef struct{
+    double sharpness;
+    framebuf *fb;
+} luckyframe;
+
+static luckyframe *heap = NULL;     // min-heap by sharpness: the worst selected frame is on top
+static int K = 0, nheap = 0;        // capacity & amount of frames in heap
+static int batchsz = 0, nbatch = 0; // size of batch & amount of frames got in current batch
+static float keeppart = 0.f;        // part of frames to keep
+static int roix = 0, roiy = 0, roiw = 0, roih = 0; // ROI for sharpness (roiw == 0 - full frame)
+static luckysave savefn = NULL;
+static char *saveprefix = NULL;
+static int dostack = 0;
+static int reserved = 0;            // buffers for selected frames are allocated in pool
+// selected frames of batch are stacked/saved by worker, so grabbing thread isn't stopped
+static pthread_t worker;
+static pthread_mutex_t wmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wcond = PTHREAD_COND_INITIALIZER;
+static framebuf **jobframes = NULL; // selected frames handed to worker
+static int njob = 0, workerrun = 0;
+static uint64_t ntotal = 0, nselected = 0;
+static double metrictime = 0.;
+
+// stack or save selected frames
+static void processbatch(framebuf **frames, int n){
+    if(dostack){ // the best frame is the first: it will be reference for alignment
+        for(int i = 0; i < n; ++i) stack_add(frames[i]);
+        framebuf *stack = stack_result();
+        if(savefn && saveprefix) savefn(stack, saveprefix); // it is saved as stack by `info.ncombine`
+        framebuf_unref(stack);
+        stack_reset(); // buffers stay allocated for the next batch
+    }else if(savefn && saveprefix){
+        for(int i = 0; i < n; ++i) savefn(frames[i], saveprefix);
+    }
+    for(int i = 0; i < n; ++i) framebuf_unref(frames[i]);
+}
+
+static void *workerthread(_U_ void *data){
+    pthread_mutex_lock(&wmutex);
+    while(1){
+        while(!njob && workerrun) pthread_cond_wait(&wcond, &wmutex);
+        if(!njob) break;
+        int n = njob;
+        pthread_mutex_unlock(&wmutex);
+        processbatch(jobframes, n);
+        pthread_mutex_lock(&wmutex);
+        njob = 0;
+        pthread_cond_broadcast(&wcond);
+    }
+    pthread_mutex_unlock(&wmutex);
+    return NULL;
+}
+
+/**
+ * @brief lucky_init - set up frames selection
+ * @param percent - part of frames to keep (%)
+ * @param batch   - amount of frames from which best are selected
+ * @param roi     - "x,y,w,h" - region for sharpness calculation (NULL - full frame)
+ * @param save    - function to save selected frames (NULL - don't save)
+ * @param prefix  - prefix of output files
+ * @param stack   - ==1 to stack selected frames of each batch (stacking should be initialized)
+ * @return 0 if all OK
+ */
+int lucky_init(float percent, int batch, const char *roi, luckysave save, char *prefix, int stack){
+    if(percent <= 0.f || percent > 100.f || batch < 1) return 1;
+    if(roi && (4 != sscanf(roi, "%d,%d,%d,%d", &roix, &roiy, &roiw, &roih) ||
+               roix < 0 || roiy < 0 || roiw < 2 || roih < 2)){
+        WARNX("Wrong ROI: %s, should be \"x,y,w,h\"", roi);
+        return 1;
+    }
+    keeppart = percent / 100.f;
+    batchsz = batch;
+    K = (int)(batch * keeppart + 0.5f);
+    if(K < 1) K = 1;
+    heap = MALLOC(luckyframe, K);
+    jobframes = MALLOC(framebuf*, K);
+    savefn = save;
+    saveprefix = prefix;
+    dostack = stack;
+    workerrun = 1;
+    if(pthread_create(&worker, NULL, workerthread, NULL)){
+        WARN("pthread_create()");
+        workerrun = 0;
+        FREE(heap);
+        FREE(jobframes);
+        return 1;
+    }
+    VMESG("Lucky imaging: keep %d best of each %d frames", K, batch);
+    return 0;
+}
+
+// sum of squared differences of neighbours in row (and with next row)
+__attribute__((optimize("tree-vectorize")))
+static uint32_t gradrow(const uint8_t *restrict p, const uint8_t *restrict n, int w){
+    uint32_t s = 0;
+    for(int x = 0; x < w - 1; ++x){
+        int32_t dx = p[x+1] - p[x], dy = n[x] - p[x];
+        s += (uint32_t)(dx * dx + dy * dy);
+    }
+    return s;
+}
+
+__attribute__((optimize("tree-vectorize")))
+static uint32_t sumrow(const uint8_t *restrict p, int w){
+    uint32_t s = 0;
+    for(int x = 0; x < w; ++x) s += p[x];
+    return s;
+}
+
+/**
+ * @brief lucky_sharpness - gradient energy of ROI normalized by squared mean intensity
+ * @param fb - frame
+ * @return sharpness (greater is better)
+ */
+double lucky_sharpness(framebuf *fb){
+    int x0 = 0, y0 = 0, w = fb->w, h = fb->h;
+    if(roiw){ // crop ROI by frame
+        x0 = (roix < w - 2) ? roix : w - 2;
+        y0 = (roiy < h - 2) ? roiy : h - 2;
+        w = (x0 + roiw <= w) ? roiw : w - x0;
+        h = (y0 + roih <= h) ? roih : h - y0;
+    }
+    uint64_t grad = 0, sum = 0;
+    for(int y = y0; y < y0 + h - 1; ++y){
+        const uint8_t *p = &fb->data[y * fb->stride + x0];
+        grad += gradrow(p, p + fb->stride, w);
+        sum += sumrow(p, w);
+    }
+    double npix = (double)(w - 1) * (h - 1), mean = (double)sum / ((double)w * (h - 1));
+    return (double)grad / npix / (mean * mean + 1.);
+}
+
+static void siftdown(int i){
+    while(1){
+        int l = 2*i + 1, r = l + 1, m = i;
+        if(l < nheap && heap[l].sharpness < heap[m].sharpness) m = l;
+        if(r < nheap && heap[r].sharpness < heap[m].sharpness) m = r;
+        if(m == i) return;
+        luckyframe t = heap[i]; heap[i] = heap[m]; heap[m] = t;
+        i = m;
+    }
+}
+
+static void siftup(int i){
+    while(i){
+        int p = (i - 1) / 2;
+        if(heap[p].sharpness <= heap[i].sharpness) return;
+        luckyframe t = heap[i]; heap[i] = heap[p]; heap[p] = t;
+        i = p;
+    }
+}
+
+/**
+ * @brief lucky_add - calculate sharpness of frame & keep it if it's among best of batch
+ *          (frame is kept by reference without copying)
+ * @param fb - frame
+ */
+void lucky_add(framebuf *fb){
+    if(!heap || !fb) return;
+    if(!reserved){ // K frames are held by heap & K by worker: pool should keep their buffers (plus replaced one)
+        framebuf_reserve(fb->size, 2 * K + 1);
+        reserved = 1;
+    }
+    double t0 = dtime();
+    double s = lucky_sharpness(fb);
+    metrictime += dtime() - t0;
+    ++ntotal;
+    VDBG("Lucky: frame %llu sharpness %g", (unsigned long long)fb->info.index, s);
+    if(nheap < K){
+        framebuf_ref(fb);
+        heap[nheap] = (luckyframe){.sharpness = s, .fb = fb};
+        siftup(nheap++);
+    }else if(s > heap[0].sharpness){
+        framebuf_unref(heap[0].fb);
+        framebuf_ref(fb);
+        heap[0] = (luckyframe){.sharpness = s, .fb = fb};
+        siftdown(0);
+    }
+    if(++nbatch >= batchsz) lucky_flush();
+}
+
+static int cmpsharp(const void *a, const void *b){ // descending
+    double sa = ((const luckyframe*)a)->sharpness, sb = ((const luckyframe*)b)->sharpness;
+    return (sa < sb) - (sa > sb);
+}
+
+static int cmpindex(const void *a, const void *b){
+    uint64_t ia = ((const luckyframe*)a)->fb->info.index, ib = ((const luckyframe*)b)->fb->info.index;
+    return (ia > ib) - (ia < ib);
+}
+
+// save/stack selected frames of current batch & start new batch
+void lucky_flush(){
+    if(!heap || !nheap) return;
+    int n = nheap;
+    if(nbatch < batchsz){ // incomplete batch: keep the same part of frames
+        n = (int)(nbatch * keeppart + 0.5f);
+        if(n < 1) n = 1;
+    }
+    qsort(heap, nheap, sizeof(luckyframe), cmpsharp);
+    VMESG("Lucky: %d of %d frames selected, sharpness %g..%g", n, nbatch, heap[n-1].sharpness, heap[0].sharpness);
+    if(!dostack) qsort(heap, n, sizeof(luckyframe), cmpindex); // save in order of grabbing
+    pthread_mutex_lock(&wmutex);
+    if(njob){
+        VDBG("Lucky: wait for previous batch");
+        while(njob) pthread_cond_wait(&wcond, &wmutex);
+    }
+    for(int i = 0; i < n; ++i) jobframes[i] = heap[i].fb; // worker takes references of selected frames
+    njob = n;
+    pthread_cond_signal(&wcond);
+    pthread_mutex_unlock(&wmutex);
+    nselected += n;
+    for(int i = n; i < nheap; ++i) framebuf_unref(heap[i].fb);
+    nheap = 0;
+    nbatch = 0;
+}
+
+// process last batch, show statistics & free buffers
+void lucky_stop(){
+    if(!heap) return;
+    lucky_flush();
+    pthread_mutex_lock(&wmutex); // worker finishes the last batch
+    workerrun = 0;
+    pthread_cond_signal(&wcond);
+    pthread_mutex_unlock(&wmutex);
+    pthread_join(worker, NULL);
+    if(ntotal) VMESG("Lucky imaging: %llu of %llu frames selected, sharpness %.2fms per frame",
+                     (unsigned long long)nselected, (unsigned long long)ntotal, metrictime * 1000. / ntotal);
+    FREE(heap);
+    FREE(jobframes);
+}
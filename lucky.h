@@ -0,0 +1,37 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef LUCKY__
+#define LUCKY__
+
+#include "framepool.h"
+
+// default amount of frames in batch if amount of images isn't set
+#define LUCKY_BATCH     (100)
+
+// function to save selected frame
+typedef void (*luckysave)(framebuf *fb, char *prefix);
+
+int  lucky_init(float percent, int batch, const char *roi, luckysave save, char *prefix, int stack);
+double lucky_sharpness(framebuf *fb);
+void lucky_add(framebuf *fb);
+void lucky_flush();
+void lucky_stop();
+
+#endif // LUCKY__
@@ -0,0 +1,245 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <linux/limits.h> // PATH_MAX
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "metrics.h"
+
+// amount of connections waiting for accept
+#define METRICS_BACKLOG     (4)
+// timeout of request reading (s)
+#define METRICS_TIMEOUT     (1)
+// max size of request
+#define METRICS_REQSZ       (1024)
+
+static const struct{
+    const char *name, *help;
+} counters[MC_AMOUNT] = {
+    [MC_FRAMES] = {"grasshopper_frames_total", "Grabbed frames"},
+    [MC_GRABERRORS] = {"grasshopper_grab_errors_total", "Errors of frame grabbing"},
+    [MC_DROPPED] = {"grasshopper_frames_dropped_total", "Frames lost by camera or driver (by embedded frame counter)"},
+    [MC_FILES] = {"grasshopper_files_written_total", "Written files"},
+    [MC_FILEERRORS] = {"grasshopper_files_failed_total", "Files failed to write"},
+    [MC_FILEBYTES] = {"grasshopper_file_bytes_total", "Size of written files (bytes)"},
+    [MC_QUEUEWAITS] = {"grasshopper_writer_queue_waits_total", "Times grabbing waited for full writers queue"},
+    [MC_STREAMDROPS] = {"grasshopper_stream_dropped_total", "Frames dropped for slow server subscribers"},
+    [MC_TRIGGERS] = {"grasshopper_trigger_events_total", "Pre-trigger events"},
+}, gauges[MG_AMOUNT] = {
+    [MG_EXPTIME] = {"grasshopper_exposure_seconds", "Exposition time"},
+    [MG_GAIN] = {"grasshopper_gain_db", "Gain"},
+    [MG_TEMPERATURE] = {"grasshopper_camera_temperature", "Camera temperature (absolute value of property)"},
+    [MG_QUEUE] = {"grasshopper_writer_queue_length", "Files waiting in writers queue"},
+    [MG_RETAINED] = {"grasshopper_retained_bytes", "Size of sequence files kept by retention"},
+}, histos[MH_AMOUNT] = {
+    [MH_INTERVAL] = {"grasshopper_frame_interval_seconds", "Interval between grabbed frames"},
+    [MH_PROCESS] = {"grasshopper_frame_processing_seconds", "Conversion & calibration of frame"},
+    [MH_WRITE] = {"grasshopper_file_write_seconds", "Encoding & writing of file"},
+};
+
+// upper bounds of histogram buckets (s), the last one is +Inf
+static const double bounds[] = {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1., 2.5, 5.};
+#define NBUCKETS    (sizeof(bounds) / sizeof(bounds[0]) + 1)
+
+typedef struct{
+    uint64_t buckets[NBUCKETS]; // non-cumulative
+    uint64_t sumns;             // sum of values (ns)
+} histogram;
+
+static uint64_t cvals[MC_AMOUNT];
+static uint64_t gvals[MG_AMOUNT];   // bits of doubles
+static histogram hvals[MH_AMOUNT];
+
+static int listenfd = -1;
+static char *unixpath = NULL;
+static pthread_t thread;
+static char outdir[PATH_MAX] = ".";  // directory for disk usage
+static double tstart = 0.;
+
+void metrics_inc(mcounter c, uint64_t n){
+    if(c < MC_AMOUNT) __atomic_add_fetch(&cvals[c], n, __ATOMIC_RELAXED);
+}
+
+void metrics_set(mgauge g, double val){
+    if(g >= MG_AMOUNT) return;
+    uint64_t bits;
+    memcpy(&bits, &val, sizeof(bits));
+    __atomic_store_n(&gvals[g], bits, __ATOMIC_RELAXED);
+}
+
+void metrics_observe(mhisto h, double val){
+    if(h >= MH_AMOUNT || !(val >= 0.)) return;
+    size_t b = 0;
+    while(b < NBUCKETS - 1 && val > bounds[b]) ++b;
+    __atomic_add_fetch(&hvals[h].buckets[b], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hvals[h].sumns, (uint64_t)(val * 1e9), __ATOMIC_RELAXED);
+}
+
+static double gauge(mgauge g){
+    uint64_t bits = __atomic_load_n(&gvals[g], __ATOMIC_RELAXED);
+    double val;
+    memcpy(&val, &bits, sizeof(val));
+    return val;
+}
+
+// print all metrics in Prometheus text format
+static void printmetrics(FILE *f){
+    for(int i = 0; i < MC_AMOUNT; ++i)
+        fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counters[i].name, counters[i].help,
+                counters[i].name, counters[i].name, (unsigned long long)__atomic_load_n(&cvals[i], __ATOMIC_RELAXED));
+    for(int i = 0; i < MG_AMOUNT; ++i){
+        double v = gauge(i);
+        if(isnan(v)) continue;
+        fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n%s %.9g\n", gauges[i].name, gauges[i].help,
+                gauges[i].name, gauges[i].name, v);
+    }
+    for(int i = 0; i < MH_AMOUNT; ++i){
+        const char *n = histos[i].name;
+        fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", n, histos[i].help, n);
+        uint64_t cum = 0;
+        for(size_t b = 0; b < NBUCKETS; ++b){
+            cum += __atomic_load_n(&hvals[i].buckets[b], __ATOMIC_RELAXED);
+            if(b < NBUCKETS - 1) fprintf(f, "%s_bucket{le=\"%g\"} %llu\n", n, bounds[b], (unsigned long long)cum);
+            else fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n", n, (unsigned long long)cum);
+        }
+        fprintf(f, "%s_sum %.9f\n%s_count %llu\n", n,
+                __atomic_load_n(&hvals[i].sumns, __ATOMIC_RELAXED) * 1e-9, n, (unsigned long long)cum);
+    }
+    struct statvfs st;
+    if(!statvfs(outdir, &st)){
+        fprintf(f, "# HELP grasshopper_disk_free_bytes Free space on output filesystem\n"
+                   "# TYPE grasshopper_disk_free_bytes gauge\ngrasshopper_disk_free_bytes %.0f\n",
+                (double)st.f_bavail * st.f_frsize);
+        fprintf(f, "# HELP grasshopper_disk_size_bytes Size of output filesystem\n"
+                   "# TYPE grasshopper_disk_size_bytes gauge\ngrasshopper_disk_size_bytes %.0f\n",
+                (double)st.f_blocks * st.f_frsize);
+    }
+    fprintf(f, "# HELP grasshopper_start_time_seconds Start time (UNIX time)\n"
+               "# TYPE grasshopper_start_time_seconds gauge\ngrasshopper_start_time_seconds %.3f\n", tstart);
+}
+
+// answer to one HTTP request
+static void serve(int fd){
+    struct timeval tv = {.tv_sec = METRICS_TIMEOUT};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    char req[METRICS_REQSZ];
+    size_t l = 0;
+    while(l < METRICS_REQSZ - 1){ // read headers
+        ssize_t n = recv(fd, req + l, METRICS_REQSZ - 1 - l, 0);
+        if(n <= 0) break;
+        l += (size_t)n;
+        req[l] = 0;
+        if(strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
+    }
+    req[l] = 0;
+    char *body = NULL, *answer = NULL;
+    size_t bodysz = 0, answersz = 0;
+    FILE *f = open_memstream(&body, &bodysz);
+    if(!f) return;
+    int ok = (strncmp(req, "GET /metrics", 12) == 0 || strncmp(req, "GET / ", 6) == 0);
+    if(ok) printmetrics(f);
+    else fprintf(f, "Not found\n");
+    fclose(f);
+    f = open_memstream(&answer, &answersz);
+    if(f){
+        fprintf(f, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+                   "Connection: close\r\n\r\n", ok ? "200 OK" : "404 Not Found", bodysz);
+        fwrite(body, 1, bodysz, f);
+        fclose(f);
+        for(size_t off = 0; off < answersz;){
+            ssize_t n = send(fd, answer + off, answersz - off, MSG_NOSIGNAL);
+            if(n <= 0) break;
+            off += (size_t)n;
+        }
+        free(answer);
+    }
+    free(body);
+}
+
+static void *listener(_U_ void *data){
+    while(1){
+        int fd = accept(listenfd, NULL, NULL);
+        if(fd < 0){
+            if(errno == EINTR) continue;
+            break;
+        }
+        serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/**
+ * @brief metrics_start - run metrics server
+ * @param path      - TCP port (localhost) or path to UNIX socket
+ * @param outprefix - prefix of output files (to show usage of its filesystem) or NULL
+ * @return 0 if all OK
+ */
+int metrics_start(const char *path, const char *outprefix){
+    if(listenfd >= 0) return 0;
+    for(int i = 0; i < MG_AMOUNT; ++i) metrics_set(i, NAN);
+    if(outprefix){
+        const char *slash = strrchr(outprefix, '/');
+        if(slash == outprefix) strcpy(outdir, "/");
+        else if(slash) snprintf(outdir, PATH_MAX, "%.*s", (int)(slash - outprefix), outprefix);
+    }
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    tstart = tv.tv_sec + tv.tv_usec * 1e-6;
+    if((listenfd = openlistener(path, METRICS_BACKLOG, &unixpath)) < 0) return 1;
+    if(pthread_create(&thread, NULL, listener, NULL)){
+        WARN("pthread_create()");
+        close(listenfd);
+        listenfd = -1;
+        if(unixpath){
+            unlink(unixpath);
+            FREE(unixpath);
+        }
+        return 1;
+    }
+    VMESG("Metrics are served on %s", path);
+    return 0;
+}
+
+int metrics_running(){
+    return listenfd >= 0;
+}
+
+void metrics_stop(){
+    if(listenfd < 0) return;
+    shutdown(listenfd, SHUT_RDWR);
+    pthread_join(thread, NULL);
+    close(listenfd);
+    listenfd = -1;
+    if(unixpath){
+        unlink(unixpath);
+        FREE(unixpath);
+    }
+}
@@ -0,0 +1,69 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Counters, gauges & histograms of pipeline: they are updated by atomic operations (never block) and served
+ * in Prometheus text format by own thread over HTTP on local TCP port or UNIX socket.
+ */
+
+#pragma once
+#ifndef METRICS__
+#define METRICS__
+
+#include <stdint.h>
+
+typedef enum{
+    MC_FRAMES,          // grabbed frames
+    MC_GRABERRORS,      // errors of grabbing
+    MC_DROPPED,         // frames lost by camera or driver (gaps of embedded frame counter)
+    MC_FILES,           // written files
+    MC_FILEERRORS,      // failed files
+    MC_FILEBYTES,       // size of written files
+    MC_QUEUEWAITS,      // grabbing waited for file writers
+    MC_STREAMDROPS,     // frames dropped for slow subscribers of server
+    MC_TRIGGERS,        // pre-trigger events
+    MC_AMOUNT
+} mcounter;
+
+typedef enum{
+    MG_EXPTIME,         // exposition time (s)
+    MG_GAIN,            // gain (dB)
+    MG_TEMPERATURE,     // camera temperature
+    MG_QUEUE,           // files in writers queue
+    MG_RETAINED,        // size of sequence files kept by retention
+    MG_AMOUNT
+} mgauge;
+
+typedef enum{
+    MH_INTERVAL,        // interval between frames (s)
+    MH_PROCESS,         // conversion & calibration of frame (s)
+    MH_WRITE,           // encoding & writing of file (s)
+    MH_AMOUNT
+} mhisto;
+
+// period of camera temperature reading (s)
+#define METRICS_TEMPPERIOD  (10.)
+
+void metrics_inc(mcounter c, uint64_t n);
+void metrics_set(mgauge g, double val);
+void metrics_observe(mhisto h, double val);
+int  metrics_start(const char *path, const char *outprefix);
+int  metrics_running();
+void metrics_stop();
+
+#endif // METRICS__
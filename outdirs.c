@@ -0,0 +1,277 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "filewriter.h"
+#include "outdirs.h"
+
+typedef enum{
+    SHARD_NONE,
+    SHARD_HOUR,     // subdirectory per hour (UTC) of frame time
+    SHARD_FRAMES    // subdirectory per `shardframes` frames
+} shardtype;
+
+// next number of frames with given prefix
+typedef struct prefixnum{
+    char *prefix;
+    long long next;
+    struct prefixnum *nextp;
+} prefixnum;
+
+static char *roots[OUTDIRS_MAX];
+static char *lastdir[OUTDIRS_MAX];  // last directory created in root
+static int nroots = 0;              // 0 - files are placed by prefix only
+static int leastloaded = 0;         // choose root by length of writers queue instead of round-robin
+static int rrnext = 0;
+static shardtype shard = SHARD_NONE;
+static long long shardframes = 0;
+static prefixnum *numbers = NULL;
+
+/**
+ * @brief outdirs_init - set output roots & sharding
+ * @param rootlist - comma-separated list of existing directories (NULL - use prefix only)
+ * @param policy   - choice of root: "rr" (round-robin) or "least" (the shortest writers queue)
+ * @param shardby  - "none", "hour" or amount of frames per directory
+ * @return 0 if all OK
+ */
+int outdirs_init(const char *rootlist, const char *policy, const char *shardby){
+    for(int i = 0; i < nroots; ++i){
+        FREE(roots[i]);
+        FREE(lastdir[i]);
+    }
+    nroots = rrnext = 0;
+    if(!policy || !*policy || strcasecmp(policy, "rr") == 0) leastloaded = 0;
+    else if(strcasecmp(policy, "least") == 0) leastloaded = 1;
+    else{
+        WARNX("Wrong root policy: %s, should be \"rr\" or \"least\"", policy);
+        return 1;
+    }
+    if(!shardby || !*shardby || strcasecmp(shardby, "none") == 0) shard = SHARD_NONE;
+    else if(strcasecmp(shardby, "hour") == 0) shard = SHARD_HOUR;
+    else{
+        char *eptr;
+        shardframes = strtoll(shardby, &eptr, 10);
+        if(*eptr || shardframes < 1){
+            WARNX("Wrong sharding: %s, should be \"none\", \"hour\" or amount of frames", shardby);
+            return 1;
+        }
+        shard = SHARD_FRAMES;
+    }
+    if(rootlist && *rootlist){
+        char *list = strdup(rootlist), *saveptr = NULL;
+        for(char *r = strtok_r(list, ",", &saveptr); r; r = strtok_r(NULL, ",", &saveptr)){
+            struct stat st;
+            if(nroots == OUTDIRS_MAX){
+                WARNX("Too many roots, max %d", OUTDIRS_MAX);
+                break;
+            }
+            if(stat(r, &st) || !S_ISDIR(st.st_mode)){
+                WARNX("%s isn't a directory", r);
+                FREE(list);
+                return 1;
+            }
+            size_t l = strlen(r);
+            while(l > 1 && r[l-1] == '/') r[--l] = 0;
+            roots[nroots++] = strdup(r);
+        }
+        FREE(list);
+    }else if(shard != SHARD_NONE) roots[nroots++] = strdup(""); // sharding by prefix directory
+    if(nroots) VMESG("Output: %d root[s] (%s), sharding %s", nroots, leastloaded ? "least loaded" : "round-robin",
+                     shard == SHARD_NONE ? "off" : (shard == SHARD_HOUR ? "by hour" : shardby));
+    return 0;
+}
+
+// amount of output roots (queues of writers)
+int outdirs_amount(){
+    return nroots ? nroots : 1;
+}
+
+// path of root `n` (NULL if there's no roots)
+const char *outdirs_root(int n){
+    if(n < 0 || n >= nroots || !*roots[n]) return NULL;
+    return roots[n];
+}
+
+// directory & name parts of prefix
+static void splitprefix(const char *prefix, char *dir, const char **base){
+    const char *slash = strrchr(prefix, '/');
+    if(!slash){
+        *dir = 0;
+        *base = prefix;
+        return;
+    }
+    snprintf(dir, PATH_MAX, "%.*s", (int)(slash - prefix), prefix);
+    *base = slash + 1;
+}
+
+// join `root` & `sub` into `out`, return 1 if path is too long
+static int joinpath(char *out, const char *root, const char *sub){
+    int l;
+    if(!*root) l = snprintf(out, PATH_MAX, "%s", *sub ? sub : ".");
+    else if(!*sub) l = snprintf(out, PATH_MAX, "%s", root);
+    else l = snprintf(out, PATH_MAX, "%s/%s", root, (*sub == '/') ? sub + 1 : sub);
+    return (l < 0 || l >= PATH_MAX);
+}
+
+// max number of files "base_NNNN.*" in directory `path` (and in its subdirectories if `depth` > 0)
+static long long scanmax(const char *path, const char *base, int depth){
+    DIR *d = opendir(path);
+    if(!d) return 0;
+    size_t bl = strlen(base);
+    long long max = 0;
+    struct dirent *de;
+    while((de = readdir(d))){
+        if(de->d_name[0] == '.') continue;
+        if(strncmp(de->d_name, base, bl) == 0 && de->d_name[bl] == '_'){
+            char *eptr;
+            long long n = strtoll(de->d_name + bl + 1, &eptr, 10);
+            if(eptr != de->d_name + bl + 1 && *eptr == '.' && n > max) max = n;
+        }else if(depth > 0 && (de->d_type == DT_DIR || de->d_type == DT_UNKNOWN)){
+            char sub[PATH_MAX];
+            if(snprintf(sub, PATH_MAX, "%s/%s", path, de->d_name) >= PATH_MAX) continue;
+            long long n = scanmax(sub, base, depth - 1);
+            if(n > max) max = n;
+        }
+    }
+    closedir(d);
+    return max;
+}
+
+// get next number for `prefix` (existing files are checked once)
+static long long nextnumber(const char *prefix){
+    prefixnum *p = numbers;
+    while(p && strcmp(p->prefix, prefix)) p = p->nextp;
+    if(!p){
+        char dir[PATH_MAX], path[PATH_MAX];
+        const char *base;
+        splitprefix(prefix, dir, &base);
+        long long max = 0;
+        for(int r = 0; r < nroots; ++r){
+            if(joinpath(path, roots[r], dir)) continue;
+            long long n = scanmax(path, base, shard != SHARD_NONE);
+            if(n > max) max = n;
+        }
+        p = MALLOC(prefixnum, 1);
+        p->prefix = strdup(prefix);
+        p->next = max + 1;
+        p->nextp = numbers;
+        numbers = p;
+        if(max) VMESG("Output: files %s_* exist, continue from %lld", prefix, p->next);
+    }
+    return p->next++;
+}
+
+// create directory with parents
+static int mkpath(const char *path){
+    char tmp[PATH_MAX];
+    snprintf(tmp, PATH_MAX, "%s", path);
+    for(char *p = tmp + 1; *p; ++p){
+        if(*p != '/') continue;
+        *p = 0;
+        if(mkdir(tmp, 0755) && errno != EEXIST) return 1;
+        *p = '/';
+    }
+    if(mkdir(tmp, 0755) && errno != EEXIST) return 1;
+    return 0;
+}
+
+static int chooseroot(){
+    int r = rrnext;
+    rrnext = (rrnext + 1) % nroots;
+    if(!leastloaded) return r;
+    int best = r, bestlen = filewriter_queuelen(r);
+    for(int i = 1; i < nroots && bestlen; ++i){
+        int n = (r + i) % nroots, l = filewriter_queuelen(n);
+        if(l < bestlen){
+            best = n;
+            bestlen = l;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief outdirs_next - choose place of next frame files (create directory if needed) NOT THREAD-SAFE!
+ * @param prefix - prefix of file names
+ * @param fb     - frame (its time is used for sharding by hour)
+ * @param slot   - (o) place of files
+ * @return 0 if all OK
+ */
+int outdirs_next(char *prefix, framebuf *fb, outslot *slot){
+    slot->prefix = prefix;
+    slot->root = 0;
+    slot->num = -1;
+    if(!nroots) return 0;
+    slot->root = chooseroot();
+    slot->num = nextnumber(prefix);
+    char dir[PATH_MAX], sub[PATH_MAX];
+    const char *base;
+    splitprefix(prefix, dir, &base);
+    int l = -1;
+    if(!joinpath(sub, roots[slot->root], dir)){
+        if(shard == SHARD_HOUR){
+            double t = isnan(fb->info.obstime) ? fb->info.timestamp : fb->info.obstime;
+            time_t sec = (t > 0.) ? (time_t)t : time(NULL);
+            struct tm tm;
+            char hour[32];
+            strftime(hour, 32, "%Y%m%d_%H", gmtime_r(&sec, &tm));
+            l = snprintf(slot->dir, PATH_MAX, "%s/%s", sub, hour);
+        }else if(shard == SHARD_FRAMES)
+            l = snprintf(slot->dir, PATH_MAX, "%s/%06lld", sub, (slot->num - 1) / shardframes);
+        else l = snprintf(slot->dir, PATH_MAX, "%s", sub);
+    }
+    if(l < 0 || l >= PATH_MAX){
+        WARNX("Too long output path for %s in %s", prefix, roots[slot->root]);
+        return 1;
+    }
+    char **last = &lastdir[slot->root];
+    if(*last && strcmp(*last, slot->dir) == 0) return 0;
+    if(mkpath(slot->dir)){
+        WARN("Can't create directory %s", slot->dir);
+        return 1;
+    }
+    FREE(*last);
+    *last = strdup(slot->dir);
+    return 0;
+}
+
+/**
+ * @brief outdirs_name - file name of frame placed by outdirs_next() NOT THREAD-SAFE!
+ * @param slot - place of files
+ * @param suff - file name suffix
+ * @return NULL or file name (don't free() it!)
+ */
+char *outdirs_name(outslot *slot, char *suff){
+    static char buff[PATH_MAX];
+    if(slot->num < 0) return check_filename(slot->prefix, suff);
+    const char *base = strrchr(slot->prefix, '/');
+    base = base ? base + 1 : slot->prefix;
+    if(snprintf(buff, PATH_MAX, "%s/%s_%06lld.%s", slot->dir, base, slot->num, suff) >= PATH_MAX) return NULL;
+    return buff;
+}
@@ -0,0 +1,51 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Output roots & directory sharding: frames are spread over several roots (disks) by round-robin or
+ * to root with the shortest writers queue, and files of each root are placed into subdirectories
+ * by hour or by amount of frames:
+ *      root/[dir of prefix/][shard/]name_NNNNNN.suffix
+ * Without roots & sharding files are named by check_filename() as before.
+ */
+
+#pragma once
+#ifndef OUTDIRS__
+#define OUTDIRS__
+
+#include <linux/limits.h> // PATH_MAX
+#include "framepool.h"
+
+// max amount of output roots
+#define OUTDIRS_MAX     (16)
+
+// place of frame files
+typedef struct{
+    int root;               // number of root (== number of writers queue)
+    long long num;          // number of frame (-1 if names are given by check_filename())
+    char dir[PATH_MAX];     // directory of files
+    char *prefix;           // prefix of names
+} outslot;
+
+int  outdirs_init(const char *roots, const char *policy, const char *shard);
+int  outdirs_amount();
+const char *outdirs_root(int n);
+int  outdirs_next(char *prefix, framebuf *fb, outslot *slot);
+char *outdirs_name(outslot *slot, char *suff);
+
+#endif // OUTDIRS__
@@ -0,0 +1,191 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/sysinfo.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "parallel.h"
+
+static pthread_t *workers = NULL;
+static int nworkers = 0;            // amount of pool threads (caller is one more participant)
+static int nactive = 1;             // amount of threads used by jobs (including caller)
+static pthread_mutex_t jobmutex = PTHREAD_MUTEX_INITIALIZER; // only one job at a time
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t startcond = PTHREAD_COND_INITIALIZER, donecond = PTHREAD_COND_INITIALIZER;
+static uint64_t generation = 0;     // number of current job
+static int stopping = 0;
+
+// current job
+static struct{
+    bandfn fn;
+    void *arg;
+    int y0, y1, grain;  // rows & band size
+    int nbands;
+    int next;           // next band to process
+    int pending;        // bands not done yet
+    int running;        // pool threads in runbands() (job is changed only when it's zero)
+} job;
+
+// per-thread scratch buffer
+static __thread void *scratch = NULL;
+static __thread size_t scratchsz = 0;
+
+// process bands of current job until they end
+static void runbands(){
+    int b;
+    while((b = __atomic_fetch_add(&job.next, 1, __ATOMIC_ACQ_REL)) < job.nbands){
+        int y0 = job.y0 + b * job.grain, y1 = y0 + job.grain;
+        if(y1 > job.y1) y1 = job.y1;
+        job.fn(job.arg, y0, y1);
+        if(__atomic_sub_fetch(&job.pending, 1, __ATOMIC_ACQ_REL) == 0){
+            pthread_mutex_lock(&mutex);
+            pthread_cond_broadcast(&donecond);
+            pthread_mutex_unlock(&mutex);
+        }
+    }
+}
+
+static void *worker(void *data){
+    int idx = (int)(intptr_t)data; // caller is participant 0, so this is participant idx+1
+    uint64_t seen = 0;
+    pthread_mutex_lock(&mutex);
+    while(1){
+        while(generation == seen && !stopping) pthread_cond_wait(&startcond, &mutex);
+        if(stopping) break;
+        seen = generation;
+        if(idx + 1 >= nactive) continue; // not used by this job
+        ++job.running;
+        pthread_mutex_unlock(&mutex);
+        runbands();
+        pthread_mutex_lock(&mutex);
+        if(--job.running == 0) pthread_cond_broadcast(&donecond);
+    }
+    pthread_mutex_unlock(&mutex);
+    FREE(scratch);
+    return NULL;
+}
+
+/**
+ * @brief parallel_init - run thread pool
+ * @param nthreads - total amount of threads (including callers), <= 0 - by amount of CPUs
+ * @return 0 if all OK
+ */
+int parallel_init(int nthreads){
+    if(workers) return 0;
+    if(nthreads <= 0) nthreads = get_nprocs();
+    if(nthreads < 2){
+        VMESG("Parallel kernels are off: one thread");
+        return 0;
+    }
+    workers = MALLOC(pthread_t, nthreads - 1);
+    stopping = 0;
+    for(int i = 0; i < nthreads - 1; ++i){
+        if(pthread_create(&workers[i], NULL, worker, (void*)(intptr_t)i)){
+            WARN("pthread_create()");
+            break;
+        }
+        ++nworkers;
+    }
+    nactive = nworkers + 1;
+    VMESG("Thread pool: %d thread[s]", nactive);
+    return 0;
+}
+
+// amount of threads used by parallel_for()
+int parallel_threads(){
+    return nactive;
+}
+
+// change amount of threads used by parallel_for() (for benchmarking)
+void parallel_setthreads(int n){
+    if(n < 1) n = 1;
+    if(n > nworkers + 1) n = nworkers + 1;
+    pthread_mutex_lock(&jobmutex);
+    nactive = n;
+    pthread_mutex_unlock(&jobmutex);
+}
+
+/**
+ * @brief parallel_for - run `fn` for rows [y0, y1) split into bands by pool threads & caller
+ * @param y0, y1   - range of rows
+ * @param rowbytes - size of data processed per row (to calculate band size)
+ * @param fn       - kernel
+ * @param arg      - its argument
+ */
+void parallel_for(int y0, int y1, size_t rowbytes, bandfn fn, void *arg){
+    if(y1 <= y0) return;
+    int grain = (rowbytes && rowbytes < PARALLEL_BANDSIZE) ? (int)(PARALLEL_BANDSIZE / rowbytes) : 1;
+    int nbands = (y1 - y0 + grain - 1) / grain;
+    if(nbands < 2 || nactive < 2 || pthread_mutex_trylock(&jobmutex)){ // run in this thread
+        fn(arg, y0, y1);
+        return;
+    }
+    if(nbands < nactive){ // small job: make one band per thread
+        grain = (y1 - y0 + nactive - 1) / nactive;
+        nbands = (y1 - y0 + grain - 1) / grain;
+    }
+    pthread_mutex_lock(&mutex);
+    // worker woken up late could still run through bands of previous job: don't change job under it
+    while(job.running) pthread_cond_wait(&donecond, &mutex);
+    job.fn = fn;
+    job.arg = arg;
+    job.y0 = y0;
+    job.y1 = y1;
+    job.grain = grain;
+    job.nbands = nbands;
+    job.next = 0;
+    job.pending = nbands;
+    ++generation;
+    pthread_cond_broadcast(&startcond);
+    pthread_mutex_unlock(&mutex);
+    runbands();
+    pthread_mutex_lock(&mutex);
+    while(__atomic_load_n(&job.pending, __ATOMIC_ACQUIRE) || job.running) pthread_cond_wait(&donecond, &mutex);
+    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&jobmutex);
+}
+
+/**
+ * @brief parallel_scratch - get scratch buffer of calling thread (it is reused by next calls)
+ * @param size - minimal size
+ * @return buffer
+ */
+void *parallel_scratch(size_t size){
+    if(scratchsz < size){
+        FREE(scratch);
+        scratch = MALLOC(uint8_t, size);
+        scratchsz = size;
+    }
+    return scratch;
+}
+
+// stop pool threads
+void parallel_stop(){
+    if(!workers) return;
+    pthread_mutex_lock(&mutex);
+    stopping = 1;
+    pthread_cond_broadcast(&startcond);
+    pthread_mutex_unlock(&mutex);
+    for(int i = 0; i < nworkers; ++i) pthread_join(workers[i], NULL);
+    FREE(workers);
+    nworkers = 0;
+    nactive = 1;
+}
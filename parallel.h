@@ -0,0 +1,44 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Persistent thread pool for per-frame kernels: parallel_for() splits rows into bands of about
+ * PARALLEL_BANDSIZE bytes which are taken by pool threads & caller. Only one job runs at a time:
+ * if pool is busy (or isn't started) the kernel is executed in calling thread.
+ */
+
+#pragma once
+#ifndef PARALLEL__
+#define PARALLEL__
+
+#include <stddef.h>
+
+// size of band of rows (bytes): it should fit into L2 cache
+#define PARALLEL_BANDSIZE   (64*1024)
+
+// kernel processing rows [y0, y1)
+typedef void (*bandfn)(void *arg, int y0, int y1);
+
+int  parallel_init(int nthreads);
+int  parallel_threads();
+void parallel_setthreads(int n);
+void parallel_for(int y0, int y1, size_t rowbytes, bandfn fn, void *arg);
+void *parallel_scratch(size_t size);
+void parallel_stop();
+
+#endif // PARALLEL__
@@ -0,0 +1,232 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <usefull_macros.h>
+#include <zlib.h>
+
+#include "cmdlnopts.h"
+#include "durable.h"
+#include "pngwriter.h"
+
+// size of IDAT chunks
+#define IDATSZ      (256*1024)
+
+// encoder state: each thread has its own, deflate state is reset instead of reallocation
+typedef struct{
+    z_stream z;
+    int inited;         // ==1 if z is initialized
+    int level;          // its compression level
+    uint8_t *rows;      // current & previous rows (in PNG byte order)
+    uint8_t *filtered;  // filter type + filtered row
+    size_t rowsz;       // size of row in bytes
+    uint8_t out[IDATSZ];// IDAT data
+} pngenc;
+
+static __thread pngenc *enc = NULL;
+
+static const char *filternames[] = {
+    [PNGFILTER_NONE] = "none",
+    [PNGFILTER_SUB] = "sub",
+    [PNGFILTER_UP] = "up",
+    [PNGFILTER_AVG] = "avg",
+    [PNGFILTER_PAETH] = "paeth",
+};
+
+// return filter type by its name or -1
+int pngfilter_byname(const char *name){
+    if(!name) return PNGFILTER_UP;
+    for(int i = 0; i <= PNGFILTER_PAETH; ++i)
+        if(strcasecmp(name, filternames[i]) == 0) return i;
+    return -1;
+}
+
+static void put32(uint8_t *buf, uint32_t val){
+    buf[0] = val >> 24; buf[1] = val >> 16; buf[2] = val >> 8; buf[3] = val;
+}
+
+static int writechunk(FILE *f, const char *type, const uint8_t *data, uint32_t len){
+    uint8_t hdr[8];
+    put32(hdr, len);
+    memcpy(hdr + 4, type, 4);
+    uLong crc = crc32(0L, hdr + 4, 4);
+    if(len) crc = crc32(crc, data, len);
+    uint8_t tail[4];
+    put32(tail, (uint32_t)crc);
+    if(fwrite(hdr, 8, 1, f) != 1) return 1;
+    if(len && fwrite(data, len, 1, f) != 1) return 1;
+    if(fwrite(tail, 4, 1, f) != 1) return 1;
+    return 0;
+}
+
+static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c){
+    int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if(pa <= pb && pa <= pc) return a;
+    if(pb <= pc) return b;
+    return c;
+}
+
+/**
+ * @brief filterrow - make filtered row
+ * @param out  - output (first byte is filter type)
+ * @param cur  - current row
+ * @param prev - previous row (NULL for first)
+ * @param len  - row length (bytes)
+ * @param bpp  - bytes per pixel
+ */
+static void filterrow(uint8_t *out, const uint8_t *cur, const uint8_t *prev, size_t len, int bpp, pngfilter f){
+    if(!prev && (f == PNGFILTER_UP || f == PNGFILTER_PAETH || f == PNGFILTER_AVG)) f = PNGFILTER_SUB;
+    *out++ = (uint8_t)f;
+    size_t i;
+    switch(f){
+        case PNGFILTER_SUB:
+            for(i = 0; i < (size_t)bpp; ++i) out[i] = cur[i];
+            for(; i < len; ++i) out[i] = cur[i] - cur[i-bpp];
+        break;
+        case PNGFILTER_UP:
+            for(i = 0; i < len; ++i) out[i] = cur[i] - prev[i];
+        break;
+        case PNGFILTER_AVG:
+            for(i = 0; i < (size_t)bpp; ++i) out[i] = cur[i] - (prev[i] >> 1);
+            for(; i < len; ++i) out[i] = cur[i] - (uint8_t)((cur[i-bpp] + prev[i]) >> 1);
+        break;
+        case PNGFILTER_PAETH:
+            for(i = 0; i < (size_t)bpp; ++i) out[i] = cur[i] - prev[i];
+            for(; i < len; ++i) out[i] = cur[i] - paeth(cur[i-bpp], prev[i], prev[i-bpp]);
+        break;
+        default:
+            memcpy(out, cur, len);
+    }
+}
+
+// prepare encoder of this thread
+static int initenc(size_t rowsz, int level){
+    if(!enc) enc = MALLOC(pngenc, 1);
+    if(enc->inited && enc->level != level){
+        deflateEnd(&enc->z);
+        enc->inited = 0;
+    }
+    if(enc->inited){
+        if(Z_OK != deflateReset(&enc->z)) return 1;
+    }else{
+        memset(&enc->z, 0, sizeof(z_stream));
+        if(Z_OK != deflateInit(&enc->z, level)) return 1;
+        enc->inited = 1;
+        enc->level = level;
+    }
+    if(enc->rowsz < rowsz){
+        FREE(enc->rows);
+        FREE(enc->filtered);
+        enc->rows = MALLOC(uint8_t, 2*rowsz);
+        enc->filtered = MALLOC(uint8_t, rowsz + 1);
+        enc->rowsz = rowsz;
+    }
+    return 0;
+}
+
+// deflate current input & write full IDAT chunks
+static int deflatedata(FILE *f, int flush){
+    int r;
+    do{
+        r = deflate(&enc->z, flush);
+        if(r == Z_STREAM_ERROR) return 1;
+        if(enc->z.avail_out == 0 || (flush == Z_FINISH && enc->z.avail_out < IDATSZ)){
+            if(writechunk(f, "IDAT", enc->out, IDATSZ - enc->z.avail_out)) return 1;
+            enc->z.next_out = enc->out;
+            enc->z.avail_out = IDATSZ;
+        }
+    }while(enc->z.avail_in || (flush == Z_FINISH && r != Z_STREAM_END));
+    return 0;
+}
+
+/**
+ * @brief writepng - save grayscale image into PNG file
+ * @param filename - file name
+ * @param data     - image data (16-bit data is in host byte order)
+ * @param w, h     - image size
+ * @param stride   - size of image row (bytes)
+ * @param depth    - 8 or 16 bit
+ * @param level    - zlib compression level (0 - store)
+ * @param filter   - row filter
+ * @return 0 if all OK
+ */
+int writepng(const char *filename, const uint8_t *data, int w, int h, int stride, int depth,
+             int level, pngfilter filter){
+    if(!filename || !data || w < 1 || h < 1 || (depth != 8 && depth != 16)) return 1;
+    if(level < 0 || level > 9) level = Z_DEFAULT_COMPRESSION;
+    int bpp = depth / 8;
+    size_t rowsz = (size_t)w * bpp;
+    if(initenc(rowsz, level)) return 1;
+    // in safe write modes file is encoded in memory and then written by durable_write()
+    char *mem = NULL;
+    size_t memsz = 0;
+    int inmem = (durable_mode() != WRITE_PLAIN);
+    FILE *f = inmem ? open_memstream(&mem, &memsz) : fopen(filename, "w");
+    if(!f){
+        WARN("Can't open %s", filename);
+        return 1;
+    }
+    static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    uint8_t ihdr[13];
+    put32(ihdr, w);
+    put32(ihdr + 4, h);
+    ihdr[8] = depth;
+    ihdr[9] = 0;  // grayscale
+    ihdr[10] = 0; // deflate
+    ihdr[11] = 0; // adaptive filtering
+    ihdr[12] = 0; // no interlace
+    int ret = 1;
+    if(fwrite(signature, 8, 1, f) != 1 || writechunk(f, "IHDR", ihdr, 13)) goto done;
+    enc->z.next_out = enc->out;
+    enc->z.avail_out = IDATSZ;
+    uint8_t *prev = NULL, *cur = enc->rows;
+    for(int y = 0; y < h; ++y){
+        const uint8_t *row = data + (size_t)y * stride;
+        if(depth == 16){ // PNG needs big-endian
+            const uint16_t *r16 = (const uint16_t*) row;
+            for(int x = 0; x < w; ++x){
+                cur[2*x] = r16[x] >> 8;
+                cur[2*x+1] = r16[x] & 0xff;
+            }
+        }else memcpy(cur, row, rowsz);
+        filterrow(enc->filtered, cur, prev, rowsz, bpp, filter);
+        enc->z.next_in = enc->filtered;
+        enc->z.avail_in = rowsz + 1;
+        if(deflatedata(f, Z_NO_FLUSH)) goto done;
+        prev = cur;
+        cur = (cur == enc->rows) ? enc->rows + rowsz : enc->rows;
+    }
+    if(deflatedata(f, Z_FINISH) || writechunk(f, "IEND", NULL, 0)) goto done;
+    ret = 0;
+done:
+    if(fclose(f)) ret = 1;
+    if(inmem){
+        if(!ret) ret = durable_write(filename, (uint8_t*)mem, memsz);
+        free(mem);
+    }
+    if(ret) WARNX("Can't write %s", filename);
+    return ret;
+}
+
+// save 8-bit frame with compression parameters from command line
+int writepngfb(char *filename, framebuf *fb){
+    return writepng(filename, fb->data, fb->w, fb->h, fb->stride, 8, G.pnglevel, pngfilter_byname(G.pngfilter));
+}
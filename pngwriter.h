@@ -0,0 +1,41 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef PNGWRITER__
+#define PNGWRITER__
+
+#include <stdint.h>
+
+#include "framepool.h"
+
+// PNG row filters
+typedef enum{
+    PNGFILTER_NONE,
+    PNGFILTER_SUB,
+    PNGFILTER_UP,
+    PNGFILTER_AVG,
+    PNGFILTER_PAETH
+} pngfilter;
+
+int pngfilter_byname(const char *name);
+int writepng(const char *filename, const uint8_t *data, int w, int h, int stride, int depth,
+             int level, pngfilter filter);
+int writepngfb(char *filename, framebuf *fb);
+
+#endif // PNGWRITER__
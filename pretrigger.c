@@ -0,0 +1,224 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "metrics.h"
+#include "pretrigger.h"
+
+// step of pixels grid for frames difference
+#define DIFF_STEP       (4)
+
+static framebuf **ring = NULL;      // last frames (oldest at `head`)
+static int capacity = 0, head = 0, nring = 0;
+static double pre = 0., post = 0.;  // time before & after event
+static double memmb = 0.;           // memory for ring (MB)
+static double diffthres = 0.;       // threshold of mean difference between frames (0 - don't check)
+static framebuf *prev = NULL;       // previous frame for difference
+static double postend = 0.;         // record all frames until this time
+static int fired = 0;               // event occured
+static const char *firereason = NULL;
+static trigsave savefn = NULL;
+static char *saveprefix = NULL;
+static uint64_t ntotal = 0, nsaved = 0, nevents = 0, ndropped = 0;
+
+// frames to save: they are passed by grabbing thread to saving thread, so event doesn't stop grabbing
+static framebuf **savequeue = NULL;
+static int sqhead = 0, sqlen = 0, sqcap = 0;
+static pthread_t saver;
+static pthread_mutex_t sqmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sqcond = PTHREAD_COND_INITIALIZER;
+static int saverrun = 0, stopping = 0;
+
+static void *saverthread(_U_ void *arg){
+    while(1){
+        pthread_mutex_lock(&sqmutex);
+        while(!sqlen && !stopping) pthread_cond_wait(&sqcond, &sqmutex);
+        if(!sqlen){
+            pthread_mutex_unlock(&sqmutex);
+            break;
+        }
+        framebuf *fb = savequeue[sqhead];
+        sqhead = (sqhead + 1) % sqcap;
+        --sqlen;
+        pthread_mutex_unlock(&sqmutex);
+        savefn(fb, saveprefix);
+        framebuf_unref(fb);
+    }
+    return NULL;
+}
+
+/**
+ * @brief tosave - put frame into queue of saving thread (frame is dropped if queue is full)
+ * @param fb  - frame
+ * @param own - caller gives its reference to queue (otherwise new reference is made)
+ */
+static void tosave(framebuf *fb, int own){
+    pthread_mutex_lock(&sqmutex);
+    if(sqlen == sqcap){
+        pthread_mutex_unlock(&sqmutex);
+        if(!ndropped) WARNX("Pre-trigger: frames are saved slower than grabbed, some of them are lost");
+        ++ndropped;
+        if(own) framebuf_unref(fb);
+        return;
+    }
+    if(!own) framebuf_ref(fb);
+    savequeue[(sqhead + sqlen++) % sqcap] = fb;
+    pthread_cond_signal(&sqcond);
+    pthread_mutex_unlock(&sqmutex);
+    ++nsaved;
+}
+
+/**
+ * @brief pretrigger_init - set up pre-trigger recording
+ * @param pretime  - time of frames before event (s)
+ * @param posttime - time of frames after event (s)
+ * @param memlimit - max size of pre-trigger ring (MB)
+ * @param diff     - threshold of mean absolute difference of neighbouring frames to fire event (0 - off)
+ * @param save     - function to save frames
+ * @param prefix   - prefix of output files
+ * @return 0 if all OK
+ */
+int pretrigger_init(double pretime, double posttime, double memlimit, double diff, trigsave save, char *prefix){
+    if(pretime <= 0. || posttime < 0. || memlimit < 1. || diff < 0. || !save || !prefix) return 1;
+    pre = pretime;
+    post = posttime;
+    memmb = memlimit;
+    diffthres = diff;
+    savefn = save;
+    saveprefix = prefix;
+    stopping = 0;
+    if(pthread_create(&saver, NULL, saverthread, NULL)){
+        WARN("Can't run pre-trigger saving thread");
+        savefn = NULL;
+        return 1;
+    }
+    saverrun = 1;
+    VMESG("Pre-trigger: keep %gs before event (max %gMB), record %gs after it", pre, memmb, post);
+    return 0;
+}
+
+/**
+ * @brief pretrigger_fire - save frames of ring and next frames (thread-safe)
+ * @param reason - name of event source
+ * @return 0 if all OK or 1 if pre-trigger recording is off
+ */
+int pretrigger_fire(const char *reason){
+    if(!savefn) return 1;
+    __atomic_store_n(&firereason, reason, __ATOMIC_RELAXED);
+    __atomic_store_n(&fired, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// mean absolute difference between frames over sparse grid
+static double framediff(const framebuf *a, const framebuf *b){
+    if(a->w != b->w || a->h != b->h) return 0.;
+    uint64_t sum = 0, n = 0;
+    for(int y = 0; y < a->h; y += DIFF_STEP){
+        const uint8_t *pa = a->data + (size_t)y * a->stride, *pb = b->data + (size_t)y * b->stride;
+        for(int x = 0; x < a->w; x += DIFF_STEP) sum += abs((int)pa[x] - (int)pb[x]);
+        n += (a->w + DIFF_STEP - 1) / DIFF_STEP;
+    }
+    return n ? (double)sum / n : 0.;
+}
+
+// give all frames of ring to saving thread
+static void flushring(){
+    for(int i = 0; i < nring; ++i) tosave(ring[(head + i) % capacity], 1);
+    head = nring = 0;
+}
+
+/**
+ * @brief pretrigger_add - process next frame: keep it in ring or save if event occured
+ * @param fb - frame
+ */
+void pretrigger_add(framebuf *fb){
+    if(!savefn || !fb) return;
+    if(!ring){ // the first frame: allocate ring & its frames
+        capacity = (int)(memmb * 1024. * 1024. / fb->size);
+        if(capacity < 2) capacity = 2;
+        ring = MALLOC(framebuf*, capacity);
+        framebuf_reserve(fb->size, capacity);
+        pthread_mutex_lock(&sqmutex);
+        sqcap = 2 * capacity; // the whole ring & the same amount of post-event frames
+        savequeue = MALLOC(framebuf*, sqcap);
+        pthread_mutex_unlock(&sqmutex);
+        VMESG("Pre-trigger ring: %d frames", capacity);
+    }
+    ++ntotal;
+    double t = fb->info.timestamp;
+    if(diffthres > 0.){
+        if(prev){
+            double d = framediff(prev, fb);
+            if(d > diffthres){
+                VMESG("Pre-trigger: frames difference %.1f", d);
+                pretrigger_fire("difference");
+            }
+        }
+        framebuf_unref(prev);
+        framebuf_ref(fb);
+        prev = fb;
+    }
+    if(__atomic_exchange_n(&fired, 0, __ATOMIC_ACQ_REL)){
+        ++nevents;
+        metrics_inc(MC_TRIGGERS, 1);
+        VMESG("Pre-trigger: event (%s), save %d frame[s] of ring",
+              __atomic_load_n(&firereason, __ATOMIC_RELAXED), nring);
+        flushring();
+        postend = t + post;
+    }
+    if(t < postend){
+        tosave(fb, 0);
+        return;
+    }
+    // drop frames out of time window or memory
+    while(nring && (nring == capacity || t - ring[head]->info.timestamp > pre)){
+        framebuf_unref(ring[head]);
+        head = (head + 1) % capacity;
+        --nring;
+    }
+    framebuf_ref(fb);
+    ring[(head + nring++) % capacity] = fb;
+}
+
+// save queued frames, free ring (frames without event are lost) & show statistics
+void pretrigger_stop(){
+    if(saverrun){
+        pthread_mutex_lock(&sqmutex);
+        stopping = 1;
+        pthread_cond_signal(&sqcond);
+        pthread_mutex_unlock(&sqmutex);
+        pthread_join(saver, NULL);
+        saverrun = 0;
+    }
+    FREE(savequeue);
+    sqhead = sqlen = sqcap = 0;
+    if(!ring) return;
+    for(int i = 0; i < nring; ++i) framebuf_unref(ring[(head + i) % capacity]);
+    framebuf_unref(prev);
+    prev = NULL;
+    FREE(ring);
+    head = nring = 0;
+    if(ntotal) VMESG("Pre-trigger: %llu events, %llu of %llu frames saved (%llu lost)", (unsigned long long)nevents,
+                     (unsigned long long)nsaved, (unsigned long long)ntotal, (unsigned long long)ndropped);
+}
@@ -0,0 +1,38 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef PRETRIGGER__
+#define PRETRIGGER__
+
+#include "framepool.h"
+
+// default memory limit for pre-trigger ring (MB)
+#define PRETRIGGER_MEM      (512)
+// default time of recording after event (s)
+#define PRETRIGGER_POST     (5.)
+
+// function to save frame
+typedef void (*trigsave)(framebuf *fb, char *prefix);
+
+int  pretrigger_init(double pretime, double posttime, double memlimit, double diff, trigsave save, char *prefix);
+void pretrigger_add(framebuf *fb);
+int  pretrigger_fire(const char *reason);
+void pretrigger_stop();
+
+#endif // PRETRIGGER__
@@ -0,0 +1,211 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fitsio.h>
+#include <glob.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "demosaic.h"
+#include "image_functions.h"
+#include "replay.h"
+
+// decoded files waiting for processing (per reader)
+#define REPLAY_DEPTH    (2)
+
+static char **files = NULL;
+static int nfiles = 0;
+static int nextfile = 0;            // next file to decode
+static int consumed = 0;            // files given to processing
+static int stopping = 0;
+static framebuf **slots = NULL;     // decoded frames by file number modulo `depth` (NULL - file failed)
+static int *ready = NULL;
+static int depth = 0;
+static double filebytes = 0.;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+// buffer of reader thread for image as it is in file
+static __thread uint8_t *buf = NULL;
+static __thread size_t bufsz = 0;
+
+// read key, return 0 if found
+static int readkey(fitsfile *fp, int type, const char *key, void *val){
+    int status = 0;
+    fits_read_key(fp, type, key, val, NULL, &status);
+    return status;
+}
+
+// fill frame parameters by header written by writefb()
+static void readinfo(fitsfile *fp, frameinfo *info, int h){
+    double d;
+    unsigned int u;
+    char str[FLEN_VALUE];
+    info->exptime = readkey(fp, TDOUBLE, "EXPTIME", &d) ? NAN : (float)(d * 1000.);
+    info->gain = readkey(fp, TDOUBLE, "GAIN", &d) ? NAN : (float)d;
+    info->timestamp = readkey(fp, TDOUBLE, "UNIXTIME", &d) ? 0. : d;
+    info->obstime = (info->timestamp > 0. && !readkey(fp, TSTRING, "TIMESRC", str) && !strcmp(str, "camera")) ?
+                    info->timestamp : NAN;
+    info->counter = readkey(fp, TUINT, "FRAMECNT", &u) ? 0 : u;
+    info->dropped = readkey(fp, TUINT, "DROPPED", &u) ? 0 : u;
+    info->ncombine = 0;
+    info->bayer = BAYER_NONE;
+    if(!readkey(fp, TSTRING, "BAYERPAT", str)){
+        for(bayerpattern p = BAYER_RGGB; p <= BAYER_BGGR; ++p)
+            if(!strcmp(str, bayer_name(p))) info->bayer = bayer_flipud(p, h); // pattern of flipped image
+    }
+}
+
+// decode file into frame (flipped back upside down as grabbed)
+static framebuf *readfile(const char *name){
+    fitsfile *fp;
+    int status = 0, bitpix, naxis;
+    long naxes[3] = {0};
+    fits_open_image(&fp, name, READONLY, &status);
+    if(status){
+        fits_report_error(stderr, status);
+        return NULL;
+    }
+    fits_get_img_param(fp, 3, &bitpix, &naxis, naxes, &status);
+    if(!status && (naxis != 2 || bitpix != BYTE_IMG || naxes[0] < 1 || naxes[1] < 1)){
+        WARNX("%s: not a 8-bit frame, skipped", name);
+        fits_close_file(fp, &status);
+        return NULL;
+    }
+    int w = (int)naxes[0], h = (int)naxes[1];
+    size_t size = (size_t)w * h;
+    if(bufsz < size){
+        FREE(buf);
+        buf = MALLOC(uint8_t, size);
+        bufsz = size;
+    }
+    long fpix[2] = {1, 1};
+    if(!status) fits_read_pix(fp, TBYTE, fpix, (long long)size, NULL, buf, NULL, &status);
+    framebuf *fb = NULL;
+    if(!status){
+        fb = framebuf_get(size);
+        fb->w = fb->stride = w;
+        fb->h = h;
+        readinfo(fp, &fb->info, h);
+        flipframe(fb->data, buf, w, h, w);
+    }else fits_report_error(stderr, status);
+    status = 0;
+    fits_close_file(fp, &status);
+    return fb;
+}
+
+static void *reader(_U_ void *data){
+    pthread_mutex_lock(&mutex);
+    while(1){
+        while(!stopping && nextfile < nfiles && nextfile >= consumed + depth) pthread_cond_wait(&cond, &mutex);
+        if(stopping || nextfile >= nfiles) break;
+        int n = nextfile++;
+        pthread_mutex_unlock(&mutex);
+        struct stat st;
+        double sz = stat(files[n], &st) ? 0. : (double)st.st_size;
+        framebuf *fb = readfile(files[n]);
+        pthread_mutex_lock(&mutex);
+        filebytes += sz;
+        slots[n % depth] = fb;
+        ready[n % depth] = 1;
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&mutex);
+    FREE(buf);
+    bufsz = 0;
+    return NULL;
+}
+
+/**
+ * @brief replay_run - decode files in parallel & process them in order by calling thread
+ * @param pattern  - glob pattern of files (e.g. "night/img_*.fits*")
+ * @param nthreads - amount of decoding threads (<= 0 - by amount of CPUs)
+ * @param fn       - processing of frame (it should take reference to keep frame)
+ * @param arg      - its argument
+ * @param st       - (o) statistics
+ * @return 0 if all OK
+ */
+int replay_run(const char *pattern, int nthreads, replayfn fn, void *arg, replaystat *st){
+    glob_t g;
+    memset(st, 0, sizeof(replaystat));
+    int r = glob(pattern, 0, NULL, &g);
+    if(r || !g.gl_pathc){
+        WARNX("No files match %s", pattern);
+        if(!r) globfree(&g);
+        return 1;
+    }
+    if(nthreads <= 0) nthreads = get_nprocs();
+    if(!fits_is_reentrant() && nthreads > 1){
+        WARNX("cfitsio isn't reentrant: decode files in one thread");
+        nthreads = 1;
+    }
+    files = g.gl_pathv;
+    nfiles = (int)g.gl_pathc;
+    nextfile = consumed = stopping = 0;
+    filebytes = 0.;
+    depth = REPLAY_DEPTH * nthreads;
+    slots = MALLOC(framebuf*, depth);
+    ready = MALLOC(int, depth);
+    pthread_t *threads = MALLOC(pthread_t, nthreads);
+    int nrun = 0;
+    for(; nrun < nthreads; ++nrun) if(pthread_create(&threads[nrun], NULL, reader, NULL)){
+        WARN("pthread_create()");
+        break;
+    }
+    VMESG("Replay %d file[s] by %d thread[s]", nfiles, nrun);
+    int ret = nrun ? 0 : 1;
+    for(int n = 0; n < nfiles && nrun; ++n){
+        double t0 = dtime();
+        pthread_mutex_lock(&mutex);
+        while(!ready[n % depth]) pthread_cond_wait(&cond, &mutex);
+        framebuf *fb = slots[n % depth];
+        ready[n % depth] = 0;
+        consumed = n + 1;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+        st->readwait += dtime() - t0;
+        if(!fb){
+            ++st->nfailed;
+            continue;
+        }
+        fb->info.index = ++st->nframes;
+        st->pixbytes += (double)fb->w * fb->h;
+        int stop = fn(fb, arg);
+        framebuf_unref(fb);
+        if(stop) break;
+    }
+    pthread_mutex_lock(&mutex);
+    stopping = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+    for(int i = 0; i < nrun; ++i) pthread_join(threads[i], NULL);
+    for(int i = 0; i < depth; ++i) if(ready[i]) framebuf_unref(slots[i]); // decoded after stop
+    st->filebytes = filebytes;
+    FREE(threads);
+    FREE(slots);
+    FREE(ready);
+    globfree(&g);
+    files = NULL;
+    return ret;
+}
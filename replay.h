@@ -0,0 +1,44 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Offline replay: FITS files written by grasshopper are decoded by pool of threads and passed in order
+ * to the same processing as grabbed frames.
+ */
+
+#pragma once
+#ifndef REPLAY__
+#define REPLAY__
+
+#include "framepool.h"
+
+// function processing replayed frame, returns 1 to stop replay
+typedef int (*replayfn)(framebuf *fb, void *arg);
+
+// statistics of replay
+typedef struct{
+    uint64_t nframes;   // processed frames
+    uint64_t nfailed;   // files not read
+    double filebytes;   // size of read files
+    double pixbytes;    // size of decoded images
+    double readwait;    // time processing waited for decoding (s)
+} replaystat;
+
+int replay_run(const char *pattern, int nthreads, replayfn fn, void *arg, replaystat *st);
+
+#endif // REPLAY__
@@ -0,0 +1,274 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <linux/limits.h> // PATH_MAX
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "durable.h"
+#include "metrics.h"
+#include "outdirs.h"
+#include "retention.h"
+
+// file of sequence
+typedef struct{
+    char *name;
+    double size;
+    time_t mtime;
+} seqfile;
+
+// files of sequence in one output root
+typedef struct{
+    seqfile *files;         // FIFO of files (oldest at `head`)
+    int capacity, head, nfiles;
+    char dir[PATH_MAX];     // directory of prefix in root
+    size_t dirlen;
+    char fsdir[PATH_MAX];   // directory to check filesystem (it exists even if `dir` isn't created yet)
+    dev_t dev;              // its filesystem
+} seqroot;
+
+static seqroot roots[OUTDIRS_MAX];
+static int nroots = 0;
+static seqroot *lastroot = NULL;    // root of just written file
+static char seqbase[PATH_MAX];      // file name part of prefix
+static size_t baselen = 0;
+static double total = 0., maxbytes = 0., minfree = 0.;
+static uint64_t nremoved = 0;
+static double removedbytes = 0.;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// size of file (it could wait for syncing with temporary name)
+static int filestat(const char *filename, struct stat *st){
+    char tmp[PATH_MAX];
+    if(!stat(filename, st)) return 0;
+    if(snprintf(tmp, PATH_MAX, "%s" DURABLE_TMPSUFFIX, filename) >= PATH_MAX) return 1;
+    return stat(tmp, st);
+}
+
+static void push(seqroot *r, const char *name, double size, time_t mtime){
+    if(r->nfiles == r->capacity){ // enlarge FIFO
+        int newcap = r->capacity ? r->capacity * 2 : 256;
+        seqfile *n = MALLOC(seqfile, newcap);
+        for(int i = 0; i < r->nfiles; ++i) n[i] = r->files[(r->head + i) % r->capacity];
+        FREE(r->files);
+        r->files = n;
+        r->capacity = newcap;
+        r->head = 0;
+    }
+    r->files[(r->head + r->nfiles++) % r->capacity] = (seqfile){.name = strdup(name), .size = size, .mtime = mtime};
+    total += size;
+}
+
+// ==1 if file name is "prefix_NNNN.fits|fits.fz|png" (only frames written by grabber, without temporary suffix)
+static int ourfile(const char *name){
+    if(strncmp(name, seqbase, baselen) || name[baselen] != '_') return 0;
+    const char *p = name + baselen + 1;
+    if(!isdigit(*p)) return 0;
+    while(isdigit(*p)) ++p;
+    return (strcmp(p, ".fits") == 0 || strcmp(p, ".fits.fz") == 0 || strcmp(p, ".png") == 0);
+}
+
+// ==1 if file is still waiting for sync of its batch (it has temporary name)
+static int unsynced(const char *filename){
+    char tmp[PATH_MAX];
+    if(!access(filename, F_OK)) return 0;
+    if(snprintf(tmp, PATH_MAX, "%s" DURABLE_TMPSUFFIX, filename) >= PATH_MAX) return 0;
+    return !access(tmp, F_OK);
+}
+
+// find files of sequence in directory `path` (and in its subdirectories - shards - if `depth` > 0)
+static int scanfiles(seqroot *r, const char *path, int curdir, int depth){
+    DIR *dir = opendir(path);
+    if(!dir) return 1;
+    struct dirent *de;
+    char name[PATH_MAX];
+    while((de = readdir(dir))){
+        if(de->d_name[0] == '.') continue;
+        struct stat st;
+        if(snprintf(name, PATH_MAX, "%s/%s", path, de->d_name) >= PATH_MAX || stat(name, &st)) continue;
+        if(S_ISDIR(st.st_mode)){
+            if(depth > 0) scanfiles(r, name, 0, depth - 1);
+        }else if(S_ISREG(st.st_mode) && ourfile(de->d_name))
+            push(r, curdir ? de->d_name : name, (double)st.st_size, st.st_mtime);
+    }
+    closedir(dir);
+    return 0;
+}
+
+static int cmpmtime(const void *a, const void *b){
+    const seqfile *f1 = (const seqfile*)a, *f2 = (const seqfile*)b;
+    if(f1->mtime != f2->mtime) return (f1->mtime < f2->mtime) ? -1 : 1;
+    return strcmp(f1->name, f2->name);
+}
+
+// free space on filesystem of root
+static double freespace(seqroot *r){
+    struct statvfs st;
+    if(statvfs(r->fsdir, &st)) return -1.;
+    return (double)st.f_bavail * st.f_frsize;
+}
+
+// root with the oldest file among roots on filesystem `dev` (NULL - all roots), NULL if nothing to remove
+static seqroot *oldest(const dev_t *dev){
+    seqroot *best = NULL;
+    for(int i = 0; i < nroots; ++i){
+        seqroot *r = &roots[i];
+        if(!r->nfiles || (dev && r->dev != *dev)) continue;
+        if(r == lastroot && r->nfiles == 1) continue; // don't remove just written file
+        if(unsynced(r->files[r->head].name)) continue; // it will be renamed by durable_sync()
+        if(!best || cmpmtime(&r->files[r->head], &best->files[best->head]) < 0) best = r;
+    }
+    return best;
+}
+
+// remove the oldest files while limits are exceeded (mutex should be locked)
+static void cleanup(){
+    while(1){
+        seqroot *r = NULL;
+        if(maxbytes > 0. && total > maxbytes) r = oldest(NULL);
+        if(!r && minfree > 0.) for(int i = 0; i < nroots && !r; ++i){
+            double f = freespace(&roots[i]);
+            if(f >= 0. && f < minfree) r = oldest(&roots[i].dev);
+        }
+        if(!r) break;
+        seqfile *old = &r->files[r->head];
+        if(unlink(old->name) && errno != ENOENT) WARN("Can't remove %s", old->name);
+        VDBG("Retention: %s removed", old->name);
+        total -= old->size;
+        ++nremoved;
+        removedbytes += old->size;
+        FREE(old->name);
+        r->head = (r->head + 1) % r->capacity;
+        --r->nfiles;
+    }
+    metrics_set(MG_RETAINED, total);
+}
+
+/**
+ * @brief retention_init - find existing files of sequence & set limits
+ * @param prefix    - prefix of file names
+ * @param rootdirs  - output roots (NULL or NULL item - prefix is relative to current directory)
+ * @param nrootdirs - amount of roots
+ * @param maxmb     - max total size of files in all roots (MB, 0 - don't check)
+ * @param minfreemb - min free space on filesystem of each root (MB, 0 - don't check)
+ * @return 0 if all OK
+ */
+int retention_init(const char *prefix, const char **rootdirs, int nrootdirs, double maxmb, double minfreemb){
+    if(!prefix || maxmb < 0. || minfreemb < 0. || (maxmb == 0. && minfreemb == 0.)) return 1;
+    if(nrootdirs < 1) nrootdirs = 1;
+    if(nrootdirs > OUTDIRS_MAX) return 1;
+    char pdir[PATH_MAX];
+    const char *slash = strrchr(prefix, '/');
+    if(!slash) *pdir = 0;
+    else if(slash == prefix) strcpy(pdir, "/");
+    else snprintf(pdir, PATH_MAX, "%.*s", (int)(slash - prefix), prefix);
+    snprintf(seqbase, PATH_MAX, "%s", slash ? slash + 1 : prefix);
+    baselen = strlen(seqbase);
+    if(!baselen) return 1;
+    maxbytes = maxmb * 1024. * 1024.;
+    minfree = minfreemb * 1024. * 1024.;
+    nroots = nrootdirs;
+    int nold = 0;
+    for(int i = 0; i < nroots; ++i){
+        seqroot *r = &roots[i];
+        const char *root = (rootdirs && rootdirs[i]) ? rootdirs[i] : "";
+        int l;
+        if(!*root) l = snprintf(r->dir, PATH_MAX, "%s", *pdir ? pdir : ".");
+        else if(!*pdir) l = snprintf(r->dir, PATH_MAX, "%s", root);
+        else l = snprintf(r->dir, PATH_MAX, "%s/%s", root, (*pdir == '/') ? pdir + 1 : pdir);
+        if(l < 0 || l >= PATH_MAX){
+            WARNX("Too long path of %s in %s", prefix, root);
+            return 1;
+        }
+        r->dirlen = strlen(r->dir);
+        snprintf(r->fsdir, PATH_MAX, "%s", *root ? root : r->dir);
+        struct stat st;
+        r->dev = stat(r->fsdir, &st) ? 0 : st.st_dev;
+        // directory of prefix in root could be created later
+        if(scanfiles(r, r->dir, !*root && !slash, 1) && (*root == 0 || errno != ENOENT)){
+            WARN("Can't open directory %s", r->dir);
+            return 1;
+        }
+        if(r->nfiles > 1) qsort(r->files, r->nfiles, sizeof(seqfile), cmpmtime); // head == 0 after pushing
+        nold += r->nfiles;
+    }
+    VMESG("Retention: %d old file[s] of %s in %d root[s] (%.1fMB); keep less than %gMB, free space more than %gMB",
+          nold, prefix, nroots, total / 1024. / 1024., maxmb, minfreemb);
+    pthread_mutex_lock(&mutex);
+    lastroot = NULL;
+    cleanup();
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+// root containing file (files out of roots' directories are accounted in the first)
+static seqroot *findroot(const char *filename){
+    for(int i = 0; i < nroots; ++i){
+        seqroot *r = &roots[i];
+        if(strncmp(filename, r->dir, r->dirlen) == 0 && filename[r->dirlen] == '/') return r;
+    }
+    return &roots[0];
+}
+
+/**
+ * @brief retention_add - account written file & remove the oldest files if needed (thread-safe)
+ * @param filename - name of file (files not belonging to sequence are ignored)
+ */
+void retention_add(const char *filename){
+    if(!baselen || !filename) return;
+    const char *name = strrchr(filename, '/');
+    name = name ? name + 1 : filename;
+    if(!ourfile(name)) return;
+    struct stat st;
+    if(filestat(filename, &st)) return;
+    pthread_mutex_lock(&mutex);
+    lastroot = findroot(filename);
+    push(lastroot, filename, (double)st.st_size, st.st_mtime);
+    cleanup();
+    pthread_mutex_unlock(&mutex);
+}
+
+// show statistics & free list
+void retention_stop(){
+    if(!baselen) return;
+    pthread_mutex_lock(&mutex);
+    int nkept = 0;
+    for(int i = 0; i < nroots; ++i){
+        seqroot *r = &roots[i];
+        nkept += r->nfiles;
+        for(int j = 0; j < r->nfiles; ++j) FREE(r->files[(r->head + j) % r->capacity].name);
+        FREE(r->files);
+        r->capacity = r->head = r->nfiles = 0;
+    }
+    VMESG("Retention: %llu file[s] removed (%.1fMB), %d file[s] kept (%.1fMB)", (unsigned long long)nremoved,
+          removedbytes / 1024. / 1024., nkept, total / 1024. / 1024.);
+    nroots = 0;
+    lastroot = NULL;
+    baselen = 0;
+    pthread_mutex_unlock(&mutex);
+}
@@ -0,0 +1,33 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef RETENTION__
+#define RETENTION__
+
+/*
+ * Disk retention of sequence files "prefix_XXXX.*" in all output roots: when their total size exceeds limit
+ * the oldest files are removed, when free space on filesystem of some root is less than given the oldest files
+ * on this filesystem are removed.
+ */
+
+int  retention_init(const char *prefix, const char **rootdirs, int nrootdirs, double maxmb, double minfreemb);
+void retention_add(const char *filename);
+void retention_stop();
+
+#endif // RETENTION__
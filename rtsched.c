@@ -0,0 +1,278 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <linux/mempolicy.h> // MPOL_*
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "rtsched.h"
+
+static cpu_set_t othermask;         // CPUs of all threads but grabbing one
+static int masked = 0;              // othermask is set
+static int grabcpu = -1;            // CPU of grabbing thread (-1 - any)
+static int rtprio = 0;              // SCHED_FIFO priority of grabbing thread (0 - SCHED_OTHER)
+static int numanode = -1;           // preferred NUMA node of grabbing thread allocations
+static int prefault = 0;            // allocate buffers at first frame
+
+// jitter statistics (used only by grabbing thread)
+static uint32_t jithist[RTSCHED_JITBINS];
+static uint64_t nframes = 0, njitter = 0, nlatency = 0, ndropped = 0;
+static double tlast = 0., dtlast = 0., dtsum = 0., dtsum2 = 0., dtmin = 0., dtmax = 0., jitmax = 0.;
+static double latmean = 0., latm2 = 0., latmin = 0., latmax = 0.;
+
+/**
+ * @brief parsecpus - parse list of CPUs like "0-3,6"
+ * @param str - list
+ * @param set - its set
+ * @return 0 if all OK
+ */
+static int parsecpus(const char *str, cpu_set_t *set){
+    CPU_ZERO(set);
+    if(!str || !*str) return 1;
+    while(*str){
+        char *e;
+        long first = strtol(str, &e, 10), last = first;
+        if(e == str) return 1;
+        if(*e == '-'){
+            str = e + 1;
+            last = strtol(str, &e, 10);
+            if(e == str) return 1;
+        }
+        if(first < 0 || last < first || last >= CPU_SETSIZE) return 1;
+        for(long i = first; i <= last; ++i) CPU_SET(i, set);
+        if(*e == ',') ++e;
+        else if(*e) return 1;
+        str = e;
+    }
+    return 0;
+}
+
+// list of CPUs in set
+static char *cpulist(const cpu_set_t *set, char *buf, size_t l){
+    *buf = 0;
+    size_t pos = 0;
+    for(int i = 0; i < CPU_SETSIZE && pos < l; ++i){
+        if(!CPU_ISSET(i, set)) continue;
+        int j = i;
+        while(j + 1 < CPU_SETSIZE && CPU_ISSET(j + 1, set)) ++j;
+        if(j > i) pos += snprintf(buf + pos, l - pos, "%s%d-%d", pos ? "," : "", i, j);
+        else pos += snprintf(buf + pos, l - pos, "%s%d", pos ? "," : "", i);
+        i = j;
+    }
+    return buf;
+}
+
+/**
+ * @brief rtsched_init - set CPUs of process threads (should be called before any thread is created)
+ * @param cpus    - list of CPUs for all threads but grabbing (NULL - all allowed except `grabcpu`)
+ * @param cpu     - CPU of grabbing thread (<0 - don't pin it)
+ * @return 0 if all OK
+ */
+int rtsched_init(const char *cpus, int cpu){
+    cpu_set_t allowed;
+    char buf[256];
+    if(sched_getaffinity(0, sizeof(allowed), &allowed)){
+        WARN("sched_getaffinity()");
+        return 1;
+    }
+    if(cpu >= 0){
+        if(cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)){
+            WARNX("CPU %d isn't available (allowed: %s)", cpu, cpulist(&allowed, buf, sizeof(buf)));
+            return 1;
+        }
+        grabcpu = cpu;
+    }
+    if(cpus){
+        if(parsecpus(cpus, &othermask)){
+            WARNX("Wrong list of CPUs: %s", cpus);
+            return 1;
+        }
+        CPU_AND(&othermask, &othermask, &allowed);
+        if(!CPU_COUNT(&othermask)){
+            WARNX("None of CPUs %s is available (allowed: %s)", cpus, cpulist(&allowed, buf, sizeof(buf)));
+            return 1;
+        }
+    }else if(grabcpu > -1 && CPU_COUNT(&allowed) > 1){ // leave grabbing CPU for grabbing thread only
+        othermask = allowed;
+        CPU_CLR(grabcpu, &othermask);
+    }else return 0;
+    if(sched_setaffinity(0, sizeof(othermask), &othermask)){
+        WARN("sched_setaffinity()");
+        return 1;
+    }
+    masked = 1;
+    VMESG("Threads run on CPUs %s", cpulist(&othermask, buf, sizeof(buf)));
+    return 0;
+}
+
+/**
+ * @brief rtsched_grab - apply real-time settings to calling (grabbing) thread;
+ *          errors aren't fatal: setting is skipped with warning
+ * @param prio    - SCHED_FIFO priority (0 - don't change scheduler)
+ * @param lockmem - lock all current & future memory of process
+ * @param numa    - allocate memory on NUMA node of grabbing CPU
+ * @return 0 if all settings applied
+ */
+int rtsched_grab(int prio, int lockmem, int numa){
+    int ret = 0, err;
+    pthread_t self = pthread_self();
+    if(grabcpu > -1){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(grabcpu, &set);
+        if((err = pthread_setaffinity_np(self, sizeof(set), &set))){
+            WARNX("Can't pin grabbing thread to CPU %d: %s", grabcpu, strerror(err));
+            ret = 1;
+        }else VMESG("Grabbing thread runs on CPU %d", grabcpu);
+    }
+    if(prio > 0){
+        int pmax = sched_get_priority_max(SCHED_FIFO);
+        if(prio > pmax) prio = pmax;
+        struct sched_param p = {.sched_priority = prio};
+        if((err = pthread_setschedparam(self, SCHED_FIFO, &p))){
+            WARNX("Can't set SCHED_FIFO priority %d: %s (CAP_SYS_NICE or `rtprio` limit needed)", prio, strerror(err));
+            ret = 1;
+        }else{
+            rtprio = prio;
+            VMESG("Grabbing thread has SCHED_FIFO priority %d", prio);
+        }
+    }
+    if(numa){
+        unsigned int cpu, node;
+        if(grabcpu < 0) WARNX("NUMA node is chosen by current CPU of grabbing thread, set its CPU to keep it");
+        unsigned long mask[4] = {0};
+        if(syscall(SYS_getcpu, &cpu, &node, NULL) || node >= sizeof(mask) * 8){
+            WARN("getcpu()");
+            ret = 1;
+        }else{
+            mask[node / (sizeof(long) * 8)] = 1UL << (node % (sizeof(long) * 8));
+            if(syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8 + 1)){
+                WARN("Can't set memory policy");
+                ret = 1;
+            }else{
+                numanode = (int)node;
+                prefault = 1;
+                VMESG("Frame buffers are allocated on NUMA node %u", node);
+            }
+        }
+    }
+    if(lockmem){
+        if(mlockall(MCL_CURRENT | MCL_FUTURE)){
+            WARN("Can't lock memory (check `ulimit -l` or CAP_IPC_LOCK)");
+            ret = 1;
+        }else{
+            prefault = 1;
+            VMESG("Process memory is locked");
+        }
+    }
+    return ret;
+}
+
+// return thread created by grabbing thread to CPUs & scheduling of other threads
+void rtsched_unpin(){
+    pthread_t self = pthread_self();
+    if(masked) pthread_setaffinity_np(self, sizeof(othermask), &othermask);
+    if(rtprio){
+        struct sched_param p = {.sched_priority = 0};
+        pthread_setschedparam(self, SCHED_OTHER, &p);
+    }
+    if(numanode > -1) syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+}
+
+/**
+ * @brief rtsched_frame - collect jitter statistics of grabbed frame (should be called by grabbing thread);
+ *          at first frame buffers of pool are allocated if memory is locked or NUMA-local
+ * @param fb - frame
+ */
+void rtsched_frame(framebuf *fb){
+    if(!fb) return;
+    if(prefault){
+        prefault = 0;
+        framebuf_reserve(fb->size, RTSCHED_PREFAULT);
+    }
+    double t = fb->info.timestamp;
+    if(nframes){
+        double dt = t - tlast;
+        dtsum += dt; dtsum2 += dt * dt;
+        if(nframes == 1 || dt < dtmin) dtmin = dt;
+        if(dt > dtmax) dtmax = dt;
+        if(nframes > 1){ // period jitter: difference of successive intervals
+            double j = fabs(dt - dtlast);
+            int bin = (int)(j / RTSCHED_JITBIN);
+            if(bin >= RTSCHED_JITBINS) bin = RTSCHED_JITBINS - 1;
+            ++jithist[bin];
+            ++njitter;
+            if(j > jitmax) jitmax = j;
+        }
+        dtlast = dt;
+    }
+    tlast = t;
+    ++nframes;
+    ndropped += fb->info.dropped;
+    if(!isnan(fb->info.obstime)){ // delay of frame delivery by camera clock
+        double l = t - fb->info.obstime, d = l - latmean;
+        ++nlatency;
+        latmean += d / nlatency;
+        latm2 += d * (l - latmean);
+        if(nlatency == 1 || l < latmin) latmin = l;
+        if(nlatency == 1 || l > latmax) latmax = l;
+    }
+}
+
+// value of given part of jitter histogram (s)
+static double jitquantile(double q){
+    uint64_t lim = (uint64_t)ceil(q * njitter), n = 0;
+    for(int i = 0; i < RTSCHED_JITBINS; ++i){
+        n += jithist[i];
+        if(n >= lim){
+            double v = (i + 1) * RTSCHED_JITBIN;
+            return (v > jitmax) ? jitmax : v;
+        }
+    }
+    return jitmax;
+}
+
+// show jitter statistics & clear it
+void rtsched_stop(){
+    if(nframes > 2){
+        double n = (double)(nframes - 1), mean = dtsum / n, var = dtsum2 / n - mean * mean;
+        VMESG("Grab intervals: %llu, mean %.3fms (std %.3fms), min %.3fms, max %.3fms", (unsigned long long)(nframes - 1),
+              mean * 1e3, (var > 0. ? sqrt(var) : 0.) * 1e3, dtmin * 1e3, dtmax * 1e3);
+        VMESG("Grab jitter: median %.3fms, 99%% %.3fms, 99.9%% %.3fms, max %.3fms", jitquantile(0.5) * 1e3,
+              jitquantile(0.99) * 1e3, jitquantile(0.999) * 1e3, jitmax * 1e3);
+        if(nlatency > 1)
+            VMESG("Frame delivery after exposure (by camera clock): mean %.3fms, std %.3fms, range %.3fms",
+                  latmean * 1e3, sqrt(latm2 / (nlatency - 1)) * 1e3, (latmax - latmin) * 1e3);
+        if(ndropped) VMESG("Frames dropped: %llu", (unsigned long long)ndropped);
+    }
+    memset(jithist, 0, sizeof(jithist));
+    nframes = njitter = nlatency = ndropped = 0;
+    tlast = dtlast = dtsum = dtsum2 = dtmin = dtmax = jitmax = 0.;
+    latmean = latm2 = latmin = latmax = 0.;
+}
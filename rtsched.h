@@ -0,0 +1,42 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Real-time options of grabbing thread: CPU affinity of grabbing & other threads, SCHED_FIFO priority,
+ * locking of memory, NUMA-local frame buffers; statistics of grabbing jitter.
+ */
+
+#pragma once
+#ifndef RTSCHED__
+#define RTSCHED__
+
+#include "framepool.h"
+
+// width of jitter histogram bin (s) & amount of bins (the last one holds all larger values)
+#define RTSCHED_JITBIN      (1e-5)
+#define RTSCHED_JITBINS     (10000)
+// amount of frame buffers allocated (and touched) by grabbing thread at first frame
+#define RTSCHED_PREFAULT    (8)
+
+int  rtsched_init(const char *cpus, int grabcpu);
+int  rtsched_grab(int prio, int lockmem, int numa);
+void rtsched_unpin();
+void rtsched_frame(framebuf *fb);
+void rtsched_stop();
+
+#endif // RTSCHED__
@@ -0,0 +1,246 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "camera_functions.h"
+#include "sequence.h"
+
+typedef struct{
+    float exptime;      // ms
+    float gain;         // dB, NAN - don't change
+    int frames;         // amount of frames
+    int roi[4];         // x0, y0, w, h (w == 0 - full frame, w < 0 - don't change)
+    char *prefix;       // prefix of output files (NULL - don't save)
+    int line;           // line in file
+} seqstep;
+
+static seqstep *steps = NULL;
+static int nsteps = 0;
+static int cur = 0;                 // current step
+static int done = 0;                // frames of current step
+static int transition = 0;          // next frame is the first of step
+static double tprev = 0.;           // time of previous frame
+static double tapply = 0.;          // time of applying of current step settings
+
+// statistics
+static int ntrans = 0, nintervals = 0;
+static double transsum = 0., transmax = 0., applysum = 0., applymax = 0., intervalsum = 0.;
+
+// parse one line of file into step `s` (it contains values of previous step); return 1 if step found
+static int parseline(char *line, seqstep *s, const char *filename, int nline){
+    char *c = strchr(line, '#');
+    if(c) *c = 0;
+    int got = 0;
+    char *saveptr = NULL;
+    for(char *tok = strtok_r(line, " \t\r\n", &saveptr); tok; tok = strtok_r(NULL, " \t\r\n", &saveptr)){
+        char *val = strchr(tok, '=');
+        if(!val || !val[1]){
+            WARNX("%s:%d: need key=value instead of \"%s\"", filename, nline, tok);
+            return -1;
+        }
+        *val++ = 0;
+        char *eptr = NULL;
+        if(strcmp(tok, "exptime") == 0){
+            s->exptime = strtof(val, &eptr);
+            if(*eptr || !(s->exptime > 0.f)) eptr = NULL;
+        }else if(strcmp(tok, "gain") == 0){
+            s->gain = strtof(val, &eptr);
+            if(*eptr || isnan(s->gain)) eptr = NULL;
+        }else if(strcmp(tok, "frames") == 0){
+            long n = strtol(val, &eptr, 10);
+            if(*eptr || n < 1 || n > INT32_MAX) eptr = NULL;
+            else s->frames = (int)n;
+        }else if(strcmp(tok, "roi") == 0){
+            int r[4];
+            if(strcmp(val, "full") == 0){
+                s->roi[0] = s->roi[1] = s->roi[2] = s->roi[3] = 0;
+                eptr = val;
+            }else if(4 == sscanf(val, "%d,%d,%d,%d", &r[0], &r[1], &r[2], &r[3]) &&
+                     r[0] >= 0 && r[1] >= 0 && r[2] > 0 && r[3] > 0){
+                memcpy(s->roi, r, sizeof(r));
+                eptr = val;
+            }
+        }else if(strcmp(tok, "prefix") == 0){
+            s->prefix = strdup(val);
+            eptr = val;
+        }else{
+            WARNX("%s:%d: unknown key \"%s\"", filename, nline, tok);
+            return -1;
+        }
+        if(!eptr){
+            WARNX("%s:%d: bad value of %s: \"%s\"", filename, nline, tok, val);
+            return -1;
+        }
+        ++got;
+    }
+    return got ? 1 : 0;
+}
+
+/**
+ * @brief sequence_load - read sequence file
+ * @param filename - name of file
+ * @param exptime  - (i) default exposition time (ms, could be NAN), (o) exposition of first step
+ * @param gain     - (i) default gain (dB, NAN - don't change), (o) gain of first step
+ * @param nframes  - default amount of frames per step (<1 - one frame)
+ * @param prefix   - default prefix of output files
+ * @return 0 if all OK
+ */
+int sequence_load(const char *filename, float *exptime, float *gain, int nframes, char *prefix){
+    FILE *f = fopen(filename, "r");
+    if(!f){
+        WARN("Can't open %s", filename);
+        return 1;
+    }
+    seqstep s = {.exptime = *exptime, .gain = *gain, .frames = (nframes > 0) ? nframes : 1,
+                 .roi = {0, 0, -1, 0}, .prefix = prefix};
+    char *line = NULL;
+    size_t len = 0;
+    int nline = 0, ret = 0, capacity = 0;
+    while(getline(&line, &len, f) > 0){
+        ++nline;
+        int r = parseline(line, &s, filename, nline);
+        if(r < 0){
+            ret = 1;
+            break;
+        }
+        if(!r) continue;
+        if(isnan(s.exptime)){
+            WARNX("%s:%d: exposition time isn't set", filename, nline);
+            ret = 1;
+            break;
+        }
+        if(nsteps == capacity){
+            capacity += 16;
+            steps = realloc(steps, capacity * sizeof(seqstep));
+            if(!steps) ERR("realloc()");
+        }
+        s.line = nline;
+        steps[nsteps++] = s;
+    }
+    FREE(line);
+    fclose(f);
+    if(!ret && !nsteps){
+        WARNX("%s: no steps", filename);
+        ret = 1;
+    }
+    if(ret){ // prefixes could be shared by steps, so keep them
+        FREE(steps);
+        nsteps = 0;
+        return 1;
+    }
+    *exptime = steps[0].exptime;
+    *gain = steps[0].gain;
+    int total = 0;
+    for(int i = 0; i < nsteps; ++i) total += steps[i].frames;
+    VMESG("Sequence %s: %d step[s], %d frame[s]", filename, nsteps, total);
+    return 0;
+}
+
+// apply settings of step `n`: only changed values are sent to camera
+static int apply(fc2Context context, int n){
+    seqstep *s = &steps[n];
+    double t0 = dtime();
+    int ret = 0;
+    if(s->roi[2] >= 0){ // ROI first: range of shutter depends on it
+        int roi[4];
+        memcpy(roi, s->roi, sizeof(roi));
+        if(FC2_ERROR_OK != setroi(context, roi)){
+            WARNX("Step %d (line %d): can't set ROI", n + 1, s->line);
+            ret = 1;
+        }
+    }
+    propsetting settings[] = {
+        PROPVAL(FC2_SHUTTER, s->exptime),
+        PROPVAL(FC2_GAIN, s->gain)
+    };
+    if(FC2_ERROR_OK != setprops(context, settings, isnan(s->gain) ? 1 : 2)){
+        WARNX("Step %d (line %d): can't set exposition/gain", n + 1, s->line);
+        ret = 1;
+    }
+    tapply = dtime() - t0;
+    VMESG("Step %d/%d: exptime=%gms gain=%gdB, %d frame[s] -> %s (set in %.2fms)", n + 1, nsteps, getexp(),
+          getgain(), s->frames, s->prefix ? s->prefix : "(none)", tapply * 1e3);
+    return ret;
+}
+
+/**
+ * @brief sequence_start - apply settings of first step (exposition & gain are already set by sequence_load() results)
+ * @param context - initialized context
+ * @param prefix  - (o) prefix of output files for first step
+ * @return 0 if all OK
+ */
+int sequence_start(fc2Context context, char **prefix){
+    if(!nsteps) return 1;
+    cur = done = 0;
+    transition = 0;
+    ntrans = nintervals = 0;
+    transsum = transmax = applysum = applymax = intervalsum = 0.;
+    *prefix = steps[0].prefix;
+    return apply(context, 0);
+}
+
+/**
+ * @brief sequence_frame - count grabbed frame & go to next step if current is done
+ * @param context - initialized context
+ * @param fb      - grabbed frame
+ * @param prefix  - (o) prefix of output files for next frames
+ * @return 1 if sequence is over
+ */
+int sequence_frame(fc2Context context, framebuf *fb, char **prefix){
+    if(cur >= nsteps) return 1;
+    double t = fb ? fb->info.timestamp : dtime();
+    if(transition){ // time from last frame of previous step to first frame of this
+        double tr = t - tprev;
+        transsum += tr;
+        if(tr > transmax) transmax = tr;
+        applysum += tapply;
+        if(tapply > applymax) applymax = tapply;
+        ++ntrans;
+        VMESG("Step %d: transition %.2fms (settings %.2fms)", cur + 1, tr * 1e3, tapply * 1e3);
+        transition = 0;
+    }else if(done){
+        intervalsum += t - tprev;
+        ++nintervals;
+    }
+    tprev = t;
+    if(++done < steps[cur].frames) return 0;
+    if(++cur == nsteps){
+        sequence_stop();
+        return 1;
+    }
+    done = 0;
+    transition = 1;
+    *prefix = steps[cur].prefix;
+    apply(context, cur);
+    return 0;
+}
+
+// show statistics
+void sequence_stop(){
+    if(ntrans) VMESG("Sequence: %d transition[s], %.2fms mean (max %.2fms), settings %.2fms mean (max %.2fms)",
+                     ntrans, transsum * 1e3 / ntrans, transmax * 1e3, applysum * 1e3 / ntrans, applymax * 1e3);
+    if(nintervals) VMESG("Sequence: mean interval between frames of step %.2fms", intervalsum * 1e3 / nintervals);
+    ntrans = nintervals = 0;
+}
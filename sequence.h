@@ -0,0 +1,38 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Observation sequences: text file with one step per line, steps are run one after another over already opened
+ * camera connection. Step is a list of `key=value` (values not given are inherited from previous step):
+ *      exptime=ms gain=dB frames=N roi=x,y,w,h|full prefix=path
+ * Text after '#' is a comment.
+ */
+
+#pragma once
+#ifndef SEQUENCE__
+#define SEQUENCE__
+
+#include <C/FlyCapture2_C.h>
+#include "framepool.h"
+
+int  sequence_load(const char *filename, float *exptime, float *gain, int nframes, char *prefix);
+int  sequence_start(fc2Context context, char **prefix);
+int  sequence_frame(fc2Context context, framebuf *fb, char **prefix);
+void sequence_stop();
+
+#endif // SEQUENCE__
@@ -0,0 +1,474 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ctype.h>
+#include <linux/limits.h> // PATH_MAX
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "camera_functions.h"
+#include "metrics.h"
+#include "pretrigger.h"
+#include "server.h"
+
+// max length of command line
+#define CMDBUFSZ        (256)
+// max amount of simultaneously connected clients
+#define MAXCLIENTS      (16)
+// max binning of preview
+#define MAXBINNING      (16)
+// prefix of files saved by `save` command without arguments
+#define DEFSAVEPREFIX   "Remote"
+
+typedef struct client{
+    int fd;                 // socket
+    pthread_t writer;       // thread sending frames
+    pthread_mutex_t mutex;  // protects fields below
+    pthread_cond_t cond;    // signal for writer
+    pthread_mutex_t wmutex; // protects writing into socket
+    framebuf *pending;      // newest frame waiting for sending (older are dropped)
+    int alive;              // ==0 when client disconnected
+    int subscribed;         // ==1 if client wants frames
+    int binning;            // preview binning (1 - full frame)
+    int roi[4];             // x0, y0, w, h of subframe (w == 0 - full frame)
+    uint64_t sent, dropped; // amount of frames sent/dropped
+    uint8_t *scratch;       // buffer for subframes/previews
+    size_t scratchsz;       // its size
+    struct client *next;
+} client;
+
+static fc2Context camcontext;
+static int listenfd = -1;
+static char *unixpath = NULL;       // path of UNIX socket to remove it at exit
+static pthread_t listenthread;
+static client *clients = NULL;
+static int nclients = 0;
+static pthread_mutex_t listmutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile int paused = 0;     // ==1 if capture stopped by `stop` command
+static uint64_t nframes = 0;        // amount of frames published
+static char saveprefix[PATH_MAX];   // prefix for `save` command
+static int saverequest = 0;
+static pthread_mutex_t savemutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief sendv - send all data from iov
+ * @return 0 if all OK
+ */
+static int sendv(int fd, struct iovec *iov, int iovcnt){
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while(msg.msg_iovlen){
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            return 1;
+        }
+        while(msg.msg_iovlen && (size_t)n >= msg.msg_iov->iov_len){
+            n -= msg.msg_iov->iov_len;
+            ++msg.msg_iov; --msg.msg_iovlen;
+        }
+        if(msg.msg_iovlen){
+            msg.msg_iov->iov_base = (uint8_t*)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static void reply(client *c, const char *fmt, ...){
+    char buf[CMDBUFSZ];
+    va_list ar;
+    va_start(ar, fmt);
+    int l = vsnprintf(buf, CMDBUFSZ - 1, fmt, ar);
+    va_end(ar);
+    if(l < 0) return;
+    if(l > CMDBUFSZ - 2) l = CMDBUFSZ - 2;
+    buf[l++] = '\n';
+    struct iovec iov = {.iov_base = buf, .iov_len = l};
+    pthread_mutex_lock(&c->wmutex);
+    sendv(c->fd, &iov, 1);
+    pthread_mutex_unlock(&c->wmutex);
+}
+
+/**
+ * @brief sendframe - send frame header & data; full frame is sent directly from grabbed buffer,
+ *          subframes and binned previews are prepared in client's scratch buffer
+ * @return 0 if all OK
+ */
+static int sendframe(client *c, framebuf *fb, int bin, const int roi[4]){
+    int x0 = 0, y0 = 0, w = fb->w, h = fb->h, s = fb->stride;
+    if(roi[2] > 0 && roi[3] > 0 && roi[0] < fb->w && roi[1] < fb->h){
+        x0 = roi[0]; y0 = roi[1];
+        w = (roi[2] < fb->w - x0) ? roi[2] : fb->w - x0;
+        h = (roi[3] < fb->h - y0) ? roi[3] : fb->h - y0;
+    }
+    if(bin > w) bin = w;
+    if(bin > h) bin = h;
+    int ow = w / bin, oh = h / bin;
+    size_t sz = (size_t)ow * oh;
+    uint8_t *data;
+    if(bin == 1 && w == fb->w && s == w){ // rows are contiguous: zero-copy
+        data = fb->data + (size_t)y0 * s;
+    }else{
+        if(c->scratchsz < sz){
+            FREE(c->scratch);
+            c->scratch = MALLOC(uint8_t, sz);
+            c->scratchsz = sz;
+        }
+        data = c->scratch;
+        uint32_t b2 = bin * bin;
+        for(int y = 0; y < oh; ++y){
+            uint8_t *optr = &data[y * ow];
+            for(int x = 0; x < ow; ++x){
+                uint32_t sum = 0;
+                for(int yy = 0; yy < bin; ++yy){
+                    uint8_t *iptr = &fb->data[(size_t)(y0 + y*bin + yy) * s + x0 + x*bin];
+                    for(int xx = 0; xx < bin; ++xx) sum += iptr[xx];
+                }
+                *optr++ = (uint8_t)(sum / b2);
+            }
+        }
+    }
+    char hdr[128];
+    int l = snprintf(hdr, 128, "FRAME %llu %d %d %g %zu\n", (unsigned long long)fb->info.index,
+                     ow, oh, fb->info.exptime, sz);
+    struct iovec iov[2] = {{.iov_base = hdr, .iov_len = l}, {.iov_base = data, .iov_len = sz}};
+    pthread_mutex_lock(&c->wmutex);
+    int r = sendv(c->fd, iov, 2);
+    pthread_mutex_unlock(&c->wmutex);
+    return r;
+}
+
+// thread sending frames to client
+static void *writer(void *data){
+    client *c = (client*) data;
+    pthread_mutex_lock(&c->mutex);
+    while(c->alive){
+        if(!c->pending){
+            pthread_cond_wait(&c->cond, &c->mutex);
+            continue;
+        }
+        framebuf *fb = c->pending;
+        c->pending = NULL;
+        int bin = c->binning, roi[4];
+        memcpy(roi, c->roi, sizeof(roi));
+        pthread_mutex_unlock(&c->mutex);
+        int r = sendframe(c, fb, bin, roi);
+        framebuf_unref(fb);
+        pthread_mutex_lock(&c->mutex);
+        if(r){ // client is dead
+            c->alive = 0;
+            shutdown(c->fd, SHUT_RDWR);
+        }else ++c->sent;
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return NULL;
+}
+
+// remove client from list & free its data
+static void rmclient(client *c){
+    pthread_mutex_lock(&listmutex);
+    client **prev = &clients;
+    while(*prev && *prev != c) prev = &(*prev)->next;
+    if(*prev) *prev = c->next;
+    --nclients;
+    pthread_mutex_unlock(&listmutex);
+    pthread_mutex_lock(&c->mutex);
+    c->alive = 0;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->mutex);
+    shutdown(c->fd, SHUT_RDWR); // break blocked send()
+    pthread_join(c->writer, NULL);
+    VMESG("Client %d disconnected: %llu frames sent, %llu dropped", c->fd,
+          (unsigned long long)c->sent, (unsigned long long)c->dropped);
+    framebuf_unref(c->pending);
+    close(c->fd);
+    FREE(c->scratch);
+    pthread_mutex_destroy(&c->mutex);
+    pthread_mutex_destroy(&c->wmutex);
+    pthread_cond_destroy(&c->cond);
+    FREE(c);
+}
+
+static void setprop(client *c, fc2PropertyType t, const char *par){
+    float f;
+    if(sscanf(par, "%f", &f) != 1){
+        reply(c, "ERR bad value");
+        return;
+    }
+    propsetting s = PROPVAL(t, f);
+    if(FC2_ERROR_OK != setprops(camcontext, &s, 1)) reply(c, "ERR can't set %s", getPropName(t));
+    else reply(c, "OK %s=%g", getPropName(t), getpropval(t));
+}
+
+/**
+ * @brief processcmd - process one command of client
+ * @param c   - client
+ * @param cmd - command line (will be modified)
+ */
+static void processcmd(client *c, char *cmd){
+    while(isspace(*cmd)) ++cmd;
+    char *par = cmd;
+    while(*par && !isspace(*par)) ++par;
+    if(*par){
+        *par++ = 0;
+        while(isspace(*par)) ++par;
+    }
+    if(!*cmd) return;
+    DBG("client %d: cmd='%s', par='%s'", c->fd, cmd, par);
+    if(strcmp(cmd, "exptime") == 0) setprop(c, FC2_SHUTTER, par);
+    else if(strcmp(cmd, "gain") == 0) setprop(c, FC2_GAIN, par);
+    else if(strcmp(cmd, "start") == 0){
+        paused = 0;
+        reply(c, "OK");
+    }else if(strcmp(cmd, "stop") == 0){
+        paused = 1;
+        reply(c, "OK");
+    }else if(strcmp(cmd, "roi") == 0){
+        int r[4] = {0};
+        if(*par && (sscanf(par, "%d %d %d %d", &r[0], &r[1], &r[2], &r[3]) != 4 ||
+                    r[0] < 0 || r[1] < 0 || r[2] < 1 || r[3] < 1)){
+            reply(c, "ERR need x0 y0 w h");
+            return;
+        }
+        pthread_mutex_lock(&c->mutex);
+        memcpy(c->roi, r, sizeof(r));
+        pthread_mutex_unlock(&c->mutex);
+        reply(c, "OK");
+    }else if(strcmp(cmd, "bin") == 0){
+        int b;
+        if(sscanf(par, "%d", &b) != 1 || b < 1 || b > MAXBINNING){
+            reply(c, "ERR binning should be from 1 to %d", MAXBINNING);
+            return;
+        }
+        pthread_mutex_lock(&c->mutex);
+        c->binning = b;
+        pthread_mutex_unlock(&c->mutex);
+        reply(c, "OK");
+    }else if(strcmp(cmd, "subscribe") == 0 || strcmp(cmd, "unsubscribe") == 0){
+        pthread_mutex_lock(&c->mutex);
+        c->subscribed = (*cmd == 's');
+        pthread_mutex_unlock(&c->mutex);
+        reply(c, "OK");
+    }else if(strcmp(cmd, "save") == 0){
+        pthread_mutex_lock(&savemutex);
+        snprintf(saveprefix, PATH_MAX, "%s", *par ? par : DEFSAVEPREFIX);
+        saverequest = 1;
+        pthread_mutex_unlock(&savemutex);
+        reply(c, "OK");
+    }else if(strcmp(cmd, "trigger") == 0){
+        if(pretrigger_fire("socket")) reply(c, "ERR pre-trigger recording is off");
+        else reply(c, "OK");
+    }else if(strcmp(cmd, "status") == 0){
+        pthread_mutex_lock(&c->mutex);
+        uint64_t sent = c->sent, dropped = c->dropped;
+        pthread_mutex_unlock(&c->mutex);
+        reply(c, "OK paused=%d frames=%llu sent=%llu dropped=%llu exptime=%g gain=%g", paused,
+              (unsigned long long)nframes, (unsigned long long)sent, (unsigned long long)dropped,
+              getexp(), getgain());
+    }else if(strcmp(cmd, "help") == 0){
+        reply(c, "OK commands: exptime ms, gain dB, start, stop, roi [x0 y0 w h], bin N, "
+                 "subscribe, unsubscribe, save [prefix], trigger, status");
+    }else reply(c, "ERR unknown command %s", cmd);
+}
+
+// thread reading commands of client
+static void *reader(void *data){
+    client *c = (client*) data;
+    char buf[CMDBUFSZ];
+    size_t len = 0;
+    while(1){
+        ssize_t n = recv(c->fd, buf + len, CMDBUFSZ - 1 - len, 0);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) break;
+        len += n;
+        buf[len] = 0;
+        char *start = buf, *eol;
+        while((eol = strchr(start, '\n'))){
+            *eol = 0;
+            if(eol > start && eol[-1] == '\r') eol[-1] = 0;
+            processcmd(c, start);
+            start = eol + 1;
+        }
+        len -= start - buf;
+        memmove(buf, start, len);
+        if(len == CMDBUFSZ - 1){
+            reply(c, "ERR too long command");
+            len = 0;
+        }
+    }
+    rmclient(c);
+    return NULL;
+}
+
+// thread accepting new connections
+static void *listener(_U_ void *data){
+    FNAME();
+    while(1){
+        int fd = accept(listenfd, NULL, NULL);
+        if(fd < 0){
+            if(errno == EINTR) continue;
+            break;
+        }
+        pthread_mutex_lock(&listmutex);
+        int n = nclients;
+        pthread_mutex_unlock(&listmutex);
+        if(n >= MAXCLIENTS){
+            const char *msg = "ERR too many clients\n";
+            send(fd, msg, strlen(msg), MSG_NOSIGNAL);
+            close(fd);
+            continue;
+        }
+        client *c = MALLOC(client, 1);
+        c->fd = fd;
+        c->alive = 1;
+        c->binning = 1;
+        pthread_mutex_init(&c->mutex, NULL);
+        pthread_mutex_init(&c->wmutex, NULL);
+        pthread_cond_init(&c->cond, NULL);
+        if(pthread_create(&c->writer, NULL, writer, c)){
+            WARN("pthread_create()");
+            close(fd);
+            FREE(c);
+            continue;
+        }
+        pthread_mutex_lock(&listmutex);
+        c->next = clients;
+        clients = c;
+        ++nclients;
+        pthread_mutex_unlock(&listmutex);
+        pthread_t th;
+        if(pthread_create(&th, NULL, reader, c)){
+            WARN("pthread_create()");
+            rmclient(c);
+            continue;
+        }
+        pthread_detach(th);
+        VMESG("Client %d connected", fd);
+    }
+    return NULL;
+}
+
+/**
+ * @brief server_start - open socket & run server threads
+ * @param context - initialized camera context
+ * @param path    - TCP port (listen on localhost) or path to UNIX socket
+ * @return 0 if all OK
+ */
+int server_start(fc2Context context, const char *path){
+    FNAME();
+    if(!path || !*path) return 1;
+    camcontext = context;
+    if((listenfd = openlistener(path, MAXCLIENTS, &unixpath)) < 0) return 1;
+    if(pthread_create(&listenthread, NULL, listener, NULL)){
+        WARN("pthread_create()");
+        goto bad;
+    }
+    VMESG("Server listens on %s", path);
+    return 0;
+bad:
+    close(listenfd);
+    listenfd = -1;
+    if(unixpath){
+        unlink(unixpath);
+        FREE(unixpath);
+    }
+    return 1;
+}
+
+/**
+ * @brief server_publish - send frame to all subscribers; if subscriber still didn't send
+ *          previous frame, it is dropped, so slow clients never stall grabbing
+ * @param fb - frame buffer
+ */
+void server_publish(framebuf *fb){
+    if(!fb || listenfd < 0) return;
+    ++nframes;
+    pthread_mutex_lock(&listmutex);
+    for(client *c = clients; c; c = c->next){
+        pthread_mutex_lock(&c->mutex);
+        if(c->alive && c->subscribed){
+            if(c->pending){
+                framebuf_unref(c->pending);
+                ++c->dropped;
+                metrics_inc(MC_STREAMDROPS, 1);
+            }
+            framebuf_ref(fb);
+            c->pending = fb;
+            pthread_cond_signal(&c->cond);
+        }
+        pthread_mutex_unlock(&c->mutex);
+    }
+    pthread_mutex_unlock(&listmutex);
+}
+
+// ==1 if clients stopped capture
+int server_paused(){
+    return paused;
+}
+
+/**
+ * @brief server_saverequest - check if any client asked to save image
+ * @return NULL or prefix of file name (static buffer)
+ */
+char *server_saverequest(){
+    static char prefix[PATH_MAX];
+    char *ret = NULL;
+    pthread_mutex_lock(&savemutex);
+    if(saverequest){
+        strcpy(prefix, saveprefix);
+        saverequest = 0;
+        ret = prefix;
+    }
+    pthread_mutex_unlock(&savemutex);
+    return ret;
+}
+
+// close all connections
+void server_stop(){
+    FNAME();
+    if(listenfd < 0) return;
+    shutdown(listenfd, SHUT_RDWR);
+    pthread_join(listenthread, NULL);
+    close(listenfd);
+    listenfd = -1;
+    if(unixpath){
+        unlink(unixpath);
+        FREE(unixpath);
+    }
+    // readers will remove clients by themselves
+    pthread_mutex_lock(&listmutex);
+    for(client *c = clients; c; c = c->next) shutdown(c->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&listmutex);
+    for(int i = 0; i < 100; ++i){
+        pthread_mutex_lock(&listmutex);
+        int n = nclients;
+        pthread_mutex_unlock(&listmutex);
+        if(n == 0) break;
+        usleep(10000);
+    }
+}
@@ -0,0 +1,210 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+// round `x` up to page size
+static size_t pgalign(size_t x){
+    size_t pg = (size_t)sysconf(_SC_PAGESIZE);
+    return (x + pg - 1) / pg * pg;
+}
+
+/**
+ * @brief shmring_create - create shared memory ring (old ring with same name is removed)
+ * @param name     - shm name (like "/grasshopper")
+ * @param nslots   - amount of slots
+ * @param slotsize - max size of frame data
+ * @return ring or NULL if failed
+ */
+shmring *shmring_create(const char *name, uint32_t nslots, uint32_t slotsize){
+    if(!name || !nslots || !slotsize) return NULL;
+    size_t dataoffset = pgalign(sizeof(shmring_hdr) + nslots * sizeof(shmslot));
+    slotsize = (uint32_t)pgalign(slotsize);
+    size_t len = dataoffset + (size_t)nslots * slotsize;
+    shm_unlink(name); // readers of old ring will keep their mapping
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if(fd < 0) return NULL;
+    if(ftruncate(fd, len)){
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED){
+        shm_unlink(name);
+        return NULL;
+    }
+    shmring *r = calloc(1, sizeof(shmring));
+    if(!r){
+        munmap(mem, len);
+        shm_unlink(name);
+        return NULL;
+    }
+    r->hdr = (shmring_hdr*) mem;
+    r->data = (uint8_t*)mem + dataoffset;
+    r->len = len;
+    r->name = strdup(name);
+    r->writer = 1;
+    r->hdr->version = SHMRING_VERSION;
+    r->hdr->nslots = nslots;
+    r->hdr->slotsize = slotsize;
+    r->hdr->dataoffset = dataoffset;
+    __atomic_store_n(&r->hdr->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+    return r;
+}
+
+/**
+ * @brief shmring_write - put next frame into ring & wake readers
+ * @param r    - ring
+ * @param data - image data (meta->h rows of meta->w bytes with meta->stride step)
+ * @param meta - frame metadata (its field `seq` is ignored)
+ * @return 0 if all OK
+ */
+int shmring_write(shmring *r, const uint8_t *data, const shmslot *meta){
+    if(!r || !r->writer || !data || !meta) return 1;
+    shmring_hdr *hdr = r->hdr;
+    size_t size = (size_t)meta->w * meta->h;
+    if(size > hdr->slotsize) return 1;
+    uint64_t n = hdr->head;
+    shmslot *slot = &hdr->slots[n % hdr->nslots];
+    // seqlock: odd value means slot is busy
+    __atomic_store_n(&slot->seq, 2*n + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    uint8_t *dst = r->data + (n % hdr->nslots) * (size_t)hdr->slotsize;
+    if(meta->stride == meta->w) memcpy(dst, data, size);
+    else for(uint32_t y = 0; y < meta->h; ++y)
+        memcpy(dst + (size_t)y * meta->w, data + (size_t)y * meta->stride, meta->w);
+    slot->index = meta->index;
+    slot->timestamp = meta->timestamp;
+    slot->exptime = meta->exptime;
+    slot->gain = meta->gain;
+    slot->w = meta->w;
+    slot->h = meta->h;
+    slot->stride = meta->w;
+    slot->size = (uint32_t)size;
+    __atomic_store_n(&slot->seq, 2*n + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&hdr->head, n + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&hdr->futex, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &hdr->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    return 0;
+}
+
+/**
+ * @brief shmring_open - open existing ring for reading
+ * @param name - shm name
+ * @return ring or NULL if failed
+ */
+shmring *shmring_open(const char *name){
+    if(!name) return NULL;
+    int fd = shm_open(name, O_RDONLY, 0);
+    if(fd < 0) return NULL;
+    struct stat st;
+    if(fstat(fd, &st) || (size_t)st.st_size < sizeof(shmring_hdr)){
+        close(fd);
+        return NULL;
+    }
+    void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mem == MAP_FAILED) return NULL;
+    shmring_hdr *hdr = (shmring_hdr*) mem;
+    if(__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHMRING_MAGIC || hdr->version != SHMRING_VERSION ||
+        hdr->dataoffset + (size_t)hdr->nslots * hdr->slotsize > (size_t)st.st_size){
+        munmap(mem, st.st_size);
+        return NULL;
+    }
+    shmring *r = calloc(1, sizeof(shmring));
+    if(!r){
+        munmap(mem, st.st_size);
+        return NULL;
+    }
+    r->hdr = hdr;
+    r->data = (uint8_t*)mem + hdr->dataoffset;
+    r->len = st.st_size;
+    r->name = strdup(name);
+    return r;
+}
+
+// amount of frames written into ring (number of next frame)
+uint64_t shmring_head(shmring *r){
+    if(!r) return 0;
+    return __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief shmring_wait - wait until frame `n` appears in ring
+ * @param r          - ring
+ * @param n          - number of frame
+ * @param timeout_ms - timeout
+ * @return current head (head <= n if timeout occured)
+ */
+uint64_t shmring_wait(shmring *r, uint64_t n, int timeout_ms){
+    if(!r) return 0;
+    uint32_t f = __atomic_load_n(&r->hdr->futex, __ATOMIC_ACQUIRE);
+    uint64_t head = shmring_head(r);
+    if(head > n || timeout_ms <= 0) return head;
+    struct timespec ts = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L};
+    syscall(SYS_futex, &r->hdr->futex, FUTEX_WAIT, f, &ts, NULL, 0);
+    return shmring_head(r);
+}
+
+/**
+ * @brief shmring_frame - get frame data without copying
+ * @param r    - ring
+ * @param n    - number of frame
+ * @param meta (o) - copy of frame metadata
+ * @return pointer to data in shared memory or NULL if frame isn't ready or overwritten;
+ *      writer can overwrite data while reader works with it, so check it by shmring_check() after
+ */
+const uint8_t *shmring_frame(shmring *r, uint64_t n, shmslot *meta){
+    if(!r) return NULL;
+    shmslot *slot = &r->hdr->slots[n % r->hdr->nslots];
+    if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != 2*n + 2) return NULL;
+    if(meta){
+        *meta = *slot;
+        if(!shmring_check(r, n)) return NULL;
+    }
+    return r->data + (n % r->hdr->nslots) * (size_t)r->hdr->slotsize;
+}
+
+// return 1 if data of frame `n` is still valid
+int shmring_check(shmring *r, uint64_t n){
+    if(!r) return 0;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&r->hdr->slots[n % r->hdr->nslots].seq, __ATOMIC_RELAXED) == 2*n + 2;
+}
+
+// unmap ring (writer also removes shm object)
+void shmring_close(shmring *r){
+    if(!r) return;
+    munmap(r->hdr, r->len);
+    if(r->writer) shm_unlink(r->name);
+    free(r->name);
+    free(r);
+}
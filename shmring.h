@@ -0,0 +1,83 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Ring buffer of frames in POSIX shared memory.
+ * This file and shmring.c depend only on libc, so other programs can use them as reader library:
+ *      shmring *r = shmring_open("/grasshopper");
+ *      uint64_t n = shmring_head(r);
+ *      while(1){
+ *          if(shmring_wait(r, n, 1000) <= n) continue; // timeout
+ *          shmslot meta;
+ *          const uint8_t *data = shmring_frame(r, n, &meta);
+ *          if(data){ ...process data in place...; if(!shmring_check(r, n)) ...frame was overwritten... }
+ *          ++n;
+ *      }
+ */
+
+#pragma once
+#ifndef SHMRING__
+#define SHMRING__
+
+#include <stdint.h>
+
+#define SHMRING_MAGIC       (0x47524853)
+#define SHMRING_VERSION     (1)
+
+// metadata of frame in slot
+typedef struct{
+    volatile uint64_t seq;  // odd while writing, 2*n+2 when frame `n` is ready
+    uint64_t index;         // frame number of grabber
+    double timestamp;       // UNIX time of grabbing
+    float exptime;          // exposition time (ms)
+    float gain;             // gain (dB)
+    uint32_t w, h, stride;  // geometry of 8-bit image
+    uint32_t size;          // size of data
+} shmslot;
+
+// header in the beginning of shared memory, data of slots are page-aligned after it
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nslots;        // amount of slots
+    uint32_t slotsize;      // max size of image data in slot
+    uint64_t dataoffset;    // offset of first slot data
+    volatile uint64_t head; // amount of frames written
+    volatile uint32_t futex;// changed after each frame: readers wait on it
+    uint32_t reserved;
+    shmslot slots[];
+} shmring_hdr;
+
+typedef struct{
+    shmring_hdr *hdr;       // mapped memory
+    uint8_t *data;          // first slot data
+    size_t len;             // size of mapping
+    char *name;             // shm name
+    int writer;             // ==1 for writer (it unlinks shm at closing)
+} shmring;
+
+shmring *shmring_create(const char *name, uint32_t nslots, uint32_t slotsize);
+int shmring_write(shmring *r, const uint8_t *data, const shmslot *meta);
+shmring *shmring_open(const char *name);
+uint64_t shmring_head(shmring *r);
+uint64_t shmring_wait(shmring *r, uint64_t n, int timeout_ms);
+const uint8_t *shmring_frame(shmring *r, uint64_t n, shmslot *meta);
+int shmring_check(shmring *r, uint64_t n);
+void shmring_close(shmring *r);
+
+#endif // SHMRING__
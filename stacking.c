@@ -0,0 +1,379 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "demosaic.h"
+#include "image_functions.h"
+#include "stacking.h"
+
+// max amount of frames: counters are uint16_t, sum of squares of 8-bit values fits uint32_t
+#define STACK_MAXFRAMES     (65535)
+// sigma clipping works after this amount of frames
+#define STACK_MINCLIP       (5)
+// preview is calculated by blocks of rows: stack_add() waits only for one block
+#define STACK_PREVROWS      (64)
+
+static const char *rejectnames[] = {
+    [STACK_REJECT_NONE] = "none",
+    [STACK_REJECT_MINMAX] = "minmax",
+    [STACK_REJECT_SIGMA] = "sigma",
+};
+
+// stack is changed by grabbing thread and shown by image thread
+static pthread_mutex_t stackmutex = PTHREAD_MUTEX_INITIALIZER;
+static int sw = 0, sh = 0;              // geometry of stack
+static uint32_t *sum = NULL, *sumsq = NULL;
+static uint16_t *cnt = NULL;            // amount of values stacked in each pixel
+static uint8_t *vmin = NULL, *vmax = NULL; // for min/max rejection
+static uint8_t *aligned = NULL, *valid = NULL; // shifted frame & its mask
+static uint8_t *ones = NULL;            // mask row for frames without shift
+static float *refx = NULL, *refy = NULL, *curx = NULL, *cury = NULL; // projections for alignment
+static float *prevmean = NULL;          // mean image for preview (used only by image thread)
+static uint8_t *preview = NULL;         // it lives until exit: image thread could show it after stack_stop()
+static size_t previewsz = 0;
+static fc2Image previmg;
+static stackreject rejmode = STACK_REJECT_NONE;
+static double nsig2 = 9.;               // squared clipping level
+static int maxshift = 0;                // max shift for alignment (0 - don't align)
+static int nframes = 0, warned = 0;
+static uint64_t nstacked = 0;           // total amount of frames stacked (statistics)
+static double expsum = 0., stacktime = 0.;
+
+// return rejection type by its name or -1
+int stack_reject_byname(const char *name){
+    if(!name) return STACK_REJECT_NONE;
+    for(int i = 0; i <= STACK_REJECT_SIGMA; ++i)
+        if(strcasecmp(name, rejectnames[i]) == 0) return i;
+    return -1;
+}
+
+/**
+ * @brief stack_init - set up stacking (buffers are allocated by first frame)
+ * @param reject - rejection of outliers
+ * @param nsigma - level of sigma clipping
+ * @param shift  - max shift of frames for alignment (pixels), 0 - don't align
+ * @return 0 if all OK
+ */
+int stack_init(stackreject reject, float nsigma, int shift){
+    if(nsigma <= 0.f || shift < 0) return 1;
+    rejmode = reject;
+    nsig2 = (double)nsigma * nsigma;
+    maxshift = shift;
+    VMESG("Stacking: rejection %s, alignment %s", rejectnames[reject], shift ? "on" : "off");
+    return 0;
+}
+
+static void stack_alloc(int w, int h){
+    size_t N = (size_t)w * h;
+    sw = w; sh = h;
+    sum = MALLOC(uint32_t, N);
+    sumsq = MALLOC(uint32_t, N);
+    cnt = MALLOC(uint16_t, N);
+    if(rejmode == STACK_REJECT_MINMAX){
+        vmin = MALLOC(uint8_t, N);
+        vmax = MALLOC(uint8_t, N);
+        memset(vmin, 0xff, N);
+    }
+    ones = MALLOC(uint8_t, w);
+    memset(ones, 1, w);
+    if(maxshift){
+        aligned = MALLOC(uint8_t, N);
+        valid = MALLOC(uint8_t, N);
+        refx = MALLOC(float, w); curx = MALLOC(float, w);
+        refy = MALLOC(float, h); cury = MALLOC(float, h);
+    }
+}
+
+// projections of frame onto axes (with mean subtracted)
+static void projections(framebuf *fb, float *px, float *py){
+    double total = 0.;
+    for(int x = 0; x < sw; ++x) px[x] = 0.f;
+    for(int y = 0; y < sh; ++y){
+        const uint8_t *p = &fb->data[y * fb->stride];
+        uint32_t s = 0;
+        for(int x = 0; x < sw; ++x){
+            px[x] += p[x];
+            s += p[x];
+        }
+        py[y] = (float)s;
+        total += s;
+    }
+    float mx = (float)(total / sw), my = (float)(total / sh);
+    for(int x = 0; x < sw; ++x) px[x] -= mx;
+    for(int y = 0; y < sh; ++y) py[y] -= my;
+}
+
+/**
+ * @brief xcorr1d - find shift of `cur` relative to `ref` by maximum of cross-correlation
+ * @param ref, cur - profiles
+ * @param n        - their length
+ * @return sub-pixel shift (cur[x+shift] == ref[x])
+ */
+static float xcorr1d(const float *ref, const float *cur, int n){
+    int M = (maxshift < n / 2) ? maxshift : n / 2;
+    double c[2*M+1];
+    int best = 0;
+    for(int s = -M; s <= M; ++s){
+        int x0 = (s < 0) ? -s : 0, x1 = (s > 0) ? n - s : n;
+        double r = 0.;
+        for(int x = x0; x < x1; ++x) r += ref[x] * cur[x + s];
+        c[s + M] = r / (x1 - x0);
+        if(c[s + M] > c[best + M]) best = s;
+    }
+    float shift = (float)best;
+    if(best > -M && best < M){ // parabolic interpolation of peak
+        double a = c[best + M - 1], b = c[best + M], d = c[best + M + 1], den = a - 2.*b + d;
+        if(den < 0.) shift += (float)(0.5 * (a - d) / den);
+    }
+    return shift;
+}
+
+// shift frame by (dx, dy) with bilinear interpolation: aligned(x, y) = fb(x+dx, y+dy)
+// (Bayer frames are shifted only by even integers, so there's no interpolation)
+static void shiftframe(framebuf *fb, float dx, float dy){
+    int ix = (int)floorf(dx), iy = (int)floorf(dy);
+    uint32_t fx = (uint32_t)((dx - ix) * 256.f + 0.5f), fy = (uint32_t)((dy - iy) * 256.f + 0.5f);
+    if(fx == 256){ ++ix; fx = 0; }
+    if(fy == 256){ ++iy; fy = 0; }
+    uint32_t w00 = (256 - fx) * (256 - fy), w10 = fx * (256 - fy), w01 = (256 - fx) * fy, w11 = fx * fy;
+    int s = fb->stride;
+    for(int y = 0; y < sh; ++y){
+        uint8_t *o = &aligned[y * sw], *m = &valid[y * sw];
+        int ys = y + iy;
+        if(ys < 0 || ys + (fy ? 1 : 0) >= sh){
+            memset(m, 0, sw);
+            continue;
+        }
+        const uint8_t *p0 = &fb->data[ys * s], *p1 = fy ? p0 + s : p0;
+        for(int x = 0; x < sw; ++x){
+            int xs = x + ix;
+            if(xs < 0 || xs + (fx ? 1 : 0) >= sw){
+                m[x] = 0;
+                continue;
+            }
+            int xs1 = fx ? xs + 1 : xs;
+            o[x] = (uint8_t)((p0[xs] * w00 + p0[xs1] * w10 + p1[xs] * w01 + p1[xs1] * w11 + 32768) >> 16);
+            m[x] = 1;
+        }
+    }
+}
+
+/**
+ * @brief addrow - add one row to accumulators (loops are branchless, so compiler can vectorize them)
+ * @param p - data
+ * @param m - mask (1 for valid pixels)
+ * @param i - index of first pixel in accumulators
+ */
+__attribute__((optimize("tree-vectorize")))
+static void addrow(const uint8_t *restrict p, const uint8_t *restrict m, size_t i, int w){
+    uint32_t *restrict S = &sum[i], *restrict S2 = &sumsq[i];
+    uint16_t *restrict C = &cnt[i];
+    if(rejmode == STACK_REJECT_SIGMA) for(int x = 0; x < w; ++x){
+        // |v - mean| <= k*sigma  <=>  (n*v - S)^2 <= k^2*(n*S2 - S^2) (+n^2 for integer data)
+        double n = C[x], d = n * p[x] - S[x], var = n * S2[x] - (double)S[x] * S[x];
+        uint32_t ok = m[x] & ((C[x] < STACK_MINCLIP) | (d * d <= nsig2 * var + n * n));
+        S[x] += ok * p[x];
+        S2[x] += ok * p[x] * p[x];
+        C[x] += ok;
+    }else for(int x = 0; x < w; ++x){
+        uint32_t ok = m[x];
+        S[x] += ok * p[x];
+        S2[x] += ok * p[x] * p[x];
+        C[x] += ok;
+    }
+    if(rejmode == STACK_REJECT_MINMAX){
+        uint8_t *restrict mn = &vmin[i], *restrict mx = &vmax[i];
+        for(int x = 0; x < w; ++x){
+            uint8_t v = p[x];
+            mn[x] = (m[x] && v < mn[x]) ? v : mn[x];
+            mx[x] = (m[x] && v > mx[x]) ? v : mx[x];
+        }
+    }
+}
+
+/**
+ * @brief stack_add - add frame to stack
+ * @param fb - frame
+ * @return amount of frames in stack or 0 if frame wasn't added
+ */
+int stack_add(framebuf *fb){
+    if(!fb) return 0;
+    pthread_mutex_lock(&stackmutex);
+    if(!sum) stack_alloc(fb->w, fb->h);
+    if(fb->w != sw || fb->h != sh || nframes == STACK_MAXFRAMES){
+        if(!warned) WARNX("Stacking: frame size changed or stack is full, frame skipped");
+        warned = 1;
+        pthread_mutex_unlock(&stackmutex);
+        return 0;
+    }
+    double t0 = dtime();
+    const uint8_t *data = fb->data, *mask = NULL;
+    int stride = fb->stride;
+    if(maxshift){
+        if(!nframes) projections(fb, refx, refy); // the first frame is reference
+        else{
+            projections(fb, curx, cury);
+            float dx = xcorr1d(refx, curx, sw), dy = xcorr1d(refy, cury, sh);
+            if(fb->info.bayer != BAYER_NONE){ // shift by whole 2x2 cells: interpolation would mix colours
+                dx = 2.f * roundf(dx / 2.f);
+                dy = 2.f * roundf(dy / 2.f);
+            }
+            VDBG("Stacking: frame %d shifted by (%.2f, %.2f)", nframes + 1, dx, dy);
+            if(dx != 0.f || dy != 0.f){
+                shiftframe(fb, dx, dy);
+                data = aligned;
+                mask = valid;
+                stride = sw;
+            }
+        }
+    }
+    for(int y = 0; y < sh; ++y)
+        addrow(&data[y * stride], mask ? &mask[y * sw] : ones, (size_t)y * sw, sw);
+    if(!isnan(fb->info.exptime)) expsum += fb->info.exptime;
+    stacktime += dtime() - t0;
+    ++nstacked;
+    int n = ++nframes;
+    pthread_mutex_unlock(&stackmutex);
+    return n;
+}
+
+// calculate mean image of rows [y0, y1) into `dst` (stackmutex should be locked)
+static void mkmean(float *dst, int y0, int y1){
+    for(size_t i = (size_t)y0 * sw; i < (size_t)y1 * sw; ++i){
+        uint32_t n = cnt[i], s = sum[i];
+        if(vmin && n > 2){
+            s -= vmin[i] + vmax[i];
+            n -= 2;
+        }
+        dst[i] = n ? (float)s / n : 0.f;
+    }
+}
+
+/**
+ * @brief stack_result - copy current stack (mean of frames) out to save it by writers
+ * @return buffer with float image (`info.ncombine` frames, mean `info.exptime`; call framebuf_unref() after
+ *          saving) or NULL if stack is empty
+ */
+framebuf *stack_result(){
+    pthread_mutex_lock(&stackmutex);
+    if(!nframes){
+        pthread_mutex_unlock(&stackmutex);
+        return NULL;
+    }
+    framebuf *fb = framebuf_get((size_t)sw * sh * sizeof(float));
+    mkmean((float*)fb->data, 0, sh);
+    fb->w = sw;
+    fb->h = sh;
+    fb->stride = sw;
+    fb->info = (frameinfo){.index = nframes, .timestamp = dtime(), .exptime = (float)(expsum / nframes),
+                           .gain = NAN, .obstime = NAN, .ncombine = nframes};
+    pthread_mutex_unlock(&stackmutex);
+    return fb;
+}
+
+/**
+ * @brief stack_writefb - save float image got by stack_result() into FITS file (savefn for writers)
+ * @return 0 if all OK
+ */
+int stack_writefb(char *filename, framebuf *fb){
+    if(!fb || fb->info.ncombine < 1) return 1;
+    if(writefloat(filename, (float*)fb->data, fb->w, fb->h, "stack", fb->info.ncombine, fb->info.exptime)){
+        WARNX("Can't save stack");
+        return 1;
+    }
+    VMESG("Stack of %d frames saved into %s", fb->info.ncombine, filename);
+    return 0;
+}
+
+// current stack linearly scaled into 8 bits for displaying (NULL if stack is empty)
+fc2Image *stack_preview(){
+    pthread_mutex_lock(&stackmutex);
+    int w = sw, h = sh, empty = !nframes;
+    pthread_mutex_unlock(&stackmutex);
+    if(empty) return NULL;
+    size_t N = (size_t)w * h;
+    if(N > previewsz){
+        FREE(preview);
+        FREE(prevmean);
+        preview = MALLOC(uint8_t, N);
+        prevmean = MALLOC(float, N);
+        previewsz = N;
+    }
+    // mean is copied out by blocks of rows, so grabbing thread isn't blocked for whole frame
+    for(int y = 0; y < h; y += STACK_PREVROWS){
+        pthread_mutex_lock(&stackmutex);
+        if(!nframes || sw != w || sh != h){ // stack was stopped meanwhile
+            pthread_mutex_unlock(&stackmutex);
+            return NULL;
+        }
+        mkmean(prevmean, y, (y + STACK_PREVROWS < h) ? y + STACK_PREVROWS : h);
+        pthread_mutex_unlock(&stackmutex);
+    }
+    float min = prevmean[0], max = prevmean[0];
+    for(size_t i = 1; i < N; ++i){
+        if(prevmean[i] < min) min = prevmean[i];
+        if(prevmean[i] > max) max = prevmean[i];
+    }
+    float scale = (max > min) ? 255.f / (max - min) : 1.f;
+    for(size_t i = 0; i < N; ++i) preview[i] = (uint8_t)((prevmean[i] - min) * scale + 0.5f);
+    previmg.rows = h;
+    previmg.cols = w;
+    previmg.stride = w;
+    previmg.pData = preview;
+    return &previmg;
+}
+
+// start new stack keeping allocated buffers (the next frame will be reference for alignment)
+void stack_reset(){
+    pthread_mutex_lock(&stackmutex);
+    if(sum){
+        size_t N = (size_t)sw * sh;
+        memset(sum, 0, N * sizeof(uint32_t));
+        memset(sumsq, 0, N * sizeof(uint32_t));
+        memset(cnt, 0, N * sizeof(uint16_t));
+        if(vmin){
+            memset(vmin, 0xff, N);
+            memset(vmax, 0, N);
+        }
+    }
+    nframes = 0;
+    expsum = 0.;
+    pthread_mutex_unlock(&stackmutex);
+}
+
+// show statistics & free buffers
+void stack_stop(){
+    pthread_mutex_lock(&stackmutex);
+    if(nstacked) VMESG("Stacking: %llu frames, %.2fms per frame", (unsigned long long)nstacked,
+                       stacktime * 1000. / nstacked);
+    FREE(sum); FREE(sumsq); FREE(cnt);
+    FREE(vmin); FREE(vmax);
+    FREE(aligned); FREE(valid); FREE(ones);
+    FREE(refx); FREE(refy); FREE(curx); FREE(cury);
+    nframes = 0;
+    nstacked = 0;
+    expsum = stacktime = 0.;
+    pthread_mutex_unlock(&stackmutex);
+}
@@ -0,0 +1,43 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef STACKING__
+#define STACKING__
+
+#include <C/FlyCapture2_C.h>
+
+#include "framepool.h"
+
+// rejection of outliers
+typedef enum{
+    STACK_REJECT_NONE,      // simple mean
+    STACK_REJECT_MINMAX,    // exclude min & max values of each pixel
+    STACK_REJECT_SIGMA      // exclude values far from running mean
+} stackreject;
+
+int  stack_reject_byname(const char *name);
+int  stack_init(stackreject reject, float nsigma, int maxshift);
+int  stack_add(framebuf *fb);
+framebuf *stack_result();
+int  stack_writefb(char *filename, framebuf *fb);
+void stack_reset();
+fc2Image *stack_preview();
+void stack_stop();
+
+#endif // STACKING__
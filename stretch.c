@@ -0,0 +1,418 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <math.h>
+#include <string.h>
+#include <strings.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "parallel.h"
+#include "stretch.h"
+
+static const char *modenames[] = {
+    [STRETCH_MINMAX] = "minmax",
+    [STRETCH_PERCENT] = "percent",
+    [STRETCH_ASINH] = "asinh",
+    [STRETCH_ZSCALE] = "zscale",
+    [STRETCH_EQUALIZE] = "equalize",
+    [STRETCH_CLAHE] = "clahe",
+};
+
+static stretchmode mode = STRETCH_EQUALIZE; // changed by user (atomic access)
+static double alpha = STRETCH_SMOOTH;       // weight of new histogram
+static int step = 1;                        // take every step-th row & pixel
+
+// state of curves: it's used only by thread calling stretch_update()
+static stretchmode curmode = STRETCH_AMOUNT;// mode of current curves (STRETCH_AMOUNT - no curves yet)
+static int currect[4];                      // region of current curves
+static double ghist[256];                   // smoothed histogram (part of pixels in each bin)
+static double gnpix = 1.;                   // amount of pixels in last sample
+static uint8_t glevels[256];                // global curve
+static int nx = 1, ny = 1;                  // CLAHE grid
+static double thist[STRETCH_TILES][STRETCH_TILES][256];
+static uint8_t tlut[STRETCH_TILES][STRETCH_TILES][256];
+
+// tiles & weight of second one for each column of region
+typedef struct{
+    uint8_t t0, t1;
+    uint16_t w1;    // 0..256
+} colmap;
+static colmap *cols = NULL;
+static int ncols = 0;
+
+// statistics
+static uint64_t nframes = 0;
+static double ttotal = 0., tmax = 0., tcur = 0.; // total, max & current frame time
+
+typedef struct{
+    const uint8_t *data;
+    int s;
+    int x0, y0, w, h;       // region
+    int reset;              // don't smooth histograms
+    uint32_t *hysto;        // common histogram
+    const uint8_t (*lut)[3];
+    uint8_t *rgb;
+    int rgbw;
+} stretchctx;
+
+/**
+ * @brief stretch_byname - get stretch mode by its name
+ * @param name - mode name (NULL or empty - equalize)
+ * @return mode or -1 if wrong name
+ */
+int stretch_byname(const char *name){
+    if(!name || !*name) return STRETCH_EQUALIZE;
+    for(int i = 0; i < STRETCH_AMOUNT; ++i)
+        if(strcasecmp(name, modenames[i]) == 0) return i;
+    return -1;
+}
+
+const char *stretch_name(stretchmode m){
+    if(m < 0 || m >= STRETCH_AMOUNT) return "unknown";
+    return modenames[m];
+}
+
+/**
+ * @brief stretch_init - set parameters of stretching
+ * @param m      - mode
+ * @param smooth - weight of new histogram in moving average (0..1], 1 - don't smooth
+ * @param K      - build histogram by every K-th row & pixel
+ * @return 0 if all OK
+ */
+int stretch_init(stretchmode m, double smooth, int K){
+    if(m < 0 || m >= STRETCH_AMOUNT || !(smooth > 0. && smooth <= 1.) || K < 1) return 1;
+    __atomic_store_n(&mode, m, __ATOMIC_RELAXED);
+    alpha = smooth;
+    step = K;
+    VDBG("Preview stretch: %s, histogram smoothing %g, sampling every %d pixel[s]", modenames[m], smooth, K);
+    return 0;
+}
+
+stretchmode stretch_mode(){
+    return __atomic_load_n(&mode, __ATOMIC_RELAXED);
+}
+
+void stretch_setmode(stretchmode m){
+    if(m < 0 || m >= STRETCH_AMOUNT) return;
+    __atomic_store_n(&mode, m, __ATOMIC_RELAXED);
+}
+
+// cycle switch between modes
+void stretch_roll(){
+    stretchmode m = (stretch_mode() + 1) % STRETCH_AMOUNT;
+    stretch_setmode(m);
+    VMESG("Preview stretch: %s", modenames[m]);
+}
+
+// smooth histogram `H` by new one
+static void smooth(double H[256], const uint32_t hnew[256], int reset){
+    double n = 0.;
+    for(int i = 0; i < 256; ++i) n += hnew[i];
+    if(n < 1.) return;
+    if(reset) for(int i = 0; i < 256; ++i) H[i] = hnew[i] / n;
+    else for(int i = 0; i < 256; ++i) H[i] += alpha * (hnew[i] / n - H[i]);
+}
+
+// cumulative histogram
+static void cumulative(const double H[256], double C[256]){
+    double s = 0.;
+    for(int i = 0; i < 256; ++i){
+        s += H[i];
+        C[i] = s;
+    }
+}
+
+// pixel value of given part `q` of histogram (interpolated inside bin)
+static double quantile(const double H[256], const double C[256], double q){
+    for(int i = 0; i < 256; ++i){
+        if(C[i] < q) continue;
+        if(H[i] <= 0.) return i;
+        return i + 1. - (C[i] - q) / H[i];
+    }
+    return 256.;
+}
+
+// add histogram of sampled rows [i0, i1) to common one
+static void ghistrows(void *arg, int i0, int i1){
+    stretchctx *c = (stretchctx*) arg;
+    uint32_t hysto[256] = {0};
+    for(int i = i0; i < i1; ++i){
+        const uint8_t *ptr = &c->data[(size_t)(c->y0 + i * step) * c->s + c->x0];
+        if(step == 1) for(int x = 0; x < c->w; ++x) ++hysto[ptr[x]];
+        else for(int x = 0; x < c->w; x += step) ++hysto[ptr[x]];
+    }
+    for(int i = 0; i < 256; ++i)
+        if(hysto[i]) __atomic_add_fetch(&c->hysto[i], hysto[i], __ATOMIC_RELAXED);
+}
+
+// CLAHE: histograms & curves of tile rows [ty0, ty1)
+static void ttilerows(void *arg, int ty0, int ty1){
+    stretchctx *c = (stretchctx*) arg;
+    uint32_t hysto[STRETCH_TILES][256];
+    for(int ty = ty0; ty < ty1; ++ty){
+        memset(hysto, 0, sizeof(hysto));
+        int ya = ty * c->h / ny, yb = (ty + 1) * c->h / ny;
+        ya = (ya + step - 1) / step * step; // the first sampled row
+        for(int y = ya; y < yb; y += step){
+            const uint8_t *ptr = &c->data[(size_t)(c->y0 + y) * c->s + c->x0];
+            for(int tx = 0; tx < nx; ++tx){
+                int xa = tx * c->w / nx, xb = (tx + 1) * c->w / nx;
+                xa = (xa + step - 1) / step * step;
+                uint32_t *h = hysto[tx];
+                for(int x = xa; x < xb; x += step) ++h[ptr[x]];
+            }
+        }
+        for(int tx = 0; tx < nx; ++tx){
+            double *H = thist[ty][tx], C[256], excess = 0., clipped[256];
+            const double limit = STRETCH_CLIPLIMIT / 256.;
+            smooth(H, hysto[tx], c->reset);
+            for(int i = 0; i < 256; ++i){ // clip histogram & spread excess over all bins
+                if(H[i] > limit){
+                    excess += H[i] - limit;
+                    clipped[i] = limit;
+                }else clipped[i] = H[i];
+            }
+            excess /= 256.;
+            for(int i = 0; i < 256; ++i) clipped[i] += excess;
+            cumulative(clipped, C);
+            for(int i = 0; i < 256; ++i){
+                double l = 256. * C[i];
+                tlut[ty][tx][i] = (l < 255.) ? (uint8_t)l : 255;
+            }
+        }
+    }
+}
+
+// linear (or asinh) curve between levels `lo` & `hi`
+static void linlevels(double lo, double hi, int isasinh){
+    if(hi - lo < 1.) hi = lo + 1.;
+    double norm = asinh(STRETCH_ASINHB);
+    for(int i = 0; i < 256; ++i){
+        double x = (i + 0.5 - lo) / (hi - lo);
+        if(x < 0.) x = 0.;
+        else if(x > 1.) x = 1.;
+        if(isasinh) x = asinh(STRETCH_ASINHB * x) / norm;
+        double l = 256. * x;
+        glevels[i] = (l < 255.) ? (uint8_t)l : 255;
+    }
+}
+
+// IRAF zscale by sorted pixels values (quantiles of histogram): line fitted to them with
+// rejection of outliers, its slope reduced by contrast gives range around median
+static void zscale(const double H[256], const double C[256], double lo, double hi){
+    enum{NPTS = 256};
+    double z[NPTS];
+    int good[NPTS], ngood = NPTS;
+    for(int k = 0; k < NPTS; ++k){
+        z[k] = quantile(H, C, (k + 0.5) / NPTS);
+        good[k] = 1;
+    }
+    double a = z[NPTS / 2], b = 0.;
+    for(int iter = 0; iter < STRETCH_ZITER; ++iter){
+        double sx = 0., sz = 0., sxx = 0., sxz = 0., n = 0.;
+        for(int k = 0; k < NPTS; ++k){
+            if(!good[k]) continue;
+            double x = (k + 0.5) / NPTS - 0.5;
+            sx += x; sz += z[k]; sxx += x * x; sxz += x * z[k]; n += 1.;
+        }
+        double d = n * sxx - sx * sx;
+        if(n < 2. || d <= 0.) break;
+        b = (n * sxz - sx * sz) / d;
+        a = (sz - b * sx) / n;
+        double s2 = 0.;
+        for(int k = 0; k < NPTS; ++k){
+            if(!good[k]) continue;
+            double r = z[k] - a - b * ((k + 0.5) / NPTS - 0.5);
+            s2 += r * r;
+        }
+        double lim = STRETCH_ZREJECT * sqrt(s2 / n);
+        int nrej = 0;
+        for(int k = 0; k < NPTS; ++k){
+            if(!good[k]) continue;
+            if(fabs(z[k] - a - b * ((k + 0.5) / NPTS - 0.5)) > lim){
+                good[k] = 0;
+                ++nrej;
+            }
+        }
+        ngood -= nrej;
+        if(!nrej || ngood < NPTS / 2) break;
+    }
+    double median = quantile(H, C, 0.5), half = 0.5 * b / STRETCH_ZCONTRAST;
+    double z1 = median - half, z2 = median + half;
+    if(z1 < lo) z1 = lo;
+    if(z2 > hi) z2 = hi;
+    linlevels(z1, z2, 0);
+}
+
+// build global curve by smoothed histogram
+static void globallevels(stretchmode m){
+    double C[256];
+    cumulative(ghist, C);
+    int lo = 0, hi = 255;
+    double thres = 0.5 / gnpix; // less than a pixel of current frame
+    while(lo < 255 && ghist[lo] <= thres) ++lo;
+    while(hi > lo && ghist[hi] <= thres) --hi;
+    switch(m){
+        case STRETCH_MINMAX:
+            linlevels(lo, hi + 1, 0);
+        break;
+        case STRETCH_PERCENT:
+        case STRETCH_ASINH:
+            linlevels(quantile(ghist, C, STRETCH_CLIPLOW / 100.), quantile(ghist, C, STRETCH_CLIPHIGH / 100.),
+                      m == STRETCH_ASINH);
+        break;
+        case STRETCH_ZSCALE:
+            zscale(ghist, C, lo, hi + 1);
+        break;
+        default: // equalize
+            for(int i = 0; i < 256; ++i){
+                double l = 256. * C[i];
+                glevels[i] = (l < 255.) ? (uint8_t)l : 255;
+            }
+    }
+}
+
+/**
+ * @brief stretch_update - take histogram[s] of new image & update curves (not reentrant)
+ * @param data - image
+ * @param s    - its stride
+ * @param rect - region of image (x, y, w, h)
+ */
+void stretch_update(const uint8_t *data, int s, const int rect[4]){
+    if(rect[2] < 1 || rect[3] < 1) return;
+    double t0 = dtime();
+    stretchmode m = stretch_mode();
+    stretchctx c = {.data = data, .s = s, .x0 = rect[0], .y0 = rect[1], .w = rect[2], .h = rect[3]};
+    c.reset = (m != curmode);
+    if(m == STRETCH_CLAHE){
+        int gx = rect[2] / STRETCH_MINTILE, gy = rect[3] / STRETCH_MINTILE;
+        if(gx > STRETCH_TILES) gx = STRETCH_TILES;
+        else if(gx < 1) gx = 1;
+        if(gy > STRETCH_TILES) gy = STRETCH_TILES;
+        else if(gy < 1) gy = 1;
+        if(gx != nx || gy != ny || memcmp(rect, currect, sizeof(currect))) c.reset = 1; // tiles moved
+        nx = gx; ny = gy;
+        parallel_for(0, ny, (size_t)rect[2] * rect[3] / ny / step / step, ttilerows, &c);
+    }else{
+        uint32_t hysto[256] = {0};
+        c.hysto = hysto;
+        int nrows = (rect[3] + step - 1) / step;
+        parallel_for(0, nrows, (size_t)(rect[2] + step - 1) / step, ghistrows, &c);
+        smooth(ghist, hysto, c.reset);
+        gnpix = (double)nrows * ((rect[2] + step - 1) / step);
+        globallevels(m);
+    }
+    curmode = m;
+    memcpy(currect, rect, sizeof(currect));
+    tcur = dtime() - t0;
+    ++nframes;
+    ttotal += tcur;
+    if(tcur > tmax) tmax = tcur;
+}
+
+// return 1 if curves are local (stretch_map() should be used instead of global levels)
+int stretch_local(){
+    return (curmode == STRETCH_CLAHE);
+}
+
+/**
+ * @brief stretch_levels - get global curve
+ * @param levels - new pixel value by old one
+ */
+void stretch_levels(uint8_t levels[256]){
+    if(curmode == STRETCH_AMOUNT || curmode == STRETCH_CLAHE){ // no global curve
+        for(int i = 0; i < 256; ++i) levels[i] = (uint8_t)i;
+    }else memcpy(levels, glevels, 256);
+}
+
+// CLAHE: convert rows [y0, y1) of region into RGB
+static void maprows(void *arg, int y0, int y1){
+    stretchctx *c = (stretchctx*) arg;
+    uint16_t (*rowlut)[256] = parallel_scratch(sizeof(uint16_t) * 256 * nx);
+    for(int y = y0; y < y1; ++y){
+        double fy = (y - c->y0 + 0.5) * ny / c->h - 0.5;
+        if(fy < 0.) fy = 0.;
+        int t0 = (int)fy;
+        if(t0 > ny - 1) t0 = ny - 1;
+        int t1 = (t0 < ny - 1) ? t0 + 1 : t0;
+        int w1 = (int)((fy - t0) * 256.);
+        if(w1 > 256) w1 = 256;
+        int w0 = 256 - w1;
+        for(int tx = 0; tx < nx; ++tx){ // curves of this row: interpolated between tile rows
+            const uint8_t *l0 = tlut[t0][tx], *l1 = tlut[t1][tx];
+            uint16_t *r = rowlut[tx];
+            for(int i = 0; i < 256; ++i) r[i] = (uint16_t)(l0[i] * w0 + l1[i] * w1);
+        }
+        const uint8_t *ptr = &c->data[(size_t)y * c->s + c->x0];
+        uint8_t *dst = &c->rgb[3 * ((size_t)y * c->rgbw + c->x0)];
+        for(int x = 0; x < c->w; ++x, dst += 3){
+            const colmap *cm = &cols[x];
+            int v = ptr[x], cw1 = cm->w1;
+            const uint8_t *p = c->lut[(rowlut[cm->t0][v] * (256 - cw1) + rowlut[cm->t1][v] * cw1 + 32768) >> 16];
+            dst[0] = p[0]; dst[1] = p[1]; dst[2] = p[2];
+        }
+    }
+}
+
+/**
+ * @brief stretch_map - convert region by local curves into RGB
+ * @param data - image
+ * @param s    - its stride
+ * @param rect - region (the same as for last stretch_update())
+ * @param lut  - colors of stretched values
+ * @param rgb  - output image
+ * @param rgbw - its width
+ */
+void stretch_map(const uint8_t *data, int s, const int rect[4], const uint8_t lut[256][3], uint8_t *rgb, int rgbw){
+    if(rect[2] < 1 || rect[3] < 1) return;
+    double t0 = dtime();
+    if(rect[2] > ncols){
+        FREE(cols);
+        cols = MALLOC(colmap, rect[2]);
+        ncols = rect[2];
+    }
+    for(int x = 0; x < rect[2]; ++x){
+        double fx = (x + 0.5) * nx / rect[2] - 0.5;
+        if(fx < 0.) fx = 0.;
+        int t = (int)fx;
+        if(t > nx - 1) t = nx - 1;
+        int w1 = (int)((fx - t) * 256.);
+        cols[x] = (colmap){.t0 = t, .t1 = (t < nx - 1) ? t + 1 : t, .w1 = (w1 > 256) ? 256 : w1};
+    }
+    stretchctx c = {.data = data, .s = s, .x0 = rect[0], .y0 = rect[1], .w = rect[2], .h = rect[3],
+                    .lut = lut, .rgb = rgb, .rgbw = rgbw};
+    parallel_for(rect[1], rect[1] + rect[3], 4 * (size_t)rect[2], maprows, &c);
+    double t = dtime() - t0;
+    ttotal += t;
+    tcur += t;
+    if(tcur > tmax) tmax = tcur;
+}
+
+// show statistics & free memory
+void stretch_stop(){
+    if(nframes)
+        VMESG("Preview stretch: %llu frames, %.2fms per frame (max %.2fms)", (unsigned long long)nframes,
+              ttotal * 1e3 / nframes, tmax * 1e3);
+    nframes = 0;
+    ttotal = tmax = tcur = 0.;
+    FREE(cols);
+    ncols = 0;
+    curmode = STRETCH_AMOUNT;
+}
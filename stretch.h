@@ -0,0 +1,70 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Stretching of preview: transfer curve of 8-bit image is built by histogram smoothed between frames
+ * (exponential moving average), so curve doesn't flicker; histogram could be taken from every K-th
+ * row & pixel only. CLAHE has own histogram for each tile of grid and maps pixels by bilinear
+ * interpolation between curves of nearest tiles.
+ */
+
+#pragma once
+#ifndef STRETCH__
+#define STRETCH__
+
+#include <stdint.h>
+
+// default weight of new histogram in EMA (1 - no smoothing)
+#define STRETCH_SMOOTH      (0.3)
+// percentiles of clipping for "percent" & "asinh" modes
+#define STRETCH_CLIPLOW     (0.5)
+#define STRETCH_CLIPHIGH    (99.5)
+// softening of asinh: y = asinh(b*x)/asinh(b)
+#define STRETCH_ASINHB      (10.)
+// zscale: contrast, rejection level (sigma) & max amount of iterations of line fitting
+#define STRETCH_ZCONTRAST   (0.25)
+#define STRETCH_ZREJECT     (2.5)
+#define STRETCH_ZITER       (5)
+// CLAHE: max grid size, min size of tile (pixels) & clip limit (relative to mean bin)
+#define STRETCH_TILES       (8)
+#define STRETCH_MINTILE     (16)
+#define STRETCH_CLIPLIMIT   (3.)
+
+typedef enum{
+    STRETCH_MINMAX,     // linear between min & max
+    STRETCH_PERCENT,    // linear between percentiles
+    STRETCH_ASINH,      // asinh between percentiles
+    STRETCH_ZSCALE,     // linear by IRAF zscale
+    STRETCH_EQUALIZE,   // histogram equalization (default)
+    STRETCH_CLAHE,      // contrast limited adaptive histogram equalization
+    STRETCH_AMOUNT
+} stretchmode;
+
+int  stretch_byname(const char *name);
+const char *stretch_name(stretchmode m);
+int  stretch_init(stretchmode m, double smooth, int step);
+stretchmode stretch_mode();
+void stretch_setmode(stretchmode m);
+void stretch_roll();
+void stretch_update(const uint8_t *data, int s, const int rect[4]);
+int  stretch_local();
+void stretch_levels(uint8_t levels[256]);
+void stretch_map(const uint8_t *data, int s, const int rect[4], const uint8_t lut[256][3], uint8_t *rgb, int rgbw);
+void stretch_stop();
+
+#endif // STRETCH__
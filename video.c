@@ -0,0 +1,441 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <usefull_macros.h>
+
+#include "aux.h"
+#include "demosaic.h"
+#include "image_functions.h"
+#include "video.h"
+
+// video encoder: stream is opened at start, header is written by first frame
+typedef struct{
+    const char *name;
+    int  (*open)(const char *target);
+    int  (*header)(int w, int h, int rgb);
+    int  (*frame)(const uint8_t *data, int stride);     // packed gray or RGB rows; -1 if frame is skipped
+    void (*close)();
+} videoenc;
+
+static const videoenc *enc = NULL;
+static FILE *vf = NULL;                 // output stream
+static int vw, vh, vrgb;                // geometry & color of video
+static int fpsnum = 25, fpsden = 1;     // frame rate
+// buffers of encoder thread: color frame & encoded data
+static uint8_t *rgbbuf = NULL, *encbuf = NULL;
+static size_t rgbsz = 0, encsz = 0;
+static uint64_t outbytes = 0;
+
+// encoder thread & queue
+static pthread_t thread;
+static pthread_mutex_t qmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qcond = PTHREAD_COND_INITIALIZER, qspace = PTHREAD_COND_INITIALIZER;
+static framebuf *queue[VIDEO_QUEUE];
+static int qhead = 0, qlen = 0, running = 0, stopping = 0, wait4space = 0, falsecol = 0;
+static int broken = 0;                  // write error: the rest frames are skipped
+
+// statistics
+static uint64_t nframes = 0, ndropped = 0, nskipped = 0;
+static double enctime = 0.;
+
+static uint8_t *getbuf(uint8_t **buf, size_t *bufsz, size_t size){
+    if(size > *bufsz){
+        FREE(*buf);
+        *buf = MALLOC(uint8_t, size);
+        *bufsz = size;
+    }
+    return *buf;
+}
+
+static int writeall(const void *data, size_t size){
+    if(size && fwrite(data, size, 1, vf) != 1) return 1;
+    outbytes += size;
+    return 0;
+}
+
+/********************************** YUV4MPEG2 **********************************/
+
+static int y4m_open(const char *target){
+    vf = fopen(target, "w");
+    if(!vf) WARN("Can't create %s", target);
+    return !vf;
+}
+
+static int y4m_pipeopen(const char *target){
+    signal(SIGPIPE, SIG_IGN); // encoder could die: get EPIPE instead
+    vf = popen(target + 1, "w");
+    if(!vf) WARN("Can't run %s", target + 1);
+    return !vf;
+}
+
+static int y4m_header(int w, int h, int rgb){
+    // gray is written as is (full range), color - as BT.601 4:4:4
+    return (fprintf(vf, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 %s\n", w, h, fpsnum, fpsden,
+                    rgb ? "C444" : "Cmono XCOLORRANGE=FULL") < 0);
+}
+
+static int y4m_frame(const uint8_t *data, int stride){
+    static const char frame[] = "FRAME\n";
+    if(writeall(frame, sizeof(frame) - 1)) return 1;
+    if(!vrgb){
+        if(stride == vw) return writeall(data, (size_t)vw * vh);
+        for(int y = 0; y < vh; ++y)
+            if(writeall(&data[(size_t)y * stride], vw)) return 1;
+        return 0;
+    }
+    size_t npix = (size_t)vw * vh;
+    uint8_t *Y = getbuf(&encbuf, &encsz, 3 * npix), *U = Y + npix, *V = U + npix;
+    for(int y = 0; y < vh; ++y){
+        const uint8_t *p = &data[(size_t)y * stride];
+        for(int x = 0; x < vw; ++x, p += 3, ++Y, ++U, ++V){
+            int r = p[0], g = p[1], b = p[2];
+            *Y = (uint8_t)((66 * r + 129 * g + 25 * b + 128 + (16 << 8)) >> 8);
+            *U = (uint8_t)((-38 * r - 74 * g + 112 * b + 128 + (128 << 8)) >> 8);
+            *V = (uint8_t)((112 * r - 94 * g - 18 * b + 128 + (128 << 8)) >> 8);
+        }
+    }
+    return writeall(encbuf, 3 * npix);
+}
+
+static void y4m_close(){
+    if(vf) fclose(vf);
+}
+
+static void y4m_pipeclose(){
+    if(!vf) return;
+    int r = pclose(vf);
+    if(r) WARNX("Video encoder exited with status %d", WIFEXITED(r) ? WEXITSTATUS(r) : r);
+}
+
+/********************************** AVI **********************************/
+
+// offsets of header fields to fill at the end
+#define AVI_RIFFSIZE    (4)
+#define AVI_TOTALFRAMES (48)
+#define AVI_LENGTH      (140)
+
+static off_t movipos = 0;               // position of 'movi' list size
+static uint32_t *aviidx = NULL;         // offset & size of frames
+static size_t nidx = 0, idxsz = 0;
+static int avistride, avifull = 0;
+
+static uint8_t *put32(uint8_t *p, uint32_t v){
+    p[0] = v & 0xff; p[1] = (v >> 8) & 0xff; p[2] = (v >> 16) & 0xff; p[3] = v >> 24;
+    return p + 4;
+}
+static uint8_t *put16(uint8_t *p, uint16_t v){
+    p[0] = v & 0xff; p[1] = v >> 8;
+    return p + 2;
+}
+static uint8_t *putfcc(uint8_t *p, const char *fcc){
+    memcpy(p, fcc, 4);
+    return p + 4;
+}
+
+static int avi_open(const char *target){
+    vf = fopen(target, "w+");
+    if(!vf) WARN("Can't create %s", target);
+    return !vf;
+}
+
+static int avi_header(int w, int h, int rgb){
+    uint8_t hdr[2048], *p = hdr;
+    avistride = ((rgb ? 3 : 1) * w + 3) & ~3; // rows of DIB are aligned by 4 bytes
+    uint32_t framesz = (uint32_t)avistride * h, strfsz = 40 + (rgb ? 0 : 1024);
+    uint32_t strlsz = 4 + 8 + 56 + 8 + strfsz, hdrlsz = 4 + 8 + 56 + 8 + strlsz;
+    p = putfcc(p, "RIFF"); p = put32(p, 0); p = putfcc(p, "AVI ");
+    p = putfcc(p, "LIST"); p = put32(p, hdrlsz); p = putfcc(p, "hdrl");
+    p = putfcc(p, "avih"); p = put32(p, 56);
+    p = put32(p, (uint32_t)(1e6 * fpsden / fpsnum + 0.5)); // us per frame
+    p = put32(p, (uint32_t)((double)framesz * fpsnum / fpsden));
+    p = put32(p, 0);
+    p = put32(p, 0x10); // AVIF_HASINDEX
+    p = put32(p, 0);    // total frames
+    p = put32(p, 0);
+    p = put32(p, 1);    // streams
+    p = put32(p, framesz);
+    p = put32(p, w); p = put32(p, h);
+    for(int i = 0; i < 4; ++i) p = put32(p, 0);
+    p = putfcc(p, "LIST"); p = put32(p, strlsz); p = putfcc(p, "strl");
+    p = putfcc(p, "strh"); p = put32(p, 56);
+    p = putfcc(p, "vids"); p = putfcc(p, "DIB ");
+    p = put32(p, 0); p = put16(p, 0); p = put16(p, 0);
+    p = put32(p, 0);
+    p = put32(p, fpsden); p = put32(p, fpsnum); // scale & rate
+    p = put32(p, 0);
+    p = put32(p, 0);    // length
+    p = put32(p, framesz);
+    p = put32(p, 0xffffffff);
+    p = put32(p, 0);
+    p = put16(p, 0); p = put16(p, 0); p = put16(p, w); p = put16(p, h);
+    p = putfcc(p, "strf"); p = put32(p, strfsz);
+    p = put32(p, 40); p = put32(p, w); p = put32(p, h); // bottom-up DIB
+    p = put16(p, 1); p = put16(p, rgb ? 24 : 8);
+    p = put32(p, 0); p = put32(p, framesz); p = put32(p, 0); p = put32(p, 0);
+    p = put32(p, rgb ? 0 : 256); p = put32(p, 0);
+    if(!rgb) for(int i = 0; i < 256; ++i) p = put32(p, (uint32_t)i * 0x010101); // gray palette
+    p = putfcc(p, "LIST");
+    movipos = (off_t)(p - hdr);
+    p = put32(p, 0); p = putfcc(p, "movi");
+    nidx = 0;
+    avifull = 0;
+    return writeall(hdr, p - hdr);
+}
+
+static int avi_frame(const uint8_t *data, int stride){
+    uint32_t framesz = (uint32_t)avistride * vh;
+    off_t pos = ftello(vf);
+    if(pos + 8 + framesz + 16 * (nidx + 1) > VIDEO_AVIMAX){
+        if(!avifull) WARNX("AVI file reached its max size, next frames are skipped (use .y4m or encoder pipe)");
+        avifull = 1;
+        return -1;
+    }
+    uint8_t *buf = getbuf(&encbuf, &encsz, framesz), chunk[8];
+    for(int y = 0; y < vh; ++y){
+        const uint8_t *src = &data[(size_t)y * stride];
+        uint8_t *dst = &buf[(size_t)(vh - 1 - y) * avistride];
+        if(vrgb) for(int x = 0; x < vw; ++x, src += 3, dst += 3){ // BGR
+            dst[0] = src[2]; dst[1] = src[1]; dst[2] = src[0];
+        }else memcpy(dst, src, vw);
+    }
+    put32(putfcc(chunk, "00db"), framesz);
+    if(writeall(chunk, 8) || writeall(buf, framesz)) return 1;
+    if(nidx == idxsz){
+        idxsz += 1024;
+        aviidx = realloc(aviidx, 2 * idxsz * sizeof(uint32_t));
+        if(!aviidx) ERR("realloc()");
+    }
+    aviidx[2 * nidx] = (uint32_t)(pos - movipos - 4); // offset from 'movi'
+    aviidx[2 * nidx + 1] = framesz;
+    ++nidx;
+    return 0;
+}
+
+// write index & sizes of lists
+static void avi_close(){
+    if(!vf) return;
+    if(vw){
+        uint8_t buf[16];
+        off_t idxpos = ftello(vf);
+        put32(putfcc(buf, "idx1"), (uint32_t)(16 * nidx));
+        writeall(buf, 8);
+        for(size_t i = 0; i < nidx; ++i){
+            uint8_t *p = putfcc(buf, "00db");
+            p = put32(p, 0x10); // AVIIF_KEYFRAME
+            p = put32(p, aviidx[2 * i]);
+            put32(p, aviidx[2 * i + 1]);
+            writeall(buf, 16);
+        }
+        off_t end = ftello(vf);
+        struct{
+            off_t pos;
+            uint32_t val;
+        } fields[] = {
+            {AVI_RIFFSIZE, (uint32_t)(end - 8)},
+            {AVI_TOTALFRAMES, (uint32_t)nidx},
+            {AVI_LENGTH, (uint32_t)nidx},
+            {movipos, (uint32_t)(idxpos - movipos - 4)},
+        };
+        for(size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i){
+            put32(buf, fields[i].val);
+            if(fseeko(vf, fields[i].pos, SEEK_SET) || fwrite(buf, 4, 1, vf) != 1){
+                WARN("Can't finalize AVI file");
+                break;
+            }
+        }
+    }
+    fclose(vf);
+    FREE(aviidx);
+    nidx = idxsz = 0;
+}
+
+static const videoenc encoders[] = {
+    {"YUV4MPEG2", y4m_open, y4m_header, y4m_frame, y4m_close},
+    {"AVI", avi_open, avi_header, avi_frame, avi_close},
+    {"YUV4MPEG2 pipe", y4m_pipeopen, y4m_header, y4m_frame, y4m_pipeclose},
+};
+
+/********************************** encoder thread **********************************/
+
+static void encodeframe(framebuf *fb){
+    int rgb = (falsecol || fb->info.bayer);
+    if(!vw){
+        if(enc->header(fb->w, fb->h, rgb)){
+            WARNX("Can't write video header, video is stopped");
+            broken = 1;
+            return;
+        }
+        vw = fb->w; vh = fb->h; vrgb = rgb;
+    }
+    if(fb->w != vw || fb->h != vh || rgb != vrgb){
+        if(!nskipped) WARNX("Frame %dx%d differs from video %dx%d: skipped", fb->w, fb->h, vw, vh);
+        ++nskipped;
+        return;
+    }
+    double t0 = dtime();
+    const uint8_t *data = fb->data;
+    int stride = fb->stride;
+    if(rgb){
+        uint8_t *out = getbuf(&rgbbuf, &rgbsz, 3 * (size_t)vw * vh);
+        if(fb->info.bayer){
+            if(demosaic(fb->data, vw, vh, stride, (bayerpattern)fb->info.bayer, DEMOSAIC_BILINEAR, out)){
+                ++nskipped;
+                return;
+            }
+        }else{ // false color by palette of display
+            uint8_t lut[256][3];
+            colorlut(lut);
+            for(int y = 0; y < vh; ++y){
+                const uint8_t *src = &fb->data[(size_t)y * stride];
+                uint8_t *dst = &out[(size_t)y * vw * 3];
+                for(int x = 0; x < vw; ++x, dst += 3){
+                    const uint8_t *c = lut[src[x]];
+                    dst[0] = c[0]; dst[1] = c[1]; dst[2] = c[2];
+                }
+            }
+        }
+        data = out;
+        stride = 3 * vw;
+    }
+    int r = enc->frame(data, stride);
+    if(r < 0){
+        ++nskipped;
+        return;
+    }
+    if(r){
+        WARN("Can't write video frame, video is stopped");
+        broken = 1;
+        return;
+    }
+    ++nframes;
+    enctime += dtime() - t0;
+}
+
+static void *encoder(_U_ void *arg){
+    while(1){
+        pthread_mutex_lock(&qmutex);
+        while(!qlen && !stopping) pthread_cond_wait(&qcond, &qmutex);
+        if(!qlen){
+            pthread_mutex_unlock(&qmutex);
+            break;
+        }
+        framebuf *fb = queue[qhead];
+        qhead = (qhead + 1) % VIDEO_QUEUE;
+        --qlen;
+        pthread_cond_signal(&qspace);
+        pthread_mutex_unlock(&qmutex);
+        if(broken) ++nskipped;
+        else encodeframe(fb);
+        framebuf_unref(fb);
+    }
+    FREE(rgbbuf);
+    FREE(encbuf);
+    rgbsz = encsz = 0;
+    return NULL;
+}
+
+/**
+ * @brief video_start - open video & run encoder thread
+ * @param target     - file name (*.y4m or *.avi) or "|command" to pipe YUV4MPEG2 into
+ * @param fps        - frame rate of video
+ * @param falsecolor - colorize gray frames by palette of display
+ * @param nodrop     - wait for encoder instead of dropping frames (for replay)
+ * @return 0 if all OK
+ */
+int video_start(const char *target, double fps, int falsecolor, int nodrop){
+    if(running || !target || !*target || !(fps > 0.)) return 1;
+    const videoenc *e = NULL;
+    const char *suff = strrchr(target, '.');
+    if(*target == '|') e = &encoders[2];
+    else if(suff && strcasecmp(suff, ".y4m") == 0) e = &encoders[0];
+    else if(suff && strcasecmp(suff, ".avi") == 0) e = &encoders[1];
+    else{
+        WARNX("Unknown video format of %s (should be *.y4m, *.avi or |command)", target);
+        return 1;
+    }
+    if(fabs(fps - round(fps)) < 1e-6){
+        fpsnum = (int)round(fps);
+        fpsden = 1;
+    }else{
+        fpsnum = (int)round(fps * 1000.);
+        fpsden = 1000;
+    }
+    if(e->open(target)) return 1;
+    enc = e;
+    vw = vh = vrgb = 0;
+    falsecol = falsecolor;
+    wait4space = nodrop;
+    qhead = qlen = stopping = broken = 0;
+    nframes = ndropped = nskipped = outbytes = 0;
+    enctime = 0.;
+    if(pthread_create(&thread, NULL, encoder, NULL)){
+        WARN("Can't run video encoder");
+        e->close();
+        vf = NULL;
+        return 1;
+    }
+    running = 1;
+    VMESG("Video %s: %s, %g frames/s%s", target, enc->name, fps, falsecolor ? ", false color" : "");
+    return 0;
+}
+
+/**
+ * @brief video_put - give frame to encoder (it's dropped if queue is full)
+ * @param fb - frame
+ */
+void video_put(framebuf *fb){
+    if(!running || !fb) return;
+    pthread_mutex_lock(&qmutex);
+    while(wait4space && qlen == VIDEO_QUEUE && !stopping) pthread_cond_wait(&qspace, &qmutex);
+    if(qlen == VIDEO_QUEUE || stopping){
+        ++ndropped;
+        pthread_mutex_unlock(&qmutex);
+        return;
+    }
+    framebuf_ref(fb);
+    queue[(qhead + qlen) % VIDEO_QUEUE] = fb;
+    ++qlen;
+    pthread_cond_signal(&qcond);
+    pthread_mutex_unlock(&qmutex);
+}
+
+// encode queued frames, close video & show statistics
+void video_stop(){
+    if(!running) return;
+    pthread_mutex_lock(&qmutex);
+    stopping = 1;
+    pthread_cond_broadcast(&qcond);
+    pthread_cond_broadcast(&qspace);
+    pthread_mutex_unlock(&qmutex);
+    pthread_join(thread, NULL);
+    running = 0;
+    enc->close();
+    vf = NULL;
+    VMESG("Video (%s): %llu frames %dx%d (%llu dropped, %llu skipped), %.2fms per frame, %.1fMB", enc->name,
+          (unsigned long long)nframes, vw, vh, (unsigned long long)ndropped, (unsigned long long)nskipped,
+          nframes ? enctime * 1e3 / nframes : 0., outbytes / 1024. / 1024.);
+}
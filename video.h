@@ -0,0 +1,42 @@
+/*
+ * This file is part of the grasshopper project.
+ * Copyright 2020 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Video export of frames: own thread takes frames from short queue (new frames are dropped when it's full, so
+ * grabbing never waits for encoder) & writes them by encoder chosen by target name:
+ *  "file.y4m" - YUV4MPEG2 (gray or 4:4:4 color);
+ *  "file.avi" - uncompressed AVI (8-bit gray with palette or 24-bit color);
+ *  "|command" - YUV4MPEG2 into stdin of external encoder (e.g. "|x264 --demuxer y4m -o out.mkv -").
+ */
+
+#pragma once
+#ifndef VIDEO__
+#define VIDEO__
+
+#include "framepool.h"
+
+// max amount of frames waiting for encoder
+#define VIDEO_QUEUE     (4)
+// max size of AVI file: RIFF sizes are 32-bit & many readers treat them as signed
+#define VIDEO_AVIMAX    (0x7fffffffLL - (1LL<<20))
+
+int  video_start(const char *target, double fps, int falsecolor, int nodrop);
+void video_put(framebuf *fb);
+void video_stop();
+
+#endif // VIDEO__